@@ -22,8 +22,9 @@ sub tempfile {
 sub commit_file {
     my ($o, $file) = @_;
     open (my $FH, "<", $file) or die "can't open $file for read: $!";
-    $o->commit_fd(fileno $FH);
+    my $committed = $o->commit_fd(fileno $FH);
     close $FH;
+    return $committed;
 }
 
 1;
@@ -49,6 +50,12 @@ ActiveState::File::Atomic - edit files atomically with locking
    }
    $at->commit_tempfile;
 
+   # Or, without a Perl filehandle:
+   while (defined($_ = $at->readline)) {
+       $at->print("blah: ", $_);
+   }
+   $at->commit_tempfile;
+
    # If you have your own file:
    $at->commit_file($myfile);
 
@@ -137,6 +144,87 @@ C<backup_ext>. Rotation numbers are always left-padded with zeros if
 C<rotate> is specified as 10 or greater.  This ensures that the files
 sort correctly.
 
+=item delta
+
+A boolean.  If true as well as C<rotate>, only the first backup is a
+whole copy of an earlier version: the others are kept as binary deltas
+against the backup after them, so that keeping many backups of a large
+file that changes a little at a time costs little more disk than one.
+Each commit turns the first backup into a delta against the file it
+replaces, which is one read of the two latest versions however many
+backups are kept.  A backup is kept whole when the delta would be no
+smaller.  The delta files can't be used as they are; read them back with
+backup().
+
+=item skip_unchanged
+
+A boolean.  If true, commit_string(), commit_file() and commit_fd()
+compare the new contents against the original file before committing.
+If they are identical the original is left untouched: no backups are
+rotated and its modification time does not change.  The object is
+closed either way.
+
+=item compress
+
+A number from 1 (fastest) to 9 (smallest).  If specified, commits store
+the new contents compressed with zlib at that level, behind a small
+header.  The reading methods recognise the header whether or not this
+option is given and always return the uncompressed contents, so readers
+need no changes; readblock() even inflates one block at a time.  Other
+programs will see the compressed bytes, though.
+
+While compressing, tempfile() is not available: use print(), write() or
+one of the commit methods.  new() croaks if the module was built without
+zlib.
+
+=item checksum
+
+A boolean.  If true, commits append a small trailer holding the CRC-32C
+of the contents.  Like the compression header, the reading methods
+recognise the trailer whether or not this option is given, leave it out
+of what they return, and croak with "Checksum mismatch" the first time
+they read a file whose contents don't match it.  This catches torn or
+damaged files for a fraction of the cost of digesting them in Perl.
+Other programs will see the trailer as part of the file.
+
+=item readhint
+
+One of C<sequential>, C<random>, C<willneed>, C<populate> or
+C<hugepage>: how the reading methods will use the file, so the kernel
+can page it in accordingly.  Use C<sequential> for readline() and
+readblock() loops over large files (the object also requests the next
+couple of megabytes ahead of the read position as it goes), C<random>
+for lookups in a large file read once with slurp(), and C<willneed> or
+C<populate> to have the whole file read in at once, in the background
+or before the first read returns, respectively.  Hints the platform
+doesn't support are ignored.
+
+=item publish
+
+A boolean.  If true, commits and appends also publish the new contents
+in shared memory, for readers that use
+L<ActiveState::File::Atomic::Snapshot> instead of new() and slurp(): they
+map each version of the file once, rather than opening and mapping it on
+every read, and can check for a new version without a system call.  A
+commit without this option withdraws what was published, so the readers
+go back to the file; if it can't, because the shared memory belongs to
+root, say, the commit still happens but then croaks.  Readers ignore
+shared memory that doesn't belong to the owner of the file, root or
+themselves, or that anyone else could write to.  The shared memory lasts
+until unpublish() or a reboot.
+
+=item nocache
+
+A boolean.  If true, the object tries not to leave the file in the page
+cache, for large files that are written or read once and would otherwise
+push more useful data out of memory.  commit_fd() and commit_file() copy
+with O_DIRECT where the filesystem supports it; other writes, and
+readblock() and readline(), drop what they are done with from the page
+cache every few megabytes; and closing the object drops the original
+file.  Commits are slower, since they wait for the data to reach the
+disk.  Don't use this on files that other processes read often: the
+pages are dropped for them too.
+
 =item debug
 
 A bitmask that can specify one or more internal flags to specify
@@ -171,6 +259,38 @@ iterate through a large file.
 
 This method croaks on failure.
 
+=item chunks()
+
+   my @chunks = $at->chunks($n, $delim);
+
+Splits the file into at most C<$n> pieces of roughly equal size for
+processing in parallel, without reading it.  Each piece ends just after
+a C<$delim> character (C<"\n"> by default; only the first character is
+used) or at the end of the file, so no record is split between two
+pieces.  Returns a list of C<[$offset, $length]> pairs that can be
+handed to slice(), for instance in forked workers that each open the
+file themselves.  The offsets refer to the contents as the reading
+methods return them, which for compressed or journaled files are not
+the bytes on disk.
+
+=item slice()
+
+   my $piece = $at->slice($offset, $length);
+
+Returns C<$length> bytes of the contents starting at C<$offset>, or
+less at the end of the file, without copying the rest of it.
+
+=item backup()
+
+   my $previous = $at->backup(1);
+
+Returns the contents of backup C<$n>, counting from 1 (the default) for
+the most recent, rebuilding it if the C<delta> option stored it as a
+delta.  With C<backup_ext> and no C<rotate> there is only backup 1.  The
+contents are those of the file as stored, so the backups of compressed
+or checksummed files come back compressed or checksummed.  Returns undef
+if there is no such backup, and croaks if it can't be rebuilt.
+
 =item commit_string()
 
    $at->commit_string($contents)
@@ -181,6 +301,9 @@ original file. Backup files are created according to the settings of
 C<backup_ext> and C<rotate>.  The method will croak on failure or if the
 C<writable> option was not passed to the constructor.
 
+Returns TRUE if the file was committed, or FALSE if the C<skip_unchanged>
+option was used and C<$contents> matched the original file.
+
 Calling commit_string() implies close(). You should not call any other method
 on the object after calling commit_string().
 
@@ -198,6 +321,8 @@ Note that the specified file is only opened, read from, and closed.  It is
 neither modified nor deleted by ActiveState::File::Atomic.  The caller is
 responsible for cleaning up the file when they no longer need it.
 
+The return value is the same as for commit_string().
+
 Calling commit_file() implies close(). You should not call any other method
 on the object after calling commit_file().
 
@@ -212,9 +337,35 @@ according to the settings of C<backup_ext> and C<rotate>.  The method will
 croak on failure or if the C<writable> option was not passed to the
 constructor.
 
+The return value is the same as for commit_string().
+
 Calling commit_fd() implies close(). You should not call any other method
 on the object after calling commit_fd().
 
+=item append()
+
+   $at->append($record);
+
+Adds C<$record> to the end of the file without rewriting it. The data is
+written to a journal beside the file (F<.I<filename>.jnl>), and readers
+see the file with the journal replayed onto it. Each append is checksummed
+and becomes visible all at once, so readers never see part of one, even if
+the writer dies halfway through. No backups are made. Once the journal
+grows larger than the file, it is folded back in by compact(), so logs and
+other append-mostly files don't cost a full rewrite per update.
+
+Any commit replaces the journal along with the file. The method will croak
+on failure or if the C<writable> option was not passed to the constructor.
+
+Calling append() implies close().
+
+=item compact()
+
+Commits the file with its journal folded in, making backups as usual, and
+removes the journal. If the journal is empty, this is the same as close().
+
+Calling compact() implies close().
+
 =item tempfile()
 
    my $wfh = $at->tempfile;
@@ -225,6 +376,27 @@ ActiveState::File::Atomic and should NOT be closed by the caller.
 
 This method croaks on failure.
 
+=item print()
+
+=item write()
+
+   $at->print($header, @lines);
+   $at->write($chunk);
+
+Appends to the temporary file that will be committed by
+commit_tempfile().  Unlike printing to the handle returned by
+tempfile(), the data is collected in a large buffer inside the object
+and written out in big chunks, so generating a file a line at a time
+does not cost a system call per line.  print() takes a list and, unlike
+the builtin, ignores C<$,> and C<$\>; write() takes a single string.
+
+Don't mix these methods with printing to the tempfile() handle: buffered
+data is flushed when tempfile() is called, but not on every print to
+the handle.
+
+These methods croak on failure or if the C<writable> option was not
+passed to the constructor.
+
 =item commit_tempfile()
 
 Commits the contents of the temporary file.
@@ -242,8 +414,97 @@ destructor will invoke it when the object goes out of scope.
 
 This method can not fail and has no return value.
 
+=item unpublish()
+
+  ActiveState::File::Atomic->unpublish($filename);
+
+Removes what commits with the C<publish> option put in shared memory for
+C<$filename>, for when the file is retired.  Readers that have it mapped
+keep their copy; new readers use the file.
+
 =back
 
+=head1 STATISTICS
+
+   my $stats = ActiveState::File::Atomic->stats;
+   printf "%d locks, %.1fms waiting\n", $stats->{locks},
+       $stats->{lock_wait}{total_us} / 1000;
+
+Returns what every ActiveState::File::Atomic and ActiveState::Dir::Atomic
+object in the process has done so far, as a hash reference with these
+counters:
+
+   locks          write locks acquired
+   lock_retries   attempts that found the lock held by someone else
+   stale_locks    lock files left behind by dead processes and removed
+   commits        files committed
+   commit_bytes   total size of the files committed
+   maps           files mapped for reading
+   map_nonresident_pages
+                  pages of those that weren't in memory yet, if counted
+
+and these timers, each a hash reference with the C<count> of timings,
+their C<total_us> and C<max_us> in microseconds, and a C<histogram>: an
+array whose element 0 counts times under 2us and element I<i> times from
+2**I<i> to 2**(I<i>+1) microseconds:
+
+   lock_wait      acquiring write locks
+   backups        rotating backups during commits
+   rename         the rename() that makes a commit visible
+
+The counters are cheap enough to be always on, except
+C<map_nonresident_pages>: that takes a mincore() sweep of every file
+mapped, so it stays at zero unless turned on with
+
+   my $was_on = ActiveState::File::Atomic->stats_residency(1);
+
+Pass a true argument to C<stats> to reset the counters to zero after
+reading them.  A file with a high
+C<lock_retries> or C<lock_wait> is a contended one.
+
+=head1 TRACING
+
+Where the system has F<sys/sdt.h>, the module is built with USDT probes
+at each step of locking, committing and rotating backups, which cost
+nothing unless something is tracing them.  The bpftrace scripts in
+F<tools/> use them to break down lock waits and commit times on a live
+system:
+
+   bpftrace tools/atomic-locks.bt /path/to/auto/ActiveState/File/Atomic/Atomic.so
+
+=head1 THE :atomic LAYER
+
+Loading ActiveState::File::Atomic also defines a PerlIO layer that gives
+the same guarantees through an ordinary filehandle:
+
+   open(my $fh, ">:atomic", $file) or die "can't open $file: $!";
+   print $fh $_ for @lines;
+   close($fh) or die "can't commit $file: $!";
+
+The file is locked and created if necessary by open(), everything
+printed is buffered inside the object, and close() commits it.  If a
+write fails, close() reverts the changes and returns FALSE instead.
+Opening with C<< >> >> starts from a copy of the current contents.
+Reading and seeking are not supported.
+
+Options can be passed as a comma separated list of C<key=value> pairs,
+for example C<< >:atomic(rotate=4) >>.  The C<rotate>, C<backup_ext>,
+C<timeout>, C<skip_unchanged>, C<compress>, C<checksum> and C<delta>
+options are supported, with the same meaning as for new().
+
+With C<skip_unchanged>, what is printed is compared against the
+original as it is written, and close() leaves an identical original,
+its backups and its modification time alone.
+
+Only an explicit close() commits.  A handle that is closed any other
+way, because it goes out of scope, because a die() unwinds past it, or
+because it is reopened, throws the changes away and leaves the original
+as it was.  To throw the changes away explicitly call:
+
+   ActiveState::File::Atomic::abandon($fh);
+
+after which close() does nothing.
+
 =head1 COPYRIGHT
 
 Copyright (C) 2004, ActiveState Corporation.
@@ -1,9 +1,16 @@
 #include "EXTERN.h"
 #include "perl.h"
 #include "XSUB.h"
+#ifdef PERLIO_LAYERS
+#include "perliol.h"
+#endif
 
 #include "atomicfile.h"
 #include "atomicdir.h"
+#include "atomicsnap.h"
+#include "atomicpack.h"
+#include "atomicinstall.h"
+#include "atomicdu.h"
 
 #define NEWZ_CONST 113
 
@@ -16,6 +23,12 @@ typedef struct {
     atomic_dir *at;
 } atomicdir_t, *atomicdir_ptr;
 
+typedef atomic_snapshot *atomicsnap_ptr;
+
+typedef struct {
+    atomic_pack *at;
+} atomicpack_t, *atomicpack_ptr;
+
 #define handle_error(self, err) \
     do { \
 	if (err != ATOMIC_ERR_SUCCESS) \
@@ -28,6 +41,18 @@ typedef struct {
 	    S_handle_error(aTHX_ "directory", atomic_dirname(self->at), err); \
     } while (0)
 
+#define pack_open(self) \
+    do { \
+	if (!self->at) \
+	    croak("The pack has been closed or committed"); \
+    } while (0)
+
+#define handle_pack_error(self, err) \
+    do { \
+	if (err != ATOMIC_ERR_SUCCESS) \
+	    S_handle_error(aTHX_ "file", atomic_filename(self->at->file), err); \
+    } while (0)
+
 #define free_tempfile(self) do {                                            \
     if (self->tempfh && !PL_dirty) {                                        \
 	GV *gv;                                                             \
@@ -117,6 +142,25 @@ S_handle_error(pTHX_ char *what, char *file, atomic_err err)
 	case ATOMIC_ERR_UNINITIALISED:
 	    croak("Can't open directory '%s': has not been initialised", file);
 	    break;
+	case ATOMIC_ERR_UNSUPPORTED:
+	    croak("Operation not supported on %s '%s'", what, file);
+	    break;
+	case ATOMIC_ERR_CORRUPT:
+	    croak("Corrupt %s '%s'", what, file);
+	    break;
+	case ATOMIC_ERR_BADCHECKSUM:
+	    croak("Checksum mismatch in %s '%s'", what, file);
+	    break;
+	case ATOMIC_ERR_NOFREESLOT:
+	    croak("No unpinned subdirectory free in %s '%s'", what, file);
+	    break;
+	case ATOMIC_ERR_UNCHANGED:
+	    croak("%s '%s' left unchanged", what, file);
+	    break;
+	case ATOMIC_ERR_CANTWITHDRAW:
+	    croak("Committed %s '%s', but can't withdraw its published "
+		  "snapshot: %s", what, file, errmsg);
+	    break;
 	default:
 	    croak("unknown error '%i'", err);
 	    break;
@@ -158,6 +202,417 @@ at_scandir(void *host, char *path, int ix)
     return retval;
 }
 
+/* Collects atomic_diffdir() results in a hash */
+static int
+at_diffdir(void *host, const char *path, atomic_change change)
+{
+    dTHX;
+    const char *what = change == ATOMIC_ADDED ? "added"
+		     : change == ATOMIC_REMOVED ? "removed" : "changed";
+    hv_store((HV*)host, path, strlen(path), newSVpv(what, 0), 0);
+    return 1;
+}
+
+#ifdef PERLIO_LAYERS
+
+/* The ':atomic' PerlIO layer.
+ *
+ *    open(my $fh, ">:atomic", $file);
+ *    open(my $fh, ">>:atomic(rotate=4,backup_ext=.bak)", $file);
+ *
+ * This is a bottom layer: it has no fd of its own and passes everything
+ * printed to atomic_write(), which does the buffering. An explicit close()
+ * commits the file; a failed write makes it revert the file instead, and so
+ * does any other close, such as the one when a die() unwinds the scope of
+ * the handle. Use ActiveState::File::Atomic::abandon($fh) to revert
+ * explicitly. With skip_unchanged, what is printed is compared against the
+ * original as it goes, and close() leaves an identical original alone. */
+
+typedef struct {
+    struct _PerlIO base;
+    atomic_file *at;
+    Pid_t pid;		/* only the opening process may commit */
+    const char *orig;	/* skip_unchanged: the original, while it matches */
+    size_t origlen;
+    int same;
+} PerlIOAtomic;
+
+static int
+S_layer_opts(pTHX_ SV *arg, atomic_opts *opts)
+{
+    char *p, *end;
+    STRLEN len;
+
+    if (!arg || !SvOK(arg))
+	return 1;
+    p = SvPV(arg, len);
+    end = p + len;
+    while (p < end) {
+	char *comma = (char *)memchr(p, ',', end - p);
+	char *eq;
+	char *val;
+	STRLEN klen;
+
+	if (!comma)
+	    comma = end;
+	if (!(eq = (char *)memchr(p, '=', comma - p)))
+	    return 0;
+	klen = eq - p;
+	val = savepvn(eq + 1, comma - eq - 1);
+	SAVEFREEPV(val);
+	if (klen == 6 && strnEQ(p, "rotate", 6))
+	    opts->rotate = atoi(val);
+	else if (klen == 7 && strnEQ(p, "timeout", 7))
+	    opts->timeout = atoi(val);
+	else if (klen == 10 && strnEQ(p, "backup_ext", 10))
+	    opts->backup_ext = *val ? val : NULL;
+	else if (klen == 14 && strnEQ(p, "skip_unchanged", 14))
+	    opts->skip_unchanged = atoi(val);
+	else if (klen == 8 && strnEQ(p, "compress", 8))
+	    opts->compress = atoi(val);
+	else if (klen == 8 && strnEQ(p, "checksum", 8))
+	    opts->checksum = atoi(val);
+	else if (klen == 5 && strnEQ(p, "delta", 5))
+	    opts->delta = atoi(val);
+	else
+	    return 0;
+	p = comma + 1;
+    }
+    return 1;
+}
+
+static PerlIO *
+PerlIOAtomic_open(pTHX_ PerlIO_funcs *self, PerlIO_list_t *layers, IV n,
+		  const char *mode, int fd, int imode, int perm,
+		  PerlIO *f, int narg, SV **args)
+{
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    PerlIOAtomic *s;
+    atomic_file *at;
+    atomic_err err;
+    Mode_t mask;
+    SV *dbg;
+
+    PERL_UNUSED_ARG(imode);
+    if (fd >= 0 || narg != 1 || (*mode != 'w' && *mode != 'a')
+	    || strchr(mode, '+'))
+    {
+	SETERRNO(EINVAL, LIB_INVARG);
+	return NULL;
+    }
+
+    ENTER;
+    if (!S_layer_opts(aTHX_ PerlIOArg, &opts)) {
+	LEAVE;
+	SETERRNO(EINVAL, LIB_INVARG);
+	return NULL;
+    }
+    dbg = get_sv("ActiveState::File::Atomic::DEBUG", FALSE);
+    if (dbg)
+	opts.debug = SvIV(dbg);
+    opts.mode = ATOMIC_CREATE;
+    mask = PerlLIO_umask(0);
+    PerlLIO_umask(mask);
+    opts.cmode = (perm ? perm : 0666) & ~mask;
+
+    errno = 0;
+    err = atomic_open(&at, SvPV_nolen(*args), &opts);
+    LEAVE;
+    if (err != ATOMIC_ERR_SUCCESS) {
+	if (!errno)
+	    SETERRNO(EINVAL, LIB_INVARG);
+	return NULL;
+    }
+
+    /* '>>' starts with a copy of the original */
+    if (*mode == 'a') {
+	char *buffer;
+	size_t length;
+	if ((err = atomic_readfile(at, &buffer, &length)) != ATOMIC_ERR_SUCCESS
+		|| (err = atomic_write(at, buffer, length))
+		    != ATOMIC_ERR_SUCCESS)
+	{
+	    dSAVE_ERRNO;
+	    atomic_close(at);
+	    RESTORE_ERRNO;
+	    return NULL;
+	}
+    }
+
+    if (!f)
+	f = PerlIO_allocate(aTHX);
+    if (!(f = PerlIO_push(aTHX_ f, self, mode, PerlIOArg))) {
+	atomic_close(at);
+	return NULL;
+    }
+    s = PerlIOSelf(f, PerlIOAtomic);
+    s->at = at;
+    s->pid = getpid();
+    s->same = 0;
+    if (opts.skip_unchanged && atomic_read_handle(at) != -1) {
+	char *buffer;
+	size_t length;
+	if (atomic_readfile(at, &buffer, &length) == ATOMIC_ERR_SUCCESS
+		&& atomic_bytes_written(at) <= length)
+	{
+	    s->orig = buffer;
+	    s->origlen = length;
+	    s->same = 1;	/* '>>' wrote the original itself */
+	}
+    }
+    PerlIOBase(f)->flags |= PERLIO_F_OPEN;
+    return f;
+}
+
+static IV
+PerlIOAtomic_popped(pTHX_ PerlIO *f)
+{
+    PerlIOAtomic *s = PerlIOSelf(f, PerlIOAtomic);
+
+    /* Still open, so this wasn't a close(): throw the changes away. A
+     * forked child leaves the parent's lock and tempfile alone. */
+    if (s->at && s->pid == getpid())
+	atomic_close(s->at);
+    s->at = NULL;
+    return PerlIOBase_popped(aTHX_ f);
+}
+
+static SSize_t
+PerlIOAtomic_write(pTHX_ PerlIO *f, const void *vbuf, Size_t count)
+{
+    PerlIOAtomic *s = PerlIOSelf(f, PerlIOAtomic);
+
+    if (!s->at || !(PerlIOBase(f)->flags & PERLIO_F_CANWRITE)
+	    || (PerlIOBase(f)->flags & PERLIO_F_ERROR))
+    {
+	SETERRNO(EBADF, SS_IVCHAN);
+	return -1;
+    }
+    if (s->same) {
+	size_t at = atomic_bytes_written(s->at);
+	if (at + count > s->origlen || memcmp(s->orig + at, vbuf, count) != 0)
+	    s->same = 0;
+    }
+    if (atomic_write(s->at, (const char *)vbuf, count) != ATOMIC_ERR_SUCCESS) {
+	PerlIOBase(f)->flags |= PERLIO_F_ERROR;
+	return -1;
+    }
+    return count;
+}
+
+static Off_t
+PerlIOAtomic_tell(pTHX_ PerlIO *f)
+{
+    PerlIOAtomic *s = PerlIOSelf(f, PerlIOAtomic);
+    return s->at ? (Off_t)atomic_bytes_written(s->at) : -1;
+}
+
+static IV
+PerlIOAtomic_close(pTHX_ PerlIO *f)
+{
+    PerlIOAtomic *s = PerlIOSelf(f, PerlIOAtomic);
+    IV code = PerlIOBase_close(aTHX_ f);
+    atomic_file *at = s->at;
+
+    s->at = NULL;
+    if (!at || s->pid != getpid())
+	return code;
+    if (code != 0 || (PerlIOBase(f)->flags & PERLIO_F_ERROR)) {
+	dSAVE_ERRNO;
+	atomic_close(at);
+	RESTORE_ERRNO;
+	return -1;
+    }
+    /* Only close() commits: the handle going out of scope, by die() or
+     * otherwise, or being reopened throws the changes away */
+    if (!PL_op || PL_op->op_type != OP_CLOSE || PL_dirty) {
+	atomic_close(at);
+	return code;
+    }
+    if (s->same && atomic_bytes_written(at) == s->origlen) {
+	atomic_close(at);
+	return 0;
+    }
+    if (atomic_commit_tempfile(at) != ATOMIC_ERR_SUCCESS) {
+	dSAVE_ERRNO;
+	atomic_close(at); /* a failed commit doesn't close */
+	RESTORE_ERRNO;
+	return -1;
+    }
+    return 0;
+}
+
+static PERLIO_FUNCS_DECL(PerlIO_atomic) = {
+    sizeof(PerlIO_funcs),
+    "atomic",
+    sizeof(PerlIOAtomic),
+    PERLIO_K_RAW,
+    PerlIOBase_pushed,
+    PerlIOAtomic_popped,
+    PerlIOAtomic_open,
+    PerlIOBase_binmode,
+    NULL,			/* getarg */
+    NULL,			/* fileno: there is no fd to share */
+    NULL,			/* dup: can't be committed twice */
+    NULL,			/* read */
+    NULL,			/* unread */
+    PerlIOAtomic_write,
+    NULL,			/* seek */
+    PerlIOAtomic_tell,
+    PerlIOAtomic_close,
+    PerlIOBase_noop_ok,		/* flush: atomic_write() owns the buffer */
+    PerlIOBase_noop_fail,	/* fill */
+    PerlIOBase_eof,
+    PerlIOBase_error,
+    PerlIOBase_clearerr,
+    PerlIOBase_setlinebuf,
+    NULL,			/* get_base */
+    NULL,			/* get_bufsiz */
+    NULL,			/* get_ptr */
+    NULL,			/* get_cnt */
+    NULL,			/* set_ptrcnt */
+};
+
+static void
+S_abandon(pTHX_ PerlIO *f)
+{
+    PerlIOAtomic *s;
+
+    if (!PerlIOValid(f) || PerlIOBase(f)->tab != &PerlIO_atomic)
+	croak("Not an ':atomic' filehandle");
+    s = PerlIOSelf(f, PerlIOAtomic);
+    if (s->at && s->pid == getpid())
+	atomic_close(s->at);
+    s->at = NULL;
+    PerlIOBase(f)->flags &= ~PERLIO_F_CANWRITE;
+}
+
+#endif /* PERLIO_LAYERS */
+
+/* The message ActiveState::Install would die with for a failed job */
+static SV *
+S_install_error(pTHX_ atomic_install_job *job)
+{
+    char *errmsg = strerror(job->err_errno);
+
+    switch (job->err) {
+	case ATOMIC_ERR_SUCCESS:
+	    return newSV(0);
+	case ATOMIC_ERR_CANTOPEN:
+	    return newSVpvf("Can't open %s: %s", job->from, errmsg);
+	case ATOMIC_ERR_CANTREAD:
+	    return newSVpvf("Read failed for file %s: %s", job->from, errmsg);
+	case ATOMIC_ERR_CANTRENAME:
+	    if (job->err_errno == EEXIST)
+		return newSVpvf("Can't save to %s since it exists", job->save);
+	    return newSVpvf("Can't rename as %s: %s", job->save, errmsg);
+	case ATOMIC_ERR_CANTWRITE:
+	    if (job->state & ATOMIC_INSTALL_CREATED)
+		return newSVpvf("Write failed for file %s", job->to);
+	    return newSVpvf("Can't create '%s': %s", job->to, errmsg);
+	default:
+	    return newSVpvf("Can't install %s: %s", job->to, errmsg);
+    }
+}
+
+/* Parses the options of ActiveState::File::Atomic->new() from 'n' SVs
+ * holding key/value pairs. */
+static void
+S_file_opts(pTHX_ SV **args, I32 n, atomic_opts *opts)
+{
+    int create = 0;
+    I32 i;
+    SV *dbg;
+
+    dbg = get_sv("ActiveState::File::Atomic::DEBUG", FALSE);
+    if (dbg)
+	opts->debug = SvIV(dbg);
+
+    /* Read options */
+    for (i = 0; i + 1 < n; i += 2) {
+	SV *skey = args[i];
+	SV *sval = args[i + 1];
+	char *key = SvPV_nolen(skey);
+
+	if (strEQ(key, "writable")) {
+	    if (SvOK(sval) && SvTRUE(sval))
+		opts->mode = ATOMIC_WRITE;
+	}
+	else if (strEQ(key, "create")) {
+	    create = (int)SvIV(sval);
+	}
+	else if (strEQ(key, "nolock")) {
+	    opts->nolock = (int)SvIV(sval);
+	}
+	else if (strEQ(key, "timeout")) {
+	    opts->timeout = (int)SvIV(sval);
+	}
+	else if (strEQ(key, "backup_ext")) {
+	    STRLEN len;
+	    char *str = SvPV(sval, len);
+	    if (len)
+		opts->backup_ext = str;
+	}
+	else if (strEQ(key, "rotate")) {
+	    opts->rotate = (int)SvIV(sval);
+	}
+	else if (strEQ(key, "delta")) {
+	    opts->delta = SvTRUE(sval) ? 1 : 0;
+	}
+	else if (strEQ(key, "mode")) {
+	    opts->cmode = (mode_t)SvIV(sval);
+	}
+	else if (strEQ(key, "owner")) {
+	    opts->uid = (uid_t)SvIV(sval);
+	}
+	else if (strEQ(key, "group")) {
+	    opts->gid = (gid_t)SvIV(sval);
+	}
+	else if (strEQ(key, "skip_unchanged")) {
+	    opts->skip_unchanged = SvTRUE(sval) ? 1 : 0;
+	}
+	else if (strEQ(key, "compress")) {
+	    opts->compress = (int)SvIV(sval);
+	}
+	else if (strEQ(key, "checksum")) {
+	    opts->checksum = SvTRUE(sval) ? 1 : 0;
+	}
+	else if (strEQ(key, "publish")) {
+	    opts->publish = SvTRUE(sval) ? 1 : 0;
+	}
+	else if (strEQ(key, "nocache")) {
+	    opts->nocache = SvTRUE(sval) ? 1 : 0;
+	}
+	else if (strEQ(key, "readhint")) {
+	    char *hint = SvPV_nolen(sval);
+	    if (strEQ(hint, "sequential"))
+		opts->readhint = ATOMIC_HINT_SEQUENTIAL;
+	    else if (strEQ(hint, "random"))
+		opts->readhint = ATOMIC_HINT_RANDOM;
+	    else if (strEQ(hint, "willneed"))
+		opts->readhint = ATOMIC_HINT_WILLNEED;
+	    else if (strEQ(hint, "populate"))
+		opts->readhint = ATOMIC_HINT_POPULATE;
+	    else if (strEQ(hint, "hugepage"))
+		opts->readhint = ATOMIC_HINT_HUGEPAGE;
+	    else
+		croak("Unknown readhint '%s'", hint);
+	}
+	else if (strEQ(key, "debug")) {
+	    opts->debug = SvIV(sval);
+	}
+	else
+	    croak("Unknown option '%s'", key);
+    }
+
+    if (create) {
+	if (opts->mode == ATOMIC_WRITE)
+	    opts->mode = ATOMIC_CREATE;
+	else
+	    croak("Option create requires writable as well");
+    }
+}
+
 MODULE = ActiveState::Dir::Atomic	PACKAGE = ActiveState::Dir::Atomic
 
 PROTOTYPES: DISABLE
@@ -208,6 +663,9 @@ new(ignored, dir, ...)
 	    else if (strEQ(key, "group")) {
 		opts.gid = (gid_t)SvIV(sval);
 	    }
+	    else if (strEQ(key, "manifest")) {
+		opts.manifest = SvTRUE(sval) ? 1 : 0;
+	    }
 	    else if (strEQ(key, "debug")) {
 		opts.debug = SvIV(sval);
 	    }
@@ -288,15 +746,125 @@ scratch(self)
 	atomicdir_ptr self
     CODE:
 	RETVAL = atomic_scratchdir_i(self->at);
+	if (!RETVAL && self->at->opts.mode != ATOMIC_READ)
+	    handle_dir_error(self, errno == EAGAIN ? ATOMIC_ERR_NOFREESLOT
+						   : ATOMIC_ERR_CANTLOCK);
     OUTPUT:
 	RETVAL
 
 SV*
 scratchpath(self)
 	atomicdir_ptr self
+    PREINIT:
+	int ix;
     CODE:
-	RETVAL = newSVpvf("%s/%d", atomic_dirname(self->at),
-				   atomic_scratchdir_i(self->at));
+	ix = atomic_scratchdir_i(self->at);
+	if (!ix && self->at->opts.mode != ATOMIC_READ)
+	    handle_dir_error(self, errno == EAGAIN ? ATOMIC_ERR_NOFREESLOT
+						   : ATOMIC_ERR_CANTLOCK);
+	RETVAL = newSVpvf("%s/%d", atomic_dirname(self->at), ix);
+    OUTPUT:
+	RETVAL
+
+int
+pin(self)
+	atomicdir_ptr self
+    PREINIT:
+	atomic_err err;
+    CODE:
+	err = atomic_pindir(self->at, &RETVAL);
+	handle_dir_error(self, err);
+    OUTPUT:
+	RETVAL
+
+void
+unpin(self)
+	atomicdir_ptr self
+    CODE:
+	atomic_unpindir(self->at);
+
+void
+clone(self, threads=0)
+	atomicdir_ptr self
+	int threads
+    PREINIT:
+	atomic_err err;
+    CODE:
+	err = atomic_clonedir(self->at, threads);
+	handle_dir_error(self, err);
+
+void
+breaklink(self, path)
+	atomicdir_ptr self
+	char *path
+    PREINIT:
+	atomic_err err;
+    CODE:
+	err = atomic_breaklink(path);
+	handle_dir_error(self, err);
+
+HV*
+sync(self, source, contents=0, threads=0)
+	atomicdir_ptr self
+	char *source
+	int contents
+	int threads
+    PREINIT:
+	atomic_syncstats stats;
+	atomic_err err;
+    CODE:
+	err = atomic_syncdir(self->at, source,
+			     contents ? ATOMIC_SYNC_CONTENTS : 0, threads,
+			     &stats);
+	handle_dir_error(self, err);
+	RETVAL = newHV();
+	sv_2mortal((SV*)RETVAL);
+	hv_store(RETVAL, "copied", 6, newSVuv(stats.files_copied), 0);
+	hv_store(RETVAL, "deleted", 7, newSVuv(stats.files_deleted), 0);
+	hv_store(RETVAL, "unchanged", 9, newSVuv(stats.files_checked), 0);
+	hv_store(RETVAL, "bytes", 5, newSVnv((NV)stats.bytes_copied), 0);
+    OUTPUT:
+	RETVAL
+
+void
+generations(self, sizes=0)
+	atomicdir_ptr self
+	int sizes
+    PREINIT:
+	atomic_dirinfo *info;
+	atomic_err err;
+	int i, n;
+    PPCODE:
+	err = atomic_scandir_stat(self->at, sizes ? ATOMIC_SCAN_SIZES : 0,
+				  &info, &n);
+	handle_dir_error(self, err);
+	EXTEND(SP, n);
+	for (i = 0; i < n; i++) {
+	    HV *hv = newHV();
+	    hv_store(hv, "index", 5, newSViv(info[i].index), 0);
+	    hv_store(hv, "current", 7, newSViv(info[i].current), 0);
+	    hv_store(hv, "pinned", 6, newSViv(info[i].pinned), 0);
+	    hv_store(hv, "mtime", 5, newSViv((IV)info[i].mtime), 0);
+	    hv_store(hv, "size", 4, info[i].size < 0 ? newSV(0)
+				     : newSVnv((NV)info[i].size), 0);
+	    hv_store(hv, "version", 7, *info[i].version
+				     ? newSVpv(info[i].version, 0) : newSV(0), 0);
+	    PUSHs(sv_2mortal(newRV_noinc((SV*)hv)));
+	}
+	free(info);
+
+HV*
+diff(self, from, to=0)
+	atomicdir_ptr self
+	int from
+	int to
+    PREINIT:
+	atomic_err err;
+    CODE:
+	RETVAL = newHV();
+	sv_2mortal((SV*)RETVAL);
+	err = atomic_diffdir(self->at, from, to, &at_diffdir, RETVAL);
+	handle_dir_error(self, err);
     OUTPUT:
 	RETVAL
 
@@ -335,6 +903,11 @@ MODULE = ActiveState::File::Atomic	PACKAGE = ActiveState::File::Atomic
 
 PROTOTYPES: DISABLE
 
+BOOT:
+#ifdef PERLIO_LAYERS
+    PerlIO_define_layer(aTHX_ PERLIO_FUNCS_CAST(&PerlIO_atomic));
+#endif
+
 atomic_ptr
 new(ignored, file, ...)
 	char*	file
@@ -342,67 +915,8 @@ new(ignored, file, ...)
 	atomic_err	err;
 	atomic_ptr	self;
 	atomic_opts	opts = ATOMIC_OPTS_INITIALIZER;
-	int i;
-	int create;
-	SV *dbg;
     CODE:
-	/* Defaults */
-	create = 0;
-
-	dbg = get_sv("ActiveState::File::Atomic::DEBUG", FALSE);
-	if (dbg)
-	    opts.debug = SvIV(dbg);
-
-	/* Read options */
-	for (i = 2; i < items; i += 2) {
-	    SV *skey = ST(i);
-	    SV *sval = ST(i + 1);
-	    char *key = SvPV_nolen(skey);
-
-	    if (strEQ(key, "writable")) {
-		if (SvOK(sval) && SvTRUE(sval))
-		    opts.mode = ATOMIC_WRITE;
-	    }
-	    else if (strEQ(key, "create")) {
-		create = (int)SvIV(sval);
-	    }
-	    else if (strEQ(key, "nolock")) {
-		opts.nolock = (int)SvIV(sval);
-	    }
-	    else if (strEQ(key, "timeout")) {
-		opts.timeout = (int)SvIV(sval);
-	    }
-	    else if (strEQ(key, "backup_ext")) {
-		STRLEN len;
-		char *str = SvPV(sval, len);
-		if (len)
-		    opts.backup_ext = str;
-	    }
-	    else if (strEQ(key, "rotate")) {
-		opts.rotate = (int)SvIV(sval);
-	    }
-	    else if (strEQ(key, "mode")) {
-		opts.cmode = (mode_t)SvIV(sval);
-	    }
-	    else if (strEQ(key, "owner")) {
-		opts.uid = (uid_t)SvIV(sval);
-	    }
-	    else if (strEQ(key, "group")) {
-		opts.gid = (gid_t)SvIV(sval);
-	    }
-	    else if (strEQ(key, "debug")) {
-		opts.debug = SvIV(sval);
-	    }
-	    else
-		croak("Unknown option '%s'", key);
-	}
-
-	if (create) {
-	    if (opts.mode == ATOMIC_WRITE)
-		opts.mode = ATOMIC_CREATE;
-	    else
-		croak("Option create requires writable as well");
-	}
+	S_file_opts(aTHX_ &ST(2), items - 2, &opts);
 
 	Newz(NEWZ_CONST_INT, self, 1, atomic_t);
 	err = atomic_open(&self->at, file, &opts);
@@ -491,6 +1005,68 @@ readblock(self, blocklen)
     OUTPUT:
 	RETVAL
 
+void
+chunks(self, n, delim=NULL)
+	atomic_ptr self
+	int n
+	char *delim
+    PREINIT:
+	atomic_chunk *chunks;
+	atomic_err err;
+	int i, got;
+    PPCODE:
+	if (n < 1)
+	    n = 1;
+	New(0, chunks, n, atomic_chunk);
+	SAVEFREEPV(chunks);
+	err = atomic_chunks(self->at, n, delim ? *delim : '\n', chunks, &got);
+	handle_error(self, err);
+	EXTEND(SP, got);
+	for (i = 0; i < got; i++) {
+	    AV *pair = newAV();
+	    av_push(pair, newSVuv(chunks[i].offset));
+	    av_push(pair, newSVuv(chunks[i].length));
+	    PUSHs(sv_2mortal(newRV_noinc((SV *)pair)));
+	}
+
+SV *
+slice(self, offset, length)
+	atomic_ptr self
+	size_t offset
+	size_t length
+    PREINIT:
+	char *buffer;
+	size_t len;
+	atomic_err err;
+    CODE:
+	err = atomic_readfile(self->at, &buffer, &len);
+	handle_error(self, err);
+	if (offset > len)
+	    offset = len;
+	if (length > len - offset)
+	    length = len - offset;
+	RETVAL = newSVpvn(buffer + offset, (STRLEN)length);
+    OUTPUT:
+	RETVAL
+
+SV *
+backup(self, n=1)
+	atomic_ptr self
+	int n
+    PREINIT:
+	char *buffer;
+	size_t len;
+	atomic_err err;
+    CODE:
+	err = atomic_read_backup(self->at, n, &buffer, &len);
+	if (err == ATOMIC_ERR_CANTOPEN && errno == ENOENT)
+	    XSRETURN_UNDEF;
+	handle_error(self, err);
+	RETVAL = newSVpvn(buffer, (STRLEN)len);
+	free(buffer);
+    OUTPUT:
+	RETVAL
+
 int
 _tempfile(self)
 	atomic_ptr self
@@ -523,6 +1099,206 @@ _save_fh(self, fh=NULL)
     OUTPUT:
 	RETVAL
 
+HV*
+stats(ignored, reset=0)
+	SV *ignored
+	int reset
+    PREINIT:
+	atomic_stats st;
+	int i, j, n;
+    CODE:
+	atomic_stats_get(&st);
+	if (reset)
+	    atomic_stats_reset();
+	RETVAL = newHV();
+	sv_2mortal((SV*)RETVAL);
+	for (i = 0; i < ATOMIC_STAT__LAST; i++) {
+	    const char *name = atomic_stat_name(i);
+	    hv_store(RETVAL, name, strlen(name),
+		     newSVnv((NV)st.counters[i]), 0);
+	}
+	for (i = 0; i < ATOMIC_TIME__LAST; i++) {
+	    const char *name = atomic_timer_name(i);
+	    atomic_hist *h = &st.timers[i];
+	    HV *hv = newHV();
+	    AV *av = newAV();
+	    for (n = ATOMIC_HIST_BUCKETS; n && !h->buckets[n - 1]; n--)
+		;
+	    for (j = 0; j < n; j++)
+		av_push(av, newSVnv((NV)h->buckets[j]));
+	    hv_store(hv, "count", 5, newSVnv((NV)h->count), 0);
+	    hv_store(hv, "total_us", 8, newSVnv((NV)h->total), 0);
+	    hv_store(hv, "max_us", 6, newSVnv((NV)h->max), 0);
+	    hv_store(hv, "histogram", 9, newRV_noinc((SV*)av), 0);
+	    hv_store(RETVAL, name, strlen(name), newRV_noinc((SV*)hv), 0);
+	}
+    OUTPUT:
+	RETVAL
+
+int
+stats_residency(ignored, on)
+	SV *ignored
+	int on
+    PREINIT:
+	int flags;
+    CODE:
+	flags = atomic_stats_enabled(~0);
+	RETVAL = (flags & ATOMIC_STATS_RESIDENCY) != 0;
+	atomic_stats_enable(on ? flags | ATOMIC_STATS_RESIDENCY
+			       : flags & ~ATOMIC_STATS_RESIDENCY);
+    OUTPUT:
+	RETVAL
+
+void
+unpublish(ignored, file)
+	SV *ignored
+	char *file
+    CODE:
+	atomic_unpublish(file);
+
+void
+_install(ignored, jobs, nthreads=0)
+	SV *ignored
+	AV *jobs
+	int nthreads
+    PREINIT:
+	atomic_install_job *j;
+	I32 i, n;
+    PPCODE:
+	/* For ActiveState::Install: [from, to, save] in, and
+	 * [same, saved, created, md5_hex, error] out, for each job */
+	n = av_len(jobs) + 1;
+	Newz(NEWZ_CONST_INT, j, n ? n : 1, atomic_install_job);
+	SAVEFREEPV(j);
+	for (i = 0; i < n; i++) {
+	    SV **job = av_fetch(jobs, i, 0);
+	    AV *av;
+	    if (!job || !SvROK(*job) || SvTYPE(SvRV(*job)) != SVt_PVAV
+		    || av_len((AV *)SvRV(*job)) < 2)
+		croak("_install() wants [from, to, save] for each job");
+	    av = (AV *)SvRV(*job);
+	    j[i].from = SvPV_nolen(*av_fetch(av, 0, 0));
+	    j[i].to = SvPV_nolen(*av_fetch(av, 1, 0));
+	    j[i].save = SvPV_nolen(*av_fetch(av, 2, 0));
+	}
+	atomic_install(j, n, nthreads);
+	EXTEND(SP, n);
+	for (i = 0; i < n; i++) {
+	    AV *res = newAV();
+	    int state = j[i].state;
+	    av_push(res, newSViv(state & ATOMIC_INSTALL_SAME ? 1 : 0));
+	    av_push(res, newSViv(state & ATOMIC_INSTALL_SAVED ? 1 : 0));
+	    av_push(res, newSViv(state & ATOMIC_INSTALL_CREATED ? 1 : 0));
+	    if ((state & ATOMIC_INSTALL_DONE) && j[i].err == ATOMIC_ERR_SUCCESS) {
+		char hex[33];
+		int k;
+		for (k = 0; k < 16; k++)
+		    sprintf(hex + 2 * k, "%02x", j[i].md5[k]);
+		av_push(res, newSVpvn(hex, 32));
+	    }
+	    else
+		av_push(res, newSV(0));
+	    av_push(res, S_install_error(aTHX_ &j[i]));
+	    PUSHs(sv_2mortal(newRV_noinc((SV *)res)));
+	}
+
+SV *
+_du(ignored, path, blocksize=512, dirs=NULL)
+	SV *ignored
+	char *path
+	int blocksize
+	HV *dirs
+    PREINIT:
+	atomic_du_dir *d;
+	size_t i, n;
+	off_t total;
+    CODE:
+	/* For ActiveState::DiskUsage: the total, or undef if the tree
+	 * couldn't be walked; 'dirs' gets the total of each directory's
+	 * tree, by the names du() would give them */
+	if (atomic_du(path, 0, blocksize, &total, dirs ? &d : NULL, &n)
+		!= ATOMIC_ERR_SUCCESS)
+	    XSRETURN_UNDEF;
+	if (dirs) {
+	    HV *sums = (HV *)sv_2mortal((SV *)newHV());
+	    SV *name = sv_2mortal(newSVpv(path, 0));
+	    STRLEN rootlen = SvCUR(name);
+	    HE *he;
+
+	    for (i = 0; i < n; i++) {
+		char *p = d[i].path, *end = p + strlen(p);
+
+		/* the directory and each one above it */
+		while (1) {
+		    SV **sum = hv_fetch(sums, p, end - p, 1);
+		    sv_setnv(*sum, (SvOK(*sum) ? SvNV(*sum) : 0)
+				   + (NV)d[i].bytes);
+		    if (end == p)
+			break;
+		    while (end > p && *--end != '/')
+			;
+		}
+	    }
+	    atomic_du_free(d, n);
+	    hv_iterinit(sums);
+	    while ((he = hv_iternext(sums))) {
+		I32 len;
+		char *rel = hv_iterkey(he, &len);
+		SvCUR_set(name, rootlen);
+		if (len) {
+		    sv_catpvn(name, "/", 1);
+		    sv_catpvn(name, rel, len);
+		}
+		(void)hv_store_ent(dirs, name, newSVsv(hv_iterval(sums, he)), 0);
+	    }
+	}
+	RETVAL = newSVnv((NV)total);
+    OUTPUT:
+	RETVAL
+
+void
+abandon(fh)
+	PerlIO *fh
+    CODE:
+#ifdef PERLIO_LAYERS
+	S_abandon(aTHX_ fh);
+#else
+	croak("PerlIO layers are not supported by this perl");
+#endif
+
+void
+print(self, ...)
+	atomic_ptr self
+    PREINIT:
+	atomic_err err;
+	struct iovec iov[16];
+	int i, n;
+	STRLEN len;
+    CODE:
+	/* hand the arguments to atomic_writev() in batches */
+	for (i = 1, n = 0; i < items; i++) {
+	    iov[n].iov_base = SvPV(ST(i), len);
+	    iov[n].iov_len = len;
+	    if (++n == sizeof(iov) / sizeof(iov[0]) || i == items - 1) {
+		err = atomic_writev(self->at, iov, n);
+		handle_error(self, err);
+		n = 0;
+	    }
+	}
+
+void
+write(self, str)
+	atomic_ptr self
+	SV *str
+    PREINIT:
+	atomic_err err;
+	char *c_str;
+	STRLEN len;
+    CODE:
+	c_str = SvPV(str, len);
+	err = atomic_write(self->at, c_str, len);
+	handle_error(self, err);
+
 void
 commit_tempfile(self)
 	atomic_ptr self
@@ -534,7 +1310,7 @@ commit_tempfile(self)
 	self->at = NULL;
 	free_tempfile(self);
 
-void
+int
 commit_string(self, str)
 	atomic_ptr self
 	SV *str
@@ -545,11 +1321,41 @@ commit_string(self, str)
     CODE:
 	c_str = SvPV(str, len);
 	err = atomic_commit_string(self->at, c_str, len);
+	if (err != ATOMIC_ERR_UNCHANGED)
+	    handle_error(self, err);
+	RETVAL = (err == ATOMIC_ERR_SUCCESS);
+	self->at = NULL;
+	free_tempfile(self);
+    OUTPUT:
+	RETVAL
+
+void
+append(self, str)
+	atomic_ptr self
+	SV *str
+    PREINIT:
+	atomic_err err;
+	char *c_str;
+	STRLEN len;
+    CODE:
+	c_str = SvPV(str, len);
+	err = atomic_append(self->at, c_str, len);
 	handle_error(self, err);
 	self->at = NULL;
 	free_tempfile(self);
 
 void
+compact(self)
+	atomic_ptr self
+    PREINIT:
+	atomic_err err;
+    CODE:
+	err = atomic_compact(self->at);
+	handle_error(self, err);
+	self->at = NULL;
+	free_tempfile(self);
+
+int
 commit_fd(self, fd)
 	atomic_ptr self
 	int fd
@@ -557,6 +1363,190 @@ commit_fd(self, fd)
 	atomic_err err;
     CODE:
 	err = atomic_commit_fd(self->at, fd);
-	handle_error(self, err);
+	if (err != ATOMIC_ERR_UNCHANGED)
+	    handle_error(self, err);
+	RETVAL = (err == ATOMIC_ERR_SUCCESS);
 	self->at = NULL;
 	free_tempfile(self);
+    OUTPUT:
+	RETVAL
+
+MODULE = ActiveState::File::Atomic	PACKAGE = ActiveState::File::Atomic::Snapshot
+
+PROTOTYPES: DISABLE
+
+atomicsnap_ptr
+new(ignored, file)
+	char*	file
+    PREINIT:
+	atomic_err	err;
+	atomicsnap_ptr	self;
+    CODE:
+	err = atomic_snapshot_open(&self, file);
+	if (err != ATOMIC_ERR_SUCCESS)
+	    S_handle_error(aTHX_ "file", file, err);
+	RETVAL = self;
+    OUTPUT:
+	RETVAL
+
+void
+DESTROY(self)
+	atomicsnap_ptr self
+    CODE:
+	atomic_snapshot_close(self);
+
+SV *
+slurp(self)
+	atomicsnap_ptr self
+    PREINIT:
+	char *buffer;
+	size_t len;
+	atomic_err err;
+    CODE:
+	err = atomic_snapshot_read(self, &buffer, &len);
+	if (err != ATOMIC_ERR_SUCCESS)
+	    S_handle_error(aTHX_ "file", self->path, err);
+	RETVAL = newSVpvn(buffer, (STRLEN)len);
+    OUTPUT:
+	RETVAL
+
+int
+changed(self)
+	atomicsnap_ptr self
+    CODE:
+	RETVAL = atomic_snapshot_changed(self);
+    OUTPUT:
+	RETVAL
+
+NV
+generation(self)
+	atomicsnap_ptr self
+    CODE:
+	RETVAL = (NV)atomic_snapshot_generation(self);
+    OUTPUT:
+	RETVAL
+
+MODULE = ActiveState::File::Atomic	PACKAGE = ActiveState::File::Atomic::Pack
+
+PROTOTYPES: DISABLE
+
+atomicpack_ptr
+new(ignored, file, ...)
+	char*	file
+    PREINIT:
+	atomic_err	err;
+	atomicpack_ptr	self;
+	atomic_opts	opts = ATOMIC_OPTS_INITIALIZER;
+    CODE:
+	S_file_opts(aTHX_ &ST(2), items - 2, &opts);
+	Newz(NEWZ_CONST_INT, self, 1, atomicpack_t);
+	err = atomic_pack_open(&self->at, file, &opts);
+	if (err != ATOMIC_ERR_SUCCESS) {
+	    Safefree(self);
+	    S_handle_error(aTHX_ "file", file, err);
+	}
+	RETVAL = self;
+    OUTPUT:
+	RETVAL
+
+void
+DESTROY(self)
+	atomicpack_ptr self
+    CODE:
+	if (self) {
+	    if (self->at)
+		atomic_pack_close(self->at);
+	    Safefree(self);
+	}
+
+void
+close(self)
+	atomicpack_ptr self
+    CODE:
+	if (self->at)
+	    atomic_pack_close(self->at);
+	self->at = NULL;
+
+SV *
+get(self, key)
+	atomicpack_ptr self
+	SV *key
+    PREINIT:
+	char *k, *value;
+	STRLEN klen;
+	size_t vlen;
+	atomic_err err;
+    CODE:
+	pack_open(self);
+	k = SvPV(key, klen);
+	err = atomic_pack_get(self->at, k, klen, &value, &vlen);
+	handle_pack_error(self, err);
+	RETVAL = value ? newSVpvn(value, (STRLEN)vlen) : &PL_sv_undef;
+    OUTPUT:
+	RETVAL
+
+void
+keys(self)
+	atomicpack_ptr self
+    PREINIT:
+	char *key, *value;
+	size_t klen, vlen, i;
+	atomic_err err;
+    PPCODE:
+	pack_open(self);
+	EXTEND(SP, (IV)atomic_pack_count(self->at));
+	for (i = 0; i < atomic_pack_count(self->at); i++) {
+	    err = atomic_pack_record(self->at, i, &key, &klen, &value, &vlen);
+	    handle_pack_error(self, err);
+	    PUSHs(sv_2mortal(newSVpvn(key, (STRLEN)klen)));
+	}
+
+IV
+count(self)
+	atomicpack_ptr self
+    CODE:
+	pack_open(self);
+	RETVAL = (IV)atomic_pack_count(self->at);
+    OUTPUT:
+	RETVAL
+
+void
+put(self, key, value)
+	atomicpack_ptr self
+	SV *key
+	SV *value
+    PREINIT:
+	char *k, *v;
+	STRLEN klen, vlen;
+	atomic_err err;
+    CODE:
+	pack_open(self);
+	k = SvPV(key, klen);
+	v = SvPV(value, vlen);
+	err = atomic_pack_put(self->at, k, klen, v, vlen);
+	handle_pack_error(self, err);
+
+void
+delete(self, key)
+	atomicpack_ptr self
+	SV *key
+    PREINIT:
+	char *k;
+	STRLEN klen;
+	atomic_err err;
+    CODE:
+	pack_open(self);
+	k = SvPV(key, klen);
+	err = atomic_pack_delete(self->at, k, klen);
+	handle_pack_error(self, err);
+
+void
+commit(self)
+	atomicpack_ptr self
+    PREINIT:
+	atomic_err err;
+    CODE:
+	pack_open(self);
+	err = atomic_pack_commit(self->at);
+	handle_pack_error(self, err);
+	self->at = NULL;
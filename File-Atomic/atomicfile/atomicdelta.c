@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "atomicdelta.h"
+
+/* Layout; see atomicdelta.h */
+#define DHEADER_LEN	32
+#define DCOPY_LEN	13
+#define DADD_LEN	5
+#define DMAX_RUN	0xffffffffUL	/* lengths are 4 bytes */
+
+#define DBLOCK		64		/* smallest block indexed */
+#define DMAX_BLOCKS	(1 << 21)
+#define DMULT		0x01000193U	/* of the rolling hash */
+
+extern unsigned int atomic_crc32c(unsigned int crc, const void *buf,
+				  size_t len);
+
+static void
+putle(char *buffer, unsigned long long n, int len)
+{
+    while (len--) {
+	*buffer++ = (char)(n & 0xff);
+	n >>= 8;
+    }
+}
+
+static unsigned long long
+getle(const char *buffer, int len)
+{
+    unsigned long long n = 0;
+    while (len--)
+	n = (n << 8) | (unsigned char)buffer[len];
+    return n;
+}
+
+static unsigned int
+hash(const unsigned char *p, size_t n)
+{
+    unsigned int h = 0;
+    while (n--)
+	h = h * DMULT + *p++;
+    return h;
+}
+
+/* The delta being made */
+struct out {
+    char       *buf;
+    size_t      len;
+    size_t      max;
+    size_t      limit;
+};
+
+/* Appends 'n' bytes. Returns 0 if that would reach the limit, -1 if
+ * memory runs out. */
+static int
+put(struct out *o, const char *p, size_t n)
+{
+    if (o->len + n >= o->limit)
+	return 0;
+    if (o->len + n > o->max) {
+	size_t max = o->max * 2;
+	char *buf;
+	if (max < o->len + n)
+	    max = o->len + n;
+	if (max > o->limit)
+	    max = o->limit;
+	if (!(buf = (char *)realloc(o->buf, max)))
+	    return -1;
+	o->buf = buf;
+	o->max = max;
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+    return 1;
+}
+
+static int
+add(struct out *o, const char *p, size_t n)
+{
+    char op[DADD_LEN];
+    int ok = 1;
+
+    while (n && ok > 0) {
+	size_t run = n > DMAX_RUN ? DMAX_RUN : n;
+	op[0] = 'A';
+	putle(op + 1, run, 4);
+	if ((ok = put(o, op, DADD_LEN)) > 0)
+	    ok = put(o, p, run);
+	p += run;
+	n -= run;
+    }
+    return ok;
+}
+
+static int
+copy(struct out *o, size_t off, size_t n)
+{
+    char op[DCOPY_LEN];
+    int ok = 1;
+
+    while (n && ok > 0) {
+	size_t run = n > DMAX_RUN ? DMAX_RUN : n;
+	op[0] = 'C';
+	putle(op + 1, off, 8);
+	putle(op + 9, run, 4);
+	ok = put(o, op, DCOPY_LEN);
+	off += run;
+	n -= run;
+    }
+    return ok;
+}
+
+atomic_err
+atomic_delta_make(const char *base, size_t baselen, const char *target,
+		  size_t targetlen, size_t limit, char **delta,
+		  size_t *deltalen)
+{
+    const unsigned char *b = (const unsigned char *)base;
+    const unsigned char *t = (const unsigned char *)target;
+    struct out o;
+    size_t *index = NULL;
+    size_t block = DBLOCK, nblocks, mask = 0;
+    size_t i, p, lit;
+    unsigned int h = 0, pow = 1;
+    int ok;
+
+    *delta = NULL;
+    *deltalen = 0;
+    if (limit <= DHEADER_LEN)
+	return ATOMIC_ERR_SUCCESS;
+    o.max = limit < 65536 ? limit : 65536;
+    o.limit = limit;
+    o.len = DHEADER_LEN;
+    if (!(o.buf = (char *)malloc(o.max)))
+	return ATOMIC_ERR_NOMEM;
+    memcpy(o.buf, ATOMIC_DELTA_MAGIC, ATOMIC_DELTA_MAGIC_LEN);
+    putle(o.buf + 8, targetlen, 8);
+    putle(o.buf + 16, atomic_crc32c(0, target, targetlen), 4);
+    putle(o.buf + 20, baselen, 8);
+    putle(o.buf + 28, atomic_crc32c(0, base, baselen), 4);
+
+    /* Index the base, a slot per block, more slots than blocks */
+    while (baselen / block > DMAX_BLOCKS)
+	block *= 2;
+    nblocks = baselen / block;
+    if (nblocks) {
+	size_t slots = 1;
+	while (slots < 2 * nblocks)
+	    slots *= 2;
+	mask = slots - 1;
+	if (!(index = (size_t *)calloc(slots, sizeof(*index)))) {
+	    free(o.buf);
+	    return ATOMIC_ERR_NOMEM;
+	}
+	/* backwards, so that the first of identical blocks wins */
+	for (i = nblocks; i-- > 0; )
+	    index[hash(b + i * block, block) & mask] = i * block + 1;
+	for (i = 1; i < block; i++)
+	    pow *= DMULT;
+    }
+
+    /* Scan the target for blocks of the base */
+    ok = 1;
+    p = lit = 0;
+    if (nblocks && targetlen >= block)
+	h = hash(t, block);
+    while (nblocks && p + block <= targetlen && ok > 0) {
+	size_t slot = index[h & mask];
+
+	if (slot && !memcmp(b + slot - 1, t + p, block)) {
+	    size_t off = slot - 1, len = block;
+	    /* grow the match both ways as far as it goes */
+	    while (p > lit && off > 0 && b[off - 1] == t[p - 1]) {
+		--p;
+		--off;
+		++len;
+	    }
+	    while (p + len < targetlen && off + len < baselen
+		    && b[off + len] == t[p + len])
+		++len;
+	    if ((ok = add(&o, target + lit, p - lit)) > 0)
+		ok = copy(&o, off, len);
+	    p += len;
+	    lit = p;
+	    if (p + block <= targetlen)
+		h = hash(t + p, block);
+	    continue;
+	}
+	if (p + block < targetlen)
+	    h = (h - t[p] * pow) * DMULT + t[p + block];
+	++p;
+    }
+    if (ok > 0)
+	ok = add(&o, target + lit, targetlen - lit);
+    free(index);
+
+    if (ok <= 0) {
+	free(o.buf);
+	return ok < 0 ? ATOMIC_ERR_NOMEM : ATOMIC_ERR_SUCCESS;
+    }
+    *delta = o.buf;
+    *deltalen = o.len;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+atomic_err
+atomic_delta_apply(const char *base, size_t baselen, const char *delta,
+		   size_t deltalen, char **target, size_t *targetlen)
+{
+    const char *p = delta + DHEADER_LEN, *end = delta + deltalen;
+    unsigned long long len;
+    size_t n = 0;
+    char *out;
+
+    if (deltalen < DHEADER_LEN || !atomic_is_delta(delta, deltalen)) {
+	errno = EIO;
+	return ATOMIC_ERR_CORRUPT;
+    }
+    if (getle(delta + 20, 8) != baselen
+	    || getle(delta + 28, 4) != atomic_crc32c(0, base, baselen))
+    {
+	errno = ESTALE;
+	return ATOMIC_ERR_CORRUPT;
+    }
+    len = getle(delta + 8, 8);
+    if (len != (size_t)len)
+	return ATOMIC_ERR_NOMEM;
+    if (!(out = (char *)malloc(len ? (size_t)len : 1)))
+	return ATOMIC_ERR_NOMEM;
+
+    while (p < end) {
+	unsigned long long off, run;
+
+	if (*p == 'C' && end - p >= DCOPY_LEN) {
+	    off = getle(p + 1, 8);
+	    run = getle(p + 9, 4);
+	    if (off > baselen || run > baselen - off || run > len - n)
+		break;
+	    memcpy(out + n, base + off, (size_t)run);
+	    p += DCOPY_LEN;
+	}
+	else if (*p == 'A' && end - p >= DADD_LEN) {
+	    run = getle(p + 1, 4);
+	    if (run > (size_t)(end - p) - DADD_LEN || run > len - n)
+		break;
+	    memcpy(out + n, p + DADD_LEN, (size_t)run);
+	    p += DADD_LEN + run;
+	}
+	else
+	    break;
+	n += (size_t)run;
+    }
+    if (p != end || n != len
+	    || atomic_crc32c(0, out, n) != getle(delta + 16, 4))
+    {
+	free(out);
+	errno = EIO;
+	return ATOMIC_ERR_CORRUPT;
+    }
+    *target = out;
+    *targetlen = n;
+    return ATOMIC_ERR_SUCCESS;
+}
@@ -0,0 +1,65 @@
+/* Binary deltas between two versions of a file, for delta backups.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#ifndef __ATOMIC_DELTA_H__
+#define __ATOMIC_DELTA_H__
+
+#include <sys/types.h>
+
+#include "atomictype.h"
+
+/* NOTE:
+ *
+ * A delta rebuilds a 'target' from a 'base'. It is:
+ *
+ *    header   the 8 byte magic "\211AFD\r\n\032\n", then the length and
+ *             CRC-32C of the target and of the base it was made against,
+ *             8 and 4 bytes each, little-endian
+ *    ops      until the target is complete, either 'C' followed by an
+ *             offset into the base (8 bytes) and a length (4 bytes), to
+ *             copy that much of the base, or 'A' followed by a length (4
+ *             bytes) and that many bytes to add
+ *
+ * The base is indexed in blocks, and the target scanned with a rolling
+ * hash of a block, so making a delta is linear in the size of both and
+ * finds any run the two have in common that covers a whole block of the
+ * base, wherever it moved to. Blocks are 64 bytes, more for bases too big
+ * to index in 2M blocks, which bounds the index to 16MB.
+ *
+ * The checksums let a delta tell whether it is being applied to the base
+ * it was made against, which for delta backups may have been rotated away.
+ */
+
+#define ATOMIC_DELTA_MAGIC	"\211AFD\r\n\032\n"
+#define ATOMIC_DELTA_MAGIC_LEN	8
+
+#define atomic_is_delta(buf, len) \
+    ((len) >= ATOMIC_DELTA_MAGIC_LEN \
+     && !memcmp((buf), ATOMIC_DELTA_MAGIC, ATOMIC_DELTA_MAGIC_LEN))
+
+/* atomic_delta_make()
+ *
+ * Makes the delta from 'base' to 'target' in '*delta', which the caller
+ * must free(). Gives up, returning ATOMIC_ERR_SUCCESS with '*delta' NULL,
+ * if the delta would be no smaller than 'limit' bytes. Returns
+ * ATOMIC_ERR_NOMEM if memory runs out.
+ */
+extern atomic_err
+atomic_delta_make(const char *base, size_t baselen, const char *target,
+		  size_t targetlen, size_t limit, char **delta,
+		  size_t *deltalen);
+
+/* atomic_delta_apply()
+ *
+ * Rebuilds the target of 'delta' from 'base' into '*target', which the
+ * caller must free(). Returns ATOMIC_ERR_CORRUPT, with errno ESTALE, if
+ * 'base' is not the one the delta was made against, and with errno EIO if
+ * the delta is damaged; or ATOMIC_ERR_NOMEM.
+ */
+extern atomic_err
+atomic_delta_apply(const char *base, size_t baselen, const char *delta,
+		   size_t deltalen, char **target, size_t *targetlen);
+
+#endif
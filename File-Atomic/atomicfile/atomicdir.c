@@ -3,15 +3,34 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/fs.h>		/* FICLONE */
+#endif
 
 #include "atomicdir.h"
+#include "atomicwalk.h"
+#include "atomicinstall.h"		/* atomic_md5_*() */
+#include "atomicprobe.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX 1024
 #endif
 
+/* Open file description locks conflict even within one process. */
+#ifdef F_OFD_SETLK
+#define PIN_SETLK F_OFD_SETLK
+#else
+#define PIN_SETLK F_SETLK
+#endif
+
 extern char *atomic_strdup(char *);
+extern unsigned int atomic_crc32c(unsigned int crc, const void *buf,
+				  size_t len);
 
 static atomic_err
 lock(atomic_file **l, char *root, atomic_opts *opts)
@@ -113,8 +132,8 @@ current(atomic_dir *self)
     return current;
 }
 
-atomic_err
-atomic_opendir(atomic_dir **ret, char *root, atomic_opts *useropts)
+static atomic_err
+do_opendir(atomic_dir **ret, char *root, atomic_opts *useropts)
 {
     struct stat sbuf;
     char path[PATH_MAX];
@@ -129,11 +148,15 @@ atomic_opendir(atomic_dir **ret, char *root, atomic_opts *useropts)
     if (!(self = (atomic_dir *)malloc(sizeof(atomic_dir))))
 	return ATOMIC_ERR_NOMEM;
     memset((void *)self, 0, sizeof(atomic_dir));
+    self->scratchfd = self->pinfd = -1;
 
     if (useropts) {
 	opts = *useropts;
 	opts.backup_ext = NULL;
 	opts.nolock = 0; /* we MUST lock for writing */
+	opts.skip_unchanged = 0; /* lock commits are never skipped */
+	opts.compress = 0;
+	opts.checksum = 0;
     }
     if (opts.rotate < 3)
 	opts.rotate = 3;
@@ -173,6 +196,7 @@ atomic_opendir(atomic_dir **ret, char *root, atomic_opts *useropts)
 	free(self);
 	return err;
     }
+    ATOMIC_PROBE1(opendir__locked, root);
 
     /* Create the subdirectories (ignores errors if they exist). This sets the
      * ndirs parameter to either opts.rotate if created the directories, or
@@ -225,9 +249,23 @@ atomic_opendir(atomic_dir **ret, char *root, atomic_opts *useropts)
     return ATOMIC_ERR_SUCCESS;
 }
 
+atomic_err
+atomic_opendir(atomic_dir **ret, char *root, atomic_opts *opts)
+{
+    atomic_err err;
+
+    ATOMIC_PROBE2(opendir__start, root, opts ? (int)opts->mode : 0);
+    err = do_opendir(ret, root, opts);
+    ATOMIC_PROBE2(opendir__done, root, err);
+    return err;
+}
+
 void
 atomic_closedir(atomic_dir *self)
 {
+    atomic_unpindir(self);
+    if (self->scratchfd != -1)
+	close(self->scratchfd);
     if (self->lock) {
 	if (self->opts.mode == ATOMIC_READ)
 	    atomic_close(self->lock);
@@ -291,17 +329,128 @@ atomic_version_i(atomic_dir *self, int dir, char *version_str)
     return version(path, version_str);
 }
 
-#define NEXTDIR(self) (current(self) % (self)->topdir + 1)
+/* Tries to take a 'type' lock on the pin file of subdirectory 'ix' without
+ * waiting, creating the file if need be. Returns the fd, or -1 with errno
+ * EAGAIN if someone else holds a conflicting lock; any other errno means
+ * the file can't be opened or locked at all, and waiting won't help. */
+static int
+pin(atomic_dir *self, int ix, short type)
+{
+    char path[PATH_MAX];
+    struct flock l;
+    int fd;
+    int r = snprintf(path, sizeof(path), "%s/.pin.%d", self->root, ix);
+    if (r < 0 || r >= sizeof(path)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    /* read locks need only read access, so readers can pin directories
+     * they can't write to, once a writer has created the file */
+    fd = open(path, type == F_RDLCK ? O_RDONLY : O_RDWR);
+    if (fd < 0 && errno == ENOENT)
+	fd = open(path, O_RDWR|O_CREAT, 0666);
+    if (fd < 0)
+	return -1;
+    memset(&l, 0, sizeof(l));
+    l.l_type = type;
+    l.l_whence = SEEK_SET;
+    if (fcntl(fd, PIN_SETLK, &l) < 0) {
+	int save_errno = errno;
+	close(fd);
+	/* POSIX lets fcntl() report a conflicting lock either way */
+	errno = save_errno == EACCES ? EAGAIN : save_errno;
+	return -1;
+    }
+    return fd;
+}
+
+atomic_err
+atomic_pindir(atomic_dir *self, int *ix)
+{
+    int cur, fd;
+
+    atomic_unpindir(self);
+    while (1) {
+	if (!(cur = current(self)))
+	    return ATOMIC_ERR_NOCURRENT;
+	if ((fd = pin(self, cur, F_RDLCK)) >= 0) {
+	    /* Make sure it didn't stop being current before we pinned it;
+	     * a writer could have picked it in between. */
+	    if (current(self) == cur)
+		break;
+	    close(fd);
+	}
+	else if (errno != EAGAIN)
+	    return ATOMIC_ERR_CANTLOCK;
+	else {
+	    /* A writer has it, so it has just been committed and the
+	     * writer hasn't let go yet, or it is no longer current. */
+	    usleep(1000);
+	}
+    }
+    self->pinned = *ix = cur;
+    self->pinfd = fd;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+void
+atomic_unpindir(atomic_dir *self)
+{
+    if (self->pinfd != -1) {
+	close(self->pinfd);
+	self->pinfd = -1;
+    }
+    self->pinned = 0;
+}
+
+/* Picks the scratch directory (see atomic_scratchdir()), or returns 0 with
+ * errno EAGAIN if they are all busy, or some other errno if a pin file
+ * can't be used; noscratch() turns that into an error. */
+static int
+scratch(atomic_dir *self)
+{
+    int cur, ix, i;
+    int t = self->opts.timeout;
+
+    if (self->opts.mode == ATOMIC_READ)
+	return 0;
+    if (self->scratch)
+	return self->scratch;
+    cur = current(self);
+    while (1) {
+	for (i = 0, ix = cur; i < self->topdir; i++) {
+	    ix = ix % self->topdir + 1;
+	    if (ix == cur)
+		continue;
+	    if ((self->scratchfd = pin(self, ix, F_WRLCK)) >= 0)
+		return self->scratch = ix;
+	    if (errno != EAGAIN)
+		return 0;
+	}
+	if (self->opts.timeout && --t <= 0) {
+	    errno = EAGAIN;
+	    return 0;
+	}
+	sleep(1);
+    }
+}
+
+static atomic_err
+noscratch(void)
+{
+    return errno == EAGAIN ? ATOMIC_ERR_NOFREESLOT : ATOMIC_ERR_CANTLOCK;
+}
 
 atomic_err
 atomic_scratchdir(atomic_dir *self, char *name, size_t len)
 {
-    int scratch;
+    int ix;
     int r;
     if (self->opts.mode == ATOMIC_READ)
 	return ATOMIC_ERR_OPENEDREADABLE;
-    scratch = NEXTDIR(self);
-    r = snprintf(name, len, "%s/%d", self->root, scratch);
+    if (!(ix = scratch(self)))
+	return noscratch();
+    r = snprintf(name, len, "%s/%d", self->root, ix);
     if (r < 0 || r >= len)
 	return ATOMIC_ERR_PATHTOOLONG;
     return ATOMIC_ERR_SUCCESS;
@@ -310,7 +459,7 @@ atomic_scratchdir(atomic_dir *self, char *name, size_t len)
 int
 atomic_scratchdir_i(atomic_dir *self)
 {
-    return NEXTDIR(self);
+    return scratch(self);
 }
 
 static atomic_err
@@ -327,15 +476,1104 @@ rollback(atomic_dir *self, int ix)
     r = snprintf(lbuf, sizeof(lbuf), "%d", ix);
     if (r < 0 || r >= sizeof(lbuf))
 	return ATOMIC_ERR_NOMEM;
+    ATOMIC_PROBE2(rollback__start, self->root, ix);
     mktemp(tmp);
-    if (symlink(lbuf, tmp) < 0)
+    if (symlink(lbuf, tmp) < 0) {
+	ATOMIC_PROBE3(rollback__done, self->root, ix, ATOMIC_ERR_CANTLINK);
 	return ATOMIC_ERR_CANTLINK;
-    if (rename(tmp, self->current) < 0)
+    }
+    if (rename(tmp, self->current) < 0) {
+	ATOMIC_PROBE3(rollback__done, self->root, ix, ATOMIC_ERR_CANTRENAME);
 	return ATOMIC_ERR_CANTRENAME;
+    }
+    ATOMIC_PROBE3(rollback__done, self->root, ix, ATOMIC_ERR_SUCCESS);
     atomic_closedir(self);
     return ATOMIC_ERR_SUCCESS;
 }
 
+/* Emptying and cloning directories */
+
+/* A list of directories, filled in by several walker threads */
+struct dirlist {
+    pthread_mutex_t mutex;
+    char **paths;
+    mode_t *modes;
+    size_t n, max;
+};
+
+static atomic_err
+dirlist_add(struct dirlist *l, const char *path, const char *name,
+	    mode_t mode)
+{
+    char buf[PATH_MAX];
+    atomic_err err = atomic_walk_join(buf, sizeof(buf), path, name);
+    if (err != ATOMIC_ERR_SUCCESS)
+	return err;
+    pthread_mutex_lock(&l->mutex);
+    if (l->n == l->max) {
+	size_t max = l->max ? l->max * 2 : 64;
+	char **paths = realloc(l->paths, max * sizeof(char *));
+	mode_t *modes = paths ? realloc(l->modes, max * sizeof(mode_t)) : NULL;
+	if (paths)
+	    l->paths = paths;
+	if (modes)
+	    l->modes = modes;
+	if (!paths || !modes) {
+	    pthread_mutex_unlock(&l->mutex);
+	    return ATOMIC_ERR_NOMEM;
+	}
+	l->max = max;
+    }
+    if (!(l->paths[l->n] = atomic_strdup(buf))) {
+	pthread_mutex_unlock(&l->mutex);
+	return ATOMIC_ERR_NOMEM;
+    }
+    l->modes[l->n++] = mode;
+    pthread_mutex_unlock(&l->mutex);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static void
+dirlist_free(struct dirlist *l)
+{
+    while (l->n)
+	free(l->paths[--l->n]);
+    free(l->paths);
+    free(l->modes);
+    pthread_mutex_destroy(&l->mutex);
+    memset(l, 0, sizeof(*l));
+}
+
+static int
+depth(const char *path)
+{
+    int d = 0;
+    for (; *path; path++)
+	d += (*path == '/');
+    return d;
+}
+
+/* deepest first */
+static int
+bydepth(const void *a, const void *b)
+{
+    return depth(*(char * const *)b) - depth(*(char * const *)a);
+}
+
+static atomic_err
+clear_entry(void *arg, atomic_walk_entry *e, int *descend)
+{
+    if (e->type == DT_DIR)
+	return dirlist_add((struct dirlist *)arg, e->path, e->name, 0);
+    if (unlinkat(e->dirfd, e->name, 0) < 0 && errno != ENOENT)
+	return ATOMIC_ERR_CANTUNLINK;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Removes everything inside 'dir': the files in parallel, then the
+ * emptied directories, deepest first. */
+static atomic_err
+cleardir(const char *dir, int nthreads)
+{
+    atomic_walk_ops ops = { NULL, clear_entry, NULL, NULL };
+    struct dirlist l;
+    atomic_err err;
+    size_t i;
+    int fd;
+
+    memset(&l, 0, sizeof(l));
+    pthread_mutex_init(&l.mutex, NULL);
+    err = atomic_walk(dir, nthreads, &ops, &l);
+    if (err == ATOMIC_ERR_SUCCESS) {
+	if ((fd = open(dir, O_RDONLY)) < 0)
+	    err = ATOMIC_ERR_CANTOPEN;
+	else {
+	    qsort(l.paths, l.n, sizeof(char *), bydepth);
+	    for (i = 0; i < l.n && err == ATOMIC_ERR_SUCCESS; i++)
+		if (unlinkat(fd, l.paths[i], AT_REMOVEDIR) < 0)
+		    err = ATOMIC_ERR_CANTUNLINK;
+	    close(fd);
+	}
+    }
+    dirlist_free(&l);
+    return err;
+}
+
+struct clone {
+    int dstfd;			/* the root of the copy */
+    struct dirlist fixmodes;	/* directories created writable */
+};
+
+static atomic_err
+clone_enter(void *arg, int dirfd, const char *path, void **dirdata)
+{
+    struct clone *c = (struct clone *)arg;
+    int fd = openat(c->dstfd, *path ? path : ".", O_RDONLY);
+    if (fd < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    *dirdata = (void *)(long)fd;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static atomic_err
+clone_entry(void *arg, atomic_walk_entry *e, int *descend)
+{
+    struct clone *c = (struct clone *)arg;
+    int dfd = (int)(long)e->dirdata;
+    char target[PATH_MAX];
+    struct stat st;
+    ssize_t sz;
+
+    switch (e->type) {
+	case DT_REG:
+	    if (linkat(e->dirfd, e->name, dfd, e->name, 0) < 0)
+		return ATOMIC_ERR_CANTLINK;
+	    break;
+	case DT_LNK:
+	    sz = readlinkat(e->dirfd, e->name, target, sizeof(target) - 1);
+	    if (sz < 0)
+		return ATOMIC_ERR_CANTREAD;
+	    target[sz] = '\0';
+	    if (symlinkat(target, dfd, e->name) < 0)
+		return ATOMIC_ERR_CANTLINK;
+	    break;
+	case DT_DIR:
+	    if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return ATOMIC_ERR_CANTREAD;
+	    /* we need to write into it; put the real mode back at the end */
+	    if (mkdirat(dfd, e->name, (st.st_mode & 07777) | S_IRWXU) < 0)
+		return ATOMIC_ERR_CANTMKDIR;
+	    if ((st.st_mode & S_IRWXU) != S_IRWXU)
+		return dirlist_add(&c->fixmodes, e->path, e->name,
+				   st.st_mode & 07777);
+	    break;
+	default:
+	    /* devices, fifos and sockets don't belong in a data directory */
+	    break;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static void
+clone_leave(void *arg, const char *path, void *dirdata)
+{
+    close((int)(long)dirdata);
+}
+
+static atomic_err
+clonetree(const char *from, const char *to, int nthreads)
+{
+    atomic_walk_ops ops = { clone_enter, clone_entry, clone_leave, NULL };
+    struct clone c;
+    atomic_err err;
+    size_t i;
+
+    memset(&c, 0, sizeof(c));
+    if ((c.dstfd = open(to, O_RDONLY)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    pthread_mutex_init(&c.fixmodes.mutex, NULL);
+    err = atomic_walk(from, nthreads, &ops, &c);
+    /* deepest first, so that no parent is made read-only too early */
+    qsort(c.fixmodes.paths, c.fixmodes.n, sizeof(char *), bydepth);
+    for (i = 0; i < c.fixmodes.n; i++)
+	fchmodat(c.dstfd, c.fixmodes.paths[i], c.fixmodes.modes[i], 0);
+    dirlist_free(&c.fixmodes);
+    close(c.dstfd);
+    return err;
+}
+
+atomic_err
+atomic_clonedir(atomic_dir *self, int nthreads)
+{
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    atomic_err err;
+    int cur, ix, r;
+
+    if (self->opts.mode == ATOMIC_READ)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    if (!(ix = scratch(self)))
+	return noscratch();
+    r = snprintf(to, sizeof(to), "%s/%d", self->root, ix);
+    if (r < 0 || r >= sizeof(to))
+	return ATOMIC_ERR_PATHTOOLONG;
+    if ((err = cleardir(to, nthreads)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (!(cur = current(self)))
+	return ATOMIC_ERR_SUCCESS;
+    r = snprintf(from, sizeof(from), "%s/%d", self->root, cur);
+    if (r < 0 || r >= sizeof(from))
+	return ATOMIC_ERR_PATHTOOLONG;
+    return clonetree(from, to, nthreads);
+}
+
+/* Copies the rest of 'in' to 'out': as a reflink if possible, else in the
+ * kernel if possible, else through a buffer. */
+static atomic_err
+copydata(int in, int out)
+{
+    char buf[65536];
+    ssize_t n;
+
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0)
+	return ATOMIC_ERR_SUCCESS;
+#endif
+#ifdef ATOMIC_HAS_COPY_FILE_RANGE
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+	;
+    if (n == 0)
+	return ATOMIC_ERR_SUCCESS;
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL)
+	return ATOMIC_ERR_CANTWRITE;
+#endif
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+	if (write(out, buf, n) != n)
+	    return ATOMIC_ERR_CANTWRITE;
+    return n < 0 ? ATOMIC_ERR_CANTREAD : ATOMIC_ERR_SUCCESS;
+}
+
+/* Gives 'fd' the mode, times and (for root) owner in 'st'. */
+static void
+copymeta(int fd, struct stat *st)
+{
+    struct timespec times[2];
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    fchmod(fd, st->st_mode & 07777);
+    if (geteuid() == 0)
+	fchown(fd, st->st_uid, st->st_gid);
+    futimens(fd, times);
+}
+
+atomic_err
+atomic_breaklink(const char *path)
+{
+    char tmp[PATH_MAX];
+    const char *base;
+    struct stat st;
+    atomic_err err;
+    int in, out, r;
+
+    if (lstat(path, &st) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    if (!S_ISREG(st.st_mode) || st.st_nlink < 2)
+	return ATOMIC_ERR_SUCCESS;
+
+    /* copy it to /dir/.name.XXXXXX and rename that over it */
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    r = snprintf(tmp, sizeof(tmp), "%.*s.%s.XXXXXX", (int)(base - path), path,
+		 base);
+    if (r < 0 || r >= sizeof(tmp))
+	return ATOMIC_ERR_PATHTOOLONG;
+    if ((in = open(path, O_RDONLY)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    if ((out = mkstemp(tmp)) < 0) {
+	close(in);
+	return ATOMIC_ERR_NOTEMPFILE;
+    }
+
+    if ((err = copydata(in, out)) == ATOMIC_ERR_SUCCESS)
+	copymeta(out, &st);
+    close(in);
+    if (close(out) < 0 && err == ATOMIC_ERR_SUCCESS)
+	err = ATOMIC_ERR_BADCLOSE;
+    if (err == ATOMIC_ERR_SUCCESS && rename(tmp, path) < 0)
+	err = ATOMIC_ERR_CANTRENAME;
+    if (err != ATOMIC_ERR_SUCCESS) {
+	int save_errno = errno;
+	unlink(tmp);
+	errno = save_errno;
+    }
+    return err;
+}
+
+/* Synchronising the scratch directory with another tree */
+
+struct sync {
+    int srcfd;			/* the roots of both trees */
+    int dstfd;
+    int flags;
+    struct dirlist dirs;	/* doomed, then modes to restore */
+    pthread_mutex_t mutex;	/* for the rest */
+    atomic_syncstats stats;
+    unsigned long serial;
+};
+
+static void
+count(struct sync *s, unsigned long *counter, off_t bytes)
+{
+    pthread_mutex_lock(&s->mutex);
+    ++*counter;
+    s->stats.bytes_copied += bytes;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/* Makes a unique temporary name for 'name' in the same directory. */
+static void
+tempname(struct sync *s, char *buf, size_t sz, const char *name)
+{
+    unsigned long n;
+    pthread_mutex_lock(&s->mutex);
+    n = ++s->serial;
+    pthread_mutex_unlock(&s->mutex);
+    snprintf(buf, sz, ".%.200s.%ld.%lu", name, (long)getpid(), n);
+}
+
+/* Compares two regular files of the same size byte for byte. */
+static int
+samecontents(int dirfd1, const char *name1, int dirfd2, const char *name2,
+	     size_t size)
+{
+    int fd1, fd2, same = 0;
+    void *p1 = MAP_FAILED, *p2 = MAP_FAILED;
+
+    if (!size)
+	return 1;
+    fd1 = openat(dirfd1, name1, O_RDONLY);
+    fd2 = openat(dirfd2, name2, O_RDONLY);
+    if (fd1 >= 0 && fd2 >= 0) {
+	p1 = mmap(NULL, size, PROT_READ, MAP_SHARED, fd1, 0);
+	p2 = mmap(NULL, size, PROT_READ, MAP_SHARED, fd2, 0);
+	if (p1 != MAP_FAILED && p2 != MAP_FAILED) {
+	    madvise(p1, size, MADV_SEQUENTIAL);
+	    madvise(p2, size, MADV_SEQUENTIAL);
+	    same = !memcmp(p1, p2, size);
+	}
+    }
+    if (p1 != MAP_FAILED)
+	munmap(p1, size);
+    if (p2 != MAP_FAILED)
+	munmap(p2, size);
+    if (fd1 >= 0)
+	close(fd1);
+    if (fd2 >= 0)
+	close(fd2);
+    return same;
+}
+
+/* First pass, over the scratch directory: removes whatever the source
+ * doesn't have, or has as a directory where scratch has a file or vice
+ * versa. */
+static atomic_err
+prune_entry(void *arg, atomic_walk_entry *e, int *descend)
+{
+    struct sync *s = (struct sync *)arg;
+    char rel[PATH_MAX];
+    struct stat st;
+    atomic_err err;
+
+    if ((err = atomic_walk_join(rel, sizeof(rel), e->path, e->name))
+	    != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (fstatat(s->srcfd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0
+	    && !S_ISDIR(st.st_mode) == (e->type != DT_DIR))
+	return ATOMIC_ERR_SUCCESS;
+    if (e->type == DT_DIR)
+	return dirlist_add(&s->dirs, e->path, e->name, 0);  /* and descend */
+    if (unlinkat(e->dirfd, e->name, 0) < 0) {
+	if (errno == ENOENT)
+	    return ATOMIC_ERR_SUCCESS;
+	return ATOMIC_ERR_CANTUNLINK;
+    }
+    count(s, &s->stats.files_deleted, 0);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static atomic_err
+sync_enter(void *arg, int dirfd, const char *path, void **dirdata)
+{
+    struct sync *s = (struct sync *)arg;
+    int fd = openat(s->dstfd, *path ? path : ".", O_RDONLY);
+    if (fd < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    *dirdata = (void *)(long)fd;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static atomic_err
+sync_file(struct sync *s, atomic_walk_entry *e, int dfd, struct stat *st)
+{
+    char tmp[PATH_MAX];
+    atomic_err err;
+    int in, out;
+
+    if ((in = openat(e->dirfd, e->name, O_RDONLY)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    tempname(s, tmp, sizeof(tmp), e->name);
+    if ((out = openat(dfd, tmp, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0) {
+	close(in);
+	return ATOMIC_ERR_NOTEMPFILE;
+    }
+    if ((err = copydata(in, out)) == ATOMIC_ERR_SUCCESS)
+	copymeta(out, st);
+    close(in);
+    if (close(out) < 0 && err == ATOMIC_ERR_SUCCESS)
+	err = ATOMIC_ERR_BADCLOSE;
+    /* renaming over the old name also breaks any hard link to it */
+    if (err == ATOMIC_ERR_SUCCESS && renameat(dfd, tmp, dfd, e->name) < 0)
+	err = ATOMIC_ERR_CANTRENAME;
+    if (err != ATOMIC_ERR_SUCCESS) {
+	int save_errno = errno;
+	unlinkat(dfd, tmp, 0);
+	errno = save_errno;
+	return err;
+    }
+    count(s, &s->stats.files_copied, st->st_size);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static atomic_err
+sync_link(struct sync *s, atomic_walk_entry *e, int dfd)
+{
+    char target[PATH_MAX];
+    char old[PATH_MAX];
+    char tmp[PATH_MAX];
+    ssize_t n, m;
+
+    if ((n = readlinkat(e->dirfd, e->name, target, sizeof(target) - 1)) < 0)
+	return ATOMIC_ERR_CANTREAD;
+    target[n] = '\0';
+    m = readlinkat(dfd, e->name, old, sizeof(old) - 1);
+    if (m == n && !memcmp(old, target, n)) {
+	count(s, &s->stats.files_checked, 0);
+	return ATOMIC_ERR_SUCCESS;
+    }
+    tempname(s, tmp, sizeof(tmp), e->name);
+    if (symlinkat(target, dfd, tmp) < 0)
+	return ATOMIC_ERR_CANTLINK;
+    if (renameat(dfd, tmp, dfd, e->name) < 0) {
+	unlinkat(dfd, tmp, 0);
+	return ATOMIC_ERR_CANTRENAME;
+    }
+    count(s, &s->stats.files_copied, 0);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Second pass, over the source: creates missing directories and copies
+ * whatever differs. */
+static atomic_err
+sync_entry(void *arg, atomic_walk_entry *e, int *descend)
+{
+    struct sync *s = (struct sync *)arg;
+    int dfd = (int)(long)e->dirdata;
+    struct stat st, dst;
+
+    if (e->type != DT_REG && e->type != DT_DIR) {
+	if (e->type == DT_LNK)
+	    return sync_link(s, e, dfd);
+	return ATOMIC_ERR_SUCCESS;	/* see clone_entry() */
+    }
+    if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	return ATOMIC_ERR_CANTREAD;
+    if (e->type == DT_DIR) {
+	/* writable until we're done, like in clone_entry() */
+	if (mkdirat(dfd, e->name, (st.st_mode & 07777) | S_IRWXU) < 0) {
+	    if (errno != EEXIST)
+		return ATOMIC_ERR_CANTMKDIR;
+	    fchmodat(dfd, e->name, (st.st_mode & 07777) | S_IRWXU, 0);
+	}
+	return dirlist_add(&s->dirs, e->path, e->name, st.st_mode & 07777);
+    }
+    if (fstatat(dfd, e->name, &dst, AT_SYMLINK_NOFOLLOW) == 0
+	    && S_ISREG(dst.st_mode)
+	    && dst.st_size == st.st_size
+	    && (dst.st_mode & 07777) == (st.st_mode & 07777)
+	    && ((s->flags & ATOMIC_SYNC_CONTENTS)
+		? samecontents(e->dirfd, e->name, dfd, e->name, st.st_size)
+		: dst.st_mtim.tv_sec == st.st_mtim.tv_sec
+		  && dst.st_mtim.tv_nsec == st.st_mtim.tv_nsec))
+    {
+	count(s, &s->stats.files_checked, 0);
+	return ATOMIC_ERR_SUCCESS;
+    }
+    return sync_file(s, e, dfd, &st);
+}
+
+atomic_err
+atomic_syncdir(atomic_dir *self, const char *src, int flags, int nthreads,
+	       atomic_syncstats *stats)
+{
+    atomic_walk_ops prune = { NULL, prune_entry, NULL, NULL };
+    atomic_walk_ops copy = { sync_enter, sync_entry, clone_leave, NULL };
+    char to[PATH_MAX];
+    struct sync s;
+    atomic_err err;
+    size_t i;
+    int ix, r;
+
+    if (self->opts.mode == ATOMIC_READ)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    if (!(ix = scratch(self)))
+	return noscratch();
+    r = snprintf(to, sizeof(to), "%s/%d", self->root, ix);
+    if (r < 0 || r >= sizeof(to))
+	return ATOMIC_ERR_PATHTOOLONG;
+
+    memset(&s, 0, sizeof(s));
+    s.flags = flags;
+    if ((s.srcfd = open(src, O_RDONLY)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    if ((s.dstfd = open(to, O_RDONLY)) < 0) {
+	close(s.srcfd);
+	return ATOMIC_ERR_CANTOPEN;
+    }
+    pthread_mutex_init(&s.mutex, NULL);
+    pthread_mutex_init(&s.dirs.mutex, NULL);
+
+    err = atomic_walk(to, nthreads, &prune, &s);
+    if (err == ATOMIC_ERR_SUCCESS) {
+	qsort(s.dirs.paths, s.dirs.n, sizeof(char *), bydepth);
+	for (i = 0; i < s.dirs.n && err == ATOMIC_ERR_SUCCESS; i++)
+	    if (unlinkat(s.dstfd, s.dirs.paths[i], AT_REMOVEDIR) < 0)
+		err = ATOMIC_ERR_CANTUNLINK;
+    }
+    dirlist_free(&s.dirs);
+
+    if (err == ATOMIC_ERR_SUCCESS) {
+	pthread_mutex_init(&s.dirs.mutex, NULL);
+	err = atomic_walk(src, nthreads, &copy, &s);
+	qsort(s.dirs.paths, s.dirs.n, sizeof(char *), bydepth);
+	for (i = 0; i < s.dirs.n; i++)
+	    fchmodat(s.dstfd, s.dirs.paths[i], s.dirs.modes[i], 0);
+	dirlist_free(&s.dirs);
+    }
+
+    {
+	int save_errno = errno;
+	pthread_mutex_destroy(&s.mutex);
+	close(s.srcfd);
+	close(s.dstfd);
+	errno = save_errno;
+    }
+    if (stats)
+	*stats = s.stats;
+    return err;
+}
+
+/* Manifests; see atomicdir.h */
+
+#define MMAGIC		"\211AF5\r\n\032\n"	/* entries hold MD5s */
+#define MMAGIC_CRC	"\211AFM\r\n\032\n"	/* older, with CRC-32Cs */
+#define MMAGIC_LEN	8
+#define MHEADER_LEN	12	/* magic, count */
+#define MENTRY_LEN	51	/* before the path; see struct mentry */
+#define MHASH_LEN	16
+
+struct mentry {
+    char *path;
+    int type;			/* 'f', 'd', 'l' or 'o' */
+    unsigned int mode;
+    unsigned long long size;
+    unsigned char hash[MHASH_LEN]; /* MD5 of the contents, or the symlink
+				    * target */
+    unsigned long long ino;	/* to tell whether 'hash' can be reused */
+    long long mtime;
+    long mtime_ns;
+};
+
+struct manifest {
+    pthread_mutex_t mutex;	/* while being built */
+    struct mentry *e;
+    size_t n, max;
+};
+
+static void
+putle(char *buffer, unsigned long long n, int len)
+{
+    int i;
+    for (i = 0; i < len; i++, n >>= 8)
+	buffer[i] = (char)(n & 0xff);
+}
+
+static unsigned long long
+getle(const char *buffer, int len)
+{
+    unsigned long long n = 0;
+    while (len--)
+	n = (n << 8) | (unsigned char)buffer[len];
+    return n;
+}
+
+static void
+manifest_free(struct manifest *m)
+{
+    while (m->n)
+	free(m->e[--m->n].path);
+    free(m->e);
+    m->e = NULL;
+    m->max = 0;
+}
+
+static int
+bypath(const void *a, const void *b)
+{
+    return strcmp(((const struct mentry *)a)->path,
+		  ((const struct mentry *)b)->path);
+}
+
+static atomic_err
+manifest_path(atomic_dir *self, int ix, char *buf, size_t sz)
+{
+    int r = snprintf(buf, sz, "%s/.manifest.%d", self->root, ix);
+    if (r < 0 || r >= sz)
+	return ATOMIC_ERR_PATHTOOLONG;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Reads the manifest of directory 'ix' into 'm', which is sorted by path. */
+static atomic_err
+manifest_read(atomic_dir *self, int ix, struct manifest *m)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    atomic_err err;
+    char *buf, *p, *end;
+    size_t i, n;
+    int fd;
+
+    memset(m, 0, sizeof(*m));
+    if ((err = manifest_path(self, ix, path, sizeof(path)))
+	    != ATOMIC_ERR_SUCCESS)
+	return err;
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return ATOMIC_ERR_CANTREAD;
+    }
+    if (st.st_size < MHEADER_LEN + 4) {
+	close(fd);
+	return ATOMIC_ERR_CORRUPT;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+	return ATOMIC_ERR_CANTMMAP;
+    /* one with CRC-32Cs can't be compared with the others; it is as good
+     * as none */
+    if (!memcmp(buf, MMAGIC_CRC, MMAGIC_LEN)) {
+	munmap(buf, st.st_size);
+	return ATOMIC_ERR_CANTOPEN;
+    }
+    end = buf + st.st_size - 4;
+    n = getle(buf + MMAGIC_LEN, 4);
+    if (memcmp(buf, MMAGIC, MMAGIC_LEN)
+	    || atomic_crc32c(0, buf, end - buf) != getle(end, 4)
+	    || n > (end - buf) / MENTRY_LEN)
+    {
+	munmap(buf, st.st_size);
+	return ATOMIC_ERR_CORRUPT;
+    }
+    if (n && !(m->e = calloc(n, sizeof(struct mentry)))) {
+	munmap(buf, st.st_size);
+	return ATOMIC_ERR_NOMEM;
+    }
+    for (i = 0, p = buf + MHEADER_LEN; i < n; i++) {
+	struct mentry *e = &m->e[i];
+	size_t len;
+	if (end - p < MENTRY_LEN
+		|| end - p - MENTRY_LEN < (len = getle(p, 2))) {
+	    err = ATOMIC_ERR_CORRUPT;
+	    break;
+	}
+	e->type = p[2];
+	e->mode = getle(p + 3, 4);
+	e->size = getle(p + 7, 8);
+	memcpy(e->hash, p + 15, MHASH_LEN);
+	e->ino = getle(p + 31, 8);
+	e->mtime = (long long)getle(p + 39, 8);
+	e->mtime_ns = getle(p + 47, 4);
+	if (!(e->path = malloc(len + 1))) {
+	    err = ATOMIC_ERR_NOMEM;
+	    break;
+	}
+	memcpy(e->path, p + MENTRY_LEN, len);
+	e->path[len] = '\0';
+	m->n++;
+	p += MENTRY_LEN + len;
+    }
+    munmap(buf, st.st_size);
+    if (err != ATOMIC_ERR_SUCCESS)
+	manifest_free(m);
+    return err;
+}
+
+/* Writes 'm', which must be sorted, as the manifest of directory 'ix'. */
+static atomic_err
+manifest_write(atomic_dir *self, int ix, struct manifest *m)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    char *buf, *p;
+    size_t i, len = MHEADER_LEN + 4;
+    atomic_err err;
+    int fd, r;
+
+    if ((err = manifest_path(self, ix, path, sizeof(path)))
+	    != ATOMIC_ERR_SUCCESS)
+	return err;
+    r = snprintf(tmp, sizeof(tmp), "%s/.manifest.XXXXXX", self->root);
+    if (r < 0 || r >= sizeof(tmp))
+	return ATOMIC_ERR_PATHTOOLONG;
+    for (i = 0; i < m->n; i++)
+	len += MENTRY_LEN + strlen(m->e[i].path);
+    if (!(buf = malloc(len)))
+	return ATOMIC_ERR_NOMEM;
+
+    memcpy(buf, MMAGIC, MMAGIC_LEN);
+    putle(buf + MMAGIC_LEN, m->n, 4);
+    for (i = 0, p = buf + MHEADER_LEN; i < m->n; i++) {
+	struct mentry *e = &m->e[i];
+	size_t plen = strlen(e->path);
+	putle(p, plen, 2);
+	p[2] = (char)e->type;
+	putle(p + 3, e->mode, 4);
+	putle(p + 7, e->size, 8);
+	memcpy(p + 15, e->hash, MHASH_LEN);
+	putle(p + 31, e->ino, 8);
+	putle(p + 39, (unsigned long long)e->mtime, 8);
+	putle(p + 47, e->mtime_ns, 4);
+	memcpy(p + MENTRY_LEN, e->path, plen);
+	p += MENTRY_LEN + plen;
+    }
+    putle(p, atomic_crc32c(0, buf, p - buf), 4);
+
+    if ((fd = mkstemp(tmp)) < 0)
+	err = ATOMIC_ERR_NOTEMPFILE;
+    else {
+	if (write(fd, buf, len) != len)
+	    err = ATOMIC_ERR_CANTWRITE;
+	fchmod(fd, 0644);
+	if (close(fd) < 0 && err == ATOMIC_ERR_SUCCESS)
+	    err = ATOMIC_ERR_BADCLOSE;
+	if (err == ATOMIC_ERR_SUCCESS && rename(tmp, path) < 0)
+	    err = ATOMIC_ERR_CANTRENAME;
+	if (err != ATOMIC_ERR_SUCCESS)
+	    unlink(tmp);
+    }
+    free(buf);
+    return err;
+}
+
+/* Building a manifest: 'old' is the previous one, for its hashes */
+struct mbuild {
+    struct manifest *m;
+    struct manifest *old;
+};
+
+static void
+md5(const void *buf, size_t len, unsigned char *digest)
+{
+    atomic_md5_ctx ctx;
+
+    atomic_md5_init(&ctx);
+    atomic_md5_update(&ctx, buf, len);
+    atomic_md5_final(&ctx, digest);
+}
+
+static atomic_err
+hashfile(int dirfd, const char *name, size_t size, unsigned char *digest)
+{
+    void *p;
+    int fd;
+
+    if (!size) {
+	md5("", 0, digest);
+	return ATOMIC_ERR_SUCCESS;
+    }
+    if ((fd = openat(dirfd, name, O_RDONLY)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+	return ATOMIC_ERR_CANTMMAP;
+    madvise(p, size, MADV_SEQUENTIAL);
+    md5(p, size, digest);
+    munmap(p, size);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static atomic_err
+manifest_entry(void *arg, atomic_walk_entry *e, int *descend)
+{
+    struct mbuild *b = (struct mbuild *)arg;
+    struct manifest *m = b->m;
+    struct mentry me, *old;
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    struct stat st;
+    atomic_err err;
+    ssize_t n;
+
+    if (!*e->path && !strcmp(e->name, VERSION_SYMLINK))
+	return ATOMIC_ERR_SUCCESS;
+    if ((err = atomic_walk_join(path, sizeof(path), e->path, e->name))
+	    != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	return ATOMIC_ERR_CANTREAD;
+    memset(&me, 0, sizeof(me));
+    me.mode = st.st_mode & 07777;
+    me.ino = st.st_ino;
+    me.mtime = st.st_mtim.tv_sec;
+    me.mtime_ns = st.st_mtim.tv_nsec;
+    switch (e->type) {
+	case DT_REG:
+	    me.type = 'f';
+	    me.size = st.st_size;
+	    me.path = path;
+	    old = b->old->n ? bsearch(&me, b->old->e, b->old->n,
+				      sizeof(struct mentry), bypath) : NULL;
+	    if (old && old->type == 'f' && old->ino == me.ino
+		    && old->size == me.size && old->mtime == me.mtime
+		    && old->mtime_ns == me.mtime_ns)
+		memcpy(me.hash, old->hash, MHASH_LEN);
+	    else if ((err = hashfile(e->dirfd, e->name, st.st_size, me.hash))
+		    != ATOMIC_ERR_SUCCESS)
+		return err;
+	    break;
+	case DT_LNK:
+	    me.type = 'l';
+	    if ((n = readlinkat(e->dirfd, e->name, target, sizeof(target))) < 0)
+		return ATOMIC_ERR_CANTREAD;
+	    me.size = n;
+	    md5(target, n, me.hash);
+	    break;
+	case DT_DIR:
+	    me.type = 'd';
+	    break;
+	default:
+	    me.type = 'o';
+	    break;
+    }
+    if (!(me.path = atomic_strdup(path)))
+	return ATOMIC_ERR_NOMEM;
+
+    pthread_mutex_lock(&m->mutex);
+    if (m->n == m->max) {
+	size_t max = m->max ? m->max * 2 : 256;
+	struct mentry *ne = realloc(m->e, max * sizeof(struct mentry));
+	if (!ne) {
+	    pthread_mutex_unlock(&m->mutex);
+	    free(me.path);
+	    return ATOMIC_ERR_NOMEM;
+	}
+	m->e = ne;
+	m->max = max;
+    }
+    m->e[m->n++] = me;
+    pthread_mutex_unlock(&m->mutex);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Writes the manifest of directory 'ix', reusing the hashes in the one of
+ * the current directory for files that are still the same inode. */
+static atomic_err
+manifest_build(atomic_dir *self, int ix)
+{
+    atomic_walk_ops ops = { NULL, manifest_entry, NULL, NULL };
+    char dir[PATH_MAX];
+    struct manifest m, old;
+    struct mbuild b;
+    atomic_err err;
+    int cur, r;
+
+    r = snprintf(dir, sizeof(dir), "%s/%d", self->root, ix);
+    if (r < 0 || r >= sizeof(dir))
+	return ATOMIC_ERR_PATHTOOLONG;
+    memset(&old, 0, sizeof(old));
+    if ((cur = current(self)) && cur != ix)
+	(void)manifest_read(self, cur, &old);	/* just an optimisation */
+    memset(&m, 0, sizeof(m));
+    pthread_mutex_init(&m.mutex, NULL);
+    b.m = &m;
+    b.old = &old;
+    err = atomic_walk(dir, 0, &ops, &b);
+    if (err == ATOMIC_ERR_SUCCESS) {
+	qsort(m.e, m.n, sizeof(struct mentry), bypath);
+	err = manifest_write(self, ix, &m);
+    }
+    pthread_mutex_destroy(&m.mutex);
+    manifest_free(&m);
+    manifest_free(&old);
+    return err;
+}
+
+atomic_err
+atomic_diffdir(atomic_dir *self, int from, int to,
+	       int (*cb)(void *host, const char *path, atomic_change change),
+	       void *host)
+{
+    struct manifest a, b;
+    atomic_err err;
+    size_t i = 0, j = 0;
+
+    if (!to && !(to = current(self)))
+	return ATOMIC_ERR_NOCURRENT;
+    if ((err = manifest_read(self, from, &a)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if ((err = manifest_read(self, to, &b)) != ATOMIC_ERR_SUCCESS) {
+	manifest_free(&a);
+	return err;
+    }
+    while (i < a.n || j < b.n) {
+	int c = i == a.n ? 1 : j == b.n ? -1 : strcmp(a.e[i].path, b.e[j].path);
+	int more = 1;
+	if (c < 0)
+	    more = cb(host, a.e[i++].path, ATOMIC_REMOVED);
+	else if (c > 0)
+	    more = cb(host, b.e[j++].path, ATOMIC_ADDED);
+	else {
+	    struct mentry *x = &a.e[i++], *y = &b.e[j++];
+	    if (x->type != y->type || x->mode != y->mode
+		    || x->size != y->size
+		    || memcmp(x->hash, y->hash, MHASH_LEN))
+		more = cb(host, y->path, ATOMIC_CHANGED);
+	}
+	if (!more)
+	    break;
+    }
+    manifest_free(&a);
+    manifest_free(&b);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Describing the subdirectories */
+
+struct dirsize {
+    pthread_mutex_t mutex;
+    off_t size;
+};
+
+static atomic_err
+size_entry(void *arg, atomic_walk_entry *e, int *descend)
+{
+    struct dirsize *ds = (struct dirsize *)arg;
+    struct stat st;
+
+    if (e->type != DT_REG)
+	return ATOMIC_ERR_SUCCESS;
+    if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	return errno == ENOENT ? ATOMIC_ERR_SUCCESS : ATOMIC_ERR_CANTREAD;
+    pthread_mutex_lock(&ds->mutex);
+    ds->size += st.st_size;
+    pthread_mutex_unlock(&ds->mutex);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Adds up the sizes of the files in directory 'ix', from its manifest if
+ * it has one. */
+static atomic_err
+dirsize(atomic_dir *self, int ix, off_t *size)
+{
+    atomic_walk_ops ops = { NULL, size_entry, NULL, NULL };
+    struct manifest m;
+    struct dirsize ds;
+    char dir[PATH_MAX];
+    atomic_err err;
+    size_t i;
+    int r;
+
+    if (manifest_read(self, ix, &m) == ATOMIC_ERR_SUCCESS) {
+	for (*size = 0, i = 0; i < m.n; i++)
+	    if (m.e[i].type == 'f')
+		*size += m.e[i].size;
+	manifest_free(&m);
+	return ATOMIC_ERR_SUCCESS;
+    }
+    r = snprintf(dir, sizeof(dir), "%s/%d", self->root, ix);
+    if (r < 0 || r >= sizeof(dir))
+	return ATOMIC_ERR_PATHTOOLONG;
+    ds.size = 0;
+    pthread_mutex_init(&ds.mutex, NULL);
+    err = atomic_walk(dir, 0, &ops, &ds);
+    pthread_mutex_destroy(&ds.mutex);
+    *size = ds.size;
+    return err;
+}
+
+/* Whether anyone but us holds a lock on ROOT/.pin.N */
+static int
+pinned(int rootfd, int ix)
+{
+    char name[32];
+    struct flock fl;
+    int fd, r;
+
+    snprintf(name, sizeof(name), ".pin.%d", ix);
+    if ((fd = openat(rootfd, name, O_RDONLY)) < 0)
+	return 0;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+#ifdef F_OFD_GETLK
+    r = fcntl(fd, F_OFD_GETLK, &fl);
+#else
+    r = fcntl(fd, F_GETLK, &fl);
+#endif
+    close(fd);
+    return r == 0 && fl.l_type != F_UNLCK;
+}
+
+atomic_err
+atomic_scandir_stat(atomic_dir *self, int flags, atomic_dirinfo **ret,
+		    int *n)
+{
+    atomic_dirinfo *info;
+    atomic_err err = ATOMIC_ERR_SUCCESS;
+    int rootfd, cur, i, ix;
+
+    *ret = NULL;
+    *n = 0;
+    if (!(info = calloc(self->topdir, sizeof(atomic_dirinfo))))
+	return ATOMIC_ERR_NOMEM;
+    if ((rootfd = open(self->root, O_RDONLY)) < 0) {
+	free(info);
+	return ATOMIC_ERR_CANTOPEN;
+    }
+    cur = current(self);
+    for (i = 0, ix = cur ? cur : 1; i < self->topdir;
+	    i++, ix = ix % self->topdir + 1)
+    {
+	atomic_dirinfo *d = &info[i];
+	char name[32];
+	struct stat st;
+	ssize_t sz;
+
+	d->index = ix;
+	d->current = (ix == cur);
+	/* our own scratch directory is write-locked, but not pinned */
+	d->pinned = ix != self->scratch && pinned(rootfd, ix);
+	snprintf(name, sizeof(name), "%d", ix);
+	if (fstatat(rootfd, name, &st, 0) < 0) {
+	    err = ATOMIC_ERR_CANTREAD;
+	    break;
+	}
+	d->mtime = st.st_mtime;
+	snprintf(name, sizeof(name), "%d/%s", ix, VERSION_SYMLINK);
+	sz = readlinkat(rootfd, name, d->version, VERSION_STR_SIZE);
+	d->version[sz > 0 ? sz : 0] = '\0';
+	d->size = -1;
+	if ((flags & ATOMIC_SCAN_SIZES)
+		&& (err = dirsize(self, ix, &d->size)) != ATOMIC_ERR_SUCCESS)
+	    break;
+    }
+    {
+	int save_errno = errno;
+	close(rootfd);
+	errno = save_errno;
+    }
+    if (err != ATOMIC_ERR_SUCCESS) {
+	free(info);
+	return err;
+    }
+    *ret = info;
+    *n = self->topdir;
+    return ATOMIC_ERR_SUCCESS;
+}
+
 atomic_err
 atomic_commitdir(atomic_dir *self)
 {
@@ -346,14 +1584,26 @@ atomic_err
 atomic_commitdir_version(atomic_dir *self, const char *version)
 {
     char tmp[PATH_MAX];
-    int ix = NEXTDIR(self);
-    int r = snprintf(tmp, sizeof(tmp), "%s/%d/%s", self->root, ix,
-		     VERSION_SYMLINK);
+    int ix = scratch(self);
+    int r;
+    if (self->opts.mode == ATOMIC_READ)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    if (!ix)
+	return noscratch();
+    r = snprintf(tmp, sizeof(tmp), "%s/%d/%s", self->root, ix,
+		 VERSION_SYMLINK);
     if (r < 0 || r >= sizeof(tmp))
 	return ATOMIC_ERR_PATHTOOLONG;
     (void)unlink(tmp);
     if (version && symlink(version, tmp) < 0)
 	return ATOMIC_ERR_CANTLINK;
+    if (self->opts.manifest) {
+	atomic_err err = manifest_build(self, ix);
+	if (err != ATOMIC_ERR_SUCCESS)
+	    return err;
+    }
+    else if (manifest_path(self, ix, tmp, sizeof(tmp)) == ATOMIC_ERR_SUCCESS)
+	(void)unlink(tmp);	/* it would be stale */
     return rollback(self, ix);
 }
 
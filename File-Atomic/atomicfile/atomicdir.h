@@ -18,6 +18,14 @@
  *    ROOT/.top             - a file containing the maximum number of
  *                            directories supported by this directory.
  *    ROOT/current          - a symlink containing the current directory
+ *    ROOT/.pin.1
+ *    ROOT/.pin.2
+ *    ROOT/...              - fcntl() lock files, one per subdirectory, by
+ *                            which readers pin a subdirectory while using it
+ *    ROOT/.manifest.1
+ *    ROOT/.manifest.2
+ *    ROOT/...              - optional listings of the subdirectories, see
+ *                            atomic_diffdir()
  *    ROOT/1
  *    ROOT/2
  *    ROOT/3
@@ -33,6 +41,11 @@
  * If the directory is opened for writing, the ".lock" file is opened and
  * locked, and the next directory is opened for writing. Any changes will
  * happen in the 'next' directory.
+ *
+ * Readers that hold on to a directory for a while should pin it with
+ * atomic_pindir(). Writers skip pinned directories when picking the scratch
+ * directory, so the data can't change underneath the reader however many
+ * commits happen meanwhile.
  */
 
 typedef struct {
@@ -41,6 +54,10 @@ typedef struct {
     char *current;          /* "$root/current" */
     atomic_file *lock;      /* "$root/.lock" */
     int topdir;             /* the top directory, or max subdirs */
+    int scratch;            /* writers: the scratch directory, once chosen */
+    int scratchfd;          /* ... and its write-locked pin file */
+    int pinned;             /* readers: the pinned directory, or 0 */
+    int pinfd;              /* ... and its read-locked pin file */
 } atomic_dir;
 
 /* atomic_opendir()
@@ -56,6 +73,8 @@ typedef struct {
  *    directory doesn't exist. In this case it is used to determine how many
  *    subdirectories to create. Once created, the directory is
  *    self-describing, and 'rotate' is ignored.
+ *  - if 'manifest' is set, commits write a manifest of the new directory;
+ *    see atomic_diffdir().
  */
 extern atomic_err
 atomic_opendir(atomic_dir **self, char *dirname, atomic_opts *opts);
@@ -125,6 +144,27 @@ extern int
 atomic_version_i(atomic_dir *self, int dir, char *version);
 
 
+/* atomic_pindir()
+ * atomic_unpindir()
+ *
+ * Pins the current directory, storing its index in '*ix', until
+ * atomic_unpindir() or atomic_closedir() is called. Writers will not reuse
+ * a pinned directory as their scratch directory. Pinning again releases the
+ * previous pin first. Each pin holds a file descriptor open.
+ *
+ * Pins are fcntl() read locks on ROOT/.pin.N. Where the system has open
+ * file description locks they are used, so that pins also hold against
+ * writers in the same process; otherwise they only hold against other
+ * processes.
+ *
+ * Returns ATOMIC_ERR_NOCURRENT if nothing has been committed yet, and
+ * ATOMIC_ERR_CANTLOCK if the pin file can't be opened or created.
+ */
+extern atomic_err
+atomic_pindir(atomic_dir *self, int *ix);
+extern void
+atomic_unpindir(atomic_dir *self);
+
 /* atomic_scratchdir()
  * atomic_scratchdir_i()
  *
@@ -133,6 +173,15 @@ atomic_version_i(atomic_dir *self, int dir, char *version);
  * directory. This will be one of the numbered subdirectories. The _i variant
  * returns the integer representation of the scratchdir().
  *
+ * The scratch directory is chosen on the first call: the next directory
+ * after the current one, in rotation, that no reader has pinned. It stays
+ * locked against pinning until the object is committed or closed. If every
+ * other directory is pinned, this waits for one to be released, for up to
+ * 'timeout' seconds if that option was given, and otherwise indefinitely.
+ * It returns ATOMIC_ERR_NOFREESLOT if it gives up, and ATOMIC_ERR_CANTLOCK
+ * without waiting if a pin file can't be opened or created. The _i variant
+ * returns zero either way, with errno EAGAIN if it gave up.
+ *
  * In readonly mode, this always returns NULL. The _i variant returns zero.
  */
 extern atomic_err
@@ -140,6 +189,68 @@ atomic_scratchdir(atomic_dir *self, char *name, size_t sz);
 extern int
 atomic_scratchdir_i(atomic_dir *self);
 
+/* atomic_clonedir()
+ *
+ * Prepares the scratch directory for an incremental update: empties it,
+ * then recreates the tree of the current directory in it, with hard links
+ * for the files and copies of the symlinks, using up to 'nthreads' threads
+ * for each (0 picks a default). Directories get the modes of the originals.
+ * If nothing has been committed yet, the scratch directory is just emptied.
+ *
+ * The files in the scratch directory are then shared with the current one.
+ * Replacing, removing or adding files is safe, but a file that is to be
+ * modified in place (written to, chmod()ed, ...) must be passed to
+ * atomic_breaklink() first, or the change shows in the current directory
+ * too.
+ *
+ * Returns the same errors as atomic_scratchdir(), ATOMIC_ERR_CANTUNLINK,
+ * ATOMIC_ERR_CANTMKDIR or ATOMIC_ERR_CANTLINK if the scratch directory
+ * can't be emptied or filled, and ATOMIC_ERR_CANTOPEN or
+ * ATOMIC_ERR_CANTREAD if a directory can't be read.
+ */
+extern atomic_err
+atomic_clonedir(atomic_dir *self, int nthreads);
+
+/* atomic_breaklink()
+ *
+ * Gives 'path' a private copy of its contents if it is a regular file with
+ * other hard links, preserving its mode and times, so that it can be
+ * modified in place without affecting the other links. The copy is a
+ * reflink where the filesystem supports it. Does nothing for other files.
+ */
+extern atomic_err
+atomic_breaklink(const char *path);
+
+/* atomic_syncdir()
+ *
+ * Makes the scratch directory a copy of the tree 'src', touching only what
+ * differs: files and symlinks in scratch that 'src' doesn't have are
+ * removed, and those that are missing or differ are copied in, using up to
+ * 'nthreads' threads (0 picks a default). A file is taken to be unchanged
+ * if its size, mode and modification time match, or, with
+ * ATOMIC_SYNC_CONTENTS in 'flags', its size, mode and contents. Copies
+ * replace the old file by renaming, so this can follow atomic_clonedir().
+ * Directories get the modes of the originals.
+ *
+ * If 'stats' isn't NULL it receives the counts, also after an error.
+ *
+ * Returns the same errors as atomic_scratchdir(), ATOMIC_ERR_CANTOPEN or
+ * ATOMIC_ERR_CANTREAD if either tree can't be read, and the errors of
+ * atomic_clonedir() and atomic_breaklink() if scratch can't be changed.
+ */
+#define ATOMIC_SYNC_CONTENTS	1
+
+typedef struct {
+    unsigned long files_copied;		/* including symlinks */
+    unsigned long files_deleted;
+    unsigned long files_checked;	/* and left alone */
+    off_t bytes_copied;
+} atomic_syncstats;
+
+extern atomic_err
+atomic_syncdir(atomic_dir *self, const char *src, int flags, int nthreads,
+	       atomic_syncstats *stats);
+
 /* atomic_commitdir()
  * atomic_commitdir_version()  
  *
@@ -160,6 +271,41 @@ extern atomic_err
 atomic_commitdir_version(atomic_dir *self, const char *version);
 
 
+/* atomic_diffdir()
+ *
+ * Calls 'cb' for each path, relative to the subdirectories, that was added,
+ * removed or changed between subdirectory 'from' and subdirectory 'to' (0
+ * for the current one), in strcmp() order, until it returns false. Entries
+ * are compared by type, mode, size and MD5 of the contents (or link
+ * target); times and owners are ignored, as is the version symlink.
+ *
+ * This reads the manifests that commits write when the 'manifest' option is
+ * set, ROOT/.manifest.N, rather than the directories, so it takes time
+ * proportional to the number of entries but doesn't touch their data.
+ * Building a manifest hashes only the files that aren't hard links to the
+ * same, unmodified inode in the current directory, as atomic_clonedir()
+ * makes them. An inode counts as unmodified if its size and mtime are
+ * those in the current manifest; the ctime can't tell, since the links
+ * atomic_clonedir() makes move it on. So a file rewritten in place, with
+ * its size kept and its mtime put back, keeps its old hash and is not
+ * reported as changed.
+ *
+ * Returns ATOMIC_ERR_CANTOPEN if either directory has no manifest (it was
+ * committed without the option, or has one of CRC-32Cs, from before they
+ * held MD5s), ATOMIC_ERR_CORRUPT if one is damaged, or
+ * ATOMIC_ERR_NOCURRENT.
+ */
+typedef enum {
+    ATOMIC_ADDED = 1,
+    ATOMIC_REMOVED,
+    ATOMIC_CHANGED
+} atomic_change;
+
+extern atomic_err
+atomic_diffdir(atomic_dir *self, int from, int to,
+	       int (*cb)(void *host, const char *path, atomic_change change),
+	       void *host);
+
 /* atomic_rollbackdir()
  *
  * Sets the current directory to the specified index. All locks are released
@@ -175,10 +321,38 @@ atomic_rollbackdir(atomic_dir *self, int ix);
  * returns false or when all directories have been scanned. Scanning starts at
  * the currently-active directory.
  * XXX The API here seems broken--they is no way to return error.
+ * atomic_scandir_stat() doesn't have that problem.
  */
 extern int
 atomic_scandir(atomic_dir *self,
 	       int (*cb)(void *host, char *path, int ix),
 	       void *host);
 
+/* atomic_scandir_stat()
+ *
+ * Describes every subdirectory at once, in the same order as
+ * atomic_scandir(), reading everything relative to one descriptor on ROOT.
+ * Stores a malloc()ed array in '*info', which the caller must free(), and
+ * its length in '*n'. The total size of the files in each subdirectory is
+ * only computed with ATOMIC_SCAN_SIZES in 'flags', from its manifest if it
+ * has one, and by walking it otherwise; without the flag 'size' is -1.
+ *
+ * Returns ATOMIC_ERR_CANTOPEN or ATOMIC_ERR_CANTREAD if ROOT or one of the
+ * subdirectories can't be read, with errno set, or ATOMIC_ERR_NOMEM.
+ */
+#define ATOMIC_SCAN_SIZES	1
+
+typedef struct {
+    int index;
+    int current;		/* is the current directory */
+    int pinned;			/* pinned by a reader */
+    time_t mtime;		/* of the subdirectory itself */
+    off_t size;			/* of its files, or -1 */
+    char version[ATOMIC_VERSION_MAX_LEN];	/* "" if there is none */
+} atomic_dirinfo;
+
+extern atomic_err
+atomic_scandir_stat(atomic_dir *self, int flags, atomic_dirinfo **info,
+		    int *n);
+
 #endif
@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "atomicdu.h"
+#include "atomicwalk.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+#define DU_STRIPES	16	/* of the set of files with several links */
+#define DU_MIN_SLOTS	256
+
+/* A file with several links; an 'ino' of 0 is an empty slot */
+struct du_key {
+    dev_t       dev;
+    ino_t       ino;
+};
+
+/* A hash set of them, open addressing, locked by stripe */
+struct du_set {
+    pthread_mutex_t mutex;
+    size_t      n;
+    size_t      mask;
+    struct du_key *slots;
+};
+
+struct du {
+    int         blocksize;
+    int         want_dirs;
+    struct du_set sets[DU_STRIPES];
+
+    pthread_mutex_t mutex;	/* for the rest */
+    off_t       total;
+    atomic_du_dir *dirs;
+    size_t      ndirs;
+    size_t      maxdirs;
+    atomic_err  err;		/* from du_leave() */
+};
+
+static size_t
+du_hash(dev_t dev, ino_t ino)
+{
+    unsigned long long h = (unsigned long long)ino * 0x9e3779b97f4a7c15ULL
+			 ^ (unsigned long long)dev;
+    return (size_t)(h ^ (h >> 29));
+}
+
+static int
+du_set_grow(struct du_set *s)
+{
+    size_t size = s->slots ? 2 * (s->mask + 1) : DU_MIN_SLOTS;
+    struct du_key *slots;
+    size_t i;
+
+    if (!(slots = (struct du_key *)calloc(size, sizeof(*slots))))
+	return -1;
+    if (s->slots) {
+	for (i = 0; i <= s->mask; i++) {
+	    size_t j;
+	    if (!s->slots[i].ino)
+		continue;
+	    j = du_hash(s->slots[i].dev, s->slots[i].ino) / DU_STRIPES
+		& (size - 1);
+	    while (slots[j].ino)
+		j = (j + 1) & (size - 1);
+	    slots[j] = s->slots[i];
+	}
+	free(s->slots);
+    }
+    s->slots = slots;
+    s->mask = size - 1;
+    return 0;
+}
+
+/* Returns 1 if the file was seen before, 0 if not, -1 if memory runs out */
+static int
+du_seen(struct du *du, dev_t dev, ino_t ino)
+{
+    size_t h = du_hash(dev, ino);
+    struct du_set *s = &du->sets[h % DU_STRIPES];
+    size_t i;
+    int seen = 0;
+
+    pthread_mutex_lock(&s->mutex);
+    if ((!s->slots || 2 * (s->n + 1) > s->mask + 1) && du_set_grow(s) < 0) {
+	pthread_mutex_unlock(&s->mutex);
+	return -1;
+    }
+    for (i = h / DU_STRIPES & s->mask; s->slots[i].ino;
+	 i = (i + 1) & s->mask)
+    {
+	if (s->slots[i].ino == ino && s->slots[i].dev == dev) {
+	    seen = 1;
+	    break;
+	}
+    }
+    if (!seen) {
+	s->slots[i].dev = dev;
+	s->slots[i].ino = ino;
+	++s->n;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return seen;
+}
+
+/* Adds to the total, and to the breakdown under 'path' */
+static atomic_err
+du_count(struct du *du, const char *path, const char *name, off_t bytes)
+{
+    atomic_err err = ATOMIC_ERR_SUCCESS;
+    char buf[PATH_MAX];
+    char *copy = NULL;
+
+    if (du->want_dirs) {
+	if ((err = atomic_walk_join(buf, sizeof(buf), path, name))
+		!= ATOMIC_ERR_SUCCESS)
+	    return err;
+	if (!(copy = strdup(buf)))
+	    return ATOMIC_ERR_NOMEM;
+    }
+    pthread_mutex_lock(&du->mutex);
+    du->total += bytes;
+    if (copy && du->ndirs == du->maxdirs) {
+	size_t max = du->maxdirs ? 2 * du->maxdirs : 64;
+	atomic_du_dir *dirs;
+	if ((dirs = (atomic_du_dir *)realloc(du->dirs, max * sizeof(*dirs)))) {
+	    du->dirs = dirs;
+	    du->maxdirs = max;
+	}
+    }
+    if (copy && du->ndirs < du->maxdirs) {
+	du->dirs[du->ndirs].path = copy;
+	du->dirs[du->ndirs].bytes = bytes;
+	++du->ndirs;
+	copy = NULL;
+    }
+    else if (copy)
+	err = ATOMIC_ERR_NOMEM;
+    pthread_mutex_unlock(&du->mutex);
+    free(copy);
+    return err;
+}
+
+/* What the files directly in a directory add up to */
+static atomic_err
+du_enter(void *arg, int dirfd, const char *path, void **dirdata)
+{
+    off_t *bytes;
+
+    (void)arg;
+    (void)dirfd;
+    (void)path;
+    if (!(bytes = (off_t *)malloc(sizeof(*bytes))))
+	return ATOMIC_ERR_NOMEM;
+    *bytes = 0;
+    *dirdata = bytes;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static atomic_err
+du_entry(void *arg, atomic_walk_entry *e, int *descend)
+{
+    struct du *du = (struct du *)arg;
+    off_t *bytes = (off_t *)e->dirdata;
+    struct stat st;
+
+    *descend = 0;
+    if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	return ATOMIC_ERR_SUCCESS;	/* gone, counts for nothing */
+    if (S_ISLNK(st.st_mode))
+	return ATOMIC_ERR_SUCCESS;
+    if (S_ISDIR(st.st_mode)) {
+	/* a directory counts for its own tree, even if it can't be read */
+	*descend = 1;
+	if (du->want_dirs)
+	    return du_count(du, e->path, e->name,
+			    (off_t)st.st_blocks * du->blocksize);
+	*bytes += (off_t)st.st_blocks * du->blocksize;
+	return ATOMIC_ERR_SUCCESS;
+    }
+    if (st.st_nlink > 1 && st.st_ino) {
+	int seen = du_seen(du, st.st_dev, st.st_ino);
+	if (seen < 0)
+	    return ATOMIC_ERR_NOMEM;
+	if (seen)
+	    return ATOMIC_ERR_SUCCESS;
+    }
+    *bytes += (off_t)st.st_blocks * du->blocksize;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static void
+du_leave(void *arg, const char *path, void *dirdata)
+{
+    struct du *du = (struct du *)arg;
+    off_t *bytes = (off_t *)dirdata;
+    atomic_err err;
+
+    if (!bytes)
+	return;
+    if (*bytes && (err = du_count(du, path, NULL, *bytes))
+	    != ATOMIC_ERR_SUCCESS)
+    {
+	pthread_mutex_lock(&du->mutex);
+	if (du->err == ATOMIC_ERR_SUCCESS)
+	    du->err = err;
+	pthread_mutex_unlock(&du->mutex);
+    }
+    free(bytes);
+}
+
+static atomic_err
+du_unreadable(void *arg, const char *path)
+{
+    (void)arg;
+    (void)path;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+atomic_err
+atomic_du(const char *root, int nthreads, int blocksize, off_t *total,
+	  atomic_du_dir **dirs, size_t *ndirs)
+{
+    atomic_walk_ops ops = { du_enter, du_entry, du_leave, du_unreadable };
+    struct du du;
+    struct stat st;
+    atomic_err err;
+    int i;
+
+    *total = 0;
+    if (dirs) {
+	*dirs = NULL;
+	*ndirs = 0;
+    }
+    if (lstat(root, &st) < 0 || S_ISLNK(st.st_mode))
+	return ATOMIC_ERR_SUCCESS;
+    if (!S_ISDIR(st.st_mode)) {
+	*total = (off_t)st.st_blocks * blocksize;
+	return ATOMIC_ERR_SUCCESS;
+    }
+
+    memset(&du, 0, sizeof(du));
+    du.blocksize = blocksize;
+    du.want_dirs = dirs != NULL;
+    pthread_mutex_init(&du.mutex, NULL);
+    for (i = 0; i < DU_STRIPES; i++)
+	pthread_mutex_init(&du.sets[i].mutex, NULL);
+
+    err = du_count(&du, "", NULL, (off_t)st.st_blocks * blocksize);
+    if (err == ATOMIC_ERR_SUCCESS) {
+	err = atomic_walk(root, nthreads, &ops, &du);
+	/* only the root can't be opened by now; it counts for itself */
+	if (err == ATOMIC_ERR_CANTOPEN)
+	    err = ATOMIC_ERR_SUCCESS;
+	if (err == ATOMIC_ERR_SUCCESS)
+	    err = du.err;
+    }
+
+    for (i = 0; i < DU_STRIPES; i++) {
+	free(du.sets[i].slots);
+	pthread_mutex_destroy(&du.sets[i].mutex);
+    }
+    pthread_mutex_destroy(&du.mutex);
+    if (err != ATOMIC_ERR_SUCCESS) {
+	atomic_du_free(du.dirs, du.ndirs);
+	return err;
+    }
+    *total = du.total;
+    if (dirs) {
+	*dirs = du.dirs;
+	*ndirs = du.ndirs;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
+
+void
+atomic_du_free(atomic_du_dir *dirs, size_t ndirs)
+{
+    size_t i;
+
+    for (i = 0; i < ndirs; i++)
+	free(dirs[i].path);
+    free(dirs);
+}
@@ -0,0 +1,48 @@
+/* Disk usage of a tree, for ActiveState::DiskUsage.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#ifndef __ATOMIC_DU_H__
+#define __ATOMIC_DU_H__
+
+#include <sys/types.h>
+
+#include "atomictype.h"
+
+/* The space counted in one directory itself, see atomic_du() */
+typedef struct {
+    char       *path;		/* relative to the root, "" for the root */
+    off_t       bytes;
+} atomic_du_dir;
+
+/* atomic_du()
+ *
+ * Adds up the space allocated to 'root' and, if it is a directory,
+ * everything under it, in '*total': 'blocksize' bytes for each of the
+ * st_blocks of every directory and other file. Symlinks are not followed
+ * and not counted, and a file with several links is counted once. A
+ * directory that can't be read counts only for itself, and an entry that
+ * disappears during the walk doesn't count. The tree is walked with up to
+ * 'nthreads' threads (0 picks a default), relative to the descriptors of
+ * the directories.
+ *
+ * If 'dirs' isn't NULL, '*dirs' gets a malloc()ed array of the space
+ * counted in each directory and the files directly in it, and '*ndirs' its
+ * length; free it with atomic_du_free(). A directory may have more than
+ * one entry: the space of a directory's tree is the sum of the entries for
+ * it and for those below it. A file with several links is counted in
+ * whichever of its directories is read first.
+ *
+ * Returns ATOMIC_ERR_NOMEM, ATOMIC_ERR_PATHTOOLONG, or ATOMIC_ERR_CANTREAD
+ * if the type of an entry can't be found. The tree is all counted or not
+ * at all.
+ */
+extern atomic_err
+atomic_du(const char *root, int nthreads, int blocksize, off_t *total,
+	  atomic_du_dir **dirs, size_t *ndirs);
+
+extern void
+atomic_du_free(atomic_du_dir *dirs, size_t ndirs);
+
+#endif
@@ -7,20 +7,107 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef ATOMIC_HAS_XATTR
+#include <sys/xattr.h>
+#endif
+#ifdef ATOMIC_HAS_ZLIB
+#include <zlib.h>
+#endif
 
 #include "atomicfile.h"
+#include "atomicsnap.h"
+#include "atomicdelta.h"
+#include "atomicprobe.h"
 
 #ifndef O_LARGEFILE
 #  define O_LARGEFILE 0
 #endif
 
+/* Header of compressed files; see atomicfile.h */
+#define ZMAGIC		"\211AFZ\r\n\032\n"
+#define ZMAGIC_LEN	8
+#define ZHEADER_LEN	16
+#define ZCHUNK		(1 << 30) /* zlib counts in uInt */
+
+/* Journal layout; see atomic_append(). The header holds the magic, the
+ * device and inode of the file it belongs to, and the offset just past the
+ * last committed record, each 8 bytes little-endian. A record is a 4 byte
+ * length and the 4 byte CRC-32C of the data, followed by the data. */
+#define JMAGIC		"\211AFJ\r\n\032\n"
+#define JMAGIC_LEN	8
+#define JHEADER_LEN	32
+#define JEND_OFF	24
+#define JRECORD_LEN	8
+#define JNONE		1	/* jstate values */
+#define JPRESENT	2
+#define JMARK		"user.atomicfile.journal"	/* see S_marked() */
+#define PMARK		"user.atomicfile.published"	/* see S_marked() */
+
+/* Checksum trailer; see atomicfile.h */
+#define CMAGIC		"\211AFC\r\n\032\n"
+#define CMAGIC_LEN	8
+#define CTRAILER_LEN	20
+#define CNONE		1	/* cstate values */
+#define CPRESENT	2
+
+/* O_DIRECT alignment for the 'nocache' option; see atomicfile.h */
+#define NCALIGN		4096
+
 extern char *atomic_strdup(char *);
+extern unsigned int atomic_crc32c(unsigned int crc, const void *buf,
+				  size_t len);
 
 /* Forward */
 static atomic_err S_lock(int fd, atomic_opts *);
-static atomic_err S_save_backups(char *fname, int rotate, char *backup_exit);
+static atomic_err S_save_backups(char *fname, int rotate, char *backup_exit,
+				 int delta);
+static atomic_err S_delta_backup(char *fname, char *backup, char **deltaname);
+static char *S_backup_name(atomic_file *self, int n);
+static atomic_err S_backup(atomic_file *self, int n, char **buffer,
+			   size_t *length);
+static atomic_err S_slurp(char *name, char **buffer, size_t *length);
 static void S_revert(atomic_file *self);
 static int S_safefd(int fd);
+static char *S_original(atomic_file *self, size_t *length);
+static int S_original_size_is(atomic_file *self, size_t length);
+static int S_untouched(atomic_file *self);
+static atomic_err S_writebuf(atomic_file *self);
+static atomic_err S_writeiov(atomic_file *self, struct iovec *iov, int iovcnt);
+static atomic_err S_map(atomic_file *self, char **buffer, size_t *length);
+static int S_compressed(char *buffer, size_t length);
+static size_t S_zlength(char *buffer);
+static atomic_err S_deflate(atomic_file *self, const char *buf, size_t len,
+			    int finish);
+static atomic_err S_inflate_file(atomic_file *self, char **buf, size_t *len);
+static atomic_err S_inflate_block(atomic_file *self, char *raw, size_t rawlen,
+				  size_t blocklen, char **block, size_t *len);
+static void S_zfree_read(atomic_file *self);
+static char *S_sidecar(atomic_file *self, const char *ext);
+static void S_putle(char *buffer, unsigned long long n, int len);
+static unsigned long long S_getle(const char *buffer, int len);
+static void S_jheader(atomic_file *self, char *header);
+static int S_journal_open(atomic_file *self, off_t *end);
+static int S_journaled(atomic_file *self);
+static void S_journal_attach(atomic_file *self);
+static atomic_err S_compact(atomic_file *self, char *extra, size_t extralen);
+static int S_marked(int fd, const char *mark);
+static int S_mark(int fd, const char *mark);
+static atomic_err S_journal_replay(atomic_file *self, char **buffer,
+				   size_t *length);
+static atomic_err S_pwriteall(int fd, const char *buf, size_t len, off_t off);
+static atomic_err S_checksum(atomic_file *self);
+static atomic_err S_verify(atomic_file *self, char *buffer, size_t length);
+static void S_advise(atomic_file *self);
+static void S_prefetch(atomic_file *self, char *pos);
+static void S_count_map(char *map, size_t length);
+static atomic_err S_commit_tempfile(atomic_file *self);
+static atomic_err S_publish(atomic_file *self, int marked);
+static int S_direct(atomic_file *self, int on);
+static void S_nocache_written(atomic_file *self, int final);
+static void S_nocache_read(atomic_file *self, char *pos);
+static void S_nocache_close(atomic_file *self);
 
 static atomic_opts s_default_opts = ATOMIC_OPTS_INITIALIZER;
 
@@ -40,6 +127,13 @@ atomic_open(atomic_file **ret, char *filename, atomic_opts *opts)
     if (!opts)
 	opts = &s_default_opts;
 
+#ifndef ATOMIC_HAS_ZLIB
+    if (opts->compress) {
+	free(self);
+	return ATOMIC_ERR_UNSUPPORTED;
+    }
+#endif
+
     self->dest = atomic_strdup(filename);
     if (!self->dest) {
 	free(self);
@@ -71,6 +165,7 @@ atomic_open(atomic_file **ret, char *filename, atomic_opts *opts)
 
     self->fd_read = -1;
     self->fd_write = -1;
+    self->fd_jnl = -1;
     if (!opts->nolock) {
 	if ((err = atomic_lock(self)) != ATOMIC_ERR_SUCCESS) {
 	    int save_errno = errno;
@@ -87,6 +182,8 @@ atomic_open(atomic_file **ret, char *filename, atomic_opts *opts)
 void
 atomic_close(atomic_file *self)
 {
+    if (self->opts.nocache && self->fd_read != -1)
+	S_nocache_close(self);
     S_revert(self);
     if (self->dest) {
 	if (self->fd_read != -1)
@@ -99,6 +196,10 @@ atomic_close(atomic_file *self)
 	munmap(self->mbuf, self->sbuf.st_size);
 	self->mbuf = NULL;
     }
+    S_zfree_read(self);
+    free(self->jbuf);
+    if (self->fd_jnl != -1)
+	close(self->fd_jnl);
     free(self);
 }
 
@@ -116,6 +217,7 @@ atomic_lock(atomic_file *self)
     gid_t group = -1;
     mode_t mode = 0;
     char *basename;
+    unsigned long long started;
 
     /* If we've already locked, self->fd_read is set. */
     if (self->fd_read != -1)
@@ -129,9 +231,12 @@ atomic_lock(atomic_file *self)
 	    return ATOMIC_ERR_CANTOPEN;
 	}
 	fstat(self->fd_read, &self->sbuf);
+	S_journal_attach(self);
 	return ATOMIC_ERR_SUCCESS;
     }
 
+    ATOMIC_PROBE1(lock__start, self->dest);
+
     /* Create a random dotfile in the same directory as self->dest. */
     bufsize = strlen(self->dest) + 9;
     temp = malloc(bufsize);
@@ -169,6 +274,7 @@ atomic_lock(atomic_file *self)
 	goto lock_failed;
 
     /* Attempt to acquire an exclusive lock on `lock'. */
+    started = atomic_stats_now();
     while (1) {
 	if (link(temp, lock) == 0) {
 	    /* link() success means the lock has been acquired.
@@ -177,6 +283,9 @@ atomic_lock(atomic_file *self)
 		close(wfd);
 		wfd = -1; /* so we don't close it again */
 	    }
+	    atomic_stats_count(ATOMIC_STAT_LOCKS, 1);
+	    atomic_stats_time(ATOMIC_TIME_LOCK_WAIT, started);
+	    ATOMIC_PROBE1(lock__acquired, self->dest);
 	    break;
 	}
 	else if (errno != EEXIST) {
@@ -190,6 +299,8 @@ atomic_lock(atomic_file *self)
 	else {
 	    struct stat old, new;
 
+	    atomic_stats_count(ATOMIC_STAT_LOCK_RETRIES, 1);
+	    ATOMIC_PROBE1(lock__retry, self->dest);
 	    if (wfd != -1)
 		close(wfd);
 
@@ -206,7 +317,10 @@ atomic_lock(atomic_file *self)
 		}
 		continue;
 	    }
-	    if ((err = S_lock(wfd, &self->opts)) != ATOMIC_ERR_SUCCESS)
+	    ATOMIC_PROBE1(lock__wait, lock);
+	    err = S_lock(wfd, &self->opts);
+	    ATOMIC_PROBE2(lock__waited, lock, err);
+	    if (err != ATOMIC_ERR_SUCCESS)
 		goto lock_failed;
 
 	    if (fstat(wfd, &old) == 0
@@ -215,6 +329,7 @@ atomic_lock(atomic_file *self)
 		    && old.st_ino == new.st_ino)
 	    {
 		/* stale lock, delete */
+		ATOMIC_PROBE1(lock__stale, lock);
 		if (unlink(lock) < 0) {
 		    if (self->opts.debug & ATOMIC_DEBUG_TRACE)
 			fprintf(stderr,
@@ -223,6 +338,7 @@ atomic_lock(atomic_file *self)
 		    err = ATOMIC_ERR_CANTLOCK;
 		    goto lock_failed;
 		}
+		atomic_stats_count(ATOMIC_STAT_STALE_LOCKS, 1);
 	    }
 
 	    /* We don't want to close(wfd) here, since that will wake up any
@@ -272,6 +388,9 @@ atomic_lock(atomic_file *self)
 	group = (self->sbuf.st_gid != mygroup)       ? self->sbuf.st_gid : -1;
     }
 
+    /* Mark what may be published while it's still ours to write to */
+    if (self->opts.publish)
+	self->pmarked = S_mark(self->fd_write, PMARK) == 0;
     if (mode)
 	fchmod(self->fd_write, mode);
     if (owner != -1 || group != -1)
@@ -305,6 +424,7 @@ lock_failed:
 	if (wfd != -1)
 	    close(wfd);
 
+	ATOMIC_PROBE2(lock__failed, self->dest, err);
 	free(lock);
 	free(temp);
 	errno = save_errno;
@@ -323,6 +443,13 @@ atomic_readblock(atomic_file *self, size_t blocklen, char **lineret, size_t *len
     size_t buflen;
     atomic_err err;
 
+    /* Compressed files are inflated a block at a time unless something
+     * already inflated the whole file, or there is a journal to replay. */
+    if ((err = S_map(self, &buffer, &buflen)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (S_compressed(buffer, buflen) && !self->zfile && !S_journaled(self))
+	return S_inflate_block(self, buffer, buflen, blocklen,
+			       lineret, lengthret);
     if ((err = atomic_readfile(self, &buffer, &buflen)) != ATOMIC_ERR_SUCCESS)
 	return err;
     if (buflen == 0) {
@@ -348,6 +475,8 @@ atomic_readblock(atomic_file *self, size_t blocklen, char **lineret, size_t *len
         *lineret = self->nextblock;
         *lengthret = eol - self->nextblock;
         self->nextblock = (eol == bufend) ? ++eol : eol;
+	S_prefetch(self, eol);
+	S_nocache_read(self, *lineret);
     }
     return ATOMIC_ERR_SUCCESS;
 }
@@ -385,12 +514,28 @@ atomic_readline(atomic_file *self, char **lineret, size_t *lengthret)
 	*lineret = self->nextline;
 	*lengthret = eol - self->nextline;
 	self->nextline = (eol == bufend) ? ++eol : eol;
+	S_prefetch(self, eol);
+	S_nocache_read(self, *lineret);
     }
     return ATOMIC_ERR_SUCCESS;
 }
 
 atomic_err
 atomic_readfile(atomic_file *self, char **buffer, size_t *length)
+{
+    atomic_err err;
+
+    if ((err = S_map(self, buffer, length)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (S_compressed(*buffer, *length)
+	    && (err = S_inflate_file(self, buffer, length)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    return S_journal_replay(self, buffer, length);
+}
+
+/* Maps the file as it is on disk. */
+static atomic_err
+S_map(atomic_file *self, char **buffer, size_t *length)
 {
     /* AIX won't let us mmap() zero bytes, so just return a static */
     if (!self->sbuf.st_size) {
@@ -407,49 +552,342 @@ atomic_readfile(atomic_file *self, char **buffer, size_t *length)
 	}
 	/* XXX This will not work for large files.  If the mmap fails,
 	 * we should just read line by line from fd_read. */
-	if ((mbuf = mmap(0, self->sbuf.st_size, PROT_READ, MAP_PRIVATE,
-			self->fd_read, 0)) == MAP_FAILED)
+	if ((mbuf = mmap(0, self->sbuf.st_size, PROT_READ, MAP_PRIVATE
+#ifdef MAP_POPULATE
+			 | (self->opts.readhint == ATOMIC_HINT_POPULATE
+			    ? MAP_POPULATE : 0)
+#endif
+			 , self->fd_read, 0)) == MAP_FAILED)
 	    return ATOMIC_ERR_CANTMMAP;
 	self->mbuf = mbuf; /* store it */
+	S_count_map(mbuf, self->sbuf.st_size);
+	S_advise(self);
     }
     *buffer = self->mbuf;
     *length = self->sbuf.st_size;
+    if (!self->cstate) {
+	atomic_err err = S_verify(self, *buffer, *length);
+	if (err != ATOMIC_ERR_SUCCESS)
+	    return err;
+    }
+    if (self->cstate == CPRESENT)
+	*length -= CTRAILER_LEN;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Counts a mapping and, if asked to, the pages of it that reading will
+ * have to fault in from disk. */
+static void
+S_count_map(char *map, size_t length)
+{
+    unsigned char vec[4096];
+    size_t page = getpagesize();
+    size_t pages = (length + page - 1) / page;
+    size_t done, i, n, missing = 0;
+
+    atomic_stats_count(ATOMIC_STAT_MAPS, 1);
+    if (!atomic_stats_enabled(ATOMIC_STATS_RESIDENCY))
+	return;
+    for (done = 0; done < pages; done += n) {
+	n = pages - done < sizeof(vec) ? pages - done : sizeof(vec);
+	if (mincore(map + done * page, n * page, (void *)vec) < 0)
+	    return;
+	for (i = 0; i < n; i++)
+	    missing += !(vec[i] & 1);
+    }
+    if (missing)
+	atomic_stats_count(ATOMIC_STAT_MAP_NONRESIDENT_PAGES, missing);
+}
+
+/* Chunked reading */
+
+/* i/n of len, without overflowing */
+static size_t
+S_share(size_t len, int i, int n)
+{
+    return len / n * i + len % n * i / n;
+}
+
+atomic_err
+atomic_chunks(atomic_file *self, int n, int delim, atomic_chunk *chunks,
+	      int *nret)
+{
+    char *buffer, *start, *end, *bufend;
+    size_t buflen;
+    atomic_err err;
+    int i, got = 0;
+
+    *nret = 0;
+    if ((err = atomic_readfile(self, &buffer, &buflen)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (n < 1)
+	n = 1;
+    bufend = buffer + buflen;
+    for (i = 1, start = buffer; start < bufend; start = end) {
+	/* Aim for an even share, then finish the record we land in. A long
+	 * record may have carried the last chunk past some of the shares. */
+	while (i < n && buffer + S_share(buflen, i, n) <= start)
+	    ++i;
+	end = (i >= n) ? bufend : buffer + S_share(buflen, i++, n);
+	if (end < bufend && end[-1] != delim) {
+	    end = memchr(end, delim, bufend - end);
+	    end = end ? end + 1 : bufend;
+	}
+	chunks[got].start = chunks[got].next = start;
+	chunks[got].length = end - start;
+	chunks[got].offset = start - buffer;
+	chunks[got].delim = delim;
+	++got;
+    }
+    *nret = got;
     return ATOMIC_ERR_SUCCESS;
 }
 
+void
+atomic_chunk_next(atomic_chunk *chunk, char **record, size_t *length)
+{
+    char *end = chunk->start + chunk->length;
+    char *eor;
+
+    if (chunk->next >= end) {
+	*record = NULL;
+	*length = 0;
+	return;
+    }
+    eor = memchr(chunk->next, chunk->delim, end - chunk->next);
+    eor = eor ? eor + 1 : end;
+    *record = chunk->next;
+    *length = eor - chunk->next;
+    chunk->next = eor;
+}
+
+struct chunk_job {
+    atomic_chunk chunk;
+    atomic_chunk_callback callback;
+    void *arg;
+    pthread_t thread;
+    int started;
+};
+
+static void *
+S_chunk_thread(void *job)
+{
+    struct chunk_job *j = (struct chunk_job *)job;
+    j->callback(&j->chunk, j->arg);
+    return NULL;
+}
+
+atomic_err
+atomic_chunks_foreach(atomic_file *self, int nthreads, int delim,
+		      atomic_chunk_callback callback, void *arg)
+{
+    struct chunk_job *jobs;
+    atomic_chunk *chunks;
+    atomic_err err;
+    int i, n;
+
+    if (nthreads < 1)
+	nthreads = 1;
+    jobs = (struct chunk_job *)calloc(nthreads, sizeof(struct chunk_job));
+    chunks = (atomic_chunk *)malloc(nthreads * sizeof(atomic_chunk));
+    if (!jobs || !chunks) {
+	free(jobs);
+	free(chunks);
+	return ATOMIC_ERR_NOMEM;
+    }
+    if ((err = atomic_chunks(self, nthreads, delim, chunks, &n))
+	    != ATOMIC_ERR_SUCCESS)
+	goto done;
+
+    /* The first chunk is ours; the rest get a thread each if possible. */
+    for (i = 0; i < n; i++) {
+	jobs[i].chunk = chunks[i];
+	jobs[i].callback = callback;
+	jobs[i].arg = arg;
+	if (i > 0)
+	    jobs[i].started = pthread_create(&jobs[i].thread, NULL,
+					     S_chunk_thread, &jobs[i]) == 0;
+    }
+    for (i = 0; i < n; i++)
+	if (!jobs[i].started)
+	    S_chunk_thread(&jobs[i]);
+    for (i = 0; i < n; i++)
+	if (jobs[i].started)
+	    pthread_join(jobs[i].thread, NULL);
+
+done:
+    free(jobs);
+    free(chunks);
+    return err;
+}
+
+/* Passes the 'readhint' option on to the kernel for a new mapping. */
+static void
+S_advise(atomic_file *self)
+{
+    size_t len = self->sbuf.st_size;
+    int advice = -1;
+
+    switch (self->opts.readhint) {
+#ifdef MADV_SEQUENTIAL
+	case ATOMIC_HINT_SEQUENTIAL:
+	    advice = MADV_SEQUENTIAL;
+	    /* start the prefetch window at the beginning */
+	    self->prefetched = self->mbuf;
+	    S_prefetch(self, self->mbuf);
+	    break;
+#endif
+#ifdef MADV_RANDOM
+	case ATOMIC_HINT_RANDOM:
+	    advice = MADV_RANDOM;
+	    break;
+#endif
+#ifdef MADV_WILLNEED
+	case ATOMIC_HINT_WILLNEED:
+#  ifndef MAP_POPULATE
+	case ATOMIC_HINT_POPULATE:
+#  endif
+	    advice = MADV_WILLNEED;
+	    break;
+#endif
+#ifdef MADV_HUGEPAGE
+	case ATOMIC_HINT_HUGEPAGE:
+	    advice = MADV_HUGEPAGE;
+	    break;
+#endif
+	default:
+	    break;
+    }
+    if (advice != -1)
+	madvise(self->mbuf, len, advice);
+}
+
+/* With ATOMIC_HINT_SEQUENTIAL, keeps ATOMIC_PREFETCH bytes ahead of the
+ * read position 'pos' on their way in, a window at a time. */
+static void
+S_prefetch(atomic_file *self, char *pos)
+{
+#ifdef MADV_WILLNEED
+    char *end = self->mbuf + self->sbuf.st_size;
+    char *next;
+
+    if (self->opts.readhint != ATOMIC_HINT_SEQUENTIAL || !self->prefetched
+	    || pos < self->mbuf || pos > end
+	    || self->prefetched - pos > ATOMIC_PREFETCH / 2)
+	return;
+    /* a big readblock() may have jumped past the window */
+    if (self->prefetched < pos)
+	self->prefetched = self->mbuf
+	    + (pos - self->mbuf) / ATOMIC_PREFETCH * ATOMIC_PREFETCH;
+    if (self->prefetched >= end)
+	return;
+    next = self->prefetched + ATOMIC_PREFETCH;
+    if (next > end)
+	next = end;
+    madvise(self->prefetched, next - self->prefetched, MADV_WILLNEED);
+    self->prefetched = next;
+#endif
+}
+
 /* The commit variants */
 
 atomic_err
 atomic_commit_fd(atomic_file *self, int rfd)
 {
-    char buffer[4096]; /* write 4K chunks */
-    int n;
-    int wfd;
+    ssize_t n;
     atomic_err err;
+    char *orig;
+    char *buffer;
+    char *inbuf = NULL;
+    size_t origlen = 0, seen = 0;
+    off_t rstart = -1, copied = 0, rdropped = 0;
 
     /* create a temporary file */
-    if ((err = atomic_tempfile(self, &wfd, NULL)) != ATOMIC_ERR_SUCCESS)
+    if ((err = atomic_tempfile(self, NULL, NULL)) != ATOMIC_ERR_SUCCESS)
 	return err;
+    if ((err = S_writebuf(self)) != ATOMIC_ERR_SUCCESS)
+	return err;
+
+    /* With 'nocache', the full buffers go out with O_DIRECT, which needs
+     * them to start at aligned offsets. */
+    if (self->opts.nocache) {
+	rstart = lseek(rfd, 0, SEEK_CUR);
+	if (!self->opts.compress
+		&& lseek(self->fd_write, 0, SEEK_CUR) % NCALIGN == 0)
+	    S_direct(self, 1);
+    }
+
+    /* The write buffer holds deflate() output when compressing, so read
+     * into a buffer of our own and go through atomic_write(). */
+    if (self->opts.compress && !(inbuf = malloc(ATOMIC_WRITE_BUFSIZE))) {
+	S_revert(self);
+	return ATOMIC_ERR_NOMEM;
+    }
+
+    /* With skip_unchanged, compare each chunk against the original while
+     * copying, unless something went into the tempfile before; 'orig' goes
+     * NULL at the first difference. */
+    orig = S_untouched(self) ? S_original(self, &origlen) : NULL;
 
-    /* copy the contents into the tempfile */
+    /* copy the contents into the tempfile, otherwise reading straight into
+     * the write buffer so that it goes out in ATOMIC_WRITE_BUFSIZE chunks */
     while (1) {
-	n = read(rfd, buffer, sizeof(buffer));
+	if (inbuf)
+	    buffer = inbuf;
+	else {
+	    if (self->wbuflen == ATOMIC_WRITE_BUFSIZE
+		    && (err = atomic_flush(self)) != ATOMIC_ERR_SUCCESS)
+		return err;
+	    buffer = self->wbuf + self->wbuflen;
+	}
+	n = read(rfd, buffer, ATOMIC_WRITE_BUFSIZE - (inbuf ? 0 : self->wbuflen));
 	if (n < 0) {
+	    free(inbuf);
 	    S_revert(self);
 	    return ATOMIC_ERR_CANTREAD;
 	}
 	else if (n == 0)
 	    break;
-	else
-	    while (n) {
-		int w = write(wfd, buffer, n);
-		if (w < 0) {
-		    S_revert(self);
-		    return ATOMIC_ERR_CANTWRITE;
-		}
-		else
-		    n -= w;
+#ifdef POSIX_FADV_DONTNEED
+	/* whole windows only: the page cache may hold the file in
+	 * multi-page pieces, which are only dropped whole */
+	copied += n;
+	if (rstart >= 0 && copied - rdropped >= ATOMIC_NOCACHE_WINDOW) {
+	    off_t to = copied / ATOMIC_NOCACHE_WINDOW * ATOMIC_NOCACHE_WINDOW;
+	    posix_fadvise(rfd, rstart + rdropped, to - rdropped,
+			  POSIX_FADV_DONTNEED);
+	    rdropped = to;
+	}
+#endif
+	if (orig) {
+	    if (seen + n > origlen || memcmp(orig + seen, buffer, n) != 0)
+		orig = NULL;
+	    seen += n;
+	}
+	if (inbuf) {
+	    if ((err = atomic_write(self, inbuf, n)) != ATOMIC_ERR_SUCCESS) {
+		free(inbuf);
+		return err;
 	    }
+	}
+	else {
+	    self->wbuflen += n;
+	    self->written += n;
+	}
+    }
+    free(inbuf);
+    if (self->opts.nocache) {
+	/* the rest is smaller than a buffer, and maybe unaligned */
+	S_direct(self, 0);
+#ifdef POSIX_FADV_DONTNEED
+	if (rstart >= 0)
+	    posix_fadvise(rfd, rstart, copied, POSIX_FADV_DONTNEED);
+#endif
+    }
+
+    if (orig && seen == origlen) {
+	atomic_close(self);
+	return ATOMIC_ERR_UNCHANGED;
     }
 
     /* commit the temporary file */
@@ -462,40 +900,127 @@ atomic_commit_fd(atomic_file *self, int rfd)
 atomic_err
 atomic_commit_string(atomic_file *self, char *buffer, size_t length)
 {
-    int wfd;
     atomic_err err;
+    char *orig;
+    size_t origlen;
 
-    /* create a temporary file */
-    if ((err = atomic_tempfile(self, &wfd, NULL)) != ATOMIC_ERR_SUCCESS)
+    if (!self->lock)
+	return ATOMIC_ERR_OPENEDREADABLE;
+
+    /* Leave the original (and its backups and mtime) alone if the new
+     * contents are identical, deciding before anything is written. The
+     * size check usually settles it before we bother mapping the
+     * original. */
+    if (self->opts.skip_unchanged && S_untouched(self)
+	    && S_original_size_is(self, length)
+	    && (orig = S_original(self, &origlen)) && origlen == length
+	    && memcmp(orig, buffer, length) == 0)
+    {
+	atomic_close(self);
+	return ATOMIC_ERR_UNCHANGED;
+    }
+
+    /* Publish these contents rather than read them back, unless there
+     * is more before them. */
+    if (S_untouched(self)) {
+	self->pbuf = buffer;
+	self->pbuflen = length;
+    }
+
+    /* flush anything written before into the temporary file, write the
+     * contents into it, and commit it */
+    if ((err = atomic_tempfile(self, NULL, NULL)) != ATOMIC_ERR_SUCCESS
+	    || (err = atomic_write(self, buffer, length)) != ATOMIC_ERR_SUCCESS
+	    || (err = atomic_commit_tempfile(self)) != ATOMIC_ERR_SUCCESS)
+    {
+	self->pbuf = NULL;	/* the caller's, after this */
 	return err;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
 
-    /* write the contents into the tempfile */
-    while (length) {
-	int w = write(wfd, buffer, length);
-	if (w < 0) {
-	    S_revert(self);
-	    return ATOMIC_ERR_CANTWRITE;
-	}
-	else {
-	    length -= w;
-	    buffer += w;
-	}
+/* The buffered writer */
+
+atomic_err
+atomic_write(atomic_file *self, const char *buffer, size_t length)
+{
+    atomic_err err;
+
+    if (!self->lock)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    if (!length)
+	return ATOMIC_ERR_SUCCESS;
+    self->written += length;
+    if (self->opts.compress)
+	return S_deflate(self, buffer, length, 0);
+
+    /* Anything at least as big as the buffer goes straight out, together
+     * with whatever is already buffered. */
+    if (length >= ATOMIC_WRITE_BUFSIZE) {
+	struct iovec iov[2];
+	iov[0].iov_base = self->wbuf;
+	iov[0].iov_len = self->wbuflen;
+	iov[1].iov_base = (char *)buffer;
+	iov[1].iov_len = length;
+	self->wbuflen = 0;
+	return S_writeiov(self, iov, 2);
     }
 
-    /* commit the temporary file */
-    if ((err = atomic_commit_tempfile(self)) != ATOMIC_ERR_SUCCESS)
+    if ((err = S_writebuf(self)) != ATOMIC_ERR_SUCCESS)
 	return err;
+    if (self->wbuflen + length > ATOMIC_WRITE_BUFSIZE
+	    && (err = atomic_flush(self)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    memcpy(self->wbuf + self->wbuflen, buffer, length);
+    self->wbuflen += length;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+atomic_err
+atomic_writev(atomic_file *self, const struct iovec *iov, int iovcnt)
+{
+    atomic_err err;
+    int i;
 
+    for (i = 0; i < iovcnt; i++) {
+	err = atomic_write(self, (const char *)iov[i].iov_base, iov[i].iov_len);
+	if (err != ATOMIC_ERR_SUCCESS)
+	    return err;
+    }
     return ATOMIC_ERR_SUCCESS;
 }
 
+atomic_err
+atomic_flush(atomic_file *self)
+{
+    struct iovec iov;
+
+    if (!self->lock)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    if (!self->wbuflen)
+	return ATOMIC_ERR_SUCCESS;
+    iov.iov_base = self->wbuf;
+    iov.iov_len = self->wbuflen;
+    self->wbuflen = 0;
+    return S_writeiov(self, &iov, 1);
+}
+
 atomic_err
 atomic_tempfile(atomic_file *self, int *fdret, char **filename)
 {
+    atomic_err err;
+
     if (!self->lock)
 	return ATOMIC_ERR_OPENEDREADABLE;
-    if (fdret)
+    if (fdret && self->opts.compress)
+	return ATOMIC_ERR_UNSUPPORTED;
+    /* the caller is about to write to the fd directly */
+    if ((err = atomic_flush(self)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (fdret) {
 	*fdret = self->fd_write;
+	self->fdout = 1;
+    }
     if (filename)
 	*filename = self->lock;
     return ATOMIC_ERR_SUCCESS;
@@ -503,6 +1028,19 @@ atomic_tempfile(atomic_file *self, int *fdret, char **filename)
 
 atomic_err
 atomic_commit_tempfile(atomic_file *self)
+{
+    atomic_err err;
+
+    ATOMIC_PROBE1(commit__start, self->dest);
+    err = S_commit_tempfile(self);
+    /* on success, 'self' is gone and the probe has already fired */
+    if (err != ATOMIC_ERR_SUCCESS)
+	ATOMIC_PROBE2(commit__done, self->dest, err);
+    return err;
+}
+
+static atomic_err
+S_commit_tempfile(atomic_file *self)
 {
     char *orig = self->dest;
     struct stat dontcare;
@@ -510,22 +1048,36 @@ atomic_commit_tempfile(atomic_file *self)
     int i;
     int ntfd;
     char *ntmpf;
+    atomic_err published;
+    unsigned long long started;
+    off_t size;
 
     if (!self->lock)
 	return ATOMIC_ERR_COMMITBEFORETEMPFILE;
+    if (self->opts.compress
+	    && (err = S_deflate(self, "", 0, 1)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if ((err = atomic_flush(self)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (self->opts.checksum && (err = S_checksum(self)) != ATOMIC_ERR_SUCCESS)
+	return err;
     if (stat(self->lock, &dontcare) < 0) {
 	S_revert(self);
 	return ATOMIC_ERR_MISSINGTEMPFILE;
     }
 
-    if ((err = S_save_backups(orig, self->opts.rotate, self->opts.backup_ext))
-	    != ATOMIC_ERR_SUCCESS)
-    {
+    started = atomic_stats_now();
+    ATOMIC_PROBE2(backup__start, orig, self->opts.rotate);
+    err = S_save_backups(orig, self->opts.rotate, self->opts.backup_ext,
+			 self->opts.delta);
+    ATOMIC_PROBE2(backup__done, orig, err);
+    if (err != ATOMIC_ERR_SUCCESS) {
 	int save_errno = errno;
 	S_revert(self);
 	errno = save_errno;
 	return err;
     }
+    atomic_stats_time(ATOMIC_TIME_BACKUPS, started);
 
     ntmpf = atomic_strdup(self->temp);
     for (i = strlen(self->temp) - 6; ntmpf[i]; i++)
@@ -557,17 +1109,35 @@ atomic_commit_tempfile(atomic_file *self)
      * be harmless (the woken up thread will find a new held-flock and go back
      * to waiting again). The write-lock itself isn't relinquished until the
      * unlink(). */
+    size = lseek(self->fd_write, 0, SEEK_END);
+    if (self->opts.nocache)
+	S_nocache_written(self, 1);
     if (close(self->fd_write) < 0) {
 	S_revert(self);
 	close(ntfd);
 	return ATOMIC_ERR_BADCLOSE;
     }
     self->fd_write = -1;
+    started = atomic_stats_now();
+    ATOMIC_PROBE2(commit__rename, self->temp, self->dest);
     if (rename(self->temp, self->dest) < 0) {
 	S_revert(self);
 	close(ntfd);
 	return ATOMIC_ERR_CANTRENAME;
     }
+    atomic_stats_time(ATOMIC_TIME_RENAME, started);
+    atomic_stats_count(ATOMIC_STAT_COMMITS, 1);
+    if (size > 0)
+	atomic_stats_count(ATOMIC_STAT_COMMIT_BYTES, size);
+
+    /* Any journal belonged to the version just replaced. Remove it while
+     * we still hold the lock, so that it can't be mistaken for a journal
+     * of a later version that happens to reuse the inode. */
+    if ((ntmpf = S_sidecar(self, ".jnl"))) {
+	unlink(ntmpf);
+	free(ntmpf);
+    }
+    published = S_publish(self, self->pmarked);
 
     /* Finally, relinquish the lock. */
     if (unlink(self->lock) < 0) {
@@ -586,82 +1156,1070 @@ atomic_commit_tempfile(atomic_file *self)
     free(self->temp); /* ditto for self->temp */
     self->temp = NULL;
 
+    /* like any failure, this doesn't close, and the probe fires in
+     * atomic_commit_tempfile() */
+    if (published != ATOMIC_ERR_SUCCESS)
+	return published;
+    ATOMIC_PROBE2(commit__done, self->dest, ATOMIC_ERR_SUCCESS);
     atomic_close(self);
     return ATOMIC_ERR_SUCCESS;
 }
 
-static void
-S_revert(atomic_file *self)
+/* The journal */
+
+atomic_err
+atomic_append(atomic_file *self, char *buffer, size_t length)
 {
-    if (self->lock) {
-	unlink(self->lock);		/* give up lock */
-	if (self->fd_write != -1) {
-	    close(self->fd_write);
-	    self->fd_write = -1;
-	}
-	free(self->lock);
-	self->lock = NULL;
+    char header[JHEADER_LEN];
+    char record[JRECORD_LEN];
+    atomic_err err;
+    char *name;
+    off_t end;
+    int fd;
+
+    if (!self->lock)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    /* Nothing to journal against yet */
+    if (self->fd_read == -1)
+	return atomic_commit_string(self, buffer, length);
+    if (length > 0xffffffffUL) {
+	S_revert(self);
+	errno = EFBIG;
+	return ATOMIC_ERR_CANTWRITE;
     }
-    if (self->temp) {
-	unlink(self->temp);
-	free(self->temp);
-	self->temp = NULL;
+    if (!length) {
+	atomic_close(self);
+	return ATOMIC_ERR_SUCCESS;
     }
-}
 
-static atomic_err
-S_link(char *from, char *to)
-{
-    struct stat sfrom, sto;
-    int save_errno;
+    if ((fd = S_journal_open(self, &end)) < 0) {
+	/* None, or one left over from an earlier version: start afresh. A
+	 * new file rather than a truncated one, in case a reader of that
+	 * earlier version still has it open. */
+	if (!(name = S_sidecar(self, ".jnl"))) {
+	    S_revert(self);
+	    return ATOMIC_ERR_NOMEM;
+	}
+	unlink(name);
+	fd = S_safefd(open(name, O_RDWR|O_CREAT|O_EXCL|O_LARGEFILE, 0600));
+	free(name);
+	if (fd < 0) {
+	    int save_errno = errno;
+	    S_revert(self);
+	    errno = save_errno;
+	    return ATOMIC_ERR_CANTOPEN;
+	}
+	fchmod(fd, self->sbuf.st_mode & 07777);
+	if (geteuid() == 0)
+	    fchown(fd, self->sbuf.st_uid, self->sbuf.st_gid);
+	S_jheader(self, header);
+	end = JHEADER_LEN;
+	if ((err = S_pwriteall(fd, header, JHEADER_LEN, 0))
+		!= ATOMIC_ERR_SUCCESS)
+	    goto failed;
+    }
 
-    unlink(to);
-    if (link(from, to) == 0)
-	return ATOMIC_ERR_SUCCESS;
+    /* Readers only look for the journal of a marked file; atomic_append()
+     * marks the file before a journal of it has any records. If this one
+     * can't be marked, fold the record in now instead. */
+    if (!S_marked(self->fd_read, JMARK)
+	    && S_mark(self->fd_read, JMARK) < 0) {
+	close(fd);
+	return S_compact(self, buffer, length);
+    }
 
-    /* Make sure that the 'from' and 'to' files are the same file */
-    save_errno = errno;
-    if (stat(from, &sfrom) == 0
-	    && stat(to, &sto) == 0
-	    && sfrom.st_dev == sto.st_dev
-	    && sfrom.st_ino == sto.st_ino)
-	return ATOMIC_ERR_SUCCESS;
+    /* Write the record past the end, over anything a writer that died
+     * left there, then move the end past it. */
+    S_putle(record, length, 4);
+    S_putle(record + 4, atomic_crc32c(0, buffer, length), 4);
+    if ((err = S_pwriteall(fd, record, JRECORD_LEN, end)) != ATOMIC_ERR_SUCCESS
+	    || (err = S_pwriteall(fd, buffer, length, end + JRECORD_LEN))
+		!= ATOMIC_ERR_SUCCESS)
+	goto failed;
+    end += JRECORD_LEN + length;
+    S_putle(header, end, 8);
+    if ((err = S_pwriteall(fd, header, 8, JEND_OFF)) != ATOMIC_ERR_SUCCESS)
+	goto failed;
+    if (close(fd) < 0) {
+	fd = -1;
+	err = ATOMIC_ERR_BADCLOSE;
+	goto failed;
+    }
 
-    errno = save_errno;
-    return ATOMIC_ERR_CANTLINK;
-}
+    /* Fold the journal in once it outgrows the file. Waiting until then
+     * keeps the cost of compacting proportional to what was appended. */
+    end -= JHEADER_LEN;
+    if (end > self->sbuf.st_size && end > ATOMIC_JOURNAL_MIN)
+	return atomic_compact(self);
+    if ((err = S_publish(self, self->opts.publish
+				&& S_mark(self->fd_read, PMARK) == 0))
+	    != ATOMIC_ERR_SUCCESS)
+    {
+	S_revert(self);
+	return err;
+    }
+    atomic_close(self);
+    return ATOMIC_ERR_SUCCESS;
 
-static int
-S_safefd(int fd)
-{
-#if defined(__sun__) && !defined(_LP64)
-    /* stdio needs all the fds < 256 */
-    if (fd >= 0 && fd < 256) {
-	int newfd = fcntl(fd, F_DUPFD, 256);
-	if (newfd >= 0) {
+failed:
+    {
+	int save_errno = errno;
+	if (fd != -1)
 	    close(fd);
-	    fd = newfd;
-	}
+	S_revert(self);
+	errno = save_errno;
+	return err;
     }
-#endif
-    return fd;
 }
 
-static int
-S_formatted_length(int n)
+atomic_err
+atomic_compact(atomic_file *self)
 {
-    int i = 0;
-    do {
-	n /= 10;
-	++i;
-    } while(n);
-    return i;
+    if (!self->lock)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    return S_compact(self, NULL, 0);
 }
 
+/* Commits the file with its journal folded in, and 'extra' after that */
 static atomic_err
-S_save_backups(char *fname, int rotate, char *backup_ext)
+S_compact(atomic_file *self, char *extra, size_t extralen)
 {
-    if (rotate) {
+    char *buffer;
+    char *all;
+    size_t length;
+    atomic_err err;
+
+    /* Replay the journal as it is now, not as when it was last read. */
+    free(self->jbuf);
+    self->jbuf = NULL;
+    self->jstate = 0;
+    if ((err = atomic_readfile(self, &buffer, &length)) != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (!self->jbuf && !extralen) {
+	atomic_close(self);
+	return ATOMIC_ERR_SUCCESS;
+    }
+    self->opts.skip_unchanged = 0;
+    if (!extralen)
+	return atomic_commit_string(self, buffer, length);
+    if (!(all = malloc(length + extralen))) {
+	S_revert(self);
+	return ATOMIC_ERR_NOMEM;
+    }
+    memcpy(all, buffer, length);
+    memcpy(all + length, extra, extralen);
+    err = atomic_commit_string(self, all, length + extralen);
+    free(all);
+    return err;
+}
+
+atomic_err
+atomic_read_backup(atomic_file *self, int n, char **buffer, size_t *length)
+{
+    atomic_err err;
+    int tries = 0;
+
+    if (n < 1 || !self->opts.backup_ext || n > (self->opts.rotate ?
+						self->opts.rotate : 1))
+    {
+	errno = ENOENT;
+	return ATOMIC_ERR_CANTOPEN;
+    }
+    /* A commit may rotate the backups while they are being read, which the
+     * delta that no longer fits tells us; start again. */
+    do {
+	err = S_backup(self, n, buffer, length);
+    } while (err == ATOMIC_ERR_CORRUPT && errno == ESTALE && ++tries < 3);
+    return err;
+}
+
+/* Publishes the contents just committed or appended, as the read functions
+ * return them, if the 'publish' option is set, and otherwise withdraws
+ * anything published earlier, which is now stale; see atomicsnap.h. Called
+ * with the lock held, so that publishers take turns. The file is committed
+ * by now whatever happens here: on failure, readers use the file, unless
+ * what was published can't be withdrawn either, which is reported with
+ * ATOMIC_ERR_CANTWITHDRAW.
+ *
+ * A published file carries PMARK, so that there is nothing to withdraw
+ * after a version without it ('marked' says whether the new version has
+ * it); a commit that can't mark the new version withdraws rather than
+ * publishes, so as not to lose track. */
+static atomic_err
+S_publish(atomic_file *self, int marked)
+{
+    atomic_file *reader;
+    char *buffer;
+    size_t length;
+    struct stat st;
+    atomic_err err;
+    int save_errno = errno;
+
+    if (!self->opts.publish || !marked) {
+	/* a file that didn't exist had no mark to go by */
+	if (self->fd_read != -1 && !S_marked(self->fd_read, PMARK))
+	    return ATOMIC_ERR_SUCCESS;
+	err = atomic_publish(self->dest, NULL, 0, 0);
+    }
+    else if (self->pbuf && stat(self->dest, &st) == 0) {
+	err = atomic_publish(self->dest, self->pbuf, self->pbuflen,
+			     st.st_mode);
+    }
+    else if (atomic_open(&reader, self->dest, NULL) != ATOMIC_ERR_SUCCESS) {
+	err = atomic_publish(self->dest, NULL, 0, 0);
+    }
+    else {
+	if (atomic_readfile(reader, &buffer, &length) != ATOMIC_ERR_SUCCESS)
+	    buffer = NULL;
+	err = atomic_publish(self->dest, buffer, length, reader->sbuf.st_mode);
+	atomic_close(reader);
+    }
+    if (err == ATOMIC_ERR_CANTWITHDRAW) {
+#ifdef ATOMIC_HAS_XATTR
+	/* so that the next commit tries again */
+	setxattr(self->dest, PMARK, "1", 1, 0);
+#endif
+	return err;
+    }
+    errno = save_errno;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static void
+S_revert(atomic_file *self)
+{
+#ifdef ATOMIC_HAS_ZLIB
+    if (self->zwrite) {
+	deflateEnd((z_stream *)self->zwrite);
+	free(self->zwrite);
+	self->zwrite = NULL;
+    }
+#endif
+    free(self->wbuf);
+    self->wbuf = NULL;
+    self->wbuflen = 0;
+    if (self->lock) {
+	unlink(self->lock);		/* give up lock */
+	if (self->fd_write != -1) {
+	    close(self->fd_write);
+	    self->fd_write = -1;
+	}
+	free(self->lock);
+	self->lock = NULL;
+    }
+    if (self->temp) {
+	unlink(self->temp);
+	free(self->temp);
+	self->temp = NULL;
+    }
+}
+
+/* Allocates the atomic_write() buffer if it isn't already. */
+static atomic_err
+S_writebuf(atomic_file *self)
+{
+    void *wbuf;
+
+    if (self->wbuf)
+	return ATOMIC_ERR_SUCCESS;
+    /* aligned for O_DIRECT; see atomic_commit_fd() */
+    if (self->opts.nocache) {
+	if (posix_memalign(&wbuf, NCALIGN, ATOMIC_WRITE_BUFSIZE))
+	    wbuf = NULL;
+    }
+    else
+	wbuf = malloc(ATOMIC_WRITE_BUFSIZE);
+    if (!(self->wbuf = (char *)wbuf)) {
+	S_revert(self);
+	return ATOMIC_ERR_NOMEM;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Writes all of 'iov' to the tempfile, coping with short writes. Reverts
+ * on failure. The iovec array is modified. */
+static atomic_err
+S_writeiov(atomic_file *self, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt) {
+	ssize_t w = writev(self->fd_write, iov, iovcnt);
+	if (w < 0) {
+	    int save_errno = errno;
+	    if (errno == EINTR)
+		continue;
+	    /* O_DIRECT refused after all: go through the page cache */
+	    if (errno == EINVAL && self->opts.nocache && S_direct(self, 0))
+		continue;
+	    S_revert(self);
+	    errno = save_errno;
+	    return ATOMIC_ERR_CANTWRITE;
+	}
+	while (iovcnt && (size_t)w >= iov->iov_len) {
+	    w -= iov->iov_len;
+	    ++iov;
+	    --iovcnt;
+	}
+	if (iovcnt) {
+	    iov->iov_base = (char *)iov->iov_base + w;
+	    iov->iov_len -= w;
+	}
+    }
+    if (self->opts.nocache)
+	S_nocache_written(self, 0);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* The 'nocache' option */
+
+/* Turns O_DIRECT on or off for the tempfile. Returns true if that changed
+ * anything. */
+static int
+S_direct(atomic_file *self, int on)
+{
+#ifdef O_DIRECT
+    int flags = fcntl(self->fd_write, F_GETFL);
+    if (flags < 0 || !(flags & O_DIRECT) == !on)
+	return 0;
+    flags = on ? flags | O_DIRECT : flags & ~O_DIRECT;
+    return fcntl(self->fd_write, F_SETFL, flags) == 0;
+#else
+    return 0;
+#endif
+}
+
+/* Starts writing back what has been written to the tempfile, and drops
+ * the whole windows before that from the page cache once they are on
+ * disk; all of it if 'final'. Only whole windows, as the page cache may
+ * hold the file in multi-page pieces, which are only dropped whole. */
+static void
+S_nocache_written(atomic_file *self, int final)
+{
+#if defined(SYNC_FILE_RANGE_WRITE) && defined(POSIX_FADV_DONTNEED)
+    int fd = self->fd_write;
+    struct stat st;
+    off_t end;
+
+    if (final)
+	end = fstat(fd, &st) < 0 ? -1 : st.st_size;
+    else
+	end = lseek(fd, 0, SEEK_CUR);
+    if (end < 0)
+	return;
+    if (end > self->wsynced) {
+	sync_file_range(fd, self->wsynced, end - self->wsynced,
+			SYNC_FILE_RANGE_WRITE);
+	self->wsynced = end;
+    }
+    if (final || self->wsynced - self->wdropped >= ATOMIC_NOCACHE_WINDOW) {
+	off_t to = final ? self->wsynced : self->wsynced
+	    / ATOMIC_NOCACHE_WINDOW * ATOMIC_NOCACHE_WINDOW;
+	sync_file_range(fd, self->wdropped, to - self->wdropped,
+			SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE
+			|SYNC_FILE_RANGE_WAIT_AFTER);
+	/* finally, everything, windows before the first included */
+	posix_fadvise(fd, final ? 0 : self->wdropped,
+		      final ? 0 : to - self->wdropped, POSIX_FADV_DONTNEED);
+	self->wdropped = to;
+    }
+#endif
+}
+
+/* Drops the windows of the mapping before 'pos', which the reader is done
+ * with. Pages still mapped can't be dropped, so they are unmapped first;
+ * the mapping itself stays valid. */
+static void
+S_nocache_read(atomic_file *self, char *pos)
+{
+    char *from, *to;
+
+    if (!self->opts.nocache || !self->mbuf || pos < self->mbuf
+	    || pos > self->mbuf + self->sbuf.st_size)
+	return;
+    from = self->rdropped ? self->rdropped : self->mbuf;
+    to = self->mbuf + (pos - self->mbuf)
+	/ ATOMIC_NOCACHE_WINDOW * ATOMIC_NOCACHE_WINDOW;
+    if (to <= from)
+	return;
+#ifdef MADV_DONTNEED
+    madvise(from, to - from, MADV_DONTNEED);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(self->fd_read, from - self->mbuf, to - from,
+		  POSIX_FADV_DONTNEED);
+#endif
+    self->rdropped = to;
+}
+
+/* Drops the whole file being closed. */
+static void
+S_nocache_close(atomic_file *self)
+{
+    if (self->mbuf) {
+	munmap(self->mbuf, self->sbuf.st_size);
+	self->mbuf = NULL;
+    }
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(self->fd_read, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* pwrite()s all of 'buf', coping with short writes */
+static atomic_err
+S_pwriteall(int fd, const char *buf, size_t len, off_t off)
+{
+    while (len) {
+	ssize_t w = pwrite(fd, buf, len, off);
+	if (w < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return ATOMIC_ERR_CANTWRITE;
+	}
+	buf += w;
+	len -= w;
+	off += w;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Cheap check whether the original's contents are 'length' bytes long,
+ * without mapping or inflating it. */
+static int
+S_original_size_is(atomic_file *self, size_t length)
+{
+    char header[ZHEADER_LEN];
+
+    if (self->fd_read == -1)
+	return 0;
+    if (self->sbuf.st_size == length
+	    || self->sbuf.st_size == length + CTRAILER_LEN)
+	return 1;
+    if (pread(self->fd_read, header, ZHEADER_LEN, 0) != ZHEADER_LEN
+	    || !S_compressed(header, ZHEADER_LEN))
+	return 0;
+    return S_zlength(header) == length;
+}
+
+/* Whether nothing has gone into the tempfile yet, through atomic_write()
+ * or through the fd handed out by atomic_tempfile(). */
+static int
+S_untouched(atomic_file *self)
+{
+    return !self->written && !self->fdout;
+}
+
+/* Returns the mapped contents of the original file if the skip_unchanged
+ * option is set and the original exists, otherwise NULL. */
+static char *
+S_original(atomic_file *self, size_t *length)
+{
+    char *buffer;
+
+    if (!self->opts.skip_unchanged || self->fd_read == -1)
+	return NULL;
+    if (atomic_readfile(self, &buffer, length) != ATOMIC_ERR_SUCCESS)
+	return NULL;
+    return buffer;
+}
+
+/* Checksums */
+
+/* Appends the trailer to the tempfile. Reverts on failure. */
+static atomic_err
+S_checksum(atomic_file *self)
+{
+    char trailer[CTRAILER_LEN];
+    unsigned int crc = 0;
+    struct stat st;
+    atomic_err err;
+    char *map;
+
+    if (fstat(self->fd_write, &st) < 0) {
+	err = ATOMIC_ERR_CANTREAD;
+	goto failed;
+    }
+    if (st.st_size) {
+	map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, self->fd_write, 0);
+	if (map == MAP_FAILED) {
+	    err = ATOMIC_ERR_CANTMMAP;
+	    goto failed;
+	}
+	crc = atomic_crc32c(0, map, st.st_size);
+	munmap(map, st.st_size);
+    }
+    S_putle(trailer, crc, 4);
+    S_putle(trailer + 4, st.st_size, 8);
+    memcpy(trailer + 12, CMAGIC, CMAGIC_LEN);
+    if ((err = S_pwriteall(self->fd_write, trailer, CTRAILER_LEN, st.st_size))
+	    == ATOMIC_ERR_SUCCESS)
+	return err;
+
+failed:
+    {
+	int save_errno = errno;
+	S_revert(self);
+	errno = save_errno;
+	return err;
+    }
+}
+
+/* Looks for a trailer at the end of the mapped file and checks it. A file
+ * that merely ends with the magic is taken at face value unless the length
+ * matches too. */
+static atomic_err
+S_verify(atomic_file *self, char *buffer, size_t length)
+{
+    char *trailer = buffer + length - CTRAILER_LEN;
+
+    if (length < CTRAILER_LEN
+	    || memcmp(trailer + 12, CMAGIC, CMAGIC_LEN) != 0
+	    || S_getle(trailer + 4, 8) != length - CTRAILER_LEN)
+    {
+	self->cstate = CNONE;
+	return ATOMIC_ERR_SUCCESS;
+    }
+    if (atomic_crc32c(0, buffer, length - CTRAILER_LEN) != S_getle(trailer, 4)) {
+	errno = EIO;
+	return ATOMIC_ERR_BADCHECKSUM;
+    }
+    self->cstate = CPRESENT;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Journal helpers */
+
+/* Returns the malloc()ed name of a hidden file next to the original:
+ * /foo/bar/.filename<ext> */
+static char *
+S_sidecar(atomic_file *self, const char *ext)
+{
+    char *basename = strrchr(self->dest, '/');
+    char *name;
+
+    basename = basename ? basename + 1 : self->dest;
+    if ((name = malloc(strlen(self->dest) + strlen(ext) + 2)))
+	sprintf(name, "%.*s.%s%s", (int)(basename - self->dest), self->dest,
+		basename, ext);
+    return name;
+}
+
+static void
+S_putle(char *buffer, unsigned long long n, int len)
+{
+    int i;
+    for (i = 0; i < len; i++, n >>= 8)
+	buffer[i] = (char)(n & 0xff);
+}
+
+static unsigned long long
+S_getle(const char *buffer, int len)
+{
+    unsigned long long n = 0;
+    while (len--)
+	n = (n << 8) | (unsigned char)buffer[len];
+    return n;
+}
+
+/* The header of a journal belonging to the file as opened */
+static void
+S_jheader(atomic_file *self, char *header)
+{
+    memcpy(header, JMAGIC, JMAGIC_LEN);
+    S_putle(header + JMAGIC_LEN, self->sbuf.st_dev, 8);
+    S_putle(header + JMAGIC_LEN + 8, self->sbuf.st_ino, 8);
+    S_putle(header + JEND_OFF, JHEADER_LEN, 8);
+}
+
+/* Opens the journal if it belongs to the file as opened, returning the fd
+ * and the committed end offset; otherwise -1. A reader only has the one
+ * it found when it opened the file; see S_journal_attach(). */
+static int
+S_journal_open(atomic_file *self, off_t *end)
+{
+    char header[JHEADER_LEN];
+    char expect[JHEADER_LEN];
+    struct stat st;
+    char *name;
+    int fd;
+
+    if (self->fd_jnl != -1)
+	fd = S_safefd(dup(self->fd_jnl));
+    else {
+	if (self->fd_read == -1 || !self->lock
+		|| !(name = S_sidecar(self, ".jnl")))
+	    return -1;
+	fd = S_safefd(open(name, O_RDWR|O_LARGEFILE));
+	free(name);
+    }
+    if (fd < 0)
+	return -1;
+    S_jheader(self, expect);
+    if (pread(fd, header, JHEADER_LEN, 0) != JHEADER_LEN
+	    || memcmp(header, expect, JEND_OFF) != 0
+	    || fstat(fd, &st) < 0
+	    || (*end = (off_t)S_getle(header + JEND_OFF, 8)) < JHEADER_LEN
+	    || *end > st.st_size)
+    {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/* Whether the file open on 'fd' carries 'mark', an extended attribute
+ * that says it may have a journal (JMARK) or have been published (PMARK),
+ * so that the many files without either needn't be checked for them.
+ * Where the filesystem can't mark files at all, any file may. */
+static int
+S_marked(int fd, const char *mark)
+{
+#ifdef ATOMIC_HAS_XATTR
+    char c;
+
+    if (fgetxattr(fd, mark, &c, sizeof(c)) >= 0)
+	return 1;
+    return errno != ENODATA;
+#else
+    (void)fd;
+    (void)mark;
+    return 1;
+#endif
+}
+
+/* Marks the file open on 'fd'; -1 if it can't be marked, though other
+ * files on its filesystem can. */
+static int
+S_mark(int fd, const char *mark)
+{
+#ifdef ATOMIC_HAS_XATTR
+    if (fsetxattr(fd, mark, "1", 1, 0) < 0
+	    && errno != ENOTSUP && errno != EOPNOTSUPP)
+	return -1;
+#else
+    (void)fd;
+    (void)mark;
+#endif
+    return 0;
+}
+
+/* Opens the journal of a reader's file along with the file. A compaction
+ * replaces the file and removes the journal, so one looked for later might
+ * be missing, or belong to the new version: either way the reader would
+ * go back in time. The kept fd still reads the right one. The file may
+ * also be replaced between opening it and looking, in which case open the
+ * new version instead. */
+static void
+S_journal_attach(atomic_file *self)
+{
+    struct stat st;
+    off_t end;
+    int tries = 0;
+    int fd;
+
+    self->jstate = JNONE;
+    while (S_marked(self->fd_read, JMARK)) {
+	char *name = S_sidecar(self, ".jnl");
+
+	if (!name)
+	    return;
+	fd = S_safefd(open(name, O_RDONLY|O_LARGEFILE));
+	free(name);
+	if (fd >= 0) {
+	    self->fd_jnl = fd;
+	    if ((fd = S_journal_open(self, &end)) >= 0) {
+		close(fd);
+		self->jstate = 0;	/* records may yet be appended */
+		return;
+	    }
+	    close(self->fd_jnl);
+	    self->fd_jnl = -1;
+	}
+	if (++tries > 3 || stat(self->dest, &st) < 0
+		|| (st.st_dev == self->sbuf.st_dev
+		    && st.st_ino == self->sbuf.st_ino))
+	    return;
+	if ((fd = S_safefd(open(self->dest, O_RDONLY|O_LARGEFILE))) < 0)
+	    return;
+	close(self->fd_read);
+	self->fd_read = fd;
+	fstat(self->fd_read, &self->sbuf);
+    }
+}
+
+/* Whether the file has a journal with anything in it, checked once */
+static int
+S_journaled(atomic_file *self)
+{
+    off_t end;
+    int fd;
+
+    if (!self->jstate) {
+	self->jstate = JNONE;
+	if ((fd = S_journal_open(self, &end)) >= 0) {
+	    if (end > JHEADER_LEN)
+		self->jstate = JPRESENT;
+	    close(fd);
+	}
+    }
+    return self->jstate == JPRESENT;
+}
+
+/* Appends the journalled records to the contents in *buffer, stopping at
+ * the first one that is truncated or fails its CRC. The result is kept in
+ * self->jbuf; if there are no records, *buffer is left alone. */
+static atomic_err
+S_journal_replay(atomic_file *self, char **buffer, size_t *length)
+{
+    char *jmap, *p, *last, *end, *out;
+    size_t n, total = 0;
+    off_t jend;
+    int fd;
+
+    if (self->jbuf) {
+	*buffer = self->jbuf;
+	*length = self->jbuflen;
+	return ATOMIC_ERR_SUCCESS;
+    }
+    if (!S_journaled(self) || (fd = S_journal_open(self, &jend)) < 0)
+	return ATOMIC_ERR_SUCCESS;
+    jmap = mmap(0, jend, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (jmap == MAP_FAILED)
+	return ATOMIC_ERR_CANTMMAP;
+
+    /* Measure the good records, then copy them after the original */
+    end = jmap + jend;
+    for (p = jmap + JHEADER_LEN; end - p >= JRECORD_LEN; p += JRECORD_LEN + n) {
+	n = S_getle(p, 4);
+	if (n > (size_t)(end - p) - JRECORD_LEN
+		|| atomic_crc32c(0, p + JRECORD_LEN, n) != S_getle(p + 4, 4))
+	    break;
+	total += n;
+    }
+    last = p;
+    if (total) {
+	if (!(out = malloc(*length + total))) {
+	    munmap(jmap, jend);
+	    return ATOMIC_ERR_NOMEM;
+	}
+	memcpy(out, *buffer, *length);
+	self->jbuf = out;
+	self->jbuflen = *length + total;
+	out += *length;
+	for (p = jmap + JHEADER_LEN; p < last; p += JRECORD_LEN + n) {
+	    n = S_getle(p, 4);
+	    memcpy(out, p + JRECORD_LEN, n);
+	    out += n;
+	}
+	*buffer = self->jbuf;
+	*length = self->jbuflen;
+    }
+    munmap(jmap, jend);
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Compression */
+
+static int
+S_compressed(char *buffer, size_t length)
+{
+    return length >= ZHEADER_LEN && memcmp(buffer, ZMAGIC, ZMAGIC_LEN) == 0;
+}
+
+/* The uncompressed length from the header */
+static size_t
+S_zlength(char *buffer)
+{
+    size_t n = 0;
+    int i;
+    for (i = ZHEADER_LEN - 1; i >= ZMAGIC_LEN; i--)
+	n = (n << 8) | (unsigned char)buffer[i];
+    return n;
+}
+
+#ifdef ATOMIC_HAS_ZLIB
+
+/* Feeds zlib the next piece of 'raw' once it has used up the last one. */
+static void
+S_zfeed(z_stream *z, char *raw, size_t rawlen)
+{
+    size_t left = rawlen - ((char *)z->next_in - raw);
+    if (!z->avail_in && left)
+	z->avail_in = left > ZCHUNK ? ZCHUNK : (uInt)left;
+}
+
+/* Compresses 'buf' into the write buffer, which is flushed whenever it
+ * fills. Starts the stream, header included, on the first call. With
+ * 'finish', ends the stream and fills in the length in the header. */
+static atomic_err
+S_deflate(atomic_file *self, const char *buf, size_t len, int finish)
+{
+    z_stream *z = (z_stream *)self->zwrite;
+    atomic_err err;
+    int zerr;
+
+    if (!z) {
+	int level = self->opts.compress;
+	if ((err = S_writebuf(self)) != ATOMIC_ERR_SUCCESS)
+	    return err;
+	if (level < 1 || level > 9)
+	    level = Z_DEFAULT_COMPRESSION;
+	if (!(z = (z_stream *)calloc(1, sizeof(z_stream)))
+		|| deflateInit(z, level) != Z_OK)
+	{
+	    free(z);
+	    S_revert(self);
+	    return ATOMIC_ERR_NOMEM;
+	}
+	self->zwrite = z;
+	/* the length is filled in when the stream is finished */
+	if ((err = atomic_flush(self)) != ATOMIC_ERR_SUCCESS)
+	    return err;
+	memcpy(self->wbuf, ZMAGIC, ZMAGIC_LEN);
+	memset(self->wbuf + ZMAGIC_LEN, 0, ZHEADER_LEN - ZMAGIC_LEN);
+	self->wbuflen = ZHEADER_LEN;
+    }
+
+    z->next_in = (Bytef *)buf;
+    z->avail_in = 0;
+    do {
+	S_zfeed(z, (char *)buf, len);
+	if (self->wbuflen == ATOMIC_WRITE_BUFSIZE
+		&& (err = atomic_flush(self)) != ATOMIC_ERR_SUCCESS)
+	    return err;
+	z->next_out = (Bytef *)self->wbuf + self->wbuflen;
+	z->avail_out = ATOMIC_WRITE_BUFSIZE - self->wbuflen;
+	zerr = deflate(z, finish && (char *)z->next_in + z->avail_in == buf + len
+			  ? Z_FINISH : Z_NO_FLUSH);
+	self->wbuflen = ATOMIC_WRITE_BUFSIZE - z->avail_out;
+	if (zerr == Z_STREAM_ERROR) {
+	    S_revert(self);
+	    return ATOMIC_ERR_CANTWRITE;
+	}
+    } while (z->avail_in || (char *)z->next_in != buf + len
+	     || (finish && zerr != Z_STREAM_END));
+
+    if (finish) {
+	char header[ZHEADER_LEN - ZMAGIC_LEN];
+	off_t n = self->written;
+	int i;
+
+	for (i = 0; i < sizeof(header); i++, n >>= 8)
+	    header[i] = (char)(n & 0xff);
+	if ((err = atomic_flush(self)) != ATOMIC_ERR_SUCCESS)
+	    return err;
+	if (pwrite(self->fd_write, header, sizeof(header), ZMAGIC_LEN)
+		!= sizeof(header))
+	{
+	    int save_errno = errno;
+	    S_revert(self);
+	    errno = save_errno;
+	    return ATOMIC_ERR_CANTWRITE;
+	}
+	deflateEnd(z);
+	free(z);
+	self->zwrite = NULL;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* Inflates the whole file into self->zfile. On entry *buf and *len describe
+ * the file as mapped; on return, the contents. */
+static atomic_err
+S_inflate_file(atomic_file *self, char **buf, size_t *len)
+{
+    char *raw = *buf;
+    size_t rawlen = *len;
+    size_t zlen = S_zlength(raw);
+    size_t out = 0;
+    z_stream z;
+    int zerr = Z_OK;
+
+    if (!self->zfile) {
+	if (!zlen) {
+	    *buf = "";
+	    *len = 0;
+	    return ATOMIC_ERR_SUCCESS;
+	}
+	if (!(self->zfile = malloc(zlen)))
+	    return ATOMIC_ERR_NOMEM;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) {
+	    free(self->zfile);
+	    self->zfile = NULL;
+	    return ATOMIC_ERR_NOMEM;
+	}
+	z.next_in = (Bytef *)raw + ZHEADER_LEN;
+	while (zerr == Z_OK) {
+	    size_t left = zlen - out;
+	    S_zfeed(&z, raw, rawlen);
+	    z.next_out = (Bytef *)self->zfile + out;
+	    z.avail_out = left > ZCHUNK ? ZCHUNK : (uInt)left;
+	    zerr = inflate(&z, Z_NO_FLUSH);
+	    out = (char *)z.next_out - self->zfile;
+	    if (zerr == Z_BUF_ERROR && z.avail_in == 0
+		    && (char *)z.next_in < raw + rawlen)
+		zerr = Z_OK; /* just needs the next chunk */
+	}
+	inflateEnd(&z);
+	if (zerr != Z_STREAM_END || out != zlen) {
+	    free(self->zfile);
+	    self->zfile = NULL;
+	    errno = EINVAL;
+	    return ATOMIC_ERR_CORRUPT;
+	}
+    }
+    *buf = self->zfile;
+    *len = zlen;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* atomic_readblock() for compressed files: inflates the next 'blocklen'
+ * bytes into self->zblock. */
+static atomic_err
+S_inflate_block(atomic_file *self, char *raw, size_t rawlen, size_t blocklen,
+		char **block, size_t *len)
+{
+    z_stream *z = (z_stream *)self->zread;
+    int zerr;
+
+    *block = NULL;
+    *len = 0;
+    if (self->zeof || !blocklen)
+	return ATOMIC_ERR_SUCCESS;
+    if (!z) {
+	if (!(z = (z_stream *)calloc(1, sizeof(z_stream))))
+	    return ATOMIC_ERR_NOMEM;
+	if (inflateInit(z) != Z_OK) {
+	    free(z);
+	    return ATOMIC_ERR_NOMEM;
+	}
+	z->next_in = (Bytef *)raw + ZHEADER_LEN;
+	self->zread = z;
+    }
+    if (blocklen > self->zblocklen) {
+	char *nb = realloc(self->zblock, blocklen);
+	if (!nb)
+	    return ATOMIC_ERR_NOMEM;
+	self->zblock = nb;
+	self->zblocklen = blocklen;
+    }
+
+    z->next_out = (Bytef *)self->zblock;
+    z->avail_out = blocklen > ZCHUNK ? ZCHUNK : (uInt)blocklen;
+    while (z->avail_out) {
+	S_zfeed(z, raw, rawlen);
+	zerr = inflate(z, Z_NO_FLUSH);
+	if (zerr == Z_STREAM_END) {
+	    self->zeof = 1;
+	    break;
+	}
+	if (zerr != Z_OK) {
+	    errno = EINVAL;
+	    return ATOMIC_ERR_CORRUPT;
+	}
+    }
+    if ((char *)z->next_out != self->zblock) {
+	*block = self->zblock;
+	*len = (char *)z->next_out - self->zblock;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static void
+S_zfree_read(atomic_file *self)
+{
+    if (self->zread) {
+	inflateEnd((z_stream *)self->zread);
+	free(self->zread);
+	self->zread = NULL;
+    }
+    free(self->zblock);
+    self->zblock = NULL;
+    free(self->zfile);
+    self->zfile = NULL;
+}
+
+#else /* !ATOMIC_HAS_ZLIB */
+
+static atomic_err
+S_deflate(atomic_file *self, const char *buf, size_t len, int finish)
+{
+    return ATOMIC_ERR_UNSUPPORTED;
+}
+
+static atomic_err
+S_inflate_file(atomic_file *self, char **buf, size_t *len)
+{
+    return ATOMIC_ERR_UNSUPPORTED;
+}
+
+static atomic_err
+S_inflate_block(atomic_file *self, char *raw, size_t rawlen, size_t blocklen,
+		char **block, size_t *len)
+{
+    return ATOMIC_ERR_UNSUPPORTED;
+}
+
+static void
+S_zfree_read(atomic_file *self)
+{
+}
+
+#endif /* ATOMIC_HAS_ZLIB */
+
+static atomic_err
+S_link(char *from, char *to)
+{
+    struct stat sfrom, sto;
+    int save_errno;
+
+    unlink(to);
+    if (link(from, to) == 0)
+	return ATOMIC_ERR_SUCCESS;
+
+    /* Make sure that the 'from' and 'to' files are the same file */
+    save_errno = errno;
+    if (stat(from, &sfrom) == 0
+	    && stat(to, &sto) == 0
+	    && sfrom.st_dev == sto.st_dev
+	    && sfrom.st_ino == sto.st_ino)
+	return ATOMIC_ERR_SUCCESS;
+
+    errno = save_errno;
+    return ATOMIC_ERR_CANTLINK;
+}
+
+static int
+S_safefd(int fd)
+{
+#if defined(__sun__) && !defined(_LP64)
+    /* stdio needs all the fds < 256 */
+    if (fd >= 0 && fd < 256) {
+	int newfd = fcntl(fd, F_DUPFD, 256);
+	if (newfd >= 0) {
+	    close(fd);
+	    fd = newfd;
+	}
+    }
+#endif
+    return fd;
+}
+
+static int
+S_formatted_length(int n)
+{
+    int i = 0;
+    do {
+	n /= 10;
+	++i;
+    } while(n);
+    return i;
+}
+
+static atomic_err
+S_save_backups(char *fname, int rotate, char *backup_ext, int delta)
+{
+    if (rotate) {
 	/* calculate the maximum length required for the rotate extension. */
 	int rotate_len = S_formatted_length(rotate);
 	int bklen = strlen(fname)
@@ -670,6 +2228,7 @@ S_save_backups(char *fname, int rotate, char *backup_ext)
 	    + 1;  /* NULL byte */
 	char *tmp1, *tmp2;
 	char *rot1, *rot2;
+	char *deltaname = NULL;
 	int i;
 	int top = rotate - 1;
 	atomic_err err;
@@ -693,16 +2252,37 @@ S_save_backups(char *fname, int rotate, char *backup_ext)
 	    }
 	}
 
+	/* The first backup moves to the second slot as a delta against the
+	 * original, which is about to become the first; see atomicfile.h */
+	if (delta && top >= 1) {
+	    sprintf(rot1, "%0*i", rotate_len, 1);
+	    if ((err = S_delta_backup(fname, tmp1, &deltaname))
+		    != ATOMIC_ERR_SUCCESS)
+	    {
+		free(tmp1);
+		return err;
+	    }
+	}
+
 	/* Walk downwards from "top" (either 'rotate' or the first empty)
 	 * moving (i-1) -> i. */
 	for (i = top; i >= 1; --i) {
+	    char *from = i == 1 && deltaname ? deltaname : tmp1;
 	    sprintf(rot1, "%0*i", rotate_len, i);
 	    sprintf(rot2, "%0*i", rotate_len, i + 1);
-	    if (rename(tmp1, tmp2) < 0) {
+	    ATOMIC_PROBE2(backup__rename, from, tmp2);
+	    if (rename(from, tmp2) < 0) {
+		int save_errno = errno;
+		if (deltaname) {
+		    unlink(deltaname);
+		    free(deltaname);
+		}
 		free(tmp1);
+		errno = save_errno;
 		return ATOMIC_ERR_CANTRENAME;
 	    }
 	}
+	free(deltaname);
 
 	/* Copy the original to the first slot. */
 	if ((err = S_link(fname, tmp1)) != ATOMIC_ERR_SUCCESS) {
@@ -728,6 +2308,194 @@ S_save_backups(char *fname, int rotate, char *backup_ext)
     return ATOMIC_ERR_SUCCESS;
 }
 
+/* Writes 'backup' as a delta against 'fname' to a new file next to it, with
+ * the same owner and permissions, and returns its malloc()ed name; or
+ * NULL if the delta saves nothing, or either file can't be read, in which
+ * case the backup is rotated whole. */
+static atomic_err
+S_delta_backup(char *fname, char *backup, char **deltaname)
+{
+    char *map[2] = { NULL, NULL };
+    size_t len[2] = { 0, 0 };
+    char *names[2];
+    struct stat st;
+    char *delta = NULL, *name = NULL;
+    size_t deltalen;
+    atomic_err err = ATOMIC_ERR_SUCCESS;
+    int i, fd = -1;
+
+    *deltaname = NULL;
+    names[0] = fname;
+    names[1] = backup;
+    for (i = 0; i < 2; i++) {
+	if ((fd = open(names[i], O_RDONLY | O_LARGEFILE)) < 0
+		|| fstat(fd, &st) < 0)
+	    goto done;
+	len[i] = st.st_size;
+	if (len[i] && (map[i] = mmap(0, len[i], PROT_READ, MAP_SHARED, fd, 0))
+		== MAP_FAILED)
+	{
+	    map[i] = NULL;
+	    goto done;
+	}
+	close(fd);
+	fd = -1;
+    }
+    /* 'st' is the backup's now; don't make deltas of deltas */
+    if (atomic_is_delta(map[1], len[1]))
+	goto done;
+    if ((err = atomic_delta_make(map[0] ? map[0] : "", len[0],
+				 map[1] ? map[1] : "", len[1], len[1],
+				 &delta, &deltalen))
+	    != ATOMIC_ERR_SUCCESS || !delta)
+	goto done;
+
+    if (!(name = malloc(strlen(backup) + 8))) {
+	err = ATOMIC_ERR_NOMEM;
+	goto done;
+    }
+    sprintf(name, "%s.XXXXXX", backup);
+    if ((fd = S_safefd(mkstemp(name))) < 0) {
+	err = ATOMIC_ERR_NOTEMPFILE;
+	goto done;
+    }
+    fchmod(fd, st.st_mode & 07777);
+    if (geteuid() == 0)
+	fchown(fd, st.st_uid, st.st_gid);
+    if ((err = S_pwriteall(fd, delta, deltalen, 0)) == ATOMIC_ERR_SUCCESS
+	    && close(fd) < 0)
+	err = ATOMIC_ERR_BADCLOSE;
+    else if (err != ATOMIC_ERR_SUCCESS)
+	close(fd);
+    fd = -1;
+    if (err != ATOMIC_ERR_SUCCESS) {
+	int save_errno = errno;
+	unlink(name);
+	errno = save_errno;
+    }
+    else {
+	*deltaname = name;
+	name = NULL;
+    }
+
+done:
+    {
+	int save_errno = errno;
+	if (fd != -1)
+	    close(fd);
+	for (i = 0; i < 2; i++)
+	    if (map[i])
+		munmap(map[i], len[i]);
+	free(delta);
+	free(name);
+	errno = save_errno;
+	return err;
+    }
+}
+
+/* Returns the malloc()ed name of backup 'n' */
+static char *
+S_backup_name(atomic_file *self, int n)
+{
+    size_t len = strlen(self->dest) + strlen(self->opts.backup_ext) + 1;
+    int rotate_len = 0;
+    char *name;
+
+    if (self->opts.rotate)
+	len += rotate_len = S_formatted_length(self->opts.rotate);
+    if (!(name = malloc(len)))
+	return NULL;
+    if (self->opts.rotate)
+	sprintf(name, "%s%s%0*i", self->dest, self->opts.backup_ext,
+		rotate_len, n);
+    else
+	sprintf(name, "%s%s", self->dest, self->opts.backup_ext);
+    return name;
+}
+
+/* Reads backup 'n', applying it to backup 'n - 1' if it is a delta */
+static atomic_err
+S_backup(atomic_file *self, int n, char **buffer, size_t *length)
+{
+    char *name, *delta, *base;
+    size_t deltalen, baselen;
+    atomic_err err;
+
+    if (!(name = S_backup_name(self, n)))
+	return ATOMIC_ERR_NOMEM;
+    err = S_slurp(name, &delta, &deltalen);
+    free(name);
+    if (err != ATOMIC_ERR_SUCCESS)
+	return err;
+    if (!atomic_is_delta(delta, deltalen)) {
+	*buffer = delta;
+	*length = deltalen;
+	return ATOMIC_ERR_SUCCESS;
+    }
+    if (n == 1) {
+	/* the first backup is always whole */
+	free(delta);
+	errno = EIO;
+	return ATOMIC_ERR_CORRUPT;
+    }
+    if ((err = S_backup(self, n - 1, &base, &baselen)) == ATOMIC_ERR_SUCCESS) {
+	err = atomic_delta_apply(base, baselen, delta, deltalen, buffer,
+				 length);
+	free(base);
+    }
+    else if (err == ATOMIC_ERR_CANTOPEN && errno == ENOENT) {
+	/* rotated away underneath */
+	errno = ESTALE;
+	err = ATOMIC_ERR_CORRUPT;
+    }
+    {
+	int save_errno = errno;
+	free(delta);
+	errno = save_errno;
+	return err;
+    }
+}
+
+/* Reads all of 'name' into a malloc()ed buffer */
+static atomic_err
+S_slurp(char *name, char **buffer, size_t *length)
+{
+    struct stat st;
+    ssize_t got;
+    size_t len = 0;
+    char *buf;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY | O_LARGEFILE)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return ATOMIC_ERR_CANTREAD;
+    }
+    if (!(buf = malloc(st.st_size ? st.st_size : 1))) {
+	close(fd);
+	return ATOMIC_ERR_NOMEM;
+    }
+    while (len < (size_t)st.st_size
+	    && (got = read(fd, buf + len, st.st_size - len)) != 0)
+    {
+	if (got < 0) {
+	    int save_errno = errno;
+	    if (save_errno == EINTR)
+		continue;
+	    free(buf);
+	    close(fd);
+	    errno = save_errno;
+	    return ATOMIC_ERR_CANTREAD;
+	}
+	len += got;
+    }
+    close(fd);
+    *buffer = buf;
+    *length = len;
+    return ATOMIC_ERR_SUCCESS;
+}
+
 static atomic_err
 S_lock(int fd, atomic_opts *o)
 {
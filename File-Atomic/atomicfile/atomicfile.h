@@ -9,8 +9,10 @@
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "atomictype.h"
+#include "atomicstats.h"
 
 typedef struct {
     atomic_opts opts;
@@ -24,13 +26,51 @@ typedef struct {
     char       *nextblock;
     char       *nextline;
     char       *mbuf;
+    char       *prefetched;
+    int         cstate;
 
     /* the locked file; will be rename()d into place */
     int         fd_write;
     char       *lock;
     char       *temp;
+
+    /* atomic_write() internals; 'fdout' is set once atomic_tempfile() has
+     * handed out the fd, which the caller may have written to since */
+    char       *wbuf;
+    size_t      wbuflen;
+    off_t       written;
+    int         fdout;
+
+    /* compression internals; the z_streams are opaque here */
+    void       *zwrite;
+    void       *zread;
+    char       *zfile;
+    char       *zblock;
+    size_t      zblocklen;
+    int         zeof;
+
+    /* journal internals; a reader keeps the journal open from the start */
+    char       *jbuf;
+    size_t      jbuflen;
+    int         jstate;
+    int         fd_jnl;
+
+    /* 'publish' internals: the contents committed, if they were in hand,
+     * and whether the new version is marked as published */
+    const char *pbuf;
+    size_t      pbuflen;
+    int         pmarked;
+
+    /* 'nocache' internals: how far the tempfile has been written back and
+     * dropped from the page cache, and the mapping dropped */
+    off_t       wsynced;
+    off_t       wdropped;
+    char       *rdropped;
 } atomic_file;
 
+/* Size of the buffer used by atomic_write() and atomic_writev(). */
+#define ATOMIC_WRITE_BUFSIZE (256 * 1024)
+
 /* atomic_open()
  *
  * Allocates and returns an atomic_file structure, returning a pointer to
@@ -95,6 +135,66 @@ atomic_lock(atomic_file *self);
  */
 #define atomic_filename(self) ((self)->dest)
 
+/* Compressed files
+ *
+ * If the 'compress' option is set, commits store the new contents as a zlib
+ * stream behind a 16 byte header: the 8 byte magic "\211AFZ\r\n\032\n"
+ * followed by the uncompressed length, little-endian. The read functions
+ * below recognise the header regardless of the options and return the
+ * uncompressed contents: atomic_readfile() and atomic_readline() inflate
+ * the whole file into a buffer owned by the object, atomic_readblock()
+ * inflates one block at a time. A file whose stream is damaged gives
+ * ATOMIC_ERR_CORRUPT. If the library was built without zlib, compressed
+ * files and the 'compress' option give ATOMIC_ERR_UNSUPPORTED.
+ *
+ * The raw tempfile fd is not available when compressing; atomic_tempfile()
+ * returns ATOMIC_ERR_UNSUPPORTED if asked for it. Use atomic_write().
+ */
+
+/* Checksums
+ *
+ * If the 'checksum' option is set, atomic_commit_tempfile() (and so every
+ * commit) follows the contents with a 20 byte trailer: the CRC-32C of the
+ * contents, the length of the contents, and the 8 byte magic
+ * "\211AFC\r\n\032\n"; the numbers are little-endian, 4 and 8 bytes. The
+ * read functions look for the trailer regardless of the options, check it
+ * the first time the file is read, and leave it out of what they return.
+ * If the contents don't match, they return ATOMIC_ERR_BADCHECKSUM. For a
+ * compressed file, the checksum covers the compressed bytes.
+ */
+
+/* Read hints
+ *
+ * The 'readhint' option tells the kernel how the mapping made by the read
+ * functions will be used: ATOMIC_HINT_SEQUENTIAL and ATOMIC_HINT_RANDOM
+ * set the readahead policy, ATOMIC_HINT_WILLNEED starts reading the whole
+ * file in, ATOMIC_HINT_POPULATE maps it with MAP_POPULATE so that the first
+ * read waits for all of it rather than faulting page by page, and
+ * ATOMIC_HINT_HUGEPAGE asks for huge pages. With ATOMIC_HINT_SEQUENTIAL,
+ * atomic_readline() and atomic_readblock() also ask for the next
+ * ATOMIC_PREFETCH bytes each time they get within half of that of the end
+ * of what was last requested. Hints the platform lacks are ignored.
+ */
+#define ATOMIC_PREFETCH (2 * 1024 * 1024)
+
+/* Bypassing the page cache
+ *
+ * The 'nocache' option is for files streamed through once, such as large
+ * artifacts, which would otherwise fill the page cache and push out the
+ * working set of everything else on the machine. atomic_commit_fd() then
+ * copies in aligned ATOMIC_WRITE_BUFSIZE chunks with O_DIRECT where the
+ * filesystem allows it, and drops what it has read of the source file
+ * from the page cache as it goes. Other writes, and all writes where
+ * O_DIRECT is refused, are written back and dropped from the page cache
+ * every ATOMIC_NOCACHE_WINDOW bytes, and the rest is written back before
+ * the commit. atomic_readblock() and atomic_readline() drop each window of
+ * the file once they are past it, and atomic_close() drops the whole file.
+ *
+ * Dropping pages drops them for every process, except where they are
+ * mapped, so don't use this on files that are also read hot.
+ */
+#define ATOMIC_NOCACHE_WINDOW (8 * 1024 * 1024)
+
 /* atomic_readblock()
  *
  * Returns a block of data from the structure. Each call to this
@@ -125,6 +225,55 @@ atomic_readline(atomic_file *self, char **line, size_t *length);
 extern atomic_err
 atomic_readfile(atomic_file *self, char **buffer, size_t *length);
 
+/* Chunked reading
+ *
+ * An atomic_chunk is a piece of the contents returned by atomic_readfile()
+ * that starts at the beginning of a record and ends just after a record
+ * delimiter (or at the end of the file), with its own cursor. Chunks share
+ * nothing with each other or with the object apart from the buffer, so
+ * each can be read by a different thread. They are valid until the object
+ * is closed or committed.
+ */
+typedef struct {
+    char       *start;
+    size_t      length;
+    size_t      offset;	/* of 'start' within the contents */
+    char       *next;
+    int         delim;
+} atomic_chunk;
+
+/* atomic_chunks()
+ *
+ * Splits the contents into at most 'n' chunks of roughly equal size,
+ * moving each boundary forward to just after the next 'delim' byte, and
+ * stores them in 'chunks', which must have room for 'n'. Sets '*nret' to
+ * the number of chunks, which is smaller than 'n' if the file has fewer
+ * records, and 0 for an empty file.
+ */
+extern atomic_err
+atomic_chunks(atomic_file *self, int n, int delim, atomic_chunk *chunks,
+	      int *nret);
+
+/* atomic_chunk_next()
+ *
+ * Returns the next record of the chunk, delimiter included, like
+ * atomic_readline(). 'record' is NULL at the end of the chunk.
+ */
+extern void
+atomic_chunk_next(atomic_chunk *chunk, char **record, size_t *length);
+
+/* atomic_chunks_foreach()
+ *
+ * Splits the contents as atomic_chunks() does and calls 'callback' for
+ * each chunk, each in a thread of its own, passing 'arg' through. Returns
+ * when all the calls have returned. A chunk whose thread can't be started
+ * is handled by the calling thread instead.
+ */
+typedef void (*atomic_chunk_callback)(atomic_chunk *chunk, void *arg);
+extern atomic_err
+atomic_chunks_foreach(atomic_file *self, int nthreads, int delim,
+		      atomic_chunk_callback callback, void *arg);
+
 /* atomic_commit() variants
  *
  * Commits changes to the original file. This works by first creating a
@@ -138,6 +287,18 @@ atomic_readfile(atomic_file *self, char **buffer, size_t *length);
  *    ATOMIC_ERR_CANTRENAME        can't rename a file[1]
  *    ATOMIC_ERR_NOMEM             can't allocate memory
  *    ATOMIC_ERR_CANTLINK          can't link (this is how backups are done)
+ *    ATOMIC_ERR_UNCHANGED         see below; not really an error
+ *    ATOMIC_ERR_CANTWITHDRAW      committed and unlocked, but readers of
+ *                                 a snapshot published earlier go on
+ *                                 seeing it; see atomic_publish()
+ *
+ * If the 'skip_unchanged' option was passed to atomic_open(),
+ * atomic_commit_string() and atomic_commit_fd() compare the new contents
+ * against the original first, unless something went into the tempfile
+ * before them, through atomic_write() or the fd from atomic_tempfile().
+ * If they are identical, nothing is written, no backups are made, the
+ * object is closed as if by atomic_close(), and ATOMIC_ERR_UNCHANGED is
+ * returned. atomic_commit_tempfile() always commits.
  *
  * The caller can usually get additional error information from 'errno'.
  *
@@ -148,6 +309,19 @@ atomic_readfile(atomic_file *self, char **buffer, size_t *length);
  *     considered fatal.
  */
 
+/* Delta backups
+ *
+ * With the 'delta' option as well as 'rotate', only the first backup is a
+ * hard link to a whole version of the file. When it is rotated to the
+ * second, it is rewritten as a delta against the original being replaced,
+ * which becomes the new first backup (see atomicdelta.h); the older
+ * backups are already deltas against their successors, and are renamed as
+ * usual. A backup is kept whole if its delta would be no smaller, and a
+ * commit only ever makes one delta, so rotation costs a read of the two
+ * latest versions however many backups are kept. Use atomic_read_backup()
+ * to get a backup back.
+ */
+
 /* Use this if you already have a filehandle open for reading.  The library
  * will read and commit the contents of the file. */
 extern atomic_err
@@ -171,4 +345,87 @@ atomic_tempfile(atomic_file *self, int *fd, char **filename);
 extern atomic_err
 atomic_commit_tempfile(atomic_file *self);
 
+/* atomic_write()
+ * atomic_writev()
+ *
+ * Appends data to the temporary file, for writers that produce the new
+ * contents a piece at a time. Small writes are collected in a buffer of
+ * ATOMIC_WRITE_BUFSIZE bytes owned by the object, and only reach the
+ * tempfile when it fills up, when atomic_flush() or atomic_tempfile() is
+ * called, or on commit. Writes larger than the buffer go straight through.
+ * Finish with atomic_commit_tempfile().
+ *
+ * Returns ATOMIC_ERR_OPENEDREADABLE if the file is not opened writable. On
+ * ATOMIC_ERR_CANTWRITE or ATOMIC_ERR_NOMEM the changes have already been
+ * reverted, and the object can only be closed.
+ */
+extern atomic_err
+atomic_write(atomic_file *self, const char *buffer, size_t length);
+extern atomic_err
+atomic_writev(atomic_file *self, const struct iovec *iov, int iovcnt);
+extern atomic_err
+atomic_flush(atomic_file *self);
+
+/* atomic_append()
+ *
+ * Adds 'buffer' to the end of the file without rewriting it: the data goes
+ * into a journal next to the file (/dir/.filename.jnl) as a record carrying
+ * its length and CRC-32C, and is made visible by updating the journal's end
+ * offset once the record is written. The read functions replay the journal
+ * onto the file, stopping at the first record that doesn't check out, so
+ * readers see either all of an append or none of it. Like the commits, this
+ * implies atomic_close(). If the file doesn't exist yet, the data is simply
+ * committed.
+ *
+ * The journal records the device and inode of the file it belongs to, so
+ * any commit makes it obsolete; commits also remove it. Once the journal
+ * grows larger than the file (and larger than ATOMIC_JOURNAL_MIN bytes),
+ * atomic_append() folds it in by calling atomic_compact(), so the cost of
+ * appending stays proportional to the amount appended.
+ *
+ * A file with a journal is marked with the extended attribute
+ * "user.atomicfile.journal", and readers only look for the journal of a
+ * marked file (on filesystems without extended attributes, of any file).
+ * They open it along with the file, so they see the appends to the version
+ * they opened even if it is compacted before they read. If the file can't
+ * be marked, atomic_append() commits the data instead.
+ *
+ * Returns the same errors as the commits, and ATOMIC_ERR_CANTOPEN if the
+ * journal can't be created.
+ */
+extern atomic_err
+atomic_append(atomic_file *self, char *buffer, size_t length);
+
+/* atomic_compact()
+ *
+ * Commits the file with its journal replayed into it, like
+ * atomic_commit_string(), and removes the journal. If there is nothing in
+ * the journal, this just closes the object.
+ */
+extern atomic_err
+atomic_compact(atomic_file *self);
+
+#define ATOMIC_JOURNAL_MIN (64 * 1024)
+
+/* atomic_bytes_written()
+ *
+ * Returns the number of bytes passed to atomic_write() and atomic_writev()
+ * so far, including any still in the buffer.
+ */
+#define atomic_bytes_written(self) ((self)->written)
+
+/* atomic_read_backup()
+ *
+ * Returns the contents of backup 'n', rebuilding it from the backups
+ * before it if it is a delta; 'n' counts from 1 with 'rotate', and must be
+ * 1 with just 'backup_ext'. The contents are as stored, so a compressed or
+ * checksummed file's backup comes back compressed or checksummed. The
+ * buffer is the caller's to free(). Returns ATOMIC_ERR_CANTOPEN if there
+ * is no such backup, and ATOMIC_ERR_CORRUPT if a delta is damaged or
+ * doesn't match the backup after it, even after starting again in case a
+ * commit rotated the backups underneath.
+ */
+extern atomic_err
+atomic_read_backup(atomic_file *self, int n, char **buffer, size_t *length);
+
 #endif
@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>		/* FICLONE */
+#endif
+
+#include "atomicinstall.h"
+
+#ifndef O_LARGEFILE
+#  define O_LARGEFILE 0
+#endif
+
+#define ICHUNK		(256 * 1024)	/* compared and hashed at a time */
+
+/* MD5 (RFC 1321) */
+
+static const unsigned int md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void
+md5_block(unsigned int *h, const unsigned char *p)
+{
+    unsigned int m[16], a = h[0], b = h[1], c = h[2], d = h[3];
+    int i;
+
+    for (i = 0; i < 16; i++, p += 4)
+	m[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    for (i = 0; i < 64; i++) {
+	unsigned int f, t;
+	int g;
+
+	if (i < 16) {
+	    f = (b & c) | (~b & d);
+	    g = i;
+	}
+	else if (i < 32) {
+	    f = (d & b) | (~d & c);
+	    g = (5 * i + 1) & 15;
+	}
+	else if (i < 48) {
+	    f = b ^ c ^ d;
+	    g = (3 * i + 5) & 15;
+	}
+	else {
+	    f = c ^ (b | ~d);
+	    g = (7 * i) & 15;
+	}
+	t = d;
+	d = c;
+	c = b;
+	f += a + md5_k[i] + m[g];
+	b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+	a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+void
+atomic_md5_init(atomic_md5_ctx *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->len = 0;
+}
+
+void
+atomic_md5_update(atomic_md5_ctx *ctx, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t have = (size_t)(ctx->len & 63);
+
+    ctx->len += len;
+    if (have) {
+	size_t n = 64 - have < len ? 64 - have : len;
+	memcpy(ctx->buf + have, p, n);
+	p += n;
+	len -= n;
+	if (have + n < 64)
+	    return;
+	md5_block(ctx->h, ctx->buf);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+	md5_block(ctx->h, p);
+    memcpy(ctx->buf, p, len);
+}
+
+void
+atomic_md5_final(atomic_md5_ctx *ctx, unsigned char *digest)
+{
+    unsigned long long bits = ctx->len * 8;
+    unsigned char pad[72];
+    size_t padlen = 64 - (size_t)((ctx->len + 8) & 63);
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+	pad[padlen + i] = (unsigned char)(bits >> (8 * i));
+    atomic_md5_update(ctx, pad, padlen + 8);
+    for (i = 0; i < 16; i++)
+	digest[i] = (unsigned char)(ctx->h[i / 4] >> (8 * (i % 4)));
+}
+
+/* Installing */
+
+struct install {
+    atomic_install_job *jobs;
+    size_t      n;
+    size_t      next;		/* job to start */
+    atomic_err  err;		/* of the first job that failed */
+    size_t      failed;
+    pthread_mutex_t mutex;
+};
+
+/* Reads up to 'len' bytes at 'off', short only at the end of the file */
+static ssize_t
+readfull(int fd, char *buf, size_t len, off_t off)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+	if ((n = pread(fd, buf + got, len - got, off + got)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (!n)
+	    break;
+	got += n;
+    }
+    return got;
+}
+
+/* Copies the 'len' bytes of 'in' to 'out': as a reflink if possible, else
+ * in the kernel if possible, else through 'buf'. */
+static atomic_err
+copyfile(int in, int out, size_t len, char *buf)
+{
+    off_t done = 0;
+    ssize_t n;
+
+    if (!len)
+	return ATOMIC_ERR_SUCCESS;
+#ifdef FICLONE
+    if (len >= ICHUNK && ioctl(out, FICLONE, in) == 0)
+	return ATOMIC_ERR_SUCCESS;
+#endif
+#ifdef ATOMIC_HAS_COPY_FILE_RANGE
+    {
+	loff_t ioff = 0, ooff = 0;
+	while ((size_t)ioff < len && (n = copy_file_range(in, &ioff, out, &ooff,
+							  len - ioff, 0)) > 0)
+	    ;
+	if ((size_t)ioff == len)
+	    return ATOMIC_ERR_SUCCESS;
+	if (n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL)
+	    return ATOMIC_ERR_CANTWRITE;
+	done = ioff;
+    }
+#endif
+    while ((size_t)done < len) {
+	if ((n = readfull(in, buf, len - done < ICHUNK ? len - done : ICHUNK,
+			  done)) <= 0)
+	    return ATOMIC_ERR_CANTREAD;
+	if (pwrite(out, buf, n, done) != n)
+	    return ATOMIC_ERR_CANTWRITE;
+	done += n;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
+
+/* 'buf' and 'tbuf' are ICHUNK bytes each. Files are read with pread()
+ * rather than mapped: most are small, and mapping them costs more than
+ * reading them. */
+static atomic_err
+install_job(atomic_install_job *job, char *buf, char *tbuf)
+{
+    atomic_md5_ctx md5;
+    struct stat st, tst;
+    size_t len;
+    off_t hashed = 0;
+    atomic_err err = ATOMIC_ERR_SUCCESS;
+    int in, out = -1;
+    ssize_t n;
+
+    atomic_md5_init(&md5);
+    if ((in = open(job->from, O_RDONLY | O_LARGEFILE)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    if (fstat(in, &st) < 0) {
+	err = ATOMIC_ERR_CANTREAD;
+	goto done;
+    }
+    len = st.st_size;
+
+    if (stat(job->to, &tst) == 0) {
+	/* Compare and hash in the same pass over the source */
+	if (S_ISREG(tst.st_mode) && (size_t)tst.st_size == len) {
+	    int tfd = open(job->to, O_RDONLY | O_LARGEFILE);
+	    int same = tfd >= 0;
+
+	    while (same && (size_t)hashed < len) {
+		size_t want = len - hashed < ICHUNK ? len - hashed : ICHUNK;
+		if ((n = readfull(in, buf, want, hashed)) != (ssize_t)want) {
+		    if (n >= 0)
+			errno = EIO;	/* shrank underneath */
+		    close(tfd);
+		    err = ATOMIC_ERR_CANTREAD;
+		    goto done;
+		}
+		atomic_md5_update(&md5, buf, n);
+		same = readfull(tfd, tbuf, want, hashed) == n
+		    && !memcmp(buf, tbuf, n);
+		hashed += n;
+	    }
+	    if (tfd >= 0)
+		close(tfd);
+	    if (same) {
+		job->state |= ATOMIC_INSTALL_SAME;
+		goto done;
+	    }
+	}
+
+	if (stat(job->save, &tst) == 0) {
+	    errno = EEXIST;
+	    err = ATOMIC_ERR_CANTRENAME;
+	    goto done;
+	}
+	if (rename(job->to, job->save) < 0) {
+	    err = ATOMIC_ERR_CANTRENAME;
+	    goto done;
+	}
+	job->state |= ATOMIC_INSTALL_SAVED;
+    }
+
+    if ((out = open(job->to, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+		    0666)) < 0)
+    {
+	err = ATOMIC_ERR_CANTWRITE;
+	goto done;
+    }
+    job->state |= ATOMIC_INSTALL_CREATED;
+    if ((err = copyfile(in, out, len, buf)) != ATOMIC_ERR_SUCCESS)
+	goto done;
+    n = close(out);
+    out = -1;
+    if (n < 0) {
+	err = ATOMIC_ERR_CANTWRITE;
+	goto done;
+    }
+
+    /* whatever the comparison didn't hash, now in the page cache */
+    while ((size_t)hashed < len) {
+	if ((n = readfull(in, buf, len - hashed < ICHUNK ? len - hashed
+						      : ICHUNK, hashed)) <= 0)
+	{
+	    if (n == 0)
+		errno = EIO;
+	    err = ATOMIC_ERR_CANTREAD;
+	    goto done;
+	}
+	atomic_md5_update(&md5, buf, n);
+	hashed += n;
+    }
+
+done:
+    {
+	int save_errno = errno;
+	if (err == ATOMIC_ERR_SUCCESS)
+	    atomic_md5_final(&md5, job->md5);
+	if (out >= 0)
+	    close(out);
+	close(in);
+	errno = save_errno;
+	return err;
+    }
+}
+
+/* One thread's share */
+struct installer {
+    struct install *s;
+    char       *buf;		/* 2 * ICHUNK bytes */
+};
+
+static void *
+worker(void *arg)
+{
+    struct install *s = ((struct installer *)arg)->s;
+    char *buf = ((struct installer *)arg)->buf;
+
+    pthread_mutex_lock(&s->mutex);
+    while (s->next < s->n && s->err == ATOMIC_ERR_SUCCESS) {
+	atomic_install_job *job = &s->jobs[s->next++];
+	atomic_err err;
+
+	pthread_mutex_unlock(&s->mutex);
+	err = install_job(job, buf, buf + ICHUNK);
+	job->err = err;
+	job->err_errno = err == ATOMIC_ERR_SUCCESS ? 0 : errno;
+	pthread_mutex_lock(&s->mutex);
+
+	job->state |= ATOMIC_INSTALL_DONE;
+	if (err != ATOMIC_ERR_SUCCESS
+		&& (s->err == ATOMIC_ERR_SUCCESS || job < &s->jobs[s->failed]))
+	{
+	    s->err = err;
+	    s->failed = job - s->jobs;
+	}
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+atomic_err
+atomic_install(atomic_install_job *jobs, size_t n, int nthreads)
+{
+    pthread_t threads[64];
+    struct installer installers[64];
+    struct install s;
+    char *bufs;
+    size_t i;
+    int started = 0;
+
+    for (i = 0; i < n; i++) {
+	jobs[i].state = 0;
+	jobs[i].err = ATOMIC_ERR_SUCCESS;
+	jobs[i].err_errno = 0;
+    }
+    if (nthreads <= 0)
+	nthreads = ATOMIC_INSTALL_THREADS;
+    if (nthreads > (int)(sizeof(threads) / sizeof(threads[0])))
+	nthreads = sizeof(threads) / sizeof(threads[0]);
+    if ((size_t)nthreads > n)
+	nthreads = n ? (int)n : 1;
+    if (!(bufs = (char *)malloc((size_t)nthreads * 2 * ICHUNK)))
+	return ATOMIC_ERR_NOMEM;
+
+    memset(&s, 0, sizeof(s));
+    s.jobs = jobs;
+    s.n = n;
+    pthread_mutex_init(&s.mutex, NULL);
+    for (i = 0; i < (size_t)nthreads; i++) {
+	installers[i].s = &s;
+	installers[i].buf = bufs + i * 2 * ICHUNK;
+    }
+
+    /* The caller's thread is one of the workers. */
+    for (i = 1; i < (size_t)nthreads; i++)
+	if (pthread_create(&threads[started], NULL, worker, &installers[i])
+		== 0)
+	    ++started;
+    worker(&installers[0]);
+    for (i = 0; i < (size_t)started; i++)
+	pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&s.mutex);
+    free(bufs);
+    if (s.err != ATOMIC_ERR_SUCCESS)
+	errno = jobs[s.failed].err_errno;
+    return s.err;
+}
@@ -0,0 +1,91 @@
+/* Copying files into place for ActiveState::Install.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#ifndef __ATOMIC_INSTALL_H__
+#define __ATOMIC_INSTALL_H__
+
+#include <sys/types.h>
+
+#include "atomictype.h"
+
+/* NOTE:
+ *
+ * ActiveState::Install decides what to install and keeps the actions that
+ * roll an install back or commit it; this does the part that costs, the
+ * compare, copy and MD5 of each file, for many files at once in several
+ * threads. Each job installs 'from' as 'to' the way the Perl code does:
+ *
+ *    - if 'to' is a regular file with the same contents, it is left alone
+ *      (ATOMIC_INSTALL_SAME)
+ *    - otherwise an existing 'to' is renamed to 'save', which must not
+ *      exist (ATOMIC_INSTALL_SAVED), and 'to' is created afresh, as
+ *      open(">") would (ATOMIC_INSTALL_CREATED), and the contents copied
+ *
+ * Either way 'md5' ends up the digest of 'from'. The comparison and the
+ * digest are made in the same pass over the source, and the copy with a
+ * reflink or copy_file_range() where the system has them, so the data
+ * passes through the process once, and through the disk once.
+ *
+ * The 'state' of a job that fails says how far it got, so that the caller
+ * can undo it along with the rest: a job never undoes itself.
+ */
+
+#define ATOMIC_INSTALL_SAME	0x01
+#define ATOMIC_INSTALL_SAVED	0x02
+#define ATOMIC_INSTALL_CREATED	0x04
+#define ATOMIC_INSTALL_DONE	0x08	/* finished, failed or not */
+
+typedef struct {
+    const char *from;
+    const char *to;
+    const char *save;
+
+    /* results */
+    int         state;
+    unsigned char md5[16];
+    atomic_err  err;		/* see atomic_install() */
+    int         err_errno;
+} atomic_install_job;
+
+/* atomic_install()
+ *
+ * Runs the 'n' jobs with up to 'nthreads' threads (0 picks a default).
+ * Once a job fails, no more are started, but those already running
+ * finish; jobs never started have a 'state' of 0. Returns the error of the
+ * first job that failed, if any, which is:
+ *
+ *    ATOMIC_ERR_CANTOPEN     can't open 'from'
+ *    ATOMIC_ERR_CANTREAD     can't read 'from'
+ *    ATOMIC_ERR_CANTRENAME   can't rename 'to' to 'save' (errno EEXIST if
+ *                            'save' exists)
+ *    ATOMIC_ERR_CANTWRITE    can't create 'to' (if not ATOMIC_INSTALL_CREATED)
+ *                            or write it
+ *    ATOMIC_ERR_NOMEM
+ */
+extern atomic_err
+atomic_install(atomic_install_job *jobs, size_t n, int nthreads);
+
+#define ATOMIC_INSTALL_THREADS 8
+
+/* atomic_md5_init()
+ * atomic_md5_update()
+ * atomic_md5_final()
+ *
+ * MD5, as Digest::MD5 computes it.
+ */
+typedef struct {
+    unsigned int h[4];
+    unsigned long long len;
+    unsigned char buf[64];
+} atomic_md5_ctx;
+
+extern void
+atomic_md5_init(atomic_md5_ctx *ctx);
+extern void
+atomic_md5_update(atomic_md5_ctx *ctx, const void *buf, size_t len);
+extern void
+atomic_md5_final(atomic_md5_ctx *ctx, unsigned char *digest);
+
+#endif
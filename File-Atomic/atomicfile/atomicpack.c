@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "atomicpack.h"
+
+/* Layout; see atomicpack.h */
+#define PMAGIC		"\211AFP\r\n\032\n"
+#define PMAGIC_LEN	8
+#define PHEADER_LEN	16
+#define PENTRY_LEN	16
+
+#define IOV_BATCH	64	/* records per atomic_writev() */
+
+static void
+putle(char *buffer, unsigned long long n, int len)
+{
+    while (len--) {
+	*buffer++ = (char)(n & 0xff);
+	n >>= 8;
+    }
+}
+
+static unsigned long long
+getle(const char *buffer, int len)
+{
+    unsigned long long n = 0;
+    while (len--)
+	n = (n << 8) | (unsigned char)buffer[len];
+    return n;
+}
+
+static int
+keycmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c)
+	return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+atomic_err
+atomic_pack_open(atomic_pack **ret, char *filename, atomic_opts *opts)
+{
+    atomic_pack *self;
+    atomic_err err;
+
+    if (!(self = (atomic_pack *)malloc(sizeof(*self))))
+	return ATOMIC_ERR_NOMEM;
+    memset(self, 0, sizeof(*self));
+    if ((err = atomic_open(&self->file, filename, opts))
+	    != ATOMIC_ERR_SUCCESS)
+    {
+	free(self);
+	return err;
+    }
+    if ((err = atomic_readfile(self->file, &self->contents, &self->length))
+	    != ATOMIC_ERR_SUCCESS)
+	goto failed;
+    if (self->length) {
+	if (self->length < PHEADER_LEN
+		|| memcmp(self->contents, PMAGIC, PMAGIC_LEN))
+	{
+	    err = ATOMIC_ERR_CORRUPT;
+	    goto failed;
+	}
+	self->count = (size_t)getle(self->contents + PMAGIC_LEN, 8);
+	if (self->count > (self->length - PHEADER_LEN) / PENTRY_LEN) {
+	    err = ATOMIC_ERR_CORRUPT;
+	    goto failed;
+	}
+    }
+    *ret = self;
+    return ATOMIC_ERR_SUCCESS;
+
+failed:
+    {
+	int save_errno = errno;
+	atomic_close(self->file);
+	free(self);
+	errno = save_errno;
+	return err;
+    }
+}
+
+atomic_err
+atomic_pack_record(atomic_pack *self, size_t i, char **key, size_t *keylen,
+		   char **value, size_t *vallen)
+{
+    const char *entry = self->contents + PHEADER_LEN + i * PENTRY_LEN;
+    unsigned long long off, klen, vlen;
+
+    if (i >= self->count)
+	return ATOMIC_ERR_CORRUPT;
+    off = getle(entry, 8);
+    klen = getle(entry + 8, 4);
+    vlen = getle(entry + 12, 4);
+    if (off > self->length || klen + vlen > self->length - off)
+	return ATOMIC_ERR_CORRUPT;
+    *key = self->contents + off;
+    *keylen = (size_t)klen;
+    *value = *key + klen;
+    *vallen = (size_t)vlen;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+atomic_err
+atomic_pack_get(atomic_pack *self, const char *key, size_t keylen,
+		char **value, size_t *vallen)
+{
+    size_t lo = 0, hi = self->count;
+    atomic_err err;
+
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	char *k;
+	size_t klen;
+	int c;
+
+	if ((err = atomic_pack_record(self, mid, &k, &klen, value, vallen))
+		!= ATOMIC_ERR_SUCCESS)
+	    return err;
+	if (!(c = keycmp(key, keylen, k, klen)))
+	    return ATOMIC_ERR_SUCCESS;
+	if (c < 0)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    *value = NULL;
+    *vallen = 0;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static atomic_err
+change(atomic_pack *self, const char *key, size_t keylen, const char *value,
+       size_t vallen)
+{
+    atomic_pack_change *c;
+
+    if (self->file->opts.mode == ATOMIC_READ)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    if (keylen > 0xffffffffUL || vallen > 0xffffffffUL) {
+	errno = EFBIG;
+	return ATOMIC_ERR_CANTWRITE;
+    }
+    if (self->nchanges == self->changes_max) {
+	size_t max = self->changes_max ? 2 * self->changes_max : 64;
+	atomic_pack_change *changes = (atomic_pack_change *)
+	    realloc(self->changes, max * sizeof(*changes));
+	if (!changes)
+	    return ATOMIC_ERR_NOMEM;
+	self->changes = changes;
+	self->changes_max = max;
+    }
+    c = &self->changes[self->nchanges];
+    if (!(c->key = (char *)malloc(keylen + vallen + 1)))
+	return ATOMIC_ERR_NOMEM;
+    memcpy(c->key, key, keylen);
+    c->keylen = keylen;
+    c->value = NULL;
+    if (value) {
+	c->value = c->key + keylen;
+	memcpy(c->value, value, vallen);
+    }
+    c->vallen = value ? vallen : 0;
+    c->seq = self->nchanges++;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+atomic_err
+atomic_pack_put(atomic_pack *self, const char *key, size_t keylen,
+		const char *value, size_t vallen)
+{
+    return change(self, key, keylen, value ? value : "", vallen);
+}
+
+atomic_err
+atomic_pack_delete(atomic_pack *self, const char *key, size_t keylen)
+{
+    return change(self, key, keylen, NULL, 0);
+}
+
+static int
+bykey(const void *a, const void *b)
+{
+    const atomic_pack_change *x = (const atomic_pack_change *)a;
+    const atomic_pack_change *y = (const atomic_pack_change *)b;
+    int c = keycmp(x->key, x->keylen, y->key, y->keylen);
+    if (c)
+	return c;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* One record of the new contents, from the old contents or a change */
+struct rec {
+    char *key;
+    size_t keylen;
+    char *value;
+    size_t vallen;
+};
+
+/* Merges the old records with the sorted changes into 'out', which has
+ * room for both. Returns the number of records. */
+static atomic_err
+merge(atomic_pack *self, struct rec *out, size_t *n)
+{
+    atomic_pack_change *c = self->changes, *end = c + self->nchanges;
+    size_t i = 0;
+    atomic_err err;
+
+    *n = 0;
+    while (i < self->count || c < end) {
+	struct rec old;
+	int cmp;
+
+	if (i < self->count) {
+	    if ((err = atomic_pack_record(self, i, &old.key, &old.keylen,
+					  &old.value, &old.vallen))
+		    != ATOMIC_ERR_SUCCESS)
+		return err;
+	    cmp = c < end ? keycmp(old.key, old.keylen, c->key, c->keylen)
+			  : -1;
+	}
+	else
+	    cmp = 1;
+
+	if (cmp < 0) {
+	    out[(*n)++] = old;
+	    ++i;
+	    continue;
+	}
+	if (cmp == 0)
+	    ++i;		/* replaced or deleted */
+	/* the last change to this key wins */
+	while (c + 1 < end && !keycmp(c->key, c->keylen, c[1].key, c[1].keylen))
+	    ++c;
+	if (c->value) {
+	    out[*n].key = c->key;
+	    out[*n].keylen = c->keylen;
+	    out[*n].value = c->value;
+	    out[*n].vallen = c->vallen;
+	    ++*n;
+	}
+	++c;
+    }
+    return ATOMIC_ERR_SUCCESS;
+}
+
+atomic_err
+atomic_pack_commit(atomic_pack *self)
+{
+    struct iovec iov[2 * IOV_BATCH];
+    struct rec *recs = NULL;
+    char *index = NULL;
+    unsigned long long off;
+    atomic_err err;
+    size_t n, i, j;
+
+    if (self->file->opts.mode == ATOMIC_READ)
+	return ATOMIC_ERR_OPENEDREADABLE;
+    if (!self->nchanges) {
+	atomic_pack_close(self);
+	return ATOMIC_ERR_SUCCESS;
+    }
+    qsort(self->changes, self->nchanges, sizeof(*self->changes), bykey);
+    if (!(recs = (struct rec *)malloc((self->count + self->nchanges)
+				       * sizeof(*recs))))
+	return ATOMIC_ERR_NOMEM;
+    if ((err = merge(self, recs, &n)) != ATOMIC_ERR_SUCCESS)
+	goto done;
+
+    /* The header and index, then the records in the same order */
+    if (!(index = (char *)malloc(PHEADER_LEN + n * PENTRY_LEN))) {
+	err = ATOMIC_ERR_NOMEM;
+	goto done;
+    }
+    memcpy(index, PMAGIC, PMAGIC_LEN);
+    putle(index + PMAGIC_LEN, n, 8);
+    off = PHEADER_LEN + (unsigned long long)n * PENTRY_LEN;
+    for (i = 0; i < n; i++) {
+	char *entry = index + PHEADER_LEN + i * PENTRY_LEN;
+	putle(entry, off, 8);
+	putle(entry + 8, recs[i].keylen, 4);
+	putle(entry + 12, recs[i].vallen, 4);
+	off += recs[i].keylen + recs[i].vallen;
+    }
+    if ((err = atomic_write(self->file, index, PHEADER_LEN + n * PENTRY_LEN))
+	    != ATOMIC_ERR_SUCCESS)
+	goto done;
+    for (i = 0; i < n; i += IOV_BATCH) {
+	for (j = 0; j < IOV_BATCH && i + j < n; j++) {
+	    iov[2 * j].iov_base = recs[i + j].key;
+	    iov[2 * j].iov_len = recs[i + j].keylen;
+	    iov[2 * j + 1].iov_base = recs[i + j].value;
+	    iov[2 * j + 1].iov_len = recs[i + j].vallen;
+	}
+	if ((err = atomic_writev(self->file, iov, 2 * j))
+		!= ATOMIC_ERR_SUCCESS)
+	    goto done;
+    }
+    err = atomic_commit_tempfile(self->file);
+
+done:
+    free(recs);
+    free(index);
+    if (err == ATOMIC_ERR_SUCCESS) {
+	/* the commit closed the file */
+	self->file = NULL;
+	atomic_pack_close(self);
+    }
+    return err;
+}
+
+void
+atomic_pack_close(atomic_pack *self)
+{
+    size_t i;
+
+    for (i = 0; i < self->nchanges; i++)
+	free(self->changes[i].key);
+    free(self->changes);
+    if (self->file)
+	atomic_close(self->file);
+    free(self);
+}
@@ -0,0 +1,118 @@
+/* Packed files: many small records in one atomic file.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#ifndef __ATOMIC_PACK_H__
+#define __ATOMIC_PACK_H__
+
+#include "atomicfile.h"
+
+/* NOTE:
+ *
+ * A pack keeps records (a key and a value, both arbitrary bytes) in a
+ * single file, so that thousands of small pieces of state cost one lock,
+ * one tempfile and one rename per batch of updates rather than per record.
+ * The file is an ordinary atomic file, committed with atomic_write() and
+ * atomic_commit_tempfile() and read with atomic_readfile(), so the
+ * 'compress', 'checksum', 'publish' and backup options all apply to it.
+ * The contents are:
+ *
+ *    header   the 8 byte magic "\211AFP\r\n\032\n" and the number of
+ *             records, 8 bytes little-endian
+ *    index    for each record in key order, the offset of the record
+ *             from the start of the contents (8 bytes), then the lengths
+ *             of its key and value (4 bytes each), little-endian
+ *    records  each key followed by its value
+ *
+ * Keys are ordered as by memcmp(), shorter first when one is a prefix of
+ * the other, so lookups are a binary search of the mapped index. An empty
+ * file is an empty pack.
+ *
+ * A commit writes the records that haven't changed straight from the
+ * mapping of the old contents, in one atomic_writev() per batch, so the
+ * cost of a commit is one sequential write of the file however many
+ * records it touches.
+ */
+
+typedef struct {
+    char       *key;
+    size_t      keylen;
+    char       *value;		/* NULL to delete */
+    size_t      vallen;
+    size_t      seq;		/* later changes to a key win */
+} atomic_pack_change;
+
+typedef struct {
+    atomic_file *file;
+    char       *contents;	/* as returned by atomic_readfile() */
+    size_t      length;
+    size_t      count;		/* records */
+
+    /* changes to be committed */
+    atomic_pack_change *changes;
+    size_t      nchanges;
+    size_t      changes_max;
+} atomic_pack;
+
+/* atomic_pack_open()
+ *
+ * Opens 'filename' as atomic_open() does, with the same options, and maps
+ * its index. Returns the errors of atomic_open() and atomic_readfile(),
+ * and ATOMIC_ERR_CORRUPT if the file isn't a pack.
+ */
+extern atomic_err
+atomic_pack_open(atomic_pack **self, char *filename, atomic_opts *opts);
+
+/* atomic_pack_get()
+ *
+ * Finds the record with the given key as last committed; changes made
+ * since by this object are not seen. '*value' points into the mapping of
+ * the file, valid until the object is closed, and is NULL if there is no
+ * such record. Returns ATOMIC_ERR_CORRUPT if the index is damaged.
+ */
+extern atomic_err
+atomic_pack_get(atomic_pack *self, const char *key, size_t keylen,
+		char **value, size_t *vallen);
+
+/* atomic_pack_record()
+ *
+ * Returns the 'i'th record in key order, for 0 <= i < atomic_pack_count().
+ */
+extern atomic_err
+atomic_pack_record(atomic_pack *self, size_t i, char **key, size_t *keylen,
+		   char **value, size_t *vallen);
+
+#define atomic_pack_count(self) ((self)->count)
+
+/* atomic_pack_put()
+ * atomic_pack_delete()
+ *
+ * Record a change to be made by atomic_pack_commit(), copying the key and
+ * value. Returns ATOMIC_ERR_OPENEDREADABLE if the pack was not opened
+ * writable, or ATOMIC_ERR_NOMEM. Keys and values are limited to 4GB.
+ */
+extern atomic_err
+atomic_pack_put(atomic_pack *self, const char *key, size_t keylen,
+		const char *value, size_t vallen);
+extern atomic_err
+atomic_pack_delete(atomic_pack *self, const char *key, size_t keylen);
+
+/* atomic_pack_commit()
+ *
+ * Commits the pack with the changes applied, and closes the object. Like
+ * atomic_commit_tempfile(), and returns the same errors. With no changes,
+ * this just closes the object.
+ */
+extern atomic_err
+atomic_pack_commit(atomic_pack *self);
+
+/* atomic_pack_close()
+ *
+ * Throws away any changes, unlocks and closes the file, and frees the
+ * object.
+ */
+extern void
+atomic_pack_close(atomic_pack *self);
+
+#endif
@@ -0,0 +1,48 @@
+/* Static tracepoints for atomic_file and atomic_dir.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#ifndef __ATOMIC_PROBE_H__
+#define __ATOMIC_PROBE_H__
+
+/* ATOMIC_PROBEn(name, args...) marks a state transition as the USDT probe
+ * atomicfile:name, for perf, bpftrace, SystemTap and the like; see the
+ * bpftrace scripts in tools/. Makefile.PL defines ATOMIC_HAS_SDT if
+ * <sys/sdt.h> exists. A probe nobody is tracing costs a nop instruction
+ * (its arguments are all values the code has at hand anyway); without
+ * ATOMIC_HAS_SDT probes compile to nothing.
+ *
+ * The probes, with their arguments:
+ *
+ *   lock__start(file)			a writer starts to lock 'file'
+ *   lock__retry(file)			link() found the lock file taken
+ *   lock__wait(lockfile)		waiting for fcntl() on the lock file
+ *   lock__waited(lockfile, err)	... done
+ *   lock__stale(lockfile)		removing an abandoned lock file
+ *   lock__acquired(file)
+ *   lock__failed(file, err)
+ *   commit__start(file)
+ *   backup__start(file, rotate)	rotating backups
+ *   backup__rename(from, to)		... one at a time
+ *   backup__done(file, err)
+ *   commit__rename(temp, file)		the rename() that publishes it
+ *   commit__done(file, err)
+ *   opendir__start(root, mode)		atomic_opendir()
+ *   opendir__locked(root)		... has the writer's lock
+ *   opendir__done(root, err)
+ *   rollback__start(root, ix)		'current' is about to move
+ *   rollback__done(root, ix, err)
+ */
+#ifdef ATOMIC_HAS_SDT
+#include <sys/sdt.h>
+#define ATOMIC_PROBE1(n, a)		DTRACE_PROBE1(atomicfile, n, a)
+#define ATOMIC_PROBE2(n, a, b)		DTRACE_PROBE2(atomicfile, n, a, b)
+#define ATOMIC_PROBE3(n, a, b, c)	DTRACE_PROBE3(atomicfile, n, a, b, c)
+#else
+#define ATOMIC_PROBE1(n, a)		((void)0)
+#define ATOMIC_PROBE2(n, a, b)		((void)0)
+#define ATOMIC_PROBE3(n, a, b, c)	((void)0)
+#endif
+
+#endif
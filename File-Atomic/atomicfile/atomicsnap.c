@@ -0,0 +1,420 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "atomicsnap.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+extern unsigned int atomic_crc32c(unsigned int crc, const void *buf,
+				  size_t len);
+
+/* The header segment; see atomicsnap.h. 'current' is the generation
+ * published, 0 for none, and 'last' the last one written, so that numbers
+ * aren't reused while a snapshot is withdrawn. The magic is written last. */
+#define SMAGIC		"\211AFS\r\n\032\n"
+#define SMAGIC_LEN	8
+
+struct header {
+    char magic[SMAGIC_LEN];
+    unsigned long long current;
+    unsigned long long last;
+    char path[PATH_MAX];
+};
+
+#if defined(__ATOMIC_ACQUIRE)
+#  define LOAD(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#  define STORE(p, n)	__atomic_store_n((p), (n), __ATOMIC_RELEASE)
+#elif defined(__GNUC__)
+#  define LOAD(p)	(__sync_synchronize(), *(volatile unsigned long long *)(p))
+#  define STORE(p, n)	(__sync_synchronize(), \
+			 *(volatile unsigned long long *)(p) = (n))
+#else
+#  define LOAD(p)	(*(volatile unsigned long long *)(p))
+#  define STORE(p, n)	(*(volatile unsigned long long *)(p) = (n))
+#endif
+
+static void
+header_name(char *buf, const char *path)
+{
+    size_t len = strlen(path);
+    sprintf(buf, "/atomicfile.%08x%08x", atomic_crc32c(0, path, len),
+	    atomic_crc32c(0xffffffff, path, len));
+}
+
+static void
+data_name(char *buf, const char *header, unsigned long long gen)
+{
+    sprintf(buf, "%s.%llu", header, gen);
+}
+
+/* Whether a segment can be believed: anyone can create one with any name,
+ * so it must belong to the owner of the file, to root or to us, and no one
+ * else may be able to write to it. */
+static int
+trusted(const struct stat *st, uid_t owner)
+{
+    return (st->st_uid == owner || st->st_uid == 0
+	    || st->st_uid == geteuid())
+	&& !(st->st_mode & (S_IWGRP|S_IWOTH));
+}
+
+/* Maps the header segment 'name' if it is that of 'path', a file belonging
+ * to 'owner'. Fails with EPERM if the segment can't be trusted, so that
+ * readers would ignore it too, and with EACCES if a writer may not use it
+ * although readers would. */
+static struct header *
+header_map(const char *name, const char *path, int writable, uid_t owner)
+{
+    struct header *h;
+    struct stat st;
+    int fd;
+
+    if ((fd = shm_open(name, writable ? O_RDWR : O_RDONLY, 0)) < 0)
+	return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*h)) {
+	close(fd);
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!trusted(&st, owner)) {
+	close(fd);
+	errno = EPERM;
+	return NULL;
+    }
+    /* writers only adopt headers of their own */
+    if (writable && st.st_uid != geteuid() && geteuid() != 0) {
+	close(fd);
+	errno = EACCES;
+	return NULL;
+    }
+    h = (struct header *)mmap(NULL, sizeof(*h),
+			      writable ? PROT_READ|PROT_WRITE : PROT_READ,
+			      MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+	return NULL;
+    if (memcmp(h->magic, SMAGIC, SMAGIC_LEN) || strcmp(h->path, path)) {
+	munmap(h, sizeof(*h));
+	errno = EEXIST;			/* another file with the same hash */
+	return NULL;
+    }
+    return h;
+}
+
+/* Maps the header segment, creating it if need be. */
+static struct header *
+header_create(const char *name, const char *path, mode_t mode, uid_t owner)
+{
+    struct header *h;
+    int fd;
+
+    if ((h = header_map(name, path, 1, owner)) || errno != ENOENT)
+	return h;
+    if ((fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0) {
+	if (errno == EEXIST)	/* unlikely, as writers hold the lock */
+	    return header_map(name, path, 1, owner);
+	return NULL;
+    }
+    if (ftruncate(fd, sizeof(*h)) < 0) {
+	close(fd);
+	shm_unlink(name);
+	return NULL;
+    }
+    h = (struct header *)mmap(NULL, sizeof(*h), PROT_READ|PROT_WRITE,
+			      MAP_SHARED, fd, 0);
+    fchmod(fd, mode & 0644);
+    close(fd);
+    if (h == MAP_FAILED) {
+	shm_unlink(name);
+	return NULL;
+    }
+    strcpy(h->path, path);
+    STORE(&h->current, 0ULL);
+    memcpy(h->magic, SMAGIC, SMAGIC_LEN);
+    return h;
+}
+
+/* Marks nothing as published, and removes what was. */
+static void
+withdraw(struct header *h, const char *name)
+{
+    char data[64];
+    unsigned long long old = h->current;
+
+    STORE(&h->current, 0ULL);
+    if (old) {
+	data_name(data, name, old);
+	shm_unlink(data);
+    }
+}
+
+static atomic_err
+write_data(const char *name, const char *buffer, size_t length, mode_t mode)
+{
+    int fd;
+
+    shm_unlink(name);		/* left over from a writer that died */
+    if ((fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    if (ftruncate(fd, length) < 0)
+	goto failed;
+    while (length) {
+	ssize_t n = write(fd, buffer, length);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    goto failed;
+	buffer += n;
+	length -= n;
+    }
+    fchmod(fd, mode & 0444);
+    if (close(fd) < 0) {
+	shm_unlink(name);
+	return ATOMIC_ERR_CANTWRITE;
+    }
+    return ATOMIC_ERR_SUCCESS;
+
+failed:
+    {
+	int save_errno = errno;
+	close(fd);
+	shm_unlink(name);
+	errno = save_errno;
+	return ATOMIC_ERR_CANTWRITE;
+    }
+}
+
+atomic_err
+atomic_publish(const char *filename, const char *buffer, size_t length,
+	       mode_t mode)
+{
+    char name[32], data[64];
+    struct header *h;
+    struct stat st;
+    unsigned long long gen, old;
+    atomic_err err = ATOMIC_ERR_SUCCESS;
+    char *path;
+
+    if (!(path = realpath(filename, NULL)))
+	return errno == ENOMEM ? ATOMIC_ERR_NOMEM : ATOMIC_ERR_CANTOPEN;
+    if (strlen(path) >= PATH_MAX) {
+	free(path);
+	return ATOMIC_ERR_PATHTOOLONG;
+    }
+    if (stat(path, &st) < 0) {
+	free(path);
+	return ATOMIC_ERR_CANTOPEN;
+    }
+    header_name(name, path);
+    h = buffer ? header_create(name, path, mode, st.st_uid)
+	       : header_map(name, path, 1, st.st_uid);
+    free(path);
+    if (!h) {
+	/* Readers won't believe a header that isn't there, belongs to
+	 * another file or can't be trusted. Any other is a snapshot that
+	 * they will go on reading. */
+	if (errno != ENOENT && errno != EEXIST && errno != EPERM
+		&& errno != EINVAL)
+	    return ATOMIC_ERR_CANTWITHDRAW;
+	return buffer ? ATOMIC_ERR_CANTOPEN : ATOMIC_ERR_SUCCESS;
+    }
+
+    if (!buffer) {
+	withdraw(h, name);
+    }
+    else {
+	gen = h->last + 1;
+	data_name(data, name, gen);
+	if ((err = write_data(data, buffer, length, mode))
+		!= ATOMIC_ERR_SUCCESS)
+	{
+	    int save_errno = errno;
+	    withdraw(h, name);
+	    errno = save_errno;
+	}
+	else {
+	    old = h->current;
+	    h->last = gen;
+	    STORE(&h->current, gen);
+	    if (old) {
+		data_name(data, name, old);
+		shm_unlink(data);
+	    }
+	}
+    }
+    munmap(h, sizeof(*h));
+    return err;
+}
+
+void
+atomic_unpublish(const char *filename)
+{
+    char name[32];
+    struct header *h;
+    struct stat st;
+    char *path;
+
+    if (!(path = realpath(filename, NULL)))
+	return;
+    header_name(name, path);
+    if (stat(path, &st) == 0 && (h = header_map(name, path, 1, st.st_uid))) {
+	/* so that readers that have the header mapped let go of it */
+	withdraw(h, name);
+	munmap(h, sizeof(*h));
+	shm_unlink(name);
+    }
+    free(path);
+}
+
+/* Readers */
+
+atomic_err
+atomic_snapshot_open(atomic_snapshot **ret, const char *filename)
+{
+    atomic_snapshot *self;
+    struct stat st;
+
+    if (!(self = (atomic_snapshot *)malloc(sizeof(*self))))
+	return ATOMIC_ERR_NOMEM;
+    memset(self, 0, sizeof(*self));
+    if (!(self->path = realpath(filename, NULL))) {
+	int save_errno = errno;
+	free(self);
+	errno = save_errno;
+	return save_errno == ENOMEM ? ATOMIC_ERR_NOMEM : ATOMIC_ERR_CANTOPEN;
+    }
+    if (strlen(self->path) >= PATH_MAX) {
+	free(self->path);
+	free(self);
+	return ATOMIC_ERR_PATHTOOLONG;
+    }
+    if (stat(self->path, &st) < 0) {
+	int save_errno = errno;
+	free(self->path);
+	free(self);
+	errno = save_errno;
+	return ATOMIC_ERR_CANTOPEN;
+    }
+    self->owner = st.st_uid;
+    header_name(self->name, self->path);
+    *ret = self;
+    return ATOMIC_ERR_SUCCESS;
+}
+
+static void
+release(atomic_snapshot *self)
+{
+    if (self->generation && self->length)
+	munmap(self->data, self->length);
+    if (self->file)
+	atomic_close(self->file);
+    self->file = NULL;
+    self->data = NULL;
+    self->length = 0;
+    self->generation = 0;
+}
+
+/* Maps generation 'gen'. Fails with ENOENT if it has been superseded. */
+static int
+map_generation(atomic_snapshot *self, unsigned long long gen)
+{
+    char data[64];
+    struct stat st;
+    char *map = "";
+    int fd;
+
+    data_name(data, self->name, gen);
+    if ((fd = shm_open(data, O_RDONLY, 0)) < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+    if (!trusted(&st, self->owner)) {
+	close(fd);
+	errno = EPERM;
+	return -1;
+    }
+    if (st.st_size
+	    && (map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd,
+				   0)) == MAP_FAILED)
+    {
+	close(fd);
+	return -1;
+    }
+    close(fd);
+    release(self);
+    self->data = map;
+    self->length = st.st_size;
+    self->generation = gen;
+    return 0;
+}
+
+atomic_err
+atomic_snapshot_read(atomic_snapshot *self, char **buffer, size_t *length)
+{
+    struct header *h;
+    unsigned long long gen = 0;
+    atomic_err err;
+    int tries;
+
+    if (!self->header)
+	self->header = header_map(self->name, self->path, 0, self->owner);
+    h = (struct header *)self->header;
+
+    /* A generation can be superseded, and removed, between reading its
+     * number and opening it: try again a few times before giving up. */
+    for (tries = 0; h && tries < 3; tries++) {
+	if (!(gen = LOAD(&h->current)))
+	    break;
+	if (gen == self->generation || map_generation(self, gen) == 0) {
+	    *buffer = self->data;
+	    *length = self->length;
+	    return ATOMIC_ERR_SUCCESS;
+	}
+	if (errno != ENOENT)
+	    break;
+    }
+    if (h && !gen) {
+	/* Withdrawn, maybe for good: look for a new header next time. */
+	munmap(h, sizeof(*h));
+	self->header = NULL;
+    }
+
+    release(self);
+    if ((err = atomic_open(&self->file, self->path, NULL))
+	    != ATOMIC_ERR_SUCCESS)
+    {
+	self->file = NULL;
+	return err;
+    }
+    return atomic_readfile(self->file, buffer, length);
+}
+
+int
+atomic_snapshot_changed(atomic_snapshot *self)
+{
+    if (!self->header || !self->generation)
+	return 1;
+    return LOAD(&((struct header *)self->header)->current)
+	!= self->generation;
+}
+
+void
+atomic_snapshot_close(atomic_snapshot *self)
+{
+    release(self);
+    if (self->header)
+	munmap(self->header, sizeof(struct header));
+    free(self->path);
+    free(self);
+}
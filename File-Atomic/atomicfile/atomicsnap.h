@@ -0,0 +1,121 @@
+/* Published snapshots: committed contents in shared memory.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#ifndef __ATOMIC_SNAP_H__
+#define __ATOMIC_SNAP_H__
+
+#include "atomicfile.h"
+
+/* NOTE:
+ *
+ * If the 'publish' option is set, each commit (and append) also copies the
+ * new contents, as the read functions would return them, into a POSIX
+ * shared memory segment while the file is still locked:
+ *
+ *    /atomicfile.HASH      - the header: the file's absolute path and the
+ *                            number of the generation currently published
+ *    /atomicfile.HASH.N    - generation N, read-only once written
+ *
+ * where HASH is derived from the absolute path of the file. A writer
+ * writes generation N, stores N in the header, and only then removes
+ * generation N-1, so a reader that has N-1 mapped keeps it for as long as
+ * it likes. The segments have the permissions of the file, without the
+ * write bits. Since anyone can create a segment of any name, readers only
+ * use segments that belong to the owner of the file, to root or to
+ * themselves, and that only their owner can write to; writers only use a
+ * header that they own. The file stays the source of truth: if publishing fails the
+ * header is left saying that nothing is published, and readers go to the
+ * file, as they do before the first commit with 'publish' and after a
+ * commit without it (which also withdraws the snapshot). A published file
+ * is marked with the extended attribute "user.atomicfile.published", so a
+ * commit without 'publish' only looks for a snapshot to withdraw if the
+ * version it replaces is marked, or the filesystem can't mark files.
+ *
+ * Readers pay for shm_open(), fstat() and mmap() once per generation
+ * rather than for open(), fstat() and mmap() on every read, and can tell
+ * that a new generation is out with a single load from the header.
+ */
+
+typedef struct {
+    char       *path;		/* absolute path of the file */
+    uid_t       owner;		/* ... and its owner */
+    char        name[32];	/* of the header segment */
+    void       *header;		/* mapped header, or NULL */
+    unsigned long long generation; /* of 'data'; 0 if read from the file */
+    char       *data;
+    size_t      length;
+    atomic_file *file;		/* reader of the file, when unpublished */
+} atomic_snapshot;
+
+/* atomic_snapshot_open()
+ *
+ * Allocates a reader for the snapshots of 'filename', which must exist.
+ * Nothing is read until atomic_snapshot_read(). Free it with
+ * atomic_snapshot_close().
+ *
+ * Returns ATOMIC_ERR_CANTOPEN if 'filename' can't be resolved, or
+ * ATOMIC_ERR_NOMEM.
+ */
+extern atomic_err
+atomic_snapshot_open(atomic_snapshot **self, const char *filename);
+
+/* atomic_snapshot_read()
+ *
+ * Returns the contents of the generation published last, mapping it if it
+ * isn't the one mapped already, or the contents of the file if nothing is
+ * published. The buffer is owned by the object and stays valid until the
+ * next call or atomic_snapshot_close(). Returns the errors of
+ * atomic_open() and atomic_readfile() when reading the file.
+ */
+extern atomic_err
+atomic_snapshot_read(atomic_snapshot *self, char **buffer, size_t *length);
+
+/* atomic_snapshot_changed()
+ *
+ * Returns true if atomic_snapshot_read() would return something other
+ * than it did last time: always when the contents came from the file.
+ */
+extern int
+atomic_snapshot_changed(atomic_snapshot *self);
+
+/* atomic_snapshot_close()
+ *
+ * Unmaps everything and frees the object.
+ */
+extern void
+atomic_snapshot_close(atomic_snapshot *self);
+
+/* atomic_snapshot_generation()
+ *
+ * The generation last returned by atomic_snapshot_read(), 0 if it came
+ * from the file. Generations of a file count up from 1.
+ */
+#define atomic_snapshot_generation(self) ((self)->generation)
+
+/* atomic_publish()
+ *
+ * Publishes 'buffer' as the next generation of 'filename', or withdraws
+ * the current one if 'buffer' is NULL. Commits with the 'publish' option
+ * call this; the caller must hold the file's lock. 'mode' gives the
+ * permissions of the segments, less the write bits.
+ *
+ * Returns ATOMIC_ERR_CANTOPEN, ATOMIC_ERR_CANTWRITE or ATOMIC_ERR_NOMEM,
+ * having withdrawn the snapshot if it could, and ATOMIC_ERR_CANTWITHDRAW
+ * if it couldn't: then readers go on seeing the last generation published,
+ * as when the header belongs to root but the writer doesn't.
+ */
+extern atomic_err
+atomic_publish(const char *filename, const char *buffer, size_t length,
+	       mode_t mode);
+
+/* atomic_unpublish()
+ *
+ * Removes the segments of 'filename', for when the file is retired.
+ * Readers that have them open or mapped are not affected.
+ */
+extern void
+atomic_unpublish(const char *filename);
+
+#endif
@@ -0,0 +1,134 @@
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "atomicstats.h"
+
+static atomic_stats s_stats;
+static int s_flags;
+
+static const char *s_stat_names[] = {
+    "locks", "lock_retries", "stale_locks", "commits", "commit_bytes",
+    "maps", "map_nonresident_pages"
+};
+
+static const char *s_timer_names[] = {
+    "lock_wait", "backups", "rename"
+};
+
+/* Relaxed atomic arithmetic where the compiler has it */
+#if defined(__ATOMIC_RELAXED)
+#  define ADD(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#  define LOAD(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#  define STORE(p, n)	__atomic_store_n((p), (n), __ATOMIC_RELAXED)
+#  define CAS(p, o, n)	__atomic_compare_exchange_n((p), &(o), (n), 0, \
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#elif defined(__GNUC__)
+#  define ADD(p, n)	__sync_fetch_and_add((p), (n))
+#  define LOAD(p)	(*(volatile unsigned long long *)(p))
+#  define STORE(p, n)	(*(volatile unsigned long long *)(p) = (n))
+#  define CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#else
+   /* good enough for single-threaded programs */
+#  define ADD(p, n)	(*(p) += (n))
+#  define LOAD(p)	(*(p))
+#  define STORE(p, n)	(*(p) = (n))
+#  define CAS(p, o, n)	(*(p) = (n), 1)
+#endif
+
+void
+atomic_stats_count(atomic_stat stat, unsigned long long n)
+{
+    ADD(&s_stats.counters[stat], n);
+}
+
+unsigned long long
+atomic_stats_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+void
+atomic_stats_time(atomic_timer timer, unsigned long long since)
+{
+    atomic_hist *h = &s_stats.timers[timer];
+    unsigned long long now = atomic_stats_now();
+    unsigned long long us = now > since ? now - since : 0;
+    unsigned long long max;
+    int b = 0;
+
+    while (b < ATOMIC_HIST_BUCKETS - 1 && us >> (b + 1))
+	b++;
+    ADD(&h->count, 1);
+    ADD(&h->total, us);
+    ADD(&h->buckets[b], 1);
+    max = LOAD(&h->max);
+    while (us > max && !CAS(&h->max, max, us))
+	max = LOAD(&h->max);
+}
+
+void
+atomic_stats_get(atomic_stats *stats)
+{
+    unsigned long long *from = (unsigned long long *)&s_stats;
+    unsigned long long *to = (unsigned long long *)stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(s_stats) / sizeof(*from); i++)
+	to[i] = LOAD(&from[i]);
+}
+
+void
+atomic_stats_reset(void)
+{
+    unsigned long long *p = (unsigned long long *)&s_stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(s_stats) / sizeof(*p); i++)
+	STORE(&p[i], 0);
+}
+
+int
+atomic_stats_enable(int flags)
+{
+#if defined(__ATOMIC_RELAXED)
+    return __atomic_exchange_n(&s_flags, flags, __ATOMIC_RELAXED);
+#elif defined(__GNUC__)
+    return __sync_lock_test_and_set(&s_flags, flags);
+#else
+    int old = s_flags;
+    s_flags = flags;
+    return old;
+#endif
+}
+
+int
+atomic_stats_enabled(int flag)
+{
+#if defined(__ATOMIC_RELAXED)
+    return __atomic_load_n(&s_flags, __ATOMIC_RELAXED) & flag;
+#else
+    return *(volatile int *)&s_flags & flag;
+#endif
+}
+
+const char *
+atomic_stat_name(atomic_stat stat)
+{
+    return stat < ATOMIC_STAT__LAST ? s_stat_names[stat] : NULL;
+}
+
+const char *
+atomic_timer_name(atomic_timer timer)
+{
+    return timer < ATOMIC_TIME__LAST ? s_timer_names[timer] : NULL;
+}
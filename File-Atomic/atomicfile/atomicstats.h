@@ -0,0 +1,96 @@
+/* Per-process counters and latency histograms for atomic_file.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#ifndef __ATOMIC_STATS_H__
+#define __ATOMIC_STATS_H__
+
+/* Counters */
+typedef enum {
+    ATOMIC_STAT_LOCKS,		/* write locks acquired */
+    ATOMIC_STAT_LOCK_RETRIES,	/* link()s that found the lock taken */
+    ATOMIC_STAT_STALE_LOCKS,	/* abandoned lock files removed */
+    ATOMIC_STAT_COMMITS,	/* files committed */
+    ATOMIC_STAT_COMMIT_BYTES,	/* bytes in the files committed */
+    ATOMIC_STAT_MAPS,		/* files mapped for reading */
+    ATOMIC_STAT_MAP_NONRESIDENT_PAGES, /* pages of those not in memory when
+					* mapped; ATOMIC_STATS_RESIDENCY */
+    ATOMIC_STAT__LAST
+} atomic_stat;
+
+/* Timers, in microseconds */
+typedef enum {
+    ATOMIC_TIME_LOCK_WAIT,	/* acquiring a write lock */
+    ATOMIC_TIME_BACKUPS,	/* rotating backups during a commit */
+    ATOMIC_TIME_RENAME,		/* the rename() that publishes a commit */
+    ATOMIC_TIME__LAST
+} atomic_timer;
+
+/* Bucket 0 counts times under 2us, bucket i > 0 those from 2^i to
+ * 2^(i+1) - 1us, and the last one everything longer. */
+#define ATOMIC_HIST_BUCKETS 32
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long total;	/* us */
+    unsigned long long max;	/* us */
+    unsigned long long buckets[ATOMIC_HIST_BUCKETS];
+} atomic_hist;
+
+typedef struct {
+    unsigned long long counters[ATOMIC_STAT__LAST];
+    atomic_hist timers[ATOMIC_TIME__LAST];
+} atomic_stats;
+
+/* atomic_stats_get()
+ * atomic_stats_reset()
+ *
+ * Copy out or zero the statistics of every atomic_file and atomic_dir in
+ * the process. Updates are atomic increments, so they are cheap and safe
+ * from any thread, but a copy taken while other threads are busy is not a
+ * consistent snapshot across counters.
+ */
+extern void
+atomic_stats_get(atomic_stats *stats);
+extern void
+atomic_stats_reset(void);
+
+/* atomic_stats_enable()
+ * atomic_stats_enabled()
+ *
+ * Turn on and off, or check, the statistics that cost more than counting:
+ *
+ *   ATOMIC_STATS_RESIDENCY   count ATOMIC_STAT_MAP_NONRESIDENT_PAGES, with a
+ *                            mincore() sweep of each file mapped
+ *
+ * They are all off to start with. atomic_stats_enable() returns the flags
+ * that were on before.
+ */
+#define ATOMIC_STATS_RESIDENCY	0x1
+
+extern int
+atomic_stats_enable(int flags);
+extern int
+atomic_stats_enabled(int flag);
+
+/* atomic_stat_name()
+ * atomic_timer_name()
+ *
+ * Short lowercase names for the counters and timers, for reports.
+ */
+extern const char *
+atomic_stat_name(atomic_stat stat);
+extern const char *
+atomic_timer_name(atomic_timer timer);
+
+/* Used by the library to update the statistics. atomic_stats_now() returns
+ * a monotonic time in microseconds for atomic_stats_time(). */
+extern void
+atomic_stats_count(atomic_stat stat, unsigned long long n);
+extern unsigned long long
+atomic_stats_now(void);
+extern void
+atomic_stats_time(atomic_timer timer, unsigned long long since);
+
+#endif
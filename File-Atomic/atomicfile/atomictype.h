@@ -11,6 +11,15 @@ typedef enum {
     ATOMIC_CREATE
 } atomic_file_mode;
 
+typedef enum {
+    ATOMIC_HINT_NONE = 0,
+    ATOMIC_HINT_SEQUENTIAL,	/* read front to back; prefetch ahead */
+    ATOMIC_HINT_RANDOM,		/* scattered lookups; no readahead */
+    ATOMIC_HINT_WILLNEED,	/* start reading the whole file in */
+    ATOMIC_HINT_POPULATE,	/* fault the whole file in when mapping it */
+    ATOMIC_HINT_HUGEPAGE	/* ask for huge pages where supported */
+} atomic_readhint;
+
 typedef enum {		/* bit flags */
     ATOMIC_DEBUG_NONE	= 0x00,
     ATOMIC_DEBUG_STRICT	= 0x01,
@@ -27,10 +36,19 @@ typedef struct {
     gid_t gid;			/* group for newly created files */
     mode_t cmode;		/* creat() mode for new files */
     atomic_debug_flags debug;	/* additional debug flags */
+    int skip_unchanged;		/* don't commit content identical to dest */
+    int compress;		/* zlib level (1-9) for commits, 0 for none */
+    int checksum;		/* add a CRC-32C trailer on commit */
+    atomic_readhint readhint;	/* how the file will be read */
+    int manifest;		/* atomic_dir: write manifests on commit */
+    int publish;		/* also publish commits in shared memory */
+    int nocache;		/* keep streamed data out of the page cache */
+    int delta;			/* keep rotated backups after .1 as deltas */
 } atomic_opts;
 
 #define ATOMIC_OPTS_INITIALIZER \
-	{ ATOMIC_READ, NULL, 0, 0, 0, (uid_t)-1, (gid_t)-1, (mode_t)0, 0 }
+	{ ATOMIC_READ, NULL, 0, 0, 0, (uid_t)-1, (gid_t)-1, (mode_t)0, 0, 0, 0, 0, \
+	  ATOMIC_HINT_NONE, 0, 0, 0, 0 }
 
 typedef enum {
     ATOMIC_ERR_SUCCESS=0,
@@ -57,6 +75,12 @@ typedef enum {
     ATOMIC_ERR_PATHTOOLONG,
     ATOMIC_ERR_RECURSIVELOCK,
     ATOMIC_ERR_EMPTYBACKUPEXT,
+    ATOMIC_ERR_UNCHANGED,	/* not an error: skip_unchanged matched */
+    ATOMIC_ERR_UNSUPPORTED,
+    ATOMIC_ERR_CORRUPT,
+    ATOMIC_ERR_BADCHECKSUM,
+    ATOMIC_ERR_NOFREESLOT,
+    ATOMIC_ERR_CANTWITHDRAW,	/* committed, but a snapshot is left over */
     ATOMIC_ERR__LAST_ /* in case the C compiler can't handle trailing ',' */
 } atomic_err;
 
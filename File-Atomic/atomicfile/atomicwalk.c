@@ -0,0 +1,253 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "atomicwalk.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+#ifndef O_DIRECTORY
+#  define O_DIRECTORY 0
+#endif
+#ifndef O_NOFOLLOW
+#  define O_NOFOLLOW 0
+#endif
+
+/* A directory waiting to be read */
+struct walk_item {
+    struct walk_item *next;
+    char path[1];
+};
+
+/* State shared by the walker threads */
+struct walk {
+    int rootfd;
+    atomic_walk_ops *ops;
+    void *arg;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct walk_item *queue;
+    int busy;			/* threads working on an item */
+    atomic_err err;		/* the first error */
+    int err_errno;
+};
+
+static int
+push(struct walk *w, const char *path, const char *name)
+{
+    char buf[PATH_MAX];
+    struct walk_item *item;
+
+    if (atomic_walk_join(buf, sizeof(buf), path, name) != ATOMIC_ERR_SUCCESS) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    if (!(item = (struct walk_item *)malloc(sizeof(*item) + strlen(buf))))
+	return -1;
+    strcpy(item->path, buf);
+    pthread_mutex_lock(&w->mutex);
+    item->next = w->queue;
+    w->queue = item;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    return 0;
+}
+
+static void
+fail(struct walk *w, atomic_err err)
+{
+    int save_errno = errno;
+    pthread_mutex_lock(&w->mutex);
+    if (w->err == ATOMIC_ERR_SUCCESS) {
+	w->err = err;
+	w->err_errno = save_errno;
+    }
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+/* A directory that can't be read fails the walk with 'err', unless the
+ * caller says to go on */
+static atomic_err
+unreadable(struct walk *w, const char *path, atomic_err err)
+{
+    if (*path && w->ops->unreadable)
+	return w->ops->unreadable(w->arg, path);
+    return err;
+}
+
+/* Reads one directory, queueing its subdirectories. */
+static atomic_err
+walk_dir(struct walk *w, const char *path)
+{
+    atomic_walk_entry e;
+    struct dirent *d;
+    atomic_err err = ATOMIC_ERR_SUCCESS;
+    void *dirdata = NULL;
+    DIR *dir;
+    int fd;
+
+    fd = openat(w->rootfd, *path ? path : ".",
+		O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    if (fd < 0)
+	return unreadable(w, path, ATOMIC_ERR_CANTOPEN);
+    if (!(dir = fdopendir(fd))) {
+	int save_errno = errno;
+	close(fd);
+	errno = save_errno;
+	return unreadable(w, path, ATOMIC_ERR_CANTOPEN);
+    }
+    if (w->ops->enter
+	    && (err = w->ops->enter(w->arg, fd, path, &dirdata))
+		!= ATOMIC_ERR_SUCCESS)
+    {
+	closedir(dir);
+	return err;
+    }
+
+    e.dirfd = fd;
+    e.path = path;
+    e.dirdata = dirdata;
+    while ((errno = 0, d = readdir(dir))) {
+	int descend;
+
+	if (d->d_name[0] == '.' && (!d->d_name[1]
+		    || (d->d_name[1] == '.' && !d->d_name[2])))
+	    continue;
+	e.name = d->d_name;
+	e.type = d->d_type;
+	if (e.type == DT_UNKNOWN) {
+	    struct stat st;
+	    if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		err = ATOMIC_ERR_CANTREAD;
+		break;
+	    }
+	    e.type = S_ISDIR(st.st_mode) ? DT_DIR
+		   : S_ISREG(st.st_mode) ? DT_REG
+		   : S_ISLNK(st.st_mode) ? DT_LNK
+		   : S_ISFIFO(st.st_mode) ? DT_FIFO
+		   : S_ISSOCK(st.st_mode) ? DT_SOCK
+		   : S_ISCHR(st.st_mode) ? DT_CHR
+		   : DT_BLK;
+	}
+	descend = (e.type == DT_DIR);
+	if (w->ops->entry
+		&& (err = w->ops->entry(w->arg, &e, &descend))
+		    != ATOMIC_ERR_SUCCESS)
+	    break;
+	if (descend && e.type == DT_DIR && push(w, path, d->d_name) < 0) {
+	    err = errno == ENOMEM ? ATOMIC_ERR_NOMEM : ATOMIC_ERR_PATHTOOLONG;
+	    break;
+	}
+    }
+    if (!d && errno && err == ATOMIC_ERR_SUCCESS)
+	err = unreadable(w, path, ATOMIC_ERR_CANTREAD);
+
+    {
+	int save_errno = errno;
+	if (w->ops->leave)
+	    w->ops->leave(w->arg, path, dirdata);
+	closedir(dir);
+	errno = save_errno;
+    }
+    return err;
+}
+
+static void *
+worker(void *arg)
+{
+    struct walk *w = (struct walk *)arg;
+    struct walk_item *item;
+    atomic_err err;
+
+    pthread_mutex_lock(&w->mutex);
+    while (1) {
+	while (!w->queue && w->busy && w->err == ATOMIC_ERR_SUCCESS)
+	    pthread_cond_wait(&w->cond, &w->mutex);
+	if (!w->queue || w->err != ATOMIC_ERR_SUCCESS)
+	    break;		/* all done, or giving up */
+	item = w->queue;
+	w->queue = item->next;
+	++w->busy;
+	pthread_mutex_unlock(&w->mutex);
+
+	if ((err = walk_dir(w, item->path)) != ATOMIC_ERR_SUCCESS)
+	    fail(w, err);
+	free(item);
+
+	pthread_mutex_lock(&w->mutex);
+	if (!--w->busy && !w->queue)
+	    pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+atomic_err
+atomic_walk(const char *root, int nthreads, atomic_walk_ops *ops, void *arg)
+{
+    pthread_t threads[64];
+    struct walk w;
+    int i, started = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.ops = ops;
+    w.arg = arg;
+    if ((w.rootfd = open(root, O_RDONLY|O_DIRECTORY)) < 0)
+	return ATOMIC_ERR_CANTOPEN;
+    pthread_mutex_init(&w.mutex, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    if (push(&w, "", NULL) < 0) {
+	close(w.rootfd);
+	return ATOMIC_ERR_NOMEM;
+    }
+
+    if (nthreads <= 0)
+	nthreads = ATOMIC_WALK_THREADS;
+    if (nthreads > (int)(sizeof(threads) / sizeof(threads[0])))
+	nthreads = sizeof(threads) / sizeof(threads[0]);
+
+    /* The caller's thread is one of the workers. */
+    for (i = 1; i < nthreads; i++)
+	if (pthread_create(&threads[started], NULL, worker, &w) == 0)
+	    ++started;
+    worker(&w);
+    for (i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+
+    /* Anything left over after an error */
+    while (w.queue) {
+	struct walk_item *item = w.queue;
+	w.queue = item->next;
+	free(item);
+    }
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.mutex);
+    close(w.rootfd);
+    errno = w.err_errno;
+    return w.err;
+}
+
+atomic_err
+atomic_walk_join(char *buf, size_t sz, const char *path, const char *name)
+{
+    int r;
+
+    if (!name)
+	r = snprintf(buf, sz, "%s", path);
+    else if (*path)
+	r = snprintf(buf, sz, "%s/%s", path, name);
+    else
+	r = snprintf(buf, sz, "%s", name);
+    if (r < 0 || (size_t)r >= sz)
+	return ATOMIC_ERR_PATHTOOLONG;
+    return ATOMIC_ERR_SUCCESS;
+}
@@ -0,0 +1,68 @@
+/* Parallel directory tree walker, used by atomic_dir.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#ifndef __ATOMIC_WALK_H__
+#define __ATOMIC_WALK_H__
+
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "atomictype.h"
+
+/* One entry of a directory being walked. 'dirfd' is open on the directory
+ * containing it, and 'path' is the directory's path relative to the root of
+ * the walk ("" for the root itself). 'type' is one of the DT_* values, never
+ * DT_UNKNOWN. 'dirdata' is whatever the 'enter' callback stored for the
+ * directory. */
+typedef struct {
+    int         dirfd;
+    const char *path;
+    const char *name;
+    int         type;
+    void       *dirdata;
+} atomic_walk_entry;
+
+/* The callbacks. Any of them may be NULL. They are called from several
+ * threads at once, but all calls for one directory happen in one thread,
+ * in the order enter, entry..., leave. A callback that returns anything but
+ * ATOMIC_ERR_SUCCESS stops the walk, which returns that error. Directories
+ * are only descended into if 'entry' sets '*descend' (it starts out true
+ * for directories if 'entry' is NULL).
+ *
+ * 'leave' is called once the directory's own entries are done, which is
+ * not necessarily after its subdirectories are.
+ *
+ * 'unreadable' is called for a directory below the root that can't be
+ * opened or read, with errno set; the walk goes on past it if it returns
+ * ATOMIC_ERR_SUCCESS. Without it, such a directory stops the walk. */
+typedef struct {
+    atomic_err (*enter)(void *arg, int dirfd, const char *path,
+			void **dirdata);
+    atomic_err (*entry)(void *arg, atomic_walk_entry *e, int *descend);
+    void       (*leave)(void *arg, const char *path, void *dirdata);
+    atomic_err (*unreadable)(void *arg, const char *path);
+} atomic_walk_ops;
+
+/* atomic_walk()
+ *
+ * Walks the tree under 'root' with up to 'nthreads' threads (0 picks a
+ * default), without following symlinks. Returns ATOMIC_ERR_CANTOPEN if a
+ * directory can't be opened, ATOMIC_ERR_NOMEM, or an error from a callback;
+ * errno is preserved from the failure.
+ */
+extern atomic_err
+atomic_walk(const char *root, int nthreads, atomic_walk_ops *ops, void *arg);
+
+/* atomic_walk_join()
+ *
+ * Joins a path relative to the walk root and an entry name into 'buf'.
+ * Returns ATOMIC_ERR_PATHTOOLONG if it doesn't fit.
+ */
+extern atomic_err
+atomic_walk_join(char *buf, size_t sz, const char *path, const char *name);
+
+#define ATOMIC_WALK_THREADS 8
+
+#endif
@@ -0,0 +1,746 @@
+/* Microbenchmarks for the atomicfile library.
+ *
+ *    make bench                       # or: ./atomicbench [-t secs] [dir]
+ *    ./atomicbench -c [-w writers] [-r readers] [-s sizes] [-T timeouts]
+ *		       [-t secs] [dir]
+ *    ./atomicbench -p [-m megabytes] [dir]
+ *
+ * Each benchmark repeats its operation for at least -t seconds (default
+ * 0.5) and prints one CSV line:
+ *
+ *    benchmark,param,iterations,us_per_op,mb_per_s
+ *
+ * 'param' is the file size, block size or rotate count the benchmark was
+ * run with, and 'mb_per_s' is empty where no data is moved. The reading
+ * benchmarks touch every cache line they are given. Files are created in
+ * 'dir' (default: a new directory under $TMPDIR or /tmp), which should be
+ * on the filesystem of interest, and removed afterwards.
+ *
+ * Copyright (c) 2004, ActiveState Corporation
+ * All Rights Reserved. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "atomicfile.h"
+#include "atomicdir.h"
+#include "atomicsnap.h"
+
+static double s_mintime = 0.5;	/* seconds per benchmark */
+static char s_dir[1024];
+static char *s_data;		/* S_BIGGEST bytes of 80-byte lines */
+
+#define S_BIGGEST (16 * 1024 * 1024)
+
+static void
+die(const char *what, atomic_err err)
+{
+    fprintf(stderr, "atomicbench: %s failed (error %d): %s\n", what, (int)err,
+	    strerror(errno));
+    exit(1);
+}
+
+static void
+path(char *buf, const char *name)
+{
+    snprintf(buf, 1024, "%s/%s", s_dir, name);
+}
+
+/* Runs 'op' until s_mintime has passed, then reports. 'bytes' is how much
+ * data one call moves, or 0. */
+static void
+run(const char *name, long param, size_t bytes, void (*op)(void *), void *arg)
+{
+    unsigned long long start, elapsed;
+    unsigned long n = 0;
+    double us;
+
+    op(arg);			/* warm up */
+    start = atomic_stats_now();
+    do {
+	op(arg);
+	++n;
+	elapsed = atomic_stats_now() - start;
+    } while (elapsed < s_mintime * 1e6);
+
+    us = (double)elapsed / n;
+    printf("%s,%ld,%lu,%.2f,", name, param, n, us);
+    if (bytes)
+	printf("%.1f", bytes / us);	/* bytes per us == MB/s */
+    printf("\n");
+    fflush(stdout);
+}
+
+static void
+commit(const char *file, const char *buf, size_t len, atomic_opts *opts)
+{
+    atomic_file *f;
+    atomic_err err;
+
+    if ((err = atomic_open(&f, (char *)file, opts)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_open", err);
+    if ((err = atomic_commit_string(f, (char *)buf, len))
+	    != ATOMIC_ERR_SUCCESS)
+	die("atomic_commit_string", err);
+}
+
+/* Touches every cache line, as a real consumer would; mapping alone is
+ * free. */
+static volatile unsigned long s_sink;
+
+static void
+consume(const char *buf, size_t len)
+{
+    unsigned long sum = 0;
+    size_t i;
+    for (i = 0; i < len; i += 64)
+	sum += (unsigned char)buf[i];
+    s_sink += sum;
+}
+
+static atomic_file *
+open_read(const char *file)
+{
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    atomic_file *f;
+    atomic_err err;
+
+    if ((err = atomic_open(&f, (char *)file, &opts)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_open", err);
+    return f;
+}
+
+/* The benchmarks */
+
+struct commit_arg {
+    char file[1024];
+    size_t size;
+    atomic_opts opts;
+};
+
+static void
+op_commit(void *arg)
+{
+    struct commit_arg *a = (struct commit_arg *)arg;
+    commit(a->file, s_data, a->size, &a->opts);
+}
+
+static void
+op_readfile(void *arg)
+{
+    atomic_file *f = open_read((char *)arg);
+    char *buf;
+    size_t len;
+    atomic_err err;
+
+    if ((err = atomic_readfile(f, &buf, &len)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_readfile", err);
+    consume(buf, len);
+    atomic_close(f);
+}
+
+static void
+op_snapshot(void *arg)
+{
+    char *buf;
+    size_t len;
+    atomic_err err;
+
+    if ((err = atomic_snapshot_read((atomic_snapshot *)arg, &buf, &len))
+	    != ATOMIC_ERR_SUCCESS)
+	die("atomic_snapshot_read", err);
+    consume(buf, len);
+}
+
+static void
+op_readline(void *arg)
+{
+    atomic_file *f = open_read((char *)arg);
+    char *line;
+    size_t len;
+    atomic_err err;
+
+    do {
+	if ((err = atomic_readline(f, &line, &len)) != ATOMIC_ERR_SUCCESS)
+	    die("atomic_readline", err);
+    } while (line);
+    atomic_close(f);
+}
+
+struct block_arg {
+    char file[1024];
+    size_t blocklen;
+};
+
+static void
+op_readblock(void *arg)
+{
+    struct block_arg *a = (struct block_arg *)arg;
+    atomic_file *f = open_read(a->file);
+    char *block;
+    size_t len;
+    atomic_err err;
+
+    do {
+	if ((err = atomic_readblock(f, a->blocklen, &block, &len))
+		!= ATOMIC_ERR_SUCCESS)
+	    die("atomic_readblock", err);
+	consume(block, len);
+    } while (block);
+    atomic_close(f);
+}
+
+struct fd_arg {
+    char file[1024];
+    int fd;
+};
+
+static void
+op_commit_fd(void *arg)
+{
+    struct fd_arg *a = (struct fd_arg *)arg;
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    atomic_file *f;
+    atomic_err err;
+
+    opts.mode = ATOMIC_WRITE;
+    if ((err = atomic_open(&f, a->file, &opts)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_open", err);
+    lseek(a->fd, 0, SEEK_SET);
+    if ((err = atomic_commit_fd(f, a->fd)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_commit_fd", err);
+}
+
+static void
+op_opendir(void *arg)
+{
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    atomic_dir *d;
+    atomic_err err;
+
+    if ((err = atomic_opendir(&d, (char *)arg, &opts)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_opendir", err);
+    atomic_closedir(d);
+}
+
+static void
+op_commitdir(void *arg)
+{
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    atomic_dir *d;
+    atomic_err err;
+
+    opts.mode = ATOMIC_WRITE;
+    if ((err = atomic_opendir(&d, (char *)arg, &opts)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_opendir", err);
+    if ((err = atomic_commitdir(d)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_commitdir", err);
+}
+
+/* Contention: -c
+ *
+ * Forks the given numbers of writers and readers on one file for -t
+ * seconds (longer runs give steadier tail latencies) for every
+ * combination of the comma separated lists -w (default 1,4,16,64,256), -r
+ * (default 0), -s (payload sizes, default 4096) and -T (lock timeouts in
+ * seconds, 0 for none; default 0). Writers loop over atomic_open() and
+ * atomic_commit_string(); readers over atomic_open() and
+ * atomic_readfile(). Prints one CSV line per combination:
+ *
+ *    writers,readers,size,timeout,commits,commits_per_s,reads_per_s,
+ *    failures,lock_p50_us,lock_p99_us,lock_p999_us,
+ *    commit_p50_us,commit_p99_us,commit_p999_us
+ *
+ * where 'lock' is the time atomic_open() took to get the lock, 'commit'
+ * the time atomic_commit_string() took, and 'failures' the writers'
+ * atomic_open()s that timed out. */
+
+#define S_MAXLIST 16
+#define S_MAXSAMPLES (1 << 20)	/* per writer */
+
+static int
+parse_list(const char *arg, long *list)
+{
+    int n = 0;
+    char *end;
+    while (n < S_MAXLIST) {
+	list[n++] = strtol(arg, &end, 10);
+	if (*end != ',')
+	    break;
+	arg = end + 1;
+    }
+    return n;
+}
+
+/* What one process did, written to s_dir/samples.N */
+struct tally {
+    unsigned long commits;
+    unsigned long reads;
+    unsigned long failures;
+    unsigned long nsamples;	/* followed by lock, then commit times */
+};
+
+static void
+child(int ix, int writer, const char *file, size_t size, int timeout,
+      int go)
+{
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    unsigned long long *lock_us, *commit_us, start, t0, t1;
+    struct tally t;
+    char name[1024], buf[32];
+    atomic_file *f;
+    atomic_err err;
+    FILE *out;
+
+    memset(&t, 0, sizeof(t));
+    lock_us = malloc(2 * S_MAXSAMPLES * sizeof(*lock_us));
+    if (!lock_us)
+	_exit(1);
+    commit_us = lock_us + S_MAXSAMPLES;
+    opts.mode = writer ? ATOMIC_WRITE : ATOMIC_READ;
+    opts.timeout = timeout;
+
+    read(go, buf, 1);		/* wait for the starting gun */
+    start = atomic_stats_now();
+    while ((t0 = atomic_stats_now()) - start < s_mintime * 1e6) {
+	if ((err = atomic_open(&f, (char *)file, &opts))
+		!= ATOMIC_ERR_SUCCESS)
+	{
+	    if (err != ATOMIC_ERR_CANTLOCK)
+		die("atomic_open", err);
+	    ++t.failures;
+	    continue;
+	}
+	t1 = atomic_stats_now();
+	if (writer) {
+	    if ((err = atomic_commit_string(f, s_data, size))
+		    != ATOMIC_ERR_SUCCESS)
+		die("atomic_commit_string", err);
+	    if (t.nsamples < S_MAXSAMPLES) {
+		lock_us[t.nsamples] = t1 - t0;
+		commit_us[t.nsamples++] = atomic_stats_now() - t1;
+	    }
+	    ++t.commits;
+	}
+	else {
+	    char *data;
+	    size_t len;
+	    if ((err = atomic_readfile(f, &data, &len)) != ATOMIC_ERR_SUCCESS)
+		die("atomic_readfile", err);
+	    consume(data, len);
+	    atomic_close(f);
+	    ++t.reads;
+	}
+    }
+
+    snprintf(name, sizeof(name), "%s/samples.%d", s_dir, ix);
+    if (!(out = fopen(name, "w"))
+	    || fwrite(&t, sizeof(t), 1, out) != 1
+	    || fwrite(lock_us, sizeof(*lock_us), t.nsamples, out)
+		!= t.nsamples
+	    || fwrite(commit_us, sizeof(*commit_us), t.nsamples, out)
+		!= t.nsamples
+	    || fclose(out) != 0)
+	_exit(1);
+    _exit(0);			/* not exit(): cleanup() is the parent's */
+}
+
+static int
+by_value(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long
+percentile(unsigned long long *sorted, unsigned long n, double p)
+{
+    unsigned long i = (unsigned long)(p * n);
+    return n ? sorted[i < n ? i : n - 1] : 0;
+}
+
+static void
+contend(int writers, int readers, size_t size, int timeout)
+{
+    unsigned long long *lock_us = NULL, *commit_us = NULL;
+    unsigned long n = 0, commits = 0, reads = 0, failures = 0;
+    char file[1024], name[1024];
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    int go[2], i, status, ok = 1;
+    pid_t pid;
+
+    path(file, "contended");
+    opts.mode = ATOMIC_CREATE;
+    commit(file, s_data, size, &opts);
+    if (pipe(go) < 0)
+	die("pipe", ATOMIC_ERR_SUCCESS);
+    fflush(stdout);
+    for (i = 0; i < writers + readers; i++) {
+	if ((pid = fork()) < 0)
+	    die("fork", ATOMIC_ERR_SUCCESS);
+	if (!pid) {
+	    close(go[1]);
+	    child(i, i < writers, file, size, timeout, go[0]);
+	}
+    }
+    close(go[0]);
+    close(go[1]);		/* go! */
+    while (wait(&status) > 0)
+	ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!ok) {
+	fprintf(stderr, "atomicbench: a child failed\n");
+	exit(1);
+    }
+
+    for (i = 0; i < writers + readers; i++) {
+	struct tally t;
+	FILE *in;
+	snprintf(name, sizeof(name), "%s/samples.%d", s_dir, i);
+	if (!(in = fopen(name, "r")) || fread(&t, sizeof(t), 1, in) != 1)
+	    die("reading samples", ATOMIC_ERR_CANTREAD);
+	lock_us = realloc(lock_us, (n + t.nsamples) * sizeof(*lock_us) + 1);
+	commit_us = realloc(commit_us,
+			    (n + t.nsamples) * sizeof(*commit_us) + 1);
+	if (!lock_us || !commit_us)
+	    die("realloc", ATOMIC_ERR_NOMEM);
+	if (fread(lock_us + n, sizeof(*lock_us), t.nsamples, in) != t.nsamples
+		|| fread(commit_us + n, sizeof(*commit_us), t.nsamples, in)
+		    != t.nsamples)
+	    die("reading samples", ATOMIC_ERR_CANTREAD);
+	fclose(in);
+	unlink(name);
+	n += t.nsamples;
+	commits += t.commits;
+	reads += t.reads;
+	failures += t.failures;
+    }
+    qsort(lock_us, n, sizeof(*lock_us), by_value);
+    qsort(commit_us, n, sizeof(*commit_us), by_value);
+
+    printf("%d,%d,%lu,%d,%lu,%.1f,%.1f,%lu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+	   writers, readers, (unsigned long)size, timeout, commits,
+	   commits / s_mintime, reads / s_mintime, failures,
+	   percentile(lock_us, n, 0.5), percentile(lock_us, n, 0.99),
+	   percentile(lock_us, n, 0.999), percentile(commit_us, n, 0.5),
+	   percentile(commit_us, n, 0.99), percentile(commit_us, n, 0.999));
+    fflush(stdout);
+    free(lock_us);
+    free(commit_us);
+}
+
+/* Page cache pollution: -p
+ *
+ * Commits a file of -m megabytes (default 256) with atomic_commit_fd()
+ * from a source file that isn't cached, then scans it once with
+ * atomic_readblock(), without and then with the 'nocache' option, while a
+ * 64MB "hot" file is kept cached by reading it before each run. Prints one
+ * CSV line for each:
+ *
+ *    nocache,mb,commit_s,scan_s,artifact_cached_mb,source_cached_mb,
+ *    hot_cached_pct,hot_read_us
+ *
+ * 'cached' is what mincore() finds in the page cache afterwards. Where
+ * memory is short, that is what was pushed out of the hot file, which is
+ * what 'hot_cached_pct' and the time to read the hot file once more show. */
+
+#define S_HOTSIZE (64 * 1024 * 1024)
+
+static double
+cached_mb(const char *file, double *pct)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    unsigned char *vec;
+    size_t pages, i, n = 0;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+	die("open", ATOMIC_ERR_CANTOPEN);
+    pages = (st.st_size + pagesize - 1) / pagesize;
+    if (st.st_size) {
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+		== MAP_FAILED)
+	    die("mmap", ATOMIC_ERR_CANTMMAP);
+	if (!(vec = malloc(pages)))
+	    die("malloc", ATOMIC_ERR_NOMEM);
+	if (mincore(map, st.st_size, vec) < 0)
+	    die("mincore", ATOMIC_ERR_CANTREAD);
+	for (i = 0; i < pages; i++)
+	    n += vec[i] & 1;
+	free(vec);
+	munmap(map, st.st_size);
+    }
+    close(fd);
+    if (pct)
+	*pct = pages ? 100.0 * n / pages : 100.0;
+    return (double)n * pagesize / (1024 * 1024);
+}
+
+/* Writes the file out and drops it from the page cache. */
+static void
+uncache(const char *file)
+{
+    int fd;
+
+    if ((fd = open(file, O_RDONLY)) < 0)
+	die("open", ATOMIC_ERR_CANTOPEN);
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void
+pollution(long mb)
+{
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    char src[1024], hot[1024], artifact[1024];
+    unsigned long long start, commit_us, scan_us, hot_us;
+    double artifact_mb, src_mb, hot_pct;
+    atomic_file *f;
+    atomic_err err;
+    char *block;
+    size_t len;
+    long i;
+    int fd, nocache;
+
+    path(src, "source");
+    path(hot, "hot");
+    path(artifact, "artifact");
+    opts.mode = ATOMIC_CREATE;
+    commit(hot, "", 0, &opts);
+    if ((fd = open(src, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0)
+	die("open", ATOMIC_ERR_CANTOPEN);
+    for (i = 0; i < mb; i++)
+	if (write(fd, s_data + (i % 16) * 1024 * 1024, 1024 * 1024)
+		!= 1024 * 1024)
+	    die("write", ATOMIC_ERR_CANTWRITE);
+    close(fd);
+    opts.mode = ATOMIC_WRITE;
+    if ((err = atomic_open(&f, hot, &opts)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_open", err);
+    for (i = 0; i < S_HOTSIZE / S_BIGGEST; i++)
+	if ((err = atomic_write(f, s_data, S_BIGGEST)) != ATOMIC_ERR_SUCCESS)
+	    die("atomic_write", err);
+    if ((err = atomic_commit_tempfile(f)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_commit_tempfile", err);
+
+    printf("nocache,mb,commit_s,scan_s,artifact_cached_mb,source_cached_mb,"
+	   "hot_cached_pct,hot_read_us\n");
+    for (nocache = 0; nocache <= 1; nocache++) {
+	unlink(artifact);
+	uncache(src);
+	op_readfile(hot);		/* warm */
+
+	opts.mode = ATOMIC_CREATE;
+	opts.nocache = nocache;
+	start = atomic_stats_now();
+	if ((fd = open(src, O_RDONLY)) < 0)
+	    die("open", ATOMIC_ERR_CANTOPEN);
+	if ((err = atomic_open(&f, artifact, &opts)) != ATOMIC_ERR_SUCCESS)
+	    die("atomic_open", err);
+	if ((err = atomic_commit_fd(f, fd)) != ATOMIC_ERR_SUCCESS)
+	    die("atomic_commit_fd", err);
+	close(fd);
+	commit_us = atomic_stats_now() - start;
+
+	opts.mode = ATOMIC_READ;
+	start = atomic_stats_now();
+	if ((err = atomic_open(&f, artifact, &opts)) != ATOMIC_ERR_SUCCESS)
+	    die("atomic_open", err);
+	do {
+	    if ((err = atomic_readblock(f, 1024 * 1024, &block, &len))
+		    != ATOMIC_ERR_SUCCESS)
+		die("atomic_readblock", err);
+	    if (block)
+		consume(block, len);
+	} while (block);
+	atomic_close(f);
+	scan_us = atomic_stats_now() - start;
+
+	artifact_mb = cached_mb(artifact, NULL);
+	src_mb = cached_mb(src, NULL);
+	cached_mb(hot, &hot_pct);
+	start = atomic_stats_now();
+	op_readfile(hot);
+	hot_us = atomic_stats_now() - start;
+	printf("%d,%ld,%.2f,%.2f,%.1f,%.1f,%.1f,%llu\n", nocache, mb,
+	       commit_us / 1e6, scan_us / 1e6, artifact_mb, src_mb, hot_pct,
+	       hot_us);
+	fflush(stdout);
+    }
+}
+
+static void
+cleanup(void)
+{
+    char cmd[1100];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", s_dir);
+    system(cmd);
+}
+
+static void
+microbenchmarks(void)
+{
+    static const size_t sizes[] = { 0, 4096, 65536, 1 << 20, S_BIGGEST };
+    static const int rotates[] = { 0, 1, 4, 16, 64 };
+    static const size_t blocks[] = { 4096, 65536, 1 << 20 };
+    atomic_opts opts = ATOMIC_OPTS_INITIALIZER;
+    struct commit_arg ca;
+    struct block_arg ba;
+    struct fd_arg fa;
+    atomic_snapshot *snap;
+    atomic_err err;
+    char file[1024];
+    size_t i;
+
+    printf("benchmark,param,iterations,us_per_op,mb_per_s\n");
+
+    /* Uncontended open + commit_string */
+    opts.mode = ATOMIC_CREATE;
+    ca.opts = opts;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	path(ca.file, "commit");
+	ca.size = sizes[i];
+	run("commit_string", (long)sizes[i], sizes[i], op_commit, &ca);
+    }
+
+    /* Reading, from the page cache */
+    path(file, "read");
+    commit(file, s_data, S_BIGGEST, &opts);
+    run("readfile", S_BIGGEST, S_BIGGEST, op_readfile, file);
+    run("readline", S_BIGGEST, S_BIGGEST, op_readline, file);
+    path(ba.file, "read");
+    for (i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+	ba.blocklen = blocks[i];
+	run("readblock", (long)blocks[i], S_BIGGEST, op_readblock, &ba);
+    }
+
+    /* A small, hot file, from the file and from a published snapshot */
+    path(file, "published");
+    opts.publish = 1;
+    commit(file, s_data, 4096, &opts);
+    opts.publish = 0;
+    run("readfile", 4096, 4096, op_readfile, file);
+    if ((err = atomic_snapshot_open(&snap, file)) != ATOMIC_ERR_SUCCESS)
+	die("atomic_snapshot_open", err);
+    run("snapshot_read", 4096, 4096, op_snapshot, snap);
+    atomic_snapshot_close(snap);
+    atomic_unpublish(file);
+    path(file, "read");
+
+    /* Copying in from another file */
+    path(fa.file, "copy");
+    commit(fa.file, "", 0, &opts);
+    if ((fa.fd = open(file, O_RDONLY)) < 0)
+	die("open", ATOMIC_ERR_CANTOPEN);
+    run("commit_fd", S_BIGGEST, S_BIGGEST, op_commit_fd, &fa);
+    close(fa.fd);
+
+    /* Backups: 0 is a single .bak file */
+    path(ca.file, "backups");
+    ca.size = 4096;
+    commit(ca.file, s_data, ca.size, &opts);
+    for (i = 0; i < sizeof(rotates) / sizeof(rotates[0]); i++) {
+	ca.opts = opts;
+	ca.opts.mode = ATOMIC_WRITE;
+	ca.opts.backup_ext = rotates[i] ? "." : ".bak";
+	ca.opts.rotate = rotates[i];
+	run("backups", rotates[i], 0, op_commit, &ca);
+    }
+
+    /* Directories */
+    path(file, "dir");
+    {
+	atomic_dir *d;
+	if ((err = atomic_opendir(&d, file, &opts)) != ATOMIC_ERR_SUCCESS)
+	    die("atomic_opendir", err);
+	if ((err = atomic_commitdir(d)) != ATOMIC_ERR_SUCCESS)
+	    die("atomic_commitdir", err);
+    }
+    run("opendir", 0, 0, op_opendir, file);
+    run("commitdir", 0, 0, op_commitdir, file);
+}
+
+int
+main(int argc, char **argv)
+{
+    long writers[S_MAXLIST] = { 1, 4, 16, 64, 256 };
+    long readers[S_MAXLIST] = { 0 };
+    long sizes[S_MAXLIST] = { 4096 }, timeouts[S_MAXLIST] = { 0 };
+    int nwriters = 5, nreaders = 1, nsizes = 1, ntimeouts = 1;
+    int contention = 0;
+    long megabytes = 0;
+    int w, r, s, t, c;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "cpm:t:w:r:s:T:")) != -1) {
+	switch (c) {
+	    case 'c': contention = 1; break;
+	    case 'p': megabytes = 256; break;
+	    case 'm': megabytes = atol(optarg); break;
+	    case 't': s_mintime = atof(optarg); break;
+	    case 'w': nwriters = parse_list(optarg, writers); break;
+	    case 'r': nreaders = parse_list(optarg, readers); break;
+	    case 's': nsizes = parse_list(optarg, sizes); break;
+	    case 'T': ntimeouts = parse_list(optarg, timeouts); break;
+	    default:
+		fprintf(stderr, "usage: %s [-t seconds] [dir]\n"
+			"       %s -c [-w writers] [-r readers] [-s sizes] "
+			"[-T timeouts] [-t seconds] [dir]\n"
+			"       %s -p [-m megabytes] [dir]\n",
+			argv[0], argv[0], argv[0]);
+		return 2;
+	}
+    }
+    for (s = 0; s < nsizes; s++)
+	if (sizes[s] < 0 || sizes[s] > S_BIGGEST) {
+	    fprintf(stderr, "atomicbench: sizes go up to %d\n", S_BIGGEST);
+	    return 2;
+	}
+    if (optind < argc) {
+	snprintf(s_dir, sizeof(s_dir), "%s/atomicbench.%ld", argv[optind],
+		 (long)getpid());
+    }
+    else {
+	const char *tmp = getenv("TMPDIR");
+	snprintf(s_dir, sizeof(s_dir), "%s/atomicbench.%ld",
+		 tmp ? tmp : "/tmp", (long)getpid());
+    }
+    if (mkdir(s_dir, 0777) < 0) {
+	fprintf(stderr, "atomicbench: can't mkdir %s: %s\n", s_dir,
+		strerror(errno));
+	return 1;
+    }
+    atexit(cleanup);
+
+    if (!(s_data = malloc(S_BIGGEST)))
+	die("malloc", ATOMIC_ERR_NOMEM);
+    for (i = 0; i < S_BIGGEST; i++)
+	s_data[i] = (i % 80 == 79) ? '\n' : 'a' + i % 26;
+
+    if (megabytes > 0)
+	pollution(megabytes);
+    else if (!contention)
+	microbenchmarks();
+    else {
+	printf("writers,readers,size,timeout,commits,commits_per_s,"
+	       "reads_per_s,failures,lock_p50_us,lock_p99_us,lock_p999_us,"
+	       "commit_p50_us,commit_p99_us,commit_p999_us\n");
+	for (s = 0; s < nsizes; s++)
+	    for (t = 0; t < ntimeouts; t++)
+		for (r = 0; r < nreaders; r++)
+		    for (w = 0; w < nwriters; w++)
+			contend(writers[w], readers[r], sizes[s], timeouts[t]);
+    }
+
+    return 0;
+}
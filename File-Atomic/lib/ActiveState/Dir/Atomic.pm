@@ -76,6 +76,23 @@ A file containing the number of backups to keep before commit() overwrites
 backups.  When a directory is first created, this number is specified by the
 C<rotate> parameter.
 
+=item ROOT/.pin.1
+
+=item ROOT/.pin.2
+
+=item ROOT/.pin...
+
+Lock files, created as needed, by which readers pin() a subdirectory.
+
+=item ROOT/.manifest.1
+
+=item ROOT/.manifest.2
+
+=item ROOT/.manifest...
+
+Listings of the subdirectories' contents, written by commit() when the
+C<manifest> option is used, and read by diff().
+
 =back
 
 This package does I<not> abstract access to the actual directory -- use
@@ -120,7 +137,8 @@ not called.
 A number representing seconds.  Normally ActiveState::Dir::Atomic will wait
 forever trying to acquire a lock on the directory if C<writable> is true.  You
 can specify how long to wait with this option.  The constructor will croak
-if it times out waiting for the lock.
+if it times out waiting for the lock.  The same limit applies to waiting for
+a subdirectory to be unpinned; see scratch().
 
 =item rotate
 
@@ -129,6 +147,17 @@ number of backups to keep before commits overwrite old directories.  The
 default is 4.  If the directory exists, this number is read from a hidden file
 that ActiveState::Dir::Atomic saves when it creates directories.
 
+=item manifest
+
+A boolean.  If true, commit() records the path, type, mode, size and MD5
+of everything in the new current directory in F<ROOT/.manifest.N>, so that
+diff() can tell what changed between two generations without reading them.
+Only files that are new or have been modified since the previous commit
+are read: hard links made by clone() cost nothing.  A file counts as
+modified if its size or modification time has changed, so one that is
+rewritten in place with the same size, and has its modification time put
+back, is not seen to change.
+
 =back
 
 =item current()
@@ -146,6 +175,24 @@ The index is always an integer greater than 1.
 Returns the full path to the current subdirectory. This method consults the
 symbolic link each time it is called, to detect changes by other applications.
 
+=item pin()
+
+  my $index = $at->pin;
+  # ... read from "$dirname/$index" ...
+  $at->unpin;
+
+Pins the current subdirectory and returns its index.  Writers will not
+reuse a pinned subdirectory for their changes however many commits happen
+meanwhile, so readers that take a while over a generation of data don't
+need a large C<rotate> to be safe.  The pin lasts until unpin(), close(),
+another pin() or the object is destroyed.  Pins work between processes,
+and on systems with open file description locks (Linux) between objects in
+the same process too.
+
+=item unpin()
+
+Releases the pin taken by pin(), if any.
+
 =item scratch()
 
   my $scratch = $at->scratch;
@@ -153,6 +200,12 @@ symbolic link each time it is called, to detect changes by other applications.
 Returns the index of the directory that will become the current directory if
 commit() is called. This croaks if the directory was not opened for writing.
 
+The scratch directory is chosen on the first call to scratch(),
+scratchpath() or commit(): the next subdirectory in rotation that isn't
+current and isn't pinned.  If every subdirectory is pinned this waits for a
+pin to be released, for up to C<timeout> seconds if given, and croaks if
+none is.
+
 =item scratchpath()
 
   my $path = $at->scratchpath;
@@ -160,6 +213,68 @@ commit() is called. This croaks if the directory was not opened for writing.
 Returns the full path to the directory that will become the current directory
 if commit() is called. This croaks if the directory was not opened for writing.
 
+=item clone()
+
+  $at->clone;
+  $at->breaklink($at->scratchpath . "/data/index");
+  # ... rewrite data/index, add and remove files ...
+  $at->commit;
+
+Empties the scratch directory and fills it with a copy of the current
+subdirectory, made of hard links to the current files rather than copies,
+so publishing a new generation only costs as much as the files that change.
+Symbolic links and directories (with their modes) are recreated.  Both
+steps walk the tree with several threads; pass a number to choose how
+many.  This croaks if the directory was not opened for writing.
+
+Because the linked files are shared with the current generation, they must
+not be modified in place: replace them with a new file, or call
+breaklink() on them first.
+
+=item breaklink()
+
+  $at->breaklink($path);
+
+Gives C<$path> its own copy of its contents if it is a hard link, so it can
+be modified without changing the other names of the file.  The copy keeps
+the mode, times and (when running as root) owner, and shares blocks with
+the original where the filesystem supports it.  Does nothing for files
+with only one link.
+
+=item sync()
+
+  my $stats = $at->sync($build_dir);
+  printf "%d files, %d bytes\n", @$stats{qw(copied bytes)};
+  $at->commit;
+
+Makes the scratch directory a copy of the tree C<$build_dir>, copying only
+the files that are missing or differ and removing those C<$build_dir>
+doesn't have, with several threads.  Files are compared by size, mode and
+modification time, or by size, mode and contents if the second argument is
+true; a third argument chooses the number of threads.  Changed files are
+replaced rather than rewritten, so sync() can follow clone(), which makes
+the cost of a commit depend on how much changed rather than on the size of
+the tree.
+
+Returns a hash reference with the number of files C<copied> (symbolic links
+included), C<deleted> and left C<unchanged>, and the C<bytes> copied.  This
+croaks on failure or if the directory was not opened for writing.
+
+=item diff()
+
+  my $changes = $at->diff($from, $to);
+  for my $path (sort keys %$changes) {
+      print "$path was $changes->{$path}\n";
+  }
+
+Compares the manifests of subdirectories C<$from> and C<$to> (by default,
+the current subdirectory) and returns a hash reference mapping each path
+that differs, relative to the subdirectories, to C<added>, C<removed> or
+C<changed>.  Modification times and owners are not compared.  Readers can
+use this to invalidate only what changed when the current subdirectory
+moves on.  This croaks if either subdirectory was committed without the
+C<manifest> option, or by a version whose manifests held CRC-32Cs.
+
 =item version()
 
   my $version = $at->version;
@@ -184,6 +299,27 @@ The C<scan()> method normally returns the number of times the callback was
 invoked; however, if the callback is not provided, then C<scan()> returns the
 number of subdirectories.
 
+=item generations()
+
+  for my $g ($at->generations(1)) {
+      printf "%d %s %d bytes%s\n", $g->{index}, $g->{version} || "-",
+	  $g->{size}, $g->{pinned} ? " (pinned)" : "";
+  }
+
+Describes every subdirectory in one call, in the same order as scan(), and
+returns a list of hash references with these keys:
+
+  index     the subdirectory's number
+  current   true for the current subdirectory
+  pinned    true if a reader has pinned it (see pin())
+  mtime     the modification time of the subdirectory itself
+  version   its version string, or undef
+  size      the total size of its files, or undef
+
+The sizes are only computed if the argument is true, from the manifest if
+the subdirectory has one and by walking it otherwise.  Unlike scan(), this
+croaks if a subdirectory can't be read.
+
 =item commit()
 
   $at->commit;
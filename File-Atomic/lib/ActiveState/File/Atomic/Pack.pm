@@ -0,0 +1,108 @@
+package ActiveState::File::Atomic::Pack;
+
+use strict;
+use ActiveState::File::Atomic;
+
+1;
+
+__END__
+
+=head1 NAME
+
+ActiveState::File::Atomic::Pack - many small records in one atomic file
+
+=head1 SYNOPSIS
+
+  use ActiveState::File::Atomic::Pack;
+
+  my $pack = ActiveState::File::Atomic::Pack->new($filename,
+                                                  writable => 1,
+                                                  create => 1);
+  my $state = $pack->get("host42");
+  $pack->put("host42", $new_state);
+  $pack->delete("host17");
+  $pack->commit;
+
+  # Readers:
+  my $pack = ActiveState::File::Atomic::Pack->new($filename);
+  for my $key ($pack->keys) {
+      print "$key: ", $pack->get($key), "\n";
+  }
+
+=head1 DESCRIPTION
+
+Keeping thousands of small pieces of state in files of their own, each
+updated through ActiveState::File::Atomic, costs a lock file, a tempfile
+and a rename per update, and the directory operations soon dominate.  A
+pack keeps them as records, each a key and a value, in a single file that
+is updated as one ActiveState::File::Atomic file is: a batch of changes
+costs one lock and one commit, and readers see either all of a batch or
+none of it.
+
+The file holds an index of the records sorted by key, so get() is a
+binary search of the mapped file rather than a parse of it.  A commit
+rewrites the file, copying the records that didn't change straight from
+the old one.  See F<atomicfile/atomicpack.h> for the format.
+
+=over 4
+
+=item new()
+
+  my $pack = ActiveState::File::Atomic::Pack->new($filename, %opts);
+
+Opens and locks the file, and reads its index.  The options are those of
+ActiveState::File::Atomic->new(), so packs can be compressed, checksummed,
+published and backed up too.  An empty file is an empty pack.  Croaks as
+ActiveState::File::Atomic->new() does, and if the file is not a pack.
+
+=item get()
+
+  my $value = $pack->get($key);
+
+Returns the value of the record with the key C<$key> as last committed,
+or undef if there is none.  Changes made with put() and delete() are not
+seen until they are committed.
+
+=item keys()
+
+Returns the keys of all the records, in order.
+
+=item count()
+
+Returns the number of records.
+
+=item put()
+
+  $pack->put($key, $value);
+
+Adds or replaces the record with the key C<$key>.  Croaks if the pack was
+not opened writable.
+
+=item delete()
+
+  $pack->delete($key);
+
+Removes the record with the key C<$key>, if there is one.  Croaks if the
+pack was not opened writable.
+
+=item commit()
+
+Commits the changes made with put() and delete(), later changes to a key
+winning over earlier ones, and closes the pack.  Croaks on failure.
+
+=item close()
+
+Throws away any changes and closes the pack.  The destructor does this
+too.
+
+=back
+
+=head1 SEE ALSO
+
+L<ActiveState::File::Atomic>
+
+=head1 COPYRIGHT
+
+Copyright (C) 2004, ActiveState Corporation.  All Rights Reserved.
+
+=cut
@@ -0,0 +1,84 @@
+package ActiveState::File::Atomic::Snapshot;
+
+use strict;
+use ActiveState::File::Atomic;
+
+1;
+
+__END__
+
+=head1 NAME
+
+ActiveState::File::Atomic::Snapshot - read published files from shared memory
+
+=head1 SYNOPSIS
+
+  # The writer:
+  use ActiveState::File::Atomic;
+  my $at = ActiveState::File::Atomic->new($filename, writable => 1,
+                                          publish => 1);
+  $at->commit_string($config);
+
+  # The readers:
+  use ActiveState::File::Atomic::Snapshot;
+  my $snap = ActiveState::File::Atomic::Snapshot->new($filename);
+  my $config = parse($snap->slurp);
+  while (1) {
+      # ... work ...
+      $config = parse($snap->slurp) if $snap->changed;
+  }
+
+=head1 DESCRIPTION
+
+Every ActiveState::File::Atomic reader opens, maps and unmaps the file each
+time.  For files read thousands of times a second that adds up.  When the
+writers commit with the C<publish> option, the contents of each version are
+also copied into POSIX shared memory, along with a counter that says which
+version is current.  A Snapshot maps a version once and keeps it until a
+newer one is published, and finding out whether one has been costs a
+single load from memory.
+
+The file remains the source of truth.  Until something is published, after
+a commit without C<publish>, and if publishing fails, a Snapshot reads the
+file instead, as ActiveState::File::Atomic would.  The shared memory has
+the permissions of the file, less the write bits.
+
+The following methods are provided:
+
+=over 4
+
+=item new()
+
+  my $snap = ActiveState::File::Atomic::Snapshot->new($filename);
+
+Creates a reader for C<$filename>.  Nothing is read yet.  Croaks if the
+file does not exist.
+
+=item slurp()
+
+Returns the contents of the latest version: the published one if there is
+one, otherwise the file's.  Croaks if the file has to be read and can't
+be.
+
+=item changed()
+
+Returns true if slurp() would return a newer version than it did last
+time.  This is always true when the last slurp() read the file, so
+checking changed() is only cheap for published files.
+
+=item generation()
+
+Returns the number of the version last returned by slurp(), counting from
+1 for the first published, or 0 if it was read from the file.
+
+=back
+
+=head1 SEE ALSO
+
+L<ActiveState::File::Atomic>
+
+=head1 COPYRIGHT
+
+Copyright (C) 2004, ActiveState Corporation.  All Rights Reserved.
+
+=cut
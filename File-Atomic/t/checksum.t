@@ -0,0 +1,64 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+use ActiveState::File::Atomic;
+use File::Path;
+
+plan tests => 11;
+
+my $tmpdir = "checksum-$$";
+mkpath($tmpdir);
+END { rmtree($tmpdir) }
+
+my $f = "$tmpdir/data";
+my $contents = join("", map { "line $_\n" } 1 .. 1000);
+sub commit {
+    ActiveState::File::Atomic->new($f, writable => 1, create => 1,
+				   checksum => 1, @_[1..$#_])
+	->commit_string($_[0]);
+}
+sub slurp { ActiveState::File::Atomic->new($f)->slurp }
+
+# The trailer is added on commit and left out when reading.
+commit($contents);
+ok(-s $f, length($contents) + 20);
+ok(slurp(), $contents);
+{
+    my $at = ActiveState::File::Atomic->new($f);
+    my $got = "";
+    while (defined(my $l = $at->readline)) { $got .= $l }
+    ok($got, $contents);
+    $at = ActiveState::File::Atomic->new($f);
+    $got = "";
+    while (defined(my $b = $at->readblock(333))) { $got .= $b }
+    ok($got, $contents);
+}
+
+# Identical contents are still recognised by skip_unchanged.
+ok(commit($contents, skip_unchanged => 1), 0);
+
+# A damaged file is reported.
+{
+    open my $FH, "+<", $f or die "can't open $f: $!";
+    seek $FH, 100, 0;
+    print $FH "X";
+    close $FH;
+    ok(!eval { slurp(); 1 });
+    ok($@ =~ /Checksum mismatch/);
+    ok(!eval { ActiveState::File::Atomic->new($f)->readline; 1 });
+}
+
+# Committing again repairs it; plain commits have no trailer.
+commit("fixed\n");
+ok(slurp(), "fixed\n");
+ActiveState::File::Atomic->new($f, writable => 1)->commit_string("plain\n");
+ok(-s $f, 6);
+
+# Compressed files carry the checksum of the compressed bytes.
+if (eval { commit($contents, compress => 9); 1 }) {
+    ok(slurp(), $contents);
+}
+else {
+    skip("built without zlib", 1);
+}
@@ -0,0 +1,47 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+use ActiveState::File::Atomic;
+use File::Path;
+
+plan tests => 9;
+
+my $tmpdir = "chunks-$$";
+mkpath($tmpdir);
+END { rmtree($tmpdir) }
+
+sub mkfile {
+    my $f = "$tmpdir/" . shift;
+    open my $FILE, "> $f" or die "can't write $f: $!";
+    print $FILE @_;
+    close $FILE;
+    return $f;
+}
+
+# Pieces cover the file exactly and end on a record boundary.
+my $contents = join("", map { "record $_\n" x ($_ % 7 + 1) } 1 .. 5000);
+my $f = mkfile('lines', $contents);
+my $at = ActiveState::File::Atomic->new($f);
+my @chunks = $at->chunks(8);
+ok(scalar(@chunks), 8);
+ok(join("", map { $at->slice(@$_) } @chunks), $contents);
+ok(!grep { substr($at->slice(@$_), -1) ne "\n" } @chunks);
+my $pos = 0;
+ok(!grep { my $gap = $_->[0] != $pos; $pos += $_->[1]; $gap } @chunks);
+
+# Other delimiters; fewer records than pieces; a long first record.
+$f = mkfile('nul', "a\0bb\0ccc");
+@chunks = ActiveState::File::Atomic->new($f)->chunks(10, "\0");
+ok(join(";", map { "@$_" } @chunks), "0 2;2 3;5 3");
+$f = mkfile('long', ("x" x 1000) . "\ny\nz\n");
+@chunks = ActiveState::File::Atomic->new($f)->chunks(4);
+ok(join(";", map { "@$_" } @chunks), "0 1001;1001 4");
+
+# Empty files have no pieces; slice() clamps.
+$f = mkfile('empty', "");
+@chunks = ActiveState::File::Atomic->new($f)->chunks(4);
+ok(scalar(@chunks), 0);
+$f = mkfile('short', "abc");
+ok(ActiveState::File::Atomic->new($f)->slice(1, 10), "bc");
+ok(ActiveState::File::Atomic->new($f)->slice(5, 1), "");
@@ -0,0 +1,63 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+
+plan tests => 13;
+
+use ActiveState::Dir::Atomic;
+use File::Path;
+
+my $tmpdir = "clone-$$";
+END { rmtree($tmpdir) }
+
+sub writer { ActiveState::Dir::Atomic->new($tmpdir, writable => 1, @_) }
+sub spew { open(my $fh, ">", $_[0]) or die "can't write $_[0]: $!"; print $fh $_[1] }
+sub slurp { open(my $fh, "<", $_[0]) or die "can't read $_[0]: $!"; local $/; <$fh> }
+sub ino { (lstat $_[0])[1] }
+
+# Generation 1, with a few levels of directories and a symlink
+my $at = writer(create => 1, rotate => 3);
+my $s = $at->scratchpath;
+mkpath(["$s/a/b/c", "$s/ro"]);
+spew("$s/top", "top\n");
+spew("$s/a/b/c/deep", "deep\n");
+spew("$s/ro/file", "ro\n");
+chmod 0555, "$s/ro";
+symlink("a/b/c/deep", "$s/link") or die "can't symlink: $!";
+spew("$s/stale", "stale\n");	# left in slot 2 for the next round
+$at->commit;
+
+# Make slot 2 hold stale contents, then go back to generation 1
+$at = writer();
+mkpath([$at->scratchpath . "/junk/more"]);
+spew($at->scratchpath . "/junk/more/file", "junk\n");
+$at->commit;
+writer()->rollback(1);
+
+$at = writer();
+$s = $at->scratchpath;
+my $cur = $at->currentpath;
+ok($at->scratch, 2);
+$at->clone(2);
+ok(ino("$s/top"), ino("$cur/top"));
+ok(ino("$s/a/b/c/deep"), ino("$cur/a/b/c/deep"));
+ok(readlink("$s/link"), "a/b/c/deep");
+ok(!-e "$s/junk");
+ok((stat "$s/ro")[2] & 07777, 0555);
+ok(slurp("$s/ro/file"), "ro\n");
+
+# Breaking the link gives a private copy with the same contents and mode
+chmod 0640, "$cur/top";
+$at->breaklink("$s/top");
+ok(ino("$s/top") != ino("$cur/top"));
+ok(slurp("$s/top"), "top\n");
+ok((stat "$s/top")[2] & 07777, 0640);
+spew("$s/top", "changed\n");
+ok(slurp("$cur/top"), "top\n");
+$at->commit;
+
+$at = ActiveState::Dir::Atomic->new($tmpdir);
+ok($at->current, 2);
+ok(slurp($at->currentpath . "/top"), "changed\n");
+chmod 0755, map { "$tmpdir/$_/ro" } 1, 2;
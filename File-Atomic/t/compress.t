@@ -0,0 +1,113 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+use ActiveState::File::Atomic;
+use File::Path;
+
+my $tmpdir  = "compress-$$";
+my $tmpfile = "$tmpdir/foo";
+
+mkpath($tmpdir);
+END { rmtree($tmpdir) }
+
+if (!eval { ActiveState::File::Atomic->new($tmpfile, writable => 1,
+					   create => 1, compress => 1) }) {
+    print "1..0 # Skipped: built without zlib\n";
+    exit 0;
+}
+
+plan tests => 15;
+
+sub raw {
+    open(my $T, "<", $tmpfile) or die "can't open $tmpfile: $!";
+    binmode($T);
+    local $/;
+    return scalar <$T>;
+}
+
+my $text = join("", map "line $_ of a very compressible file\n", 1 .. 20000);
+
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile, writable => 1,
+					    create => 1, compress => 6);
+    $at->commit_string($text);
+    my $raw = raw();
+    ok(substr($raw, 0, 8), "\211AFZ\r\n\032\n");
+    ok(length($raw) < length($text) / 10);
+}
+
+# Readers don't need to know.
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile);
+    ok($at->slurp, $text);
+    $at = ActiveState::File::Atomic->new($tmpfile);
+    ok($at->readline, "line 1 of a very compressible file\n");
+    ok($at->readline, "line 2 of a very compressible file\n");
+    $at = ActiveState::File::Atomic->new($tmpfile);
+    my($blocks, $all) = (0, "");
+    while (defined(my $b = $at->readblock(65536))) {
+	$blocks++;
+	$all .= $b;
+    }
+    ok($all, $text);
+    ok($blocks, int((length($text) + 65535) / 65536));
+}
+
+# Streaming writes and commit_file().
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile, writable => 1,
+					    compress => 1);
+    eval { $at->tempfile };
+    ok($@, qr/^Operation not supported/);
+    $at->print("x" x 1000, "\n") for 1 .. 1000;
+    $at->commit_tempfile;
+    $at = ActiveState::File::Atomic->new($tmpfile);
+    ok($at->slurp, ("x" x 1000 . "\n") x 1000);
+
+    my $src = "$tmpdir/src";
+    open(my $S, ">", $src) or die "can't write $src: $!";
+    print $S $text;
+    close($S);
+    $at = ActiveState::File::Atomic->new($tmpfile, writable => 1,
+					 compress => 9);
+    $at->commit_file($src);
+    $at = ActiveState::File::Atomic->new($tmpfile);
+    ok($at->slurp, $text);
+
+    # skip_unchanged compares the uncompressed contents
+    $at = ActiveState::File::Atomic->new($tmpfile, writable => 1,
+					 compress => 9, skip_unchanged => 1);
+    ok($at->commit_file($src), 0);
+}
+
+# Empty contents, and going back to plain files.
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile, writable => 1,
+					    compress => 1);
+    $at->commit_string("");
+    $at = ActiveState::File::Atomic->new($tmpfile);
+    ok($at->slurp, "");
+    ok($at->readblock(10), undef);
+    $at = ActiveState::File::Atomic->new($tmpfile, writable => 1);
+    $at->commit_string("plain\n");
+    ok(raw(), "plain\n");
+}
+
+# Damaged files are reported.
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile, writable => 1,
+					    compress => 1);
+    $at->commit_string($text);
+    my $raw = raw();
+    substr($raw, 100, 50) = "\0" x 50;
+    open(my $T, ">", $tmpfile) or die;
+    binmode($T);
+    print $T $raw;
+    close($T);
+    $at = ActiveState::File::Atomic->new($tmpfile);
+    eval { $at->slurp };
+    ok($@, qr/^Corrupt file/);
+}
+
+# vim: ft=perl
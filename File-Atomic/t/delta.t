@@ -0,0 +1,78 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+use File::Path;
+
+plan tests => 21;
+
+use ActiveState::File::Atomic;
+
+my $dir = "delta-$$";
+mkpath($dir);
+END { rmtree($dir) }
+my $file = "$dir/file";
+
+sub commit {
+    my $at = ActiveState::File::Atomic->new($file, writable => 1,
+					    create => 1, @_);
+    $at->commit_string(pop @_);
+}
+
+# Versions of a large file, each changing a little of the last
+commit("");
+my @versions;
+my $text = join("", map { "record $_: " . ("abc" x ($_ % 40)) . "\n" } 1 .. 20000);
+for my $v (0 .. 6) {
+    substr($text, 1000 * $v + 7, 5) = "v$v-xx";	# changed in place
+    $text = "inserted $v\n$text" if $v % 2;		# everything moves
+    push @versions, $text;
+    commit(rotate => 4, delta => 1, $text);
+}
+
+my $at = ActiveState::File::Atomic->new($file, rotate => 4);
+ok($at->slurp eq $versions[6]);
+ok($at->backup eq $versions[5]);
+ok($at->backup(1) eq $versions[5]);
+ok($at->backup(2) eq $versions[4]);
+ok($at->backup(4) eq $versions[2]);
+ok(!defined $at->backup(5));
+ok(!defined $at->backup(0));
+
+# Only the first backup is whole
+ok(-s "$file.1", length $versions[5]);
+ok(-s "$file.2" < length($versions[4]) / 100);
+ok(-s "$file.4" < length($versions[2]) / 100);
+
+# Whole backups from before mix with deltas; unrelated contents stay whole
+rmtree($dir);
+mkpath($dir);
+my $base = join("", map { "line $_\n" } 1 .. 2000);
+my @v = map { "$base$_\n" } 1 .. 4;
+commit("");
+commit(rotate => 3, $_) for @v[0 .. 2];
+commit(rotate => 3, delta => 1, $v[3]);
+$at = ActiveState::File::Atomic->new($file, rotate => 3);
+ok($at->backup(1) eq $v[2]);
+ok($at->backup(2) eq $v[1]);
+ok($at->backup(3) eq $v[0]);
+ok(-s "$file.2" < 100);
+ok(-s "$file.3", length $v[0]);
+commit(rotate => 3, delta => 1, $_) for "\0\1\2", "again\n";
+ok(-s "$file.2", length $v[3]);
+ok(ActiveState::File::Atomic->new($file, rotate => 3)->backup(3) eq $v[2]);
+
+# A damaged delta is noticed
+open(my $fh, "+<", "$file.3") or die "can't open $file.3: $!";
+seek($fh, 40, 0);
+print $fh "X";
+close($fh);
+$at = ActiveState::File::Atomic->new($file, rotate => 3);
+ok(!eval { $at->backup(3); 1 });
+ok($@ =~ /^Corrupt file/);
+ok($at->backup(2) eq $v[3]);
+
+# A plain backup is backup 1
+commit(backup_ext => ".bak", "new\n");
+ok(ActiveState::File::Atomic->new($file, backup_ext => ".bak")->backup,
+   "again\n");
@@ -3,7 +3,7 @@
 use strict;
 use Test;
 
-plan tests => 21;
+plan tests => 28;
 
 use ActiveState::Dir::Atomic;
 use File::Path;
@@ -102,4 +102,24 @@ ok($fd2, $fd1);
     ok(!-f "$path/foo");
 }
 
+# Describe all the subdirectories at once
+{
+    my $reader = ActiveState::Dir::Atomic->new($tmpdir);
+    $reader->pin;
+    my $at = ActiveState::Dir::Atomic->new($tmpdir);
+    my @g = $at->generations(1);
+    ok(join(",", map { $_->{index} } @g), "1,2,3");
+    ok($g[0]{current} && !$g[1]{current} && !$g[2]{current});
+    ok($g[0]{pinned} && !$g[1]{pinned});
+    ok($g[0]{size}, 0);
+    ok($g[1]{size}, length("$$\n"));
+    my @nosizes = $at->generations;
+    ok(!defined $nosizes[1]{size} && !defined $g[1]{version});
+}
+{
+    my $at = ActiveState::Dir::Atomic->new($tmpdir, writable => 1);
+    $at->commit("v3");
+    ok((ActiveState::Dir::Atomic->new($tmpdir)->generations)[0]{version}, "v3");
+}
+
 # vim: ft=perl
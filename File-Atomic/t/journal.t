@@ -0,0 +1,95 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+use ActiveState::File::Atomic;
+use File::Path;
+use POSIX ();
+
+plan tests => 15;
+
+my $tmpdir = "journal-$$";
+mkpath($tmpdir);
+END { rmtree($tmpdir) }
+
+my $f = "$tmpdir/log";
+my $jnl = "$tmpdir/.log.jnl";
+sub slurp { ActiveState::File::Atomic->new($f)->slurp }
+sub append {
+    ActiveState::File::Atomic->new($f, writable => 1, create => 1, @_[1..$#_])
+	->append($_[0]);
+}
+
+# The first append creates the file; later ones go to the journal.
+append("one\n");
+ok(-s $f, 4);
+ok(!-e $jnl);
+my $ino = (stat $f)[1];
+append("two\n");
+append("three\n");
+ok(slurp(), "one\ntwo\nthree\n");
+ok((stat $f)[1], $ino);
+ok(-s $f, 4);
+
+# readline() and writers' slurp() see the journal too.
+{
+    my $at = ActiveState::File::Atomic->new($f);
+    my @lines;
+    while (defined(my $l = $at->readline)) { push @lines, $l }
+    ok(join("", @lines), "one\ntwo\nthree\n");
+}
+
+# A torn record at the end is ignored, and overwritten by the next append.
+{
+    open my $J, ">>", $jnl or die "can't append to $jnl: $!";
+    print $J "\x20\0\0\0junk";
+    close $J;
+    ok(slurp(), "one\ntwo\nthree\n");
+    append("four\n");
+    ok(slurp(), "one\ntwo\nthree\nfour\n");
+}
+
+# compact() folds the journal in and removes it.
+{
+    ActiveState::File::Atomic->new($f, writable => 1, backup_ext => ".bak")
+	->compact;
+    ok(!-e $jnl);
+    ok(slurp(), "one\ntwo\nthree\nfour\n");
+    ok(-s "$f.bak", 4);
+}
+
+# A commit obsoletes the journal.
+{
+    append("five\n");
+    ActiveState::File::Atomic->new($f, writable => 1)->commit_string("new\n");
+    ok(slurp(), "new\n");
+}
+
+# A reader keeps the journal it opened with, though a compaction removes it
+# before the reader gets to it.
+{
+    append("six\n");
+    my $at = ActiveState::File::Atomic->new($f);
+    ActiveState::File::Atomic->new($f, writable => 1)->compact;
+    ok($at->slurp, "new\nsix\n");
+}
+
+# Concurrent appenders, with automatic compaction along the way.
+{
+    my $rec = "x" x 1000;
+    my @pids;
+    for my $w (1 .. 4) {
+	my $pid = fork;
+	die "can't fork: $!" unless defined $pid;
+	unless ($pid) {
+	    append("$w$rec\n") for 1 .. 50;
+	    POSIX::_exit(0);
+	}
+	push @pids, $pid;
+    }
+    waitpid($_, 0) for @pids;
+    my %seen;
+    $seen{substr($_, 0, 1)}++ for grep { length == 1002 } split /^/, slurp();
+    ok(join(",", map { $seen{$_} } 1 .. 4), "50,50,50,50");
+    ok(-s $f > 4 * 50 * 1002 / 3);
+}
@@ -0,0 +1,85 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+use ActiveState::File::Atomic;
+use File::Path;
+
+plan tests => 18;
+
+my $tmpdir  = "layer-$$";
+my $tmpfile = "$tmpdir/foo";
+my $glob    = "$tmpdir/{.,}foo*";
+
+mkpath($tmpdir);
+END { rmtree($tmpdir) }
+
+sub contents {
+    open(my $T, "<", $tmpfile) or die "can't open $tmpfile: $!";
+    local $/;
+    return scalar <$T>;
+}
+
+# Nothing shows up until close().
+{
+    ok(open(my $fh, ">:atomic", $tmpfile));
+    print $fh "line $_\n" for 1 .. 1000;
+    ok(!-e $tmpfile);
+    ok(tell($fh), length(join("", map "line $_\n", 1 .. 1000)));
+    ok(close($fh));
+    ok(contents(), join("", map "line $_\n", 1 .. 1000));
+}
+
+# Append mode starts from the original; options are passed as arguments.
+{
+    ok(open(my $fh, ">>:atomic(rotate=2)", $tmpfile));
+    print $fh "more\n";
+    ok(close($fh));
+    ok(contents(), join("", map "line $_\n", 1 .. 1000) . "more\n");
+    ok(-e "$tmpfile.1");
+}
+
+# Changes can be abandoned before close().
+{
+    open(my $fh, ">:atomic", $tmpfile) or die "can't open $tmpfile: $!";
+    print $fh "lost\n";
+    ActiveState::File::Atomic::abandon($fh);
+    ok(@{[glob($glob)]}, 2); # foo and foo.1
+    close($fh);
+    ok(contents() =~ /more\n\z/);
+}
+
+# Only close() commits: a die() or going out of scope throws changes away.
+{
+    my $before = contents();
+    ok(!eval {
+	open(my $fh, ">:atomic", $tmpfile) or die "can't open $tmpfile: $!";
+	print $fh "partial\n";
+	die "oops\n";
+    });
+    ok(contents(), $before);
+    {
+	open(my $fh, ">:atomic", $tmpfile) or die "can't open $tmpfile: $!";
+	print $fh "dropped\n";
+    }
+    ok(contents(), $before);
+}
+
+# skip_unchanged leaves an identical original and its backups alone.
+{
+    my $ino = (stat $tmpfile)[1];
+    my $before = contents();
+    open(my $fh, ">:atomic(skip_unchanged=1,rotate=3)", $tmpfile)
+	or die "can't open $tmpfile: $!";
+    print $fh $before;
+    ok(close($fh));
+    ok((stat $tmpfile)[1], $ino);
+    ok(!-e "$tmpfile.2");
+}
+
+# Reading isn't supported.
+{
+    ok(!open(my $fh, "<:atomic", $tmpfile));
+}
+
+# vim: ft=perl
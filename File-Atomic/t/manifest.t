@@ -0,0 +1,82 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+
+plan tests => 12;
+
+use ActiveState::Dir::Atomic;
+use File::Path;
+
+my $tmpdir = "manifest-$$";
+END { rmtree($tmpdir) }
+
+sub writer { ActiveState::Dir::Atomic->new($tmpdir, writable => 1, @_) }
+sub spew { open(my $fh, ">", $_[0]) or die "can't write $_[0]: $!"; print $fh $_[1] }
+
+my $at = writer(create => 1, rotate => 4, manifest => 1);
+my $s = $at->scratchpath;
+mkpath("$s/a/b");
+spew("$s/keep", "keep\n");
+spew("$s/change", "before\n");
+spew("$s/remove", "remove\n");
+spew("$s/a/b/mode", "mode\n");
+symlink("keep", "$s/link") or die "can't symlink: $!";
+$at->commit("v1");
+ok(-f "$tmpdir/.manifest.1");
+
+$at = writer(manifest => 1);
+$at->clone;
+$s = $at->scratchpath;
+$at->breaklink("$s/change");
+spew("$s/change", "after!\n");		# same size
+unlink("$s/remove", "$s/link");
+symlink("change", "$s/link") or die "can't symlink: $!";
+$at->breaklink("$s/a/b/mode");
+chmod 0600, "$s/a/b/mode";
+spew("$s/a/new", "new\n");
+$at->commit("v2");
+
+my $d = ActiveState::Dir::Atomic->new($tmpdir)->diff(1);
+ok(join(",", map { "$_=$d->{$_}" } sort keys %$d),
+   "a/b/mode=changed,a/new=added,change=changed,link=changed,remove=removed");
+
+$d = ActiveState::Dir::Atomic->new($tmpdir)->diff(2, 1);
+ok($d->{"a/new"}, "removed");
+ok($d->{remove}, "added");
+ok(keys %{ ActiveState::Dir::Atomic->new($tmpdir)->diff(2) }, 0);
+
+# Nothing changed, only a commit
+$at = writer(manifest => 1);
+$at->clone;
+$at->commit;
+ok(keys %{ ActiveState::Dir::Atomic->new($tmpdir)->diff(2, 3) }, 0);
+
+# Committing without the option removes the stale manifest of the slot
+$at = writer();
+$at->clone;
+$at->commit;
+ok(!-e "$tmpdir/.manifest.4");
+eval { ActiveState::Dir::Atomic->new($tmpdir)->diff(3) };
+ok($@ =~ /manifest|open/i);
+
+$at = writer(manifest => 1);
+ok($at->scratch, 1);
+$at->clone;
+$at->commit;
+ok(-f "$tmpdir/.manifest.1");
+
+# A damaged manifest is detected
+open(my $fh, "+<", "$tmpdir/.manifest.1") or die;
+seek($fh, 20, 0);
+print $fh "X";
+close($fh);
+eval { ActiveState::Dir::Atomic->new($tmpdir)->diff(3, 1) };
+ok($@ =~ /corrupt/i);
+
+# One of CRC-32Cs, as older versions wrote, is as good as none
+open($fh, "+<", "$tmpdir/.manifest.1") or die;
+print $fh "\211AFM\r\n\032\n";
+close($fh);
+eval { ActiveState::Dir::Atomic->new($tmpdir)->diff(3, 1) };
+ok($@ =~ /manifest|open/i && $@ !~ /corrupt/i);
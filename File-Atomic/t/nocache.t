@@ -0,0 +1,54 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+
+plan tests => 8;
+
+use ActiveState::File::Atomic;
+
+my $file = "nocache-$$";
+my $src = "nocache-src-$$";
+END { unlink($file, $src) }
+
+# Bigger than a few write buffers and read windows, and not a multiple
+# of the page size, so both the aligned and the tail paths are taken.
+my $data = join("", map { "line $_ " . ("x" x ($_ % 97)) . "\n" } 1 .. 300000);
+open(my $fh, ">", $src) or die "can't write $src: $!";
+print $fh $data;
+close($fh) or die "can't write $src: $!";
+ok(length($data) > 16 * 1024 * 1024 && length($data) % 4096);
+
+my $at = ActiveState::File::Atomic->new($file, writable => 1, create => 1,
+					nocache => 1);
+ok($at->commit_file($src));
+ok(-s $file, length($data));
+ok(ActiveState::File::Atomic->new($file)->slurp eq $data);
+
+# Streaming reads see the whole file
+$at = ActiveState::File::Atomic->new($file, nocache => 1);
+my $got = "";
+while (defined(my $block = $at->readblock(65536))) {
+    $got .= $block;
+}
+ok($got eq $data);
+
+$at = ActiveState::File::Atomic->new($file, nocache => 1);
+my $lines = 0;
+++$lines while defined $at->readline;
+ok($lines, 300000);
+undef $at;
+
+# Buffered writes and checksums
+$at = ActiveState::File::Atomic->new($file, writable => 1, nocache => 1,
+				     checksum => 1);
+$at->print(substr($data, 0, 1000));
+$at->write(substr($data, 1000));
+$at->commit_tempfile;
+ok(ActiveState::File::Atomic->new($file)->slurp eq $data);
+
+# commit_fd() after some buffered output starts unaligned
+$at = ActiveState::File::Atomic->new($file, writable => 1, nocache => 1);
+$at->print("head\n");
+ok($at->commit_file($src)
+   && ActiveState::File::Atomic->new($file)->slurp eq "head\n$data");
@@ -0,0 +1,68 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+
+plan tests => 19;
+
+use ActiveState::File::Atomic;
+use ActiveState::File::Atomic::Pack;
+
+my $file = "pack-$$";
+END { unlink($file) }
+
+sub pack_rw { ActiveState::File::Atomic::Pack->new($file, writable => 1, @_) }
+
+# A new file is an empty pack
+my $pack = pack_rw(create => 1);
+ok($pack->count, 0);
+ok(!defined $pack->get("x"));
+$pack->put("b", "two");
+$pack->put("a", "one");
+$pack->put("c", "");
+$pack->put("b", "TWO");		# later changes win
+ok(!defined $pack->get("a"));	# not committed yet
+$pack->commit;
+ok(!eval { $pack->get("a"); 1 });
+
+$pack = ActiveState::File::Atomic::Pack->new($file);
+ok(join(",", $pack->keys), "a,b,c");
+ok($pack->get("a"), "one");
+ok($pack->get("b"), "TWO");
+ok($pack->get("c"), "");
+ok(!defined $pack->get("ab"));
+ok(!eval { $pack->put("d", 4); 1 });
+undef $pack;
+
+# Many records, keys with binary data and prefixes of each other
+$pack = pack_rw();
+$pack->put("key$_", "value $_") for 1 .. 2000;
+$pack->put("k\0ey", "nul");
+$pack->put("k", "short");
+$pack->delete("a");
+$pack->delete("nonexistent");
+$pack->commit;
+
+$pack = pack_rw();
+ok($pack->count, 2000 + 2 + 2);
+ok($pack->get("key1234"), "value 1234");
+ok($pack->get("k\0ey"), "nul");
+ok($pack->get("k"), "short");
+ok(!defined $pack->get("a"));
+my @keys = $pack->keys;
+ok(join("\n", @keys), join("\n", sort @keys));
+
+# Deleting and putting back a key in one batch leaves it
+$pack->delete("b");
+$pack->put("b", "back");
+$pack->put("c", "gone");
+$pack->delete("c");
+$pack->commit;
+$pack = ActiveState::File::Atomic::Pack->new($file);
+ok($pack->get("b"), "back");
+ok(!defined $pack->get("c"));
+
+# Anything else is not a pack
+ActiveState::File::Atomic->new($file, writable => 1)
+    ->commit_string("not a pack");
+ok(!eval { ActiveState::File::Atomic::Pack->new($file); 1 });
@@ -0,0 +1,84 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+
+plan tests => 13;
+
+use ActiveState::Dir::Atomic;
+use File::Path;
+use IO::Handle;
+use POSIX ();
+
+my $tmpdir = "pin-$$";
+END { rmtree($tmpdir) }
+
+sub writer { ActiveState::Dir::Atomic->new($tmpdir, writable => 1, @_) }
+
+writer(create => 1, rotate => 3)->commit;
+ok(ActiveState::Dir::Atomic->new($tmpdir)->current, 1);
+
+# A reader in another process pins generation 1 and holds it until we
+# close the pipe.
+pipe(my $R, my $W) or die "can't pipe: $!";
+pipe(my $R2, my $W2) or die "can't pipe: $!";
+my $pid = fork;
+die "can't fork: $!" unless defined $pid;
+unless ($pid) {
+    close $W;
+    close $R2;
+    my $at = ActiveState::Dir::Atomic->new($tmpdir);
+    print $W2 $at->pin, "\n";
+    close $W2;
+    <$R>;
+    POSIX::_exit(0);
+}
+close $R;
+close $W2;
+chomp(my $pinned = <$R2>);
+ok($pinned, 1);
+
+# Writers go round it.
+writer()->commit;
+my $r2 = ActiveState::Dir::Atomic->new($tmpdir);
+ok($r2->pin, 2);
+my $w = writer();
+ok($w->scratch, 3);
+$w->commit;
+
+# With everything else pinned, there is no scratch directory.
+$w = writer(timeout => 1);
+ok(!eval { $w->scratch; 1 });
+ok($@ =~ /^No unpinned subdirectory/);
+ok(!eval { $w->commit; 1 });
+undef $w;
+
+# Releasing a pin frees the generation.
+$r2->unpin;
+$w = writer();
+ok($w->scratch, 2);
+undef $w;
+close $W;
+waitpid($pid, 0);
+$w = writer();
+ok($w->scratch, 1);
+$w->commit;
+ok(ActiveState::Dir::Atomic->new($tmpdir)->current, 1);
+
+# A pin file that can't be used is an error straight away, not a wait for
+# a lock that no one holds.
+unlink("$tmpdir/.pin.2");
+mkdir("$tmpdir/.pin.2") or die "can't mkdir: $!";
+$w = writer();
+ok(!eval { $w->scratch; 1 });
+ok($@ =~ /^Can't lock/);
+undef $w;
+rmdir("$tmpdir/.pin.2");
+skip($> == 0 ? "root can create the pin file anyway" : 0, sub {
+    unlink("$tmpdir/.pin.1");
+    chmod(0555, $tmpdir);
+    my $ok = !eval { ActiveState::Dir::Atomic->new($tmpdir)->pin; 1 }
+	&& $@ =~ /^Can't lock/;
+    chmod(0755, $tmpdir);
+    $ok;
+});
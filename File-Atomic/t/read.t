@@ -5,7 +5,7 @@ use ActiveState::File::Atomic;
 use File::Path;
 use Test;
 
-plan tests => 6;
+plan tests => 12;
 
 my $tmpdir  = "errors-$$";
 sub mkfile {
@@ -65,5 +65,22 @@ $f = mkfile('foobar', undef, "");
     ok($at->slurp, "");
 }
 
+# Read hints only change how the file is paged in. The file spans a few
+# prefetch windows so that sequential reads move the window along.
+my $big = join("", map { sprintf("%07d\n", $_) } 1 .. 600_000);
+$f = mkfile('big', undef, $big);
+for my $hint (qw(sequential random willneed populate hugepage)) {
+    my $at = ActiveState::File::Atomic->new($f, readhint => $hint);
+    my $got = "";
+    if ($hint eq 'sequential') {
+	while (defined(my $l = $at->readline)) { $got .= $l }
+    }
+    else {
+	$got = $at->slurp;
+    }
+    ok($got eq $big);
+}
+ok(!eval { ActiveState::File::Atomic->new($f, readhint => 'bogus') });
+
 
 # vim: ft=perl
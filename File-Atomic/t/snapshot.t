@@ -0,0 +1,118 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+
+plan tests => 19;
+
+use ActiveState::File::Atomic;
+use ActiveState::File::Atomic::Snapshot;
+use Cwd qw(abs_path);
+use File::Path;
+use POSIX ();
+
+my $file = "snapshot-$$";
+END {
+    ActiveState::File::Atomic->unpublish($file) if -e $file;
+    unlink($file);
+}
+
+sub commit {
+    my($data, @opts) = @_;
+    ActiveState::File::Atomic->new($file, writable => 1, create => 1, @opts)
+	->commit_string($data);
+}
+
+# Nothing published yet: the file is read
+commit("cold");
+my $snap = ActiveState::File::Atomic::Snapshot->new($file);
+ok($snap->slurp, "cold");
+ok($snap->generation, 0);
+ok($snap->changed);
+
+# Published versions are mapped once each
+commit("one", publish => 1);
+ok($snap->slurp, "one");
+my $gen = $snap->generation;
+ok($gen > 0);
+ok(!$snap->changed);
+ok($snap->slurp, "one");
+
+commit("two" x 1000, publish => 1);
+ok($snap->changed);
+ok($snap->slurp, "two" x 1000);
+ok($snap->generation, $gen + 1);
+
+# Appends publish too
+ActiveState::File::Atomic->new($file, writable => 1, publish => 1)
+    ->append("!");
+ok($snap->slurp, "two" x 1000 . "!");
+
+# A commit without 'publish' withdraws the snapshot
+commit("three");
+ok($snap->changed);
+ok($snap->slurp, "three");
+ok($snap->generation, 0);
+
+# A second reader sees the same, and the empty file is fine too
+commit("", publish => 1);
+ok(ActiveState::File::Atomic::Snapshot->new($file)->slurp, "");
+
+# Once unpublished, the file is read again
+ActiveState::File::Atomic->unpublish($file);
+unlink($file);
+ok(!eval { ActiveState::File::Atomic::Snapshot->new($file); 1 });
+commit("back");
+ok(ActiveState::File::Atomic::Snapshot->new($file)->slurp, "back");
+
+# A header that others could write to is ignored by readers and writers.
+sub header {
+    my $path = abs_path(shift);
+    for my $h (grep { !/\.\d+$/ } glob("/dev/shm/atomicfile.*")) {
+	open(my $fh, "<", $h) or next;
+	local $/;
+	return $h if index(<$fh>, "$path\0") >= 0;
+    }
+    return undef;
+}
+commit("four", publish => 1);
+my $header = header($file);
+skip(!$header ? "no /dev/shm" : 0, sub {
+    chmod(0666, $header);
+    my $s = ActiveState::File::Atomic::Snapshot->new($file);
+    my $ok = $s->slurp eq "four" && $s->generation == 0;
+    commit("five", publish => 1);
+    $ok &&= $s->slurp eq "five" && $s->generation == 0;
+    chmod(0644, $header);
+    $ok;
+});
+
+# A writer that can't withdraw a snapshot says so, after committing.
+skip($> != 0 || !$header ? "needs root and /dev/shm" : 0, sub {
+    my $dir = "snapshot-$$.d";
+    mkpath($dir);
+    chmod(0777, $dir);
+    my $f = "$dir/f";
+    my $uid = getpwnam("nobody");
+    ActiveState::File::Atomic->new($f, writable => 1, create => 1)
+	->commit_string("root");
+    chown($uid, -1, $f);
+    ActiveState::File::Atomic->new($f, writable => 1, publish => 1)
+	->commit_string("published");
+    my $pid = fork;
+    die "can't fork: $!" unless defined $pid;
+    unless ($pid) {
+	POSIX::setuid($uid) or POSIX::_exit(2);
+	my $ok = !eval {
+	    ActiveState::File::Atomic->new($f, writable => 1)
+		->commit_string("mine");
+	    1;
+	} && $@ =~ /can't withdraw its published snapshot/;
+	POSIX::_exit($ok ? 0 : 1);
+    }
+    waitpid($pid, 0);
+    my $ok = $? == 0;
+    ActiveState::File::Atomic->unpublish($f);
+    rmtree($dir);
+    $ok;
+});
@@ -0,0 +1,49 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+
+plan tests => 13;
+
+use ActiveState::File::Atomic;
+
+my $file = "stats-$$";
+END { unlink($file, "$file.bak") }
+
+ActiveState::File::Atomic->stats(1);
+my $stats = ActiveState::File::Atomic->stats;
+ok($stats->{locks}, 0);
+ok($stats->{lock_wait}{count}, 0);
+
+for my $i (1 .. 3) {
+    my $at = ActiveState::File::Atomic->new($file, writable => 1, create => 1,
+					    $i > 1 ? (backup_ext => ".bak") : ());
+    $at->commit_string("x" x (100 * $i));
+}
+ActiveState::File::Atomic->new($file)->slurp;
+
+$stats = ActiveState::File::Atomic->stats(1);
+ok($stats->{locks}, 3);
+ok($stats->{commits}, 3);
+ok($stats->{commit_bytes}, 600);
+ok($stats->{maps} >= 1);
+ok($stats->{rename}{count}, 3);
+my $h = $stats->{lock_wait};
+my $sum = 0;
+$sum += $_ for @{ $h->{histogram} };
+ok($sum, 3);
+ok($h->{max_us} <= $h->{total_us});
+
+# A lock file left behind by a dead process is recovered from
+open(my $fh, ">", ".$file.lck") or die "can't write .$file.lck: $!";
+close($fh);
+ActiveState::File::Atomic->new($file, writable => 1)->close;
+ok(ActiveState::File::Atomic->stats->{stale_locks}, 1);
+
+# Counting the pages that weren't in memory is opt-in.
+ActiveState::File::Atomic->stats(1);
+ActiveState::File::Atomic->new($file)->slurp;
+ok(ActiveState::File::Atomic->stats->{map_nonresident_pages}, 0);
+ok(!ActiveState::File::Atomic->stats_residency(1));
+ActiveState::File::Atomic->new($file)->slurp;
+ok(ActiveState::File::Atomic->stats_residency(0));
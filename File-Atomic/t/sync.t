@@ -0,0 +1,70 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+
+plan tests => 16;
+
+use ActiveState::Dir::Atomic;
+use File::Path;
+
+my $tmpdir = "sync-$$";
+my $src = "syncsrc-$$";
+END { rmtree([$tmpdir, $src]) }
+
+sub writer { ActiveState::Dir::Atomic->new($tmpdir, writable => 1, @_) }
+sub spew { open(my $fh, ">", $_[0]) or die "can't write $_[0]: $!"; print $fh $_[1] }
+sub slurp { open(my $fh, "<", $_[0]) or die "can't read $_[0]: $!"; local $/; <$fh> }
+sub ino { (lstat $_[0])[1] }
+
+mkpath(["$src/a/b", "$src/gone/deeper"]);
+spew("$src/top", "top\n");
+spew("$src/a/b/deep", "deep\n");
+spew("$src/gone/deeper/file", "doomed\n");
+symlink("a/b/deep", "$src/link") or die "can't symlink: $!";
+chmod 0600, "$src/top";
+
+# Into an empty scratch directory everything is copied
+my $at = writer(create => 1, rotate => 3);
+my $stats = $at->sync($src);
+ok($stats->{copied}, 4);
+ok($stats->{bytes}, 4 + 5 + 7);
+ok(slurp($at->scratchpath . "/a/b/deep"), "deep\n");
+ok(readlink($at->scratchpath . "/link"), "a/b/deep");
+ok((stat($at->scratchpath . "/top"))[2] & 07777, 0600);
+$at->commit;
+
+# Change one file, remove a subtree, turn a file into a directory
+spew("$src/a/b/deep", "deeper\n");
+rmtree("$src/gone");
+unlink("$src/top");
+mkdir("$src/top") or die;
+spew("$src/top/file", "file\n");
+
+$at = writer();
+$at->clone;
+my $cur = $at->currentpath;
+my $s = $at->scratchpath;
+$stats = $at->sync($src, 0, 2);
+ok($stats->{copied}, 2);
+ok($stats->{deleted}, 2);
+ok($stats->{unchanged}, 1);
+ok(!-e "$s/gone");
+ok(slurp("$s/top/file"), "file\n");
+ok(slurp("$s/a/b/deep"), "deeper\n");
+ok(slurp("$cur/a/b/deep"), "deep\n");	# the clone wasn't modified
+$at->commit;
+
+# Same size and time but different contents: only a content compare notices
+$at = writer();
+$at->sync($src);
+my $file = $at->scratchpath . "/a/b/deep";
+spew("$src/a/b/deep", "DEEPER\n");
+utime(1e9, 1e9, "$src/a/b/deep", $file);
+ok($at->sync($src)->{copied}, 0);
+ok($at->sync($src, 1)->{copied}, 1);
+ok(slurp($file), "DEEPER\n");
+$at->commit;
+
+eval { ActiveState::Dir::Atomic->new($tmpdir)->sync($src) };
+ok($@ ne "");
@@ -0,0 +1,113 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+use ActiveState::File::Atomic;
+use File::Path;
+
+plan tests => 18;
+
+my $tmpdir  = "unchanged-$$";
+sub mkfile {
+    my $basename = shift;
+    my $callback = shift;
+    my $f = "$tmpdir/$basename";
+    open my $FILE, "> $f" or die "can't write $f: $!";
+    print $FILE @_;
+    close $FILE;
+    &$callback($f) if $callback;
+    return $f;
+}
+sub lstmp {
+    opendir(my $DIR, $tmpdir) or die "can't opendir $tmpdir: $!";
+    return my @files = sort grep { $_ !~ /^\.\.?$/ } readdir($DIR);
+}
+
+mkpath($tmpdir);
+END { rmtree($tmpdir) }
+
+my $f = mkfile('conf', undef, "a = 1\n");
+my $ino = (stat $f)[1];
+
+# Identical content is not committed, and no backup is made.
+{
+    my $at = ActiveState::File::Atomic->new($f, writable => 1, rotate => 3,
+					    skip_unchanged => 1);
+    ok($at->commit_string("a = 1\n"), 0);
+    ok((stat $f)[1], $ino);
+    ok(join(",", lstmp()), "conf");
+}
+
+# Same via commit_file().
+{
+    my $src = mkfile('src', undef, "a = 1\n");
+    my $at = ActiveState::File::Atomic->new($f, writable => 1, rotate => 3,
+					    skip_unchanged => 1);
+    ok($at->commit_file($src), 0);
+    ok((stat $f)[1], $ino);
+    unlink $src;
+}
+
+# Different content (same size, then a longer one) is committed.
+{
+    my $at = ActiveState::File::Atomic->new($f, writable => 1, rotate => 3,
+					    skip_unchanged => 1);
+    ok($at->commit_string("a = 2\n"), 1);
+    ok((stat $f)[1] != $ino);
+    ok(join(",", lstmp()), "conf,conf.1");
+}
+{
+    my $src = mkfile('src', undef, "a = 2\nb = 3\n");
+    my $at = ActiveState::File::Atomic->new($f, writable => 1,
+					    skip_unchanged => 1);
+    ok($at->commit_file($src), 1);
+    unlink $src;
+    $at = ActiveState::File::Atomic->new($f);
+    ok($at->slurp, "a = 2\nb = 3\n");
+}
+
+# Without the option, identical content is committed as before.
+{
+    my $at = ActiveState::File::Atomic->new($f, writable => 1);
+    ok($at->commit_string("a = 2\nb = 3\n"), 1);
+}
+
+# A file that doesn't exist yet is never "unchanged".
+{
+    my $at = ActiveState::File::Atomic->new("$tmpdir/new", writable => 1,
+					    create => 1, skip_unchanged => 1);
+    ok($at->commit_string(""), 1);
+}
+
+# Contents printed before commit_string() count: this isn't unchanged.
+{
+    my $at = ActiveState::File::Atomic->new($f, writable => 1,
+					    skip_unchanged => 1);
+    $at->print("# header\n");
+    ok($at->commit_string("a = 2\nb = 3\n"), 1);
+    ok(ActiveState::File::Atomic->new($f)->slurp, "# header\na = 2\nb = 3\n");
+}
+
+# So do contents printed before commit_file(), and those written to the
+# tempfile's handle.
+{
+    my $src = mkfile('src', undef, "# header\na = 2\nb = 3\n");
+    my $at = ActiveState::File::Atomic->new($f, writable => 1,
+					    skip_unchanged => 1);
+    $at->print("# more\n");
+    ok($at->commit_file($src), 1);
+    unlink $src;
+    ok(ActiveState::File::Atomic->new($f)->slurp,
+       "# more\n# header\na = 2\nb = 3\n");
+}
+{
+    my $at = ActiveState::File::Atomic->new($f, writable => 1,
+					    skip_unchanged => 1);
+    my $fh = $at->tempfile;
+    print $fh "# first\n";
+    ok($at->commit_string("# more\n# header\na = 2\nb = 3\n"), 1);
+    ok(ActiveState::File::Atomic->new($f)->slurp,
+       "# first\n# more\n# header\na = 2\nb = 3\n");
+}
+
+# vim: ft=perl
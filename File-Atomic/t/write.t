@@ -0,0 +1,71 @@
+#!/usr/bin/perl -w
+
+use strict;
+use Test;
+use ActiveState::File::Atomic;
+use File::Path;
+
+plan tests => 8;
+
+my $tmpdir  = "write-$$";
+my $tmpfile = "$tmpdir/foo";
+my $glob    = "$tmpdir/{.,}foo*";
+
+mkpath($tmpdir);
+END { rmtree($tmpdir) }
+
+sub contents {
+    open(my $T, "<", $tmpfile) or die "can't open $tmpfile: $!";
+    local $/;
+    return scalar <$T>;
+}
+
+# Many small writes.
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile, writable => 1, create => 1);
+    $at->print("line $_", "\n") for 1 .. 10000;
+    ok(!-e $tmpfile); # nothing committed yet
+    $at->commit_tempfile;
+    ok(contents(), join("", map "line $_\n", 1 .. 10000));
+}
+
+# Writes larger than the buffer, mixed with small ones.
+{
+    my $big = "x" x (600 * 1024);
+    my $at = ActiveState::File::Atomic->new($tmpfile, writable => 1);
+    $at->write("head\n");
+    $at->write($big);
+    $at->print("middle\n", $big, "tail\n");
+    $at->commit_tempfile;
+    ok(contents(), "head\n$big" . "middle\n$big" . "tail\n");
+}
+
+# Buffered data is flushed before the tempfile handle is used.
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile, writable => 1);
+    $at->print("first\n");
+    my $wfh = $at->tempfile;
+    print $wfh "second\n";
+    $at->commit_tempfile;
+    ok(contents(), "first\nsecond\n");
+}
+
+# Closing without a commit throws the data away.
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile, writable => 1);
+    $at->print("lost\n") for 1 .. 100;
+    $at->close;
+    ok(contents(), "first\nsecond\n");
+    ok(@{[glob($glob)]}, 1);
+}
+
+# Readers can't write.
+{
+    my $at = ActiveState::File::Atomic->new($tmpfile);
+    eval { $at->print("nope\n") };
+    ok($@, qr/'\Q$tmpfile\E' was not opened writable/);
+    eval { $at->write("nope\n") };
+    ok($@, qr/'\Q$tmpfile\E' was not opened writable/);
+}
+
+# vim: ft=perl
@@ -0,0 +1,163 @@
+#!/usr/bin/perl -w
+#
+# Multi-process contention harness for ActiveState::File::Atomic: the
+# sweep t/writers.t and t/lockers.t do once, measured.  For every
+# combination of the comma separated lists given, forks that many writers
+# and readers on one file for --duration seconds and prints a CSV line:
+#
+#    writers,readers,size,timeout,commits,commits_per_s,reads_per_s,
+#    failures,lock_p50_us,lock_p99_us,lock_p999_us,
+#    commit_p50_us,commit_p99_us,commit_p999_us
+#
+# 'lock' is how long new() took to get the lock, 'commit' how long
+# commit_string() took, and 'failures' the writers' new()s that timed out.
+# The columns are those of 'atomicbench -c' (see atomicfile/bench.c), which
+# measures the C library alone, so the two can be compared.
+#
+#    perl -Mblib tools/contention.pl [--writers 1,4,16,64,256] [--readers 0]
+#	 [--sizes 4096] [--timeout 0] [--duration 0.5] [dir]
+#
+# Copyright (c) 2004, ActiveState Corporation
+# All Rights Reserved.
+
+use strict;
+use ActiveState::File::Atomic;
+use Getopt::Long;
+use File::Path qw(rmtree);
+use POSIX ();
+use Time::HiRes qw(time);
+
+my %opt = (
+    writers => "1,4,16,64,256",
+    readers => "0",
+    sizes => "4096",
+    timeout => "0",
+    duration => 0.5,
+);
+GetOptions(\%opt, "writers=s", "readers=s", "sizes=s", "timeout=s",
+	   "duration=f")
+    or die "usage: $0 [--writers N,...] [--readers N,...] [--sizes N,...] "
+	 . "[--timeout N,...] [--duration secs] [dir]\n";
+
+my $dir = (@ARGV ? $ARGV[0] : $ENV{TMPDIR} || "/tmp") . "/contention.$$";
+mkdir($dir, 0777) or die "can't mkdir $dir: $!";
+my $parent = $$;
+END { rmtree($dir) if $$ == $parent && defined $dir }
+$SIG{INT} = $SIG{TERM} = sub { exit 1 };
+$| = 1;
+
+print join(",", qw(writers readers size timeout commits commits_per_s
+		   reads_per_s failures lock_p50_us lock_p99_us lock_p999_us
+		   commit_p50_us commit_p99_us commit_p999_us)), "\n";
+for my $size (split /,/, $opt{sizes}) {
+    for my $timeout (split /,/, $opt{timeout}) {
+	for my $readers (split /,/, $opt{readers}) {
+	    for my $writers (split /,/, $opt{writers}) {
+		contend($writers, $readers, $size, $timeout);
+	    }
+	}
+    }
+}
+exit 0;
+
+sub contend {
+    my($writers, $readers, $size, $timeout) = @_;
+    my $file = "$dir/contended";
+    my $data = ("x" x 79 . "\n") x int($size / 80) . "x" x ($size % 80);
+    ActiveState::File::Atomic->new($file, writable => 1, create => 1)
+	->commit_string($data);
+
+    # The children wait for the pipe to close, so they start together.
+    pipe(my $GO_R, my $GO_W) or die "pipe failed: $!";
+    my @pids;
+    for my $i (0 .. $writers + $readers - 1) {
+	my $pid = fork;
+	die "fork failed: $!" unless defined $pid;
+	if (!$pid) {
+	    close $GO_W;
+	    my $ok = eval {
+		child($i, $i < $writers, $file, $data, $timeout, $GO_R);
+		1;
+	    };
+	    print STDERR $@ unless $ok;
+	    POSIX::_exit($ok ? 0 : 1);
+	}
+	push @pids, $pid;
+    }
+    close $GO_R;
+    close $GO_W;
+    for (@pids) {
+	waitpid($_, 0);
+	die "$0: a child failed\n" if $?;
+    }
+
+    my(@lock, @commit);
+    my($commits, $reads, $failures) = (0, 0, 0);
+    for my $i (0 .. $writers + $readers - 1) {
+	open(my $IN, "<", "$dir/samples.$i")
+	    or die "can't read $dir/samples.$i: $!";
+	my($c, $r, $f) = split ' ', scalar <$IN>;
+	$commits += $c;
+	$reads += $r;
+	$failures += $f;
+	while (<$IN>) {
+	    my($l, $t) = split;
+	    push @lock, $l;
+	    push @commit, $t;
+	}
+	close $IN;
+	unlink "$dir/samples.$i";
+    }
+    @lock = sort { $a <=> $b } @lock;
+    @commit = sort { $a <=> $b } @commit;
+
+    printf "%d,%d,%d,%d,%d,%.1f,%.1f,%d,%s\n", $writers, $readers, $size,
+	$timeout, $commits, $commits / $opt{duration},
+	$reads / $opt{duration}, $failures,
+	join(",", map { percentile($_->[0], $_->[1]) }
+		  [\@lock, 0.5], [\@lock, 0.99], [\@lock, 0.999],
+		  [\@commit, 0.5], [\@commit, 0.99], [\@commit, 0.999]);
+}
+
+sub child {
+    my($i, $writer, $file, $data, $timeout, $GO) = @_;
+    my($commits, $reads, $failures, @samples) = (0, 0, 0);
+
+    sysread($GO, my $buf, 1);	# wait for the starting gun
+    my $start = time;
+    my $t0;
+    while (($t0 = time) - $start < $opt{duration}) {
+	my $at = eval {
+	    ActiveState::File::Atomic->new($file, writable => $writer,
+					   $timeout ? (timeout => $timeout) : ())
+	};
+	if (!$at) {
+	    die $@ unless $writer && $@ =~ /lock/i;
+	    ++$failures;
+	    next;
+	}
+	my $t1 = time;
+	if ($writer) {
+	    $at->commit_string($data);
+	    push @samples, sprintf("%d %d\n", ($t1 - $t0) * 1e6,
+				   (time - $t1) * 1e6);
+	    ++$commits;
+	}
+	else {
+	    my $got = $at->slurp;
+	    ++$reads;
+	}
+    }
+
+    open(my $OUT, ">", "$dir/samples.$i")
+	or die "can't write $dir/samples.$i: $!";
+    print $OUT "$commits $reads $failures\n", @samples;
+    close $OUT or die "can't write $dir/samples.$i: $!";
+}
+
+sub percentile {
+    my($sorted, $p) = @_;
+    return 0 unless @$sorted;
+    my $i = int($p * @$sorted);
+    return $sorted->[$i < @$sorted ? $i : $#$sorted];
+}
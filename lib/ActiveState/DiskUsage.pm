@@ -8,14 +8,28 @@ our %seen;
 our $blocksize = 512;
 $blocksize = 1024 if $^O eq "hpux";
 
+# Where ActiveState::File::Atomic is built, its native code walks the tree
+# with several threads; the Perl walk below is used otherwise, and if that
+# fails.
+our $NATIVE = $^O ne "MSWin32" && eval {
+    require ActiveState::File::Atomic;
+    defined &ActiveState::File::Atomic::_du;
+};
+
 sub du {
+    my($f, $dirs) = @_;
+    if ($NATIVE) {
+	my $total = ActiveState::File::Atomic->_du($f, $blocksize,
+						   $dirs ? $dirs : ());
+	return $total if defined $total;
+    }
     local %seen;
-    return _du(@_);
+    return _du($f, $dirs);
 }
 
 sub _du
 {
-    my $f = shift;
+    my($f, $dirs) = @_;
     my $total = 0;
 
     my @s = lstat($f);
@@ -29,9 +43,10 @@ sub _du
 	    closedir($d);
 	    for (@files) {
 		next if $_ eq "." || $_ eq "..";
-		$total += _du("$f/$_");
+		$total += _du("$f/$_", $dirs);
 	    }
 	}
+	$dirs->{$f} = $total if $dirs;
 	return $total;
     }
 
@@ -61,6 +76,22 @@ are recursively counted as well. Symbolic links are not dereferenced.
 The return value of the du() function is the number of bytes
 allocated.
 
+If a hash reference is passed as the second argument, the hash also gets
+the number of bytes allocated under each directory, the given one
+included, keyed by its path (the given path with the names of the
+subdirectories appended):
+
+ my %dirs;
+ du("/usr/lib", \%dirs);
+ print "$dirs{'/usr/lib/perl5'} bytes in /usr/lib/perl5\n";
+
+A file with several links is counted in only one of the directories it
+is in.
+
+Where ActiveState::File::Atomic is available, its native code walks the
+tree, with several threads.  Setting C<$ActiveState::DiskUsage::NATIVE>
+to 0 turns this off.
+
 The du() function is not exported by default.
 
 =head1 BUGS
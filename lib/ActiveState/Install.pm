@@ -39,6 +39,21 @@ my %from;
 my %summary;
 my $ppmsave;
 my $preserve_mtime;
+my @queue;        # [from, to] of files waiting for the native engine
+my %queued;
+my %digest_old;   # "dev:ino" => "size mtime ctime md5", from the last install
+my %digest_new;   # the same, for the files seen by this one
+my $hires_stat = eval { require Time::HiRes; Time::HiRes::d_hires_stat() };
+my $atomic;       # the ActiveState::Dir::Atomic being installed into
+my $live;         # "ROOT/current", and the scratch generation staging it
+my $scratch;
+
+# Where ActiveState::File::Atomic is built, its native engine does the
+# compare, copy and MD5 of plain files, many at a time; see _flush_queue().
+our $NATIVE = eval {
+    require ActiveState::File::Atomic;
+    defined &ActiveState::File::Atomic::_install;
+};
 
 sub install {
     my %args = @_;
@@ -56,6 +71,7 @@ sub install {
     $owner = delete $args{owner};
     $group = delete $args{group};
     $preserve_mtime = delete $args{preserve_mtime};
+    my $atomic_dir = delete $args{atomic_dir};
 
     $verbose = delete $args{verbose};
     unless (defined $verbose) {
@@ -124,9 +140,36 @@ sub install {
     %from = ();
     %summary = ();
     $ppmsave = 0;
+    @queue = ();
+    %queued = ();
+    %digest_old = ();
+    %digest_new = ();
+    $atomic = $live = $scratch = undef;
     
     # Start installing
     eval {
+	# the paths in ROOT/current are installed in a new generation of
+	# the directory, which only becomes current if all goes well
+	if (defined $atomic_dir) {
+	    require ActiveState::Dir::Atomic;
+	    $atomic = ActiveState::Dir::Atomic->new($atomic_dir,
+						    writable => 1, create => 1);
+	    _load_digests(_digest_file($etc));
+	    my @kept = _digests_kept("$etc/.packages/$pkg");
+	    $atomic->clone;
+	    $live = "$atomic_dir/current";
+	    $scratch = $atomic->scratchpath;
+	    _digests_restamp(@kept);
+	    print "Staging $live in $scratch\n" if $verbose > 1;
+	    $files = { map { $_ => _staged($files->{$_}) } keys %$files };
+	    my $staged_etc = _staged($etc);
+	    if ($staged_etc ne $etc && !-d $staged_etc) {
+		require File::Path;
+		File::Path::mkpath($staged_etc);
+	    }
+	    $etc = $staged_etc;
+	}
+
 	# first we lock
 	if ($lockfile) {
 	    my $tmp = "$etc/lock.$$";
@@ -160,11 +203,13 @@ sub install {
 		chomp;
 		my($md5, $config, $file) = split(' ', $_, 3);
 		die unless length($md5) == 32;
+		$file = _staged($file);
 		$md5_old{$file} = $md5;
 		$config_old{$file} = $config;
 	    }
 	    #use Data::Dump; Data::Dump::dump(\%md5_old);
 	}
+	_load_digests(_digest_file($etc)) unless $atomic;
 
         # copy files
 	for my $from (sort keys %$files) {
@@ -194,6 +239,7 @@ sub install {
 		die "Can't install $from since it's neither a regular file nor a directory";
 	    }
 	}
+	_flush_queue();
 
 	# delete old files that are not in the new package
 	for my $fname (keys %md5_old) {
@@ -204,7 +250,7 @@ sub install {
 	    next if $inode_new{join(":", (lstat _)[0,1])};
 
 	    # abandon file?
-	    my $abandon = _special_file($fname) || 0;
+	    my $abandon = _special_file(_live($fname)) || 0;
 	    next if $abandon == FILE_ABANDON;
 	    next if $abandon == FILE_ABANDON_MODIFIED
 	            and _file_md5($fname) ne $md5_old{$fname};
@@ -235,12 +281,23 @@ sub install {
 	print $f "Date: " . iso_datetime(time) . "\n";
 	print $f "Installer: " . __PACKAGE__ . " $VERSION\n";
 	print $f "\n";
-	for my $fname (sort keys %md5_new) {
+	for my $fname (sort { _live($a) cmp _live($b) } keys %md5_new) {
 	    my $c = $config_file->{$from{$fname}} || 0;
-	    print $f "$md5_new{$fname} $c $fname\n";
+	    print $f "$md5_new{$fname} $c ", _live($fname), "\n";
 	}
 	close($f) || die "Can't write $pkg_file: $!";
 	chmod(0444, $pkg_file);
+
+	if ($atomic) {
+	    # settle the new generation, then publish it whole; what is
+	    # left to commit is outside it
+	    my @staged = grep { _staged_action($_) } @commit_actions;
+	    @commit_actions = grep { !_staged_action($_) } @commit_actions;
+	    _do(\@staged);
+	    print "Publish $scratch as $live\n" if $verbose > 1;
+	    $atomic->commit;
+	    $atomic = undef;
+	}
     };
     if ($@) {
 	_rollback();
@@ -248,11 +305,40 @@ sub install {
     }
     else {
 	_commit();
+	_save_digests(_digest_file($etc));
     }
 
     return wantarray ? %summary : ($summary{new} || 0) + ($summary{update} || 0);
 }
 
+# The scratch path of a path in the current generation, and back
+sub _staged {
+    my $path = shift;
+    return $path unless $atomic && defined $path;
+    $path =~ s,^\Q$live\E(?=/|\z),$scratch,;
+    return $path;
+}
+
+sub _live {
+    my $path = shift;
+    return $path unless defined $scratch;
+    $path =~ s,^\Q$scratch\E(?=/|\z),$live,;
+    return $path;
+}
+
+# Whether an action only touches the scratch generation
+sub _staged_action {
+    my $path = $_[0][1];
+    return $path =~ m,^\Q$scratch\E(?:/|\z),;
+}
+
+# Gives a file of the scratch generation its own inode before it is
+# changed in place, since clone() shares it with the current one
+sub _unshare {
+    my $file = shift;
+    $atomic->breaklink($file) if $atomic;
+}
+
 sub _special_file {
     my $fname = shift;
     return $special_file->{$fname} if exists $special_file->{$fname};
@@ -332,11 +418,19 @@ sub _copy_link {
 
 sub _copy_file {
     my($from, $to) = @_;
+    _flush_queue() if $queued{$to};
     $from{$to} = $from;
 
     my $config_flags = $config_file->{$from};
 
     print "Installing $to\n" if $verbose > 1;
+    my $same;
+    $same = _cached_same($from, $to) if !$config_flags && -f $to;
+    if ($NATIVE && !$config_flags && !$same) {
+	push(@queue, [$from, $to]);
+	$queued{$to}++;
+	return;
+    }
     my $copy_to = $to;
 
     if ($config_flags) {
@@ -387,8 +481,9 @@ sub _copy_file {
 	}
     }
     elsif (-e $to) {
-	if (-f _ && compare($from, $to) == 0) {
-	    $copy_to = undef;
+	if (-f _) {
+	    $same = compare($from, $to) == 0 unless defined $same;
+	    $copy_to = undef if $same;
 	}
     }
 
@@ -426,10 +521,56 @@ sub _copy_file {
 	$md5_new{$to} = _file_md5($from);  # still want to keep track of it
     }
     $summary{file}++;
+    _installed($from, $to, $config_flags);
+}
+
+# Installs the queued files with the native engine, recording the same
+# actions and counts that _copy_file() does, and dies with the first error
+# once whatever the failed jobs got done is on the rollback list.
+sub _flush_queue {
+    return unless @queue;
+    my @jobs = @queue;
+    @queue = ();
+    %queued = ();
+
+    my @results = ActiveState::File::Atomic->_install(
+	[map { [@$_, "$_->[1].save-$$"] } @jobs]);
+    my $error;
+    for my $i (0 .. $#jobs) {
+	my($from, $to) = @{$jobs[$i]};
+	my($same, $saved, $created, $md5, $err) = @{$results[$i]};
+	if ($saved) {
+	    print " save as $to.save-$$\n" if $verbose > 3;
+	    _on_rollback("rename", "$to.save-$$", $to);
+	    _on_commit("unlink", "$to.save-$$");
+	}
+	_on_rollback("unlink", $to) if $created;
+	if (defined $err) {
+	    $error = $err unless defined $error;
+	    next;
+	}
+	next unless defined $md5;  # never started
+
+	$summary{$same ? "same" : $saved ? "update" : "new"}++;
+	$summary{file}++;
+	$md5_new{$to} = $md5;
+	_installed($from, $to);
+    }
+    die "$error\n" if defined $error;
+}
+
+# The attributes of a file just installed, or found already installed
+sub _installed {
+    my($from, $to, $config_flags) = @_;
 
     # Copy certain file attributes too
-    my($from_mode, $from_mtime)= (stat $from)[2, 9];
-    utime($from_mtime, $from_mtime, $to) if $preserve_mtime;
+    my @from_stat = stat $from;
+    my($from_mode, $from_mtime)= @from_stat[2, 9];
+    _digest_seen([_digest_stat($from)], $md5_new{$to});
+    if ($preserve_mtime) {
+	_unshare($to) if (stat $to)[9] != $from_mtime;
+	utime($from_mtime, $from_mtime, $to);
+    }
 
     # transfer -x bits and turn off -w for non-config files
     my $x = ($from_mode & 0111);
@@ -444,17 +585,23 @@ sub _copy_file {
 	}
 	if ($new_mode != $to_mode) {
 	    printf " chmod(%04o, '%s')\n", $new_mode, $to if $verbose > 2;
+	    _unshare($to);
 	    chmod($new_mode, $to) || die "Can't chmod: $!";
 	}
     }
     
     if (defined $owner) {
 	print " chown($owner, $group, '$to')\n" if $verbose > 2;
+	my($uid, $gid) = (stat $to)[4, 5];
+	_unshare($to) if $uid != $owner || ($group != -1 && $gid != $group);
 	chown($owner, $group, $to) || die "Can't chown: $!";
     }
 
     # we remember the inode of installed files
-    $inode_new{join(":", (stat $to)[0,1])} = $to;
+    my @to_stat = stat $to;
+    $inode_new{join(":", @to_stat[0,1])} = $to;
+    # a config file may have been left alone with other contents
+    _digest_seen([_digest_stat($to)], $md5_new{$to}) unless $config_flags;
 }
 
 sub _ppmsave {
@@ -471,8 +618,127 @@ sub _ppmsave {
 sub _file_md5 {
     my $file = shift;
     open(my $f, "<", $file) || die "Can't open $file: $!";
+    my @st = _digest_stat($f);
+    my $md5 = _cached_md5(@st);
+    return $md5 if defined $md5;
     binmode($f);
-    return Digest::MD5->new->addfile($f)->hexdigest;
+    $md5 = Digest::MD5->new->addfile($f)->hexdigest;
+    _digest_seen(\@st, $md5);
+    return $md5;
+}
+
+# The digests of files are kept from one install of a package to the next,
+# by the device, inode, size, mtime and ctime of the file, so that files
+# that have not changed since are not read again to find out. The ctime
+# moves on even when a file is rewritten and its mtime put back, or its
+# inode is reused for another file of the same size and mtime.
+sub _digest_file {
+    my $etc = shift;
+    return "$etc/.packages/.$pkg.digests";
+}
+
+sub _load_digests {
+    my $file = shift;
+    open(my $f, "<", $file) || return;
+    # a file changed as the digests were being saved may still have the
+    # times saved, so those are not trusted
+    my $saved = (_digest_stat($f))[9];
+    local $_;
+    while (<$f>) {
+	my($key, $size, $mtime, $ctime, $md5) = split;
+	next unless defined $md5 && length($md5) == 32 && $ctime < $saved;
+	$digest_old{$key} = "$size $mtime $ctime $md5";
+    }
+}
+
+# Saves the digests of the files this install saw; failing to is no reason
+# to fail the install.
+sub _save_digests {
+    my $file = shift;
+    return unless %digest_new;
+    eval {
+	require ActiveState::File::Atomic;
+	my $at = ActiveState::File::Atomic->new($file, writable => 1,
+						create => 1, mode => 0644);
+	$at->commit_string(join("", map { "$_ $digest_new{$_}\n" }
+				    sort keys %digest_new));
+    };
+    print "Can't save digests to $file: $@" if $@ && $verbose > 1;
+}
+
+# stat() with the times to the nanosecond, where Time::HiRes can tell
+sub _digest_stat {
+    return $hires_stat ? Time::HiRes::stat($_[0]) : stat($_[0]);
+}
+
+# What a digest is kept by, besides the device and inode
+sub _digest_stamp {
+    my @st = @_;
+    return sprintf("%d %.9f %.9f", @st[7, 9, 10]);
+}
+
+# The digest of a file from its _digest_stat(), if it is known
+sub _cached_md5 {
+    my @st = @_;
+    return undef unless @st;
+    my $key = "$st[0]:$st[1]";
+    my $entry = $digest_old{$key} || $digest_new{$key} || return undef;
+    my $stamp = _digest_stamp(@st);
+    return undef unless substr($entry, 0, length($stamp) + 1) eq "$stamp ";
+    $digest_new{$key} = $entry;
+    return substr($entry, length($stamp) + 1);
+}
+
+# Cloning a generation links its files into the next one, which moves
+# their ctime on.  The installed files whose digests still hold before
+# the clone are stamped again after it, from their staged paths.
+sub _digests_kept {
+    my $pkg_file = shift;
+    open(my $f, "<", $pkg_file) || return;
+    my @kept;
+    local $_;
+    my $header = 1;
+    while (<$f>) {
+	if ($header) {
+	    $header = 0 if /^$/;
+	    next;
+	}
+	chomp;
+	my $file = (split(' ', $_, 3))[2];
+	my @st = _digest_stat($file);
+	next unless @st;
+	my $entry = $digest_old{"$st[0]:$st[1]"} || next;
+	my $stamp = _digest_stamp(@st);
+	next unless substr($entry, 0, length($stamp) + 1) eq "$stamp ";
+	push(@kept, [$file, "$st[0]:$st[1]", substr($entry, length($stamp) + 1)]);
+    }
+    return @kept;
+}
+
+sub _digests_restamp {
+    for (@_) {
+	my($file, $key, $md5) = @$_;
+	my @st = _digest_stat(_staged($file));
+	next unless @st && "$st[0]:$st[1]" eq $key;
+	$digest_old{$key} = _digest_stamp(@st) . " $md5";
+    }
+}
+
+sub _digest_seen {
+    my($st, $md5) = @_;
+    return unless @$st && defined $md5;
+    $digest_new{"$st->[0]:$st->[1]"} = _digest_stamp(@$st) . " $md5";
+}
+
+# Whether two files have the same contents, if that is known from their
+# digests, without reading them
+sub _cached_same {
+    my($from, $to) = @_;
+    my $from_md5 = _cached_md5(_digest_stat($from));
+    return undef unless defined $from_md5;
+    my $to_md5 = _cached_md5(_digest_stat($to));
+    return undef unless defined $to_md5;
+    return $from_md5 eq $to_md5;
 }
 
 sub _create {
@@ -499,6 +765,12 @@ sub _on_commit {
 }
 
 sub _rollback {
+    if ($atomic) {
+	# the scratch generation is simply never published
+	@rollback_actions = grep { !_staged_action($_) } @rollback_actions;
+	$atomic->close;
+	$atomic = undef;
+    }
     return unless @rollback_actions;
     print "Undo partial install\n" if $verbose;
     _do([reverse @rollback_actions]);
@@ -718,6 +990,22 @@ It can chown the files it installs.
 
 It keeps track of installed files and their checksums.
 
+=item *
+
+Where ActiveState::File::Atomic is available, the files that are not
+configuration files are compared, copied and checksummed by its native
+code, several at a time and reading each file only once.  Setting
+C<$ActiveState::Install::NATIVE> to 0 turns this off.
+
+=item *
+
+It remembers the checksums of the files it has seen, by inode, size,
+modification time and inode change time, next to the package's record in
+F<$etc/.packages>, so that an upgrade only reads the files that have
+changed since.  The times are kept to the nanosecond where Time::HiRes
+can tell them.  Since the inode change time can't be set back, a file
+that was rewritten and had its modification time put back is read again.
+
 =back
 
 =head2 The install function
@@ -819,6 +1107,18 @@ Boolean attribute that makes the installer duplicate the file
 modification time of the source files for the installed files if true.
 The default is not to duplicate modification times.
 
+=item atomic_dir
+
+The root of an C<ActiveState::Dir::Atomic> directory.  Files installed
+under its F<current> link, and the F<etc> directory if it is there too,
+are installed in a new generation of the directory instead, made of hard
+links to the current one, which replaces it with a single switch of the
+link once the install has succeeded.  Other programs never see a
+partial install, a failed or interrupted one leaves the current
+generation untouched, and the generation before is kept should the
+install have to be undone with the rollback() method.  The packing list
+names the files as they are found through F<current>.
+
 =item verbose
 
 A numeric value that indicates how much noise should be generated
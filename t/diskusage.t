@@ -7,7 +7,7 @@ BEGIN {
     }
 }
 
-print "1..1\n";
+print "1..13\n";
 
 use strict;
 use ActiveState::DiskUsage qw(du);
@@ -20,3 +20,80 @@ my $du2 = $1 * 1024;
 print "# $du1 $du2\n";
 print "not " unless abs($du1 - $du2) <= 512;
 print "ok 1\n";
+
+# The native walker, where there is one, against the Perl code, on a tree
+# of our own
+use File::Path qw(mkpath rmtree);
+
+my $native = $ActiveState::DiskUsage::NATIVE;
+my $dir = "du-$$";
+mkpath(["$dir/a/b/c", "$dir/d", "$dir/empty"]);
+END { rmtree($dir) if $dir }
+
+sub put { open(my $fh, ">", $_[0]) or die "can't write $_[0]: $!"; print $fh $_[1] }
+
+put("$dir/top", "x" x 100_000);
+put("$dir/a/b/c/deep", "y" x 20_000);
+put("$dir/d/f$_", "z" x ($_ * 1000)) for 1 .. 50;
+link("$dir/top", "$dir/a/top-link") or die "can't link: $!";
+link("$dir/d/f50", "$dir/a/b/f50-link") or die "can't link: $!";
+symlink("top", "$dir/a/sym") or die "can't symlink: $!";
+symlink("a", "$dir/dirsym") or die "can't symlink: $!";
+
+sub du_with {
+    my($native, $f, $dirs) = @_;
+    local $ActiveState::DiskUsage::NATIVE = $native;
+    return du($f, $dirs);
+}
+
+sub dirs {
+    my $h = shift;
+    return join(",", map { "$_=$h->{$_}" } sort keys %$h);
+}
+
+print "not " unless du($dir) > 100_000 + 20_000 + 50 * 25_000;
+print "ok 2\n";
+print "not " unless du("$dir/a/sym") == 0;
+print "ok 3\n";
+print "not " unless du("$dir/missing") == 0;
+print "ok 4\n";
+
+if (!$native) {
+    print "ok $_ # skip ActiveState::File::Atomic not available\n" for 5 .. 13;
+    exit 0;
+}
+
+print "not " unless du_with(1, $dir) == du_with(0, $dir);
+print "ok 5\n";
+print "not " unless du_with(1, "$dir/top") == du_with(0, "$dir/top");
+print "ok 6\n";
+print "not " unless du_with(1, "$dir/empty") == du_with(0, "$dir/empty");
+print "ok 7\n";
+print "not " unless du_with(1, "$dir/a/..") == du_with(0, "$dir/a/..");
+print "ok 8\n";
+
+# The breakdown; a file with several links counts in one place only
+my(%native, %perl);
+du_with(1, $dir, \%native);
+du_with(0, $dir, \%perl);
+print "not " unless join(",", sort keys %native) eq join(",", sort keys %perl);
+print "ok 9\n";
+print "not " unless $native{$dir} == du_with(0, $dir);
+print "ok 10\n";
+print "not " unless $native{"$dir/a"} + $native{"$dir/d"}
+		    == $perl{"$dir/a"} + $perl{"$dir/d"};
+print "ok 11\n";
+%native = %perl = ();
+du_with(1, "$dir/a/..", \%native);
+du_with(0, "$dir/a/..", \%perl);
+print "not " unless join(",", sort keys %native) eq join(",", sort keys %perl)
+		    && $native{"$dir/a/.."} == $perl{"$dir/a/.."};
+print "ok 12\n";
+
+# Without hard links between them, every directory is as Perl has it
+unlink("$dir/a/top-link", "$dir/a/b/f50-link");
+%native = %perl = ();
+du_with(1, $dir, \%native);
+du_with(0, $dir, \%perl);
+print "not " unless dirs(\%native) eq dirs(\%perl);
+print "ok 13\n";
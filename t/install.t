@@ -10,7 +10,7 @@ BEGIN {
 use strict;
 use lib "./lib";
 
-print "1..15\n";
+print "1..53\n";
 
 use ActiveState::Install qw(install installed
                             CFG_FORCE_OURS CFG_KEEP_THEIRS
@@ -289,6 +289,265 @@ print "not " unless -l "$t/s/link";
 print "ok 15\n";
 
 
+# The native engine, where ActiveState::File::Atomic is built, against the
+# Perl code; the "n" tree is installed by it where it can be, and only what
+# needs it is skipped without it
+use File::Path qw(mkpath rmtree);
+use Digest::MD5 qw(md5_hex);
+require File::Find;
+
+my $n = 15;
+my $has_native = $ActiveState::Install::NATIVE;
+my $no_native = $has_native ? "" : "ActiveState::File::Atomic not available";
+
+sub test {
+    print "not " unless $_[0];
+    print "ok ", ++$n, "\n";
+}
+
+sub test_eq {
+    my($got, $want) = @_;
+    print "# got '$got'\n# expected '$want'\n" unless $got eq $want;
+    test($got eq $want);
+}
+
+sub skip_native {
+    my $count = shift;
+    print "ok ", ++$n, " # skip $no_native\n" for 1 .. $count;
+}
+
+sub test_native_eq {
+    return skip_native(1) if $no_native;
+    test_eq(@_);
+}
+
+my $dir = "install-$$";
+mkpath("$dir/pkg/sub/deeper");
+END { rmtree($dir) if $dir }
+
+sub put {
+    my($file, $data) = @_;
+    open(my $fh, ">", $file) or die "can't write $file: $!";
+    binmode($fh);
+    print $fh $data;
+    close($fh) or die "can't write $file: $!";
+}
+
+sub ino { (lstat $_[0])[1] }
+
+sub slurp {
+    my $file = shift;
+    open(my $fh, "<", $file) or return undef;
+    binmode($fh);
+    local $/;
+    return scalar <$fh>;
+}
+
+# Sizes around the MD5 block and the engine's chunk, and many small files
+my $i = 0;
+for my $size (0, 1, 55, 56, 63, 64, 65, 4095, 1048576 + 3, 3000000) {
+    put("$dir/pkg/f" . $i++, join("", map { chr(($_ * 7 + $size) % 256) } 1 .. $size));
+}
+put("$dir/pkg/sub/deeper/s$_", "small $_\n" x $_) for 1 .. 300;
+put("$dir/pkg/tool", "#!/bin/sh\n");
+chmod(0755, "$dir/pkg/tool");
+symlink("tool", "$dir/pkg/link") or die "can't symlink: $!";
+put("$dir/pkg/sub/conf", "setting = 1\n");
+
+sub install_to {
+    my($native, $to) = @_;
+    local $ActiveState::Install::NATIVE = $native && $has_native;
+    mkpath("$dir/etc-$to");
+    my %summary = install(
+	pkg => "Test", ver => "1",
+	files => { "$dir/pkg" => "$dir/$to" },
+	config_files => { "$dir/pkg/sub/conf" => CFG_KEEP_THEIRS },
+	etc => "$dir/etc-$to",
+	verbose => 0,
+    );
+    return join(",", map { "$_=$summary{$_}" } sort keys %summary);
+}
+
+# The packing list, without the date, and the installed files and modes
+sub state_of {
+    my $to = shift;
+    my $list = slurp("$dir/etc-$to/.packages/Test");
+    $list =~ s/^Date:.*\n//m;
+    $list =~ s/\Q$dir\/$to\E/TO/g;
+    my @files;
+    File::Find::find({ no_chdir => 1, wanted => sub {
+	(my $rel = $File::Find::name) =~ s/^\Q$dir\/$to\E//;
+	my @st = lstat($File::Find::name);
+	push(@files, sprintf("%s %o %s", $rel, $st[2],
+			     -f _ ? md5_hex(slurp($File::Find::name)) : ""));
+    }}, "$dir/$to");
+    return join("\n", $list, sort @files);
+}
+
+# A fresh install, a repeat, and an update
+my $native = install_to(1, "n");
+test_native_eq($native, install_to(0, "p"));
+test($native =~ /new=31\d/);
+test_native_eq(state_of("n"), state_of("p"));
+test(slurp("$dir/n/f8") eq slurp("$dir/pkg/f8"));
+
+test_native_eq(install_to(1, "n"), install_to(0, "p"));
+test_native_eq(state_of("n"), state_of("p"));
+
+put("$dir/pkg/f3", "changed");
+put("$dir/pkg/f9", slurp("$dir/pkg/f9") . "more");
+put("$dir/pkg/sub/new", "new file");
+unlink("$dir/pkg/sub/deeper/s7");
+put("$dir/n/f2", "edited");		# same size as nothing else
+put("$dir/p/f2", "edited");
+$native = install_to(1, "n");
+test_native_eq($native, install_to(0, "p"));
+test($native =~ /update=3/ && $native =~ /new=1/ && $native =~ /del=1/);
+test_native_eq(state_of("n"), state_of("p"));
+test(!glob("$dir/n/*.save-*"));
+
+# A failure rolls everything back, including the files that did get copied
+my $before = state_of("n");
+put("$dir/pkg/f4", "changed too");
+put("$dir/pkg/f5", "and this");
+put("$dir/n/f5.save-$$", "in the way");
+test(!eval { install_to(1, "n"); 1 });
+test($@ =~ /^Can't save to \S+f5\.save-$$ since it exists/);
+unlink("$dir/n/f5.save-$$");
+test_eq(state_of("n"), $before);
+test(slurp("$dir/n/f4") eq slurp("$dir/p/f4"));
+
+# Digests saved by the last install, which need ActiveState::File::Atomic
+# too; trusted once older than the digests
+sub reads {
+    my($native, $to) = @_;
+    my($reads, $summary) = reads_by(sub { install_to($native, $to) });
+    return "$reads $summary";
+}
+
+# How many files an install reads through, and what it returns
+sub reads_by {
+    my $install = shift;
+    my $reads = 0;
+    no warnings 'redefine';
+    my $compare = \&ActiveState::Install::compare;
+    my $engine = \&ActiveState::File::Atomic::_install;
+    my $addfile = \&Digest::MD5::addfile;
+    local *ActiveState::Install::compare = sub { $reads++; &$compare };
+    local *ActiveState::File::Atomic::_install = sub {
+	$reads += @{$_[1]};
+	&$engine;
+    };
+    local *Digest::MD5::addfile = sub { $reads++; &$addfile };
+    my $summary = $install->();
+    return ($reads, $summary);
+}
+
+if ($no_native) {
+    skip_native(7);
+}
+else {
+    install_to(1, "n");
+    install_to(0, "p");
+    my $digests = "$dir/etc-n/.packages/.Test.digests";
+    test(-s $digests);
+    utime(time + 2, time + 2, $digests, "$dir/etc-p/.packages/.Test.digests");
+    test(reads(1, "n") =~ /^0 file=31\d,link=1,same=31\d$/);
+    test(reads(0, "p") =~ /^0 file=31\d,link=1,same=31\d$/);
+    put("$dir/pkg/f6", "different size");
+    utime(time + 2, time + 2, $digests, "$dir/etc-p/.packages/.Test.digests");
+    test(reads(1, "n") =~ /^1 .*update=1$/);
+    test(reads(0, "p") =~ /^1 .*update=1$/);
+
+    # A file rewritten in place with its size and mtime kept, as happens when
+    # its inode is reused, is not mistaken for the one the digest was kept for
+    my @st = stat("$dir/pkg/f7");
+    put("$dir/pkg/f7", "x" x $st[7]);
+    utime($st[8], $st[9], "$dir/pkg/f7");
+    utime(time + 2, time + 2, $digests, "$dir/etc-p/.packages/.Test.digests");
+    test(reads(1, "n") =~ /^\d+ .*update=1$/);
+    test(reads(0, "p") =~ /^\d+ .*update=1$/);
+}
+
+# Installing into a generation of an ActiveState::Dir::Atomic, which
+# needs ActiveState::File::Atomic
+if ($no_native) {
+    skip_native(17);
+}
+else {
+    my $root = "$dir/root";
+    my $cur = "$root/current";
+    rmtree("$dir/pkg");
+    mkpath(["$dir/pkg/lib/sub", "$dir/pkg/bin"]);
+    require ActiveState::Dir::Atomic;
+
+    put("$dir/pkg/lib/a", "a\n");
+    put("$dir/pkg/lib/sub/b", "b\n");
+    put("$dir/pkg/lib/gone", "gone\n");
+    put("$dir/pkg/bin/tool", "#!/bin/sh\n");
+    chmod(0755, "$dir/pkg/bin/tool");
+    symlink("tool", "$dir/pkg/bin/link") or die "can't symlink: $!";
+
+    my $install_pkg = sub {
+	return install(
+	    pkg => "Test", ver => shift,
+	    files => { "$dir/pkg/lib" => "$cur/lib", "$dir/pkg/bin" => "$cur/bin" },
+	    etc => "$cur/etc",
+	    atomic_dir => $root,
+	    verbose => 0,
+	    @_,
+	);
+    };
+
+    # The first install creates the directory and its first generation
+    my %summary = $install_pkg->(1);
+    test_eq($summary{new}, 4);
+
+    # The digests hold for the next generation, though cloning it moved
+    # the ctime of its files on: installing again reads none of them
+    utime(time + 2, time + 2, "$cur/etc/.packages/.Test.digests");
+    my($reads) = reads_by(sub { scalar $install_pkg->(1) });
+    test_eq($reads, 0);
+    my $gen1 = ActiveState::Dir::Atomic->new($root)->current;
+    test_eq(slurp("$cur/lib/sub/b"), "b\n");
+    test_eq(readlink("$cur/bin/link"), "tool");
+    test_eq(sprintf("%o", (stat "$cur/bin/tool")[2] & 07777), "555");
+    my $pkg = installed(pkg => "Test", etc => "$cur/etc");
+    test_eq(join(",", sort $pkg->files), join(",", map { "$cur/$_" }
+	qw(bin/link bin/tool lib/a lib/gone lib/sub/b)));
+
+    # An update is a new generation; the unchanged files are the same inodes
+    put("$dir/pkg/lib/a", "a changed\n");
+    unlink("$dir/pkg/lib/gone");
+    %summary = $install_pkg->(2);
+    test_eq("$summary{update} $summary{same} $summary{del}", "1 2 1");
+    my $gen2 = ActiveState::Dir::Atomic->new($root)->current;
+    test($gen2 != $gen1);
+    test_eq(slurp("$cur/lib/a"), "a changed\n");
+    test_eq(slurp("$root/$gen1/lib/a"), "a\n");
+    test(!-e "$cur/lib/gone" && -e "$root/$gen1/lib/gone");
+    test_eq(ino("$cur/lib/sub/b"), ino("$root/$gen1/lib/sub/b"));
+    test(!glob("$cur/lib/*.save-*") && !-e "$cur/etc/ActiveState_Install.lck");
+
+    # Attributes changed in place don't reach the generation before
+    utime(1000000000, 1000000000, "$dir/pkg/lib/sub/b");
+    $install_pkg->(3, preserve_mtime => 1);
+    test((stat "$cur/lib/sub/b")[9] == 1000000000
+	 && (stat "$root/$gen2/lib/sub/b")[9] != 1000000000);
+
+    # A failed install is never seen
+    my $gen3 = ActiveState::Dir::Atomic->new($root)->current;
+    put("$dir/pkg/lib/a", "a again\n");
+    put("$cur/lib/a.save-$$", "in the way");
+    test(!eval { $install_pkg->(4); 1 });
+    test(ActiveState::Dir::Atomic->new($root)->current == $gen3
+	 && slurp("$cur/lib/a") eq "a changed\n");
+
+    # And a published one can be undone, back to the generation before
+    ActiveState::Dir::Atomic->new($root, writable => 1)->rollback($gen2);
+    test((stat "$cur/lib/sub/b")[9] != 1000000000);
+}
+
 # clean up all the mess
 END {
     system("rm -rf apkg bpkg .packages $t $tlink");